@@ -505,10 +505,10 @@ void DBEmptyGroupsCommand::Undo()
 // AddEntryCommand
 // ------------------------------------------------
 
-AddEntryCommand::AddEntryCommand(CommandInterface *pcomInt, const CItemData &ci,
+AddEntryCommand::AddEntryCommand(CommandInterface *pcomInt, CItemData ci,
                                  const CUUID &baseUUID,
                                  const CItemAtt *att, const Command *pcmd)
-  : Command(pcomInt), m_ci(ci)
+  : Command(pcomInt), m_ci(std::move(ci))
 {
   m_CommandChangeType = DB;
 
@@ -811,6 +811,9 @@ void UpdateEntryCommand::Doit(const CUUID &entry_uuid,
     if (ftype == CItemData::PASSWORD ||
         ftype == CItemData::XTIME)
       m_pcomInt->UpdateExpiryEntry(pos->second);
+    if (ftype == CItemData::GROUP || ftype == CItemData::TITLE ||
+        ftype == CItemData::USER)
+      m_pcomInt->ReindexEntry(entry_uuid);
 
     pos->second.SetStatus(es);
     m_pcomInt->AddChangedNodes(pos->second.GetGroup());
@@ -1120,6 +1123,40 @@ void UpdatePasswordHistoryCommand::Undo()
   }
 }
 
+// ------------------------------------------------
+// MergeDuplicateAttsCommand
+// ------------------------------------------------
+
+MergeDuplicateAttsCommand::MergeDuplicateAttsCommand(CommandInterface *pcomInt)
+ : Command(pcomInt)
+{
+  m_CommandChangeType = DB;
+}
+
+int MergeDuplicateAttsCommand::Execute()
+{
+  int rc(0);
+  if (!m_pcomInt->IsReadOnly()) {
+    SaveDBInformation();
+
+    m_mapSavedAttRefs.clear(); // in case it's being redone
+    m_removedAtts.clear();
+    rc = m_pcomInt->DoMergeDuplicateAtts(m_mapSavedAttRefs, m_removedAtts);
+
+    m_CommandDBChange = DB;
+  }
+  return rc;
+}
+
+void MergeDuplicateAttsCommand::Undo()
+{
+  if (!m_pcomInt->IsReadOnly() && m_CommandDBChange == DB) {
+    m_pcomInt->UndoMergeDuplicateAtts(m_mapSavedAttRefs, m_removedAtts);
+
+    RestoreDBInformation();
+  }
+}
+
 // ------------------------------------------------
 // RenameGroupCommand
 // ------------------------------------------------
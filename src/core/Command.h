@@ -230,10 +230,11 @@ class DeleteEntryCommand;
 class AddEntryCommand : public Command
 {
 public:
-  static AddEntryCommand *Create(CommandInterface *pcomInt, const CItemData &ci,
+  // Pass ci with std::move() if it's not needed afterwards, to save copying it
+  static AddEntryCommand *Create(CommandInterface *pcomInt, CItemData ci,
                                  const pws_os::CUUID &baseUUID = pws_os::CUUID::NullUUID(),
                                  const CItemAtt *att = nullptr, const Command *pcmd = nullptr)
-  { return new AddEntryCommand(pcomInt, ci, baseUUID, att, pcmd); }
+  { return new AddEntryCommand(pcomInt, std::move(ci), baseUUID, att, pcmd); }
   ~AddEntryCommand();
   int Execute();
   void Undo();
@@ -242,7 +243,7 @@ public:
 
 private:
   AddEntryCommand& operator=(const AddEntryCommand&) = delete; // Do not implement
-  AddEntryCommand(CommandInterface *pcomInt, const CItemData &ci,
+  AddEntryCommand(CommandInterface *pcomInt, CItemData ci,
                   const pws_os::CUUID &baseUUID, const CItemAtt *att,
                   const Command *pcmd = nullptr);
   CItemData m_ci;
@@ -452,6 +453,21 @@ private:
   SavePWHistoryMap m_mapSavedHistory;
 };
 
+class MergeDuplicateAttsCommand : public Command
+{
+public:
+  // Execute() returns the number of attachments removed
+  static MergeDuplicateAttsCommand *Create(CommandInterface *pcomInt)
+  { return new MergeDuplicateAttsCommand(pcomInt); }
+  int Execute();
+  void Undo();
+
+private:
+  MergeDuplicateAttsCommand(CommandInterface *pcomInt);
+  SaveAttRefMap m_mapSavedAttRefs;
+  AttList m_removedAtts;
+};
+
 class RenameGroupCommand : public Command
 {
 public:
@@ -62,6 +62,11 @@ class CommandInterface {
                                       SavePWHistoryMap &mapSavedHistory) = 0;
   virtual void UndoUpdatePasswordHistory(SavePWHistoryMap &mapSavedHistory) = 0;
 
+  virtual int DoMergeDuplicateAtts(SaveAttRefMap &mapSavedAttRefs,
+                                   AttList &removedAtts) = 0;
+  virtual void UndoMergeDuplicateAtts(const SaveAttRefMap &mapSavedAttRefs,
+                                      const AttList &removedAtts) = 0;
+
   virtual int DoRenameGroup(const StringX &sxOldPath, const StringX &sxNewPath,
                             MultiCommands * &pmulticmds) = 0;
   virtual void UndoRenameGroup(MultiCommands *pmulticmds) = 0;
@@ -90,6 +95,8 @@ class CommandInterface {
                                  const StringX &value) = 0;
   virtual void RemoveExpiryEntry(const CItemData &ci) = 0;
 
+  virtual void ReindexEntry(const pws_os::CUUID &entry_uuid) = 0;
+
   virtual const PSWDPolicyMap &GetPasswordPolicies() = 0;
   virtual bool SetPasswordPolicies(const PSWDPolicyMap &MapPSWDPLC) = 0;
   virtual bool AddPolicy(const StringX &sxPolicyName, const PWPolicy &st_pp,
@@ -537,9 +537,7 @@ int PWScore::WriteXMLFile(const StringX &filename,
     ofs << "\"" << endl;
   }
 
-  CUUID huuid(*m_hdr.m_file_uuid.GetARep(), true); // true to print canonically
-
-  ofs << "Database_uuid=\"" << huuid << "\"" << endl;
+  ofs << "Database_uuid=\"" << m_hdr.m_file_uuid.Canonic() << "\"" << endl;
   ofs << "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\"" << endl;
   ofs << "xsi:noNamespaceSchemaLocation=\"pwsafe.xsd\">" << endl;
   ofs << endl;
@@ -1430,7 +1428,7 @@ int PWScore::ImportPlaintextFile(const StringX &ImportedPrefix,
     }
     
     // Add to commands to execute
-    Command *pcmd = AddEntryCommand::Create(this, ci_temp);
+    Command *pcmd = AddEntryCommand::Create(this, std::move(ci_temp));
     pcmd->SetNoGUINotify();
     pmulticmds->Add(pcmd);
     numImported++;
@@ -1832,7 +1830,7 @@ int PWScore::ImportKeePassV1TXTFile(const StringX &filename,
 
     ci_temp.SetStatus(CItemData::ES_ADDED);
 
-    Command *pcmd = AddEntryCommand::Create(this, ci_temp);
+    Command *pcmd = AddEntryCommand::Create(this, std::move(ci_temp));
     pcmd->SetNoGUINotify();
     pmulticmds->Add(pcmd);
     numImported++;
@@ -2314,7 +2312,7 @@ int PWScore::ImportKeePassV1CSVFile(const StringX &filename,
     ci_temp.SetStatus(CItemData::ES_ADDED);
 
     // Add to commands to execute
-    Command *pcmd = AddEntryCommand::Create(this, ci_temp);
+    Command *pcmd = AddEntryCommand::Create(this, std::move(ci_temp));
     pcmd->SetNoGUINotify();
     pmulticmds->Add(pcmd);
     numImported++;
@@ -27,6 +27,7 @@
 #include <vector>
 #include <algorithm>
 #include <set>
+#include <thread>
 
 using namespace std;
 
@@ -41,7 +42,8 @@ static void CompareField(CItemData::FieldType field,
                          const CItemData &first, const CItemData &second,
                          CItemData::FieldBits &bsConflicts, bool bTreatWhiteSpaceasEmpty = false)
 {
-  if (bsTest.test(field)) {
+  // Same digests means same values, so there's no need to decrypt them
+  if (bsTest.test(field) && !first.IsSameFieldValue(field, second)) {
     bool flip;
     if (bTreatWhiteSpaceasEmpty) {
       StringX a(first.GetFieldValue(field)), b(second.GetFieldValue(field));
@@ -59,6 +61,123 @@ static void CompareField(CItemData::FieldType field,
  * XXX Logic of comparing two entries should really be moved to CItemData
  */
 
+namespace {
+// An entry found in both databases, whose fields are to be compared
+struct ComparePair {
+  ItemListIter currentPos, compPos;
+  StringX group, title, user;
+  // Whose passwords to compare, the bases of aliases and shortcuts
+  const CItemData *pcurrentPW, *pcompPW;
+  CItemData::FieldBits bsConflicts;
+};
+
+/*
+ First byte (values in square brackets taken from ItemData.h)
+ 1... ....  NAME       [0x00] - n/a - depreciated
+ .1.. ....  UUID       [0x01] - n/a - unique
+ ..1. ....  GROUP      [0x02] - not checked - must be identical
+ ...1 ....  TITLE      [0x03] - not checked - must be identical
+ .... 1...  USER       [0x04] - not checked - must be identical
+ .... .1..  NOTES      [0x05]
+ .... ..1.  PASSWORD   [0x06]
+ .... ...1  CTIME      [0x07] - not checked by default
+
+ Second byte
+ 1... ....  PMTIME     [0x08] - not checked by default
+ .1.. ....  ATIME      [0x09] - not checked by default
+ ..1. ....  XTIME      [0x0a] - not checked by default
+ ...1 ....  RESERVED   [0x0b] - not used
+ .... 1...  RMTIME     [0x0c] - not checked by default
+ .... .1..  URL        [0x0d]
+ .... ..1.  AUTOTYPE   [0x0e]
+ .... ...1  PWHIST     [0x0f]
+
+ Third byte
+ 1... ....  POLICY     [0x10] - not checked by default
+ .1.. ....  XTIME_INT  [0x11] - not checked by default
+ ..1. ....  RUNCMD     [0x12]
+ ...1 ....  DCA        [0x13]
+ .... 1...  EMAIL      [0x14]
+ .... .1..  PROTECTED  [0x15]
+ .... ..1.  SYMBOLS    [0x16]
+ .... ...1  SHIFTDCA   [0x17]
+
+ Fourth byte
+ 1... ....  POLICYNAME [0x18] - not checked by default
+ .1.. ....  KBSHORTCUT [0x19] - not checked by default
+*/
+void CompareEntries(ComparePair &pair, const CItemData::FieldBits &bsFields,
+                    bool bTreatWhiteSpaceasEmpty,
+                    const PWPolicy &cur_default_pwp, const PWPolicy &cmp_default_pwp)
+{
+  const CItemData &currentItem = pair.currentPos->second;
+  const CItemData &compItem = pair.compPos->second;
+  CItemData::FieldBits &bsConflicts = pair.bsConflicts;
+
+  bsConflicts.reset();
+
+  if (bsFields.test(CItemData::PASSWORD) &&
+      !pair.pcurrentPW->IsSameFieldValue(CItemData::PASSWORD, *pair.pcompPW) &&
+      pair.pcurrentPW->GetPassword() != pair.pcompPW->GetPassword())
+    bsConflicts.flip(CItemData::PASSWORD);
+
+  CompareField(CItemData::NOTES, bsFields, currentItem, compItem,
+               bsConflicts, bTreatWhiteSpaceasEmpty);
+  CompareField(CItemData::CTIME, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::PMTIME, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::ATIME, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::XTIME, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::RMTIME, bsFields, currentItem, compItem, bsConflicts);
+
+  if (bsFields.test(CItemData::XTIME_INT)) {
+    int32 current_xint, comp_xint;
+    currentItem.GetXTimeInt(current_xint);
+    compItem.GetXTimeInt(comp_xint);
+    if (current_xint != comp_xint)
+      bsConflicts.flip(CItemData::XTIME_INT);
+  }
+
+  CompareField(CItemData::URL, bsFields, currentItem, compItem,
+               bsConflicts, bTreatWhiteSpaceasEmpty);
+  CompareField(CItemData::AUTOTYPE, bsFields, currentItem, compItem,
+               bsConflicts, bTreatWhiteSpaceasEmpty);
+  CompareField(CItemData::PWHIST, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::POLICYNAME, bsFields, currentItem, compItem, bsConflicts);
+
+  // Don't test policy or symbols if either entry is using a named policy
+  // as these are meaningless to compare
+  if (currentItem.GetPolicyName().empty() && compItem.GetPolicyName().empty()) {
+    if (bsFields.test(CItemData::POLICY)) {
+      PWPolicy cur_pwp, cmp_pwp;
+      if (currentItem.GetPWPolicy().empty())
+        cur_pwp = cur_default_pwp;
+      else
+        currentItem.GetPWPolicy(cur_pwp);
+      if (compItem.GetPWPolicy().empty())
+        cmp_pwp = cmp_default_pwp;
+      else
+        compItem.GetPWPolicy(cmp_pwp);
+      if (cur_pwp != cmp_pwp)
+        bsConflicts.flip(CItemData::POLICY);
+    }
+    CompareField(CItemData::SYMBOLS, bsFields, currentItem, compItem, bsConflicts);
+  }
+
+  CompareField(CItemData::RUNCMD, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::DCA, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::SHIFTDCA, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::EMAIL, bsFields, currentItem, compItem, bsConflicts);
+  CompareField(CItemData::PROTECTED, bsFields, currentItem, compItem, bsConflicts);
+
+  if (bsFields.test(CItemData::KBSHORTCUT) &&
+      currentItem.GetKBShortcut() != compItem.GetKBShortcut())
+    bsConflicts.flip(CItemData::KBSHORTCUT);
+}
+
+// Fewer than this many pairs per thread isn't worth starting one for
+const size_t MIN_PAIRS_PER_THREAD = 256;
+} // anonymous namespace
+
 void PWScore::Compare(PWScore *pothercore,
                       const CItemData::FieldBits &bsFields, const bool &subgroup_bset,
                       const bool &bTreatWhiteSpaceasEmpty,  const stringT &subgroup_name,
@@ -74,15 +193,17 @@ void PWScore::Compare(PWScore *pothercore,
   Algorithm:
     Foreach entry in current database {
       Find in comparison database - subject to subgroup checking
-      if found {
-        Compare
-        if match
-          OK
-       else
-          There are conflicts; note them & increment numConflicts
-      } else {
+      if found
+        note the pair
+      else
         save & increment numOnlyInCurrent
-      }
+    }
+
+    Compare the fields of the pairs, spread across threads, then in order {
+      if match
+        OK
+      else
+        There are conflicts; note them & increment numConflicts
     }
 
     Foreach entry in comparison database {
@@ -90,11 +211,14 @@ void PWScore::Compare(PWScore *pothercore,
       if not found
         save & increment numOnlyInComp
     }
+
+  Find() looks up each core's index by group, title & user, so none of
+  this searches either database.
   */
 
-  CItemData::FieldBits bsConflicts(0);
   st_CompareData st_data;
   int numOnlyInCurrent(0), numOnlyInComp(0), numConflicts(0), numIdentical(0);
+  std::vector<ComparePair> vPairs;
 
   ItemListIter currentPos;
   for (currentPos = GetEntryIter();
@@ -125,136 +249,19 @@ void PWScore::Compare(PWScore *pothercore,
       ItemListIter foundPos = pothercore->Find(st_data.group,
                                                st_data.title, st_data.user);
       if (foundPos != pothercore->GetEntryEndIter()) {
-        // found a match, see if all other fields also match
-        // Difference flags:
-        /*
-         First byte (values in square brackets taken from ItemData.h)
-         1... ....  NAME       [0x00] - n/a - depreciated
-         .1.. ....  UUID       [0x01] - n/a - unique
-         ..1. ....  GROUP      [0x02] - not checked - must be identical
-         ...1 ....  TITLE      [0x03] - not checked - must be identical
-         .... 1...  USER       [0x04] - not checked - must be identical
-         .... .1..  NOTES      [0x05]
-         .... ..1.  PASSWORD   [0x06]
-         .... ...1  CTIME      [0x07] - not checked by default
-
-         Second byte
-         1... ....  PMTIME     [0x08] - not checked by default
-         .1.. ....  ATIME      [0x09] - not checked by default
-         ..1. ....  XTIME      [0x0a] - not checked by default
-         ...1 ....  RESERVED   [0x0b] - not used
-         .... 1...  RMTIME     [0x0c] - not checked by default
-         .... .1..  URL        [0x0d]
-         .... ..1.  AUTOTYPE   [0x0e]
-         .... ...1  PWHIST     [0x0f]
-
-         Third byte
-         1... ....  POLICY     [0x10] - not checked by default
-         .1.. ....  XTIME_INT  [0x11] - not checked by default
-         ..1. ....  RUNCMD     [0x12]
-         ...1 ....  DCA        [0x13]
-         .... 1...  EMAIL      [0x14]
-         .... .1..  PROTECTED  [0x15]
-         .... ..1.  SYMBOLS    [0x16]
-         .... ...1  SHIFTDCA   [0x17]
-
-         Fourth byte
-         1... ....  POLICYNAME [0x18] - not checked by default
-         .1.. ....  KBSHORTCUT [0x19] - not checked by default
-
-        */
-        bsConflicts.reset();
-        StringX sxCurrentPassword, sxComparisonPassword;
-
+        // found a match, see if all other fields also match, below
         const CItemData &compItem = pothercore->GetEntry(foundPos);
-
-        if (currentItem.IsDependent()) {
-          CItemData *pci_base = GetBaseEntry(&currentItem);
-          sxCurrentPassword = pci_base->GetPassword();
-        } else
-          sxCurrentPassword = currentItem.GetPassword();
-
-        if (compItem.IsDependent()) {
-          CItemData *pci_base = pothercore->GetBaseEntry(&compItem);
-          sxComparisonPassword = pci_base->GetPassword();
-        } else
-          sxComparisonPassword = compItem.GetPassword();
-
-        if (bsFields.test(CItemData::PASSWORD) &&
-            sxCurrentPassword != sxComparisonPassword)
-          bsConflicts.flip(CItemData::PASSWORD);
-
-        CompareField(CItemData::NOTES, bsFields, currentItem, compItem,
-                     bsConflicts, bTreatWhiteSpaceasEmpty);
-        CompareField(CItemData::CTIME, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::PMTIME, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::ATIME, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::XTIME, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::RMTIME, bsFields, currentItem, compItem, bsConflicts);
-
-        if (bsFields.test(CItemData::XTIME_INT)) {
-          int32 current_xint, comp_xint;
-          currentItem.GetXTimeInt(current_xint);
-          compItem.GetXTimeInt(comp_xint);
-          if (current_xint != comp_xint)
-            bsConflicts.flip(CItemData::XTIME_INT);
-        }
-
-        CompareField(CItemData::URL, bsFields, currentItem, compItem,
-                     bsConflicts, bTreatWhiteSpaceasEmpty);
-        CompareField(CItemData::AUTOTYPE, bsFields, currentItem, compItem,
-                     bsConflicts, bTreatWhiteSpaceasEmpty);
-        CompareField(CItemData::PWHIST, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::POLICYNAME, bsFields, currentItem, compItem, bsConflicts);
-
-        // Don't test policy or symbols if either entry is using a named policy
-        // as these are meaningless to compare
-        if (currentItem.GetPolicyName().empty() && compItem.GetPolicyName().empty()) {
-          if (bsFields.test(CItemData::POLICY)) {
-            PWPolicy cur_pwp, cmp_pwp;
-            if (currentItem.GetPWPolicy().empty())
-              cur_pwp = PWSprefs::GetInstance()->GetDefaultPolicy();
-            else
-              currentItem.GetPWPolicy(cur_pwp);
-            if (compItem.GetPWPolicy().empty())
-              cmp_pwp = PWSprefs::GetInstance()->GetDefaultPolicy(true);
-            else
-              compItem.GetPWPolicy(cmp_pwp);
-            if (cur_pwp != cmp_pwp)
-              bsConflicts.flip(CItemData::POLICY);
-          }
-          CompareField(CItemData::SYMBOLS, bsFields, currentItem, compItem, bsConflicts);
-        }
-
-        CompareField(CItemData::RUNCMD, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::DCA, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::SHIFTDCA, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::EMAIL, bsFields, currentItem, compItem, bsConflicts);
-        CompareField(CItemData::PROTECTED, bsFields, currentItem, compItem, bsConflicts);
-
-        if (bsFields.test(CItemData::KBSHORTCUT) &&
-            currentItem.GetKBShortcut() != compItem.GetKBShortcut())
-          bsConflicts.flip(CItemData::KBSHORTCUT);
-
-        st_data.uuid0 = currentPos->first;
-        st_data.uuid1 = foundPos->first;
-        st_data.bsDiffs = bsConflicts;
-        st_data.indatabase = BOTH;
-        st_data.unknflds0 = currentItem.NumberUnknownFields() > 0;
-        st_data.unknflds1 = compItem.NumberUnknownFields() > 0;
-        st_data.bIsProtected0 = currentItem.IsProtected();
-        st_data.bHasAttachment0 = currentItem.HasAttRef();
-        st_data.bHasAttachment1 = compItem.HasAttRef();
-
-        if (bsConflicts.any()) {
-          numConflicts++;
-          st_data.id = numConflicts;
-          list_Conflicts.push_back(st_data);
-        } else {
-          numIdentical++;
-          st_data.id = numIdentical;
-          list_Identical.push_back(st_data);
-        }
+        ComparePair pair;
+        pair.currentPos = currentPos;
+        pair.compPos = foundPos;
+        pair.group = st_data.group;
+        pair.title = st_data.title;
+        pair.user = st_data.user;
+        pair.pcurrentPW = currentItem.IsDependent() ?
+          GetBaseEntry(&currentItem) : &currentItem;
+        pair.pcompPW = compItem.IsDependent() ?
+          pothercore->GetBaseEntry(&compItem) : &compItem;
+        vPairs.push_back(pair);
       } else {
         // didn't find any match...
         numOnlyInCurrent++;
@@ -270,6 +277,66 @@ void PWScore::Compare(PWScore *pothercore,
     }
   } // iteration over our entries
 
+  // Compare the pairs' fields, each thread taking a contiguous slice
+  const PWPolicy cur_default_pwp = PWSprefs::GetInstance()->GetDefaultPolicy();
+  const PWPolicy cmp_default_pwp = PWSprefs::GetInstance()->GetDefaultPolicy(true);
+  const bool bTreatWS = bTreatWhiteSpaceasEmpty;
+  auto compare_slice = [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      if (pbCancel != nullptr && *pbCancel)
+        return;
+      CompareEntries(vPairs[i], bsFields, bTreatWS, cur_default_pwp, cmp_default_pwp);
+    }
+  };
+
+  size_t numThreads = std::max(1U, std::thread::hardware_concurrency());
+  numThreads = std::min(numThreads,
+                        (vPairs.size() + MIN_PAIRS_PER_THREAD - 1) / MIN_PAIRS_PER_THREAD);
+  if (numThreads <= 1) {
+    compare_slice(0, vPairs.size());
+  } else {
+    std::vector<std::thread> vThreads;
+    const size_t slice = (vPairs.size() + numThreads - 1) / numThreads;
+    for (size_t first = slice; first < vPairs.size(); first += slice)
+      vThreads.emplace_back(compare_slice, first, std::min(first + slice, vPairs.size()));
+    compare_slice(0, slice);
+    for (auto &thread : vThreads)
+      thread.join();
+  }
+
+  if (pbCancel != nullptr && *pbCancel) {
+    return;
+  }
+
+  for (const ComparePair &pair : vPairs) {
+    const CItemData &currentItem = pair.currentPos->second;
+    const CItemData &compItem = pair.compPos->second;
+
+    st_data.Empty();
+    st_data.group = pair.group;
+    st_data.title = pair.title;
+    st_data.user = pair.user;
+    st_data.uuid0 = pair.currentPos->first;
+    st_data.uuid1 = pair.compPos->first;
+    st_data.bsDiffs = pair.bsConflicts;
+    st_data.indatabase = BOTH;
+    st_data.unknflds0 = currentItem.NumberUnknownFields() > 0;
+    st_data.unknflds1 = compItem.NumberUnknownFields() > 0;
+    st_data.bIsProtected0 = currentItem.IsProtected();
+    st_data.bHasAttachment0 = currentItem.HasAttRef();
+    st_data.bHasAttachment1 = compItem.HasAttRef();
+
+    if (pair.bsConflicts.any()) {
+      numConflicts++;
+      st_data.id = numConflicts;
+      list_Conflicts.push_back(st_data);
+    } else {
+      numIdentical++;
+      st_data.id = numIdentical;
+      list_Identical.push_back(st_data);
+    }
+  }
+
   ItemListIter compPos;
   for (compPos = pothercore->GetEntryIter();
        compPos != pothercore->GetEntryEndIter();
@@ -280,7 +347,7 @@ void PWScore::Compare(PWScore *pothercore,
     }
 
     st_data.Empty();
-    CItemData compItem = pothercore->GetEntry(compPos);
+    const CItemData &compItem = pothercore->GetEntry(compPos);
 
     if (!subgroup_bset ||
         compItem.Matches(std::wstring(subgroup_name), subgroup_object,
@@ -483,31 +550,36 @@ stringT PWScore::Merge(PWScore *pothercore,
       int diff_flags = 0;
       int32 cxtint, oxtint;
       time_t cxt, oxt;
-      if (otherItem.GetPassword() != curItem.GetPassword()) {
+      if (!otherItem.IsSameFieldValue(CItemData::PASSWORD, curItem) &&
+          otherItem.GetPassword() != curItem.GetPassword()) {
         diff_flags |= MRG_PASSWORD;
         LoadAString(str_temp, IDSC_FLDNMPASSWORD);
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetNotes() != curItem.GetNotes()) {
+      if (!otherItem.IsSameFieldValue(CItemData::NOTES, curItem) &&
+          otherItem.GetNotes() != curItem.GetNotes()) {
         diff_flags |= MRG_NOTES;
         LoadAString(str_temp, IDSC_FLDNMNOTES);
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetURL() != curItem.GetURL()) {
+      if (!otherItem.IsSameFieldValue(CItemData::URL, curItem) &&
+          otherItem.GetURL() != curItem.GetURL()) {
         diff_flags |= MRG_URL;
         LoadAString(str_temp, IDSC_FLDNMURL);
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetAutoType() != curItem.GetAutoType()) {
+      if (!otherItem.IsSameFieldValue(CItemData::AUTOTYPE, curItem) &&
+          otherItem.GetAutoType() != curItem.GetAutoType()) {
         diff_flags |= MRG_AUTOTYPE;
         LoadAString(str_temp, IDSC_FLDNMAUTOTYPE);
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetPWHistory() != curItem.GetPWHistory()) {
+      if (!otherItem.IsSameFieldValue(CItemData::PWHIST, curItem) &&
+          otherItem.GetPWHistory() != curItem.GetPWHistory()) {
         diff_flags |= MRG_HISTORY;
         LoadAString(str_temp, IDSC_FLDNMPWHISTORY);
         str_diffs += str_temp + _T(", ");
@@ -548,7 +620,8 @@ stringT PWScore::Merge(PWScore *pothercore,
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetRunCommand() != curItem.GetRunCommand()) {
+      if (!otherItem.IsSameFieldValue(CItemData::RUNCMD, curItem) &&
+          otherItem.GetRunCommand() != curItem.GetRunCommand()) {
         diff_flags |= MRG_EXECUTE;
         LoadAString(str_temp, IDSC_FLDNMRUNCOMMAND);
         str_diffs += str_temp + _T(", ");
@@ -564,13 +637,15 @@ stringT PWScore::Merge(PWScore *pothercore,
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetEmail() != curItem.GetEmail()) {
+      if (!otherItem.IsSameFieldValue(CItemData::EMAIL, curItem) &&
+          otherItem.GetEmail() != curItem.GetEmail()) {
         diff_flags |= MRG_EMAIL;
         LoadAString(str_temp, IDSC_FLDNMEMAIL);
         str_diffs += str_temp + _T(", ");
       }
 
-      if (otherItem.GetSymbols() != curItem.GetSymbols()) {
+      if (!otherItem.IsSameFieldValue(CItemData::SYMBOLS, curItem) &&
+          otherItem.GetSymbols() != curItem.GetSymbols()) {
         diff_flags |= MRG_SYMBOLS;
         LoadAString(str_temp, IDSC_FLDNMSYMBOLS);
         str_diffs += str_temp + _T(", ");
@@ -998,6 +1073,11 @@ void PWScore::Synchronize(PWScore *pothercore,
       // Do not try and change GROUPTITLE = 0x00 (use GROUP & TITLE separately) or UUID = 0x01
       for (size_t i = 2; i < bsSyncFields.size(); i++) {
         if (bsSyncFields.test(i)) {
+          // Nothing to update if it's the same, which is cheap to tell
+          if (static_cast<CItemData::FieldType>(i) != CItemData::POLICYNAME &&
+              updItem.IsSameFieldValue(static_cast<CItemData::FieldType>(i), otherItem))
+            continue;
+
           StringX sxValue = otherItem.GetFieldValue(static_cast<CItemData::FieldType>(i));
 
           // Special processing for password policies (default & named)
@@ -11,32 +11,88 @@
 #include "Item.h"
 #include "crypto/BlowFish.h"
 #include "crypto/TwoFish.h"
-#include "PWSrand.h"
 #include "UTF8Conv.h"
 #include "Util.h"
 #include "os/env.h"
 
 #include <vector>
+#include <bitset>
+
+size_t CItem::FieldMap::Index(int ft) const
+{
+  size_t retval = 0;
+  const int word = ft / 64;
+  for (int i = 0; i < word; i++)
+    retval += std::bitset<64>(m_set[i]).count();
+  const uint64 below = (uint64(1) << (ft % 64)) - 1;
+  return retval + std::bitset<64>(m_set[word] & below).count();
+}
+
+CItem::FieldMap::FieldMap(FieldMap &&that) noexcept
+  : m_fields(std::move(that.m_fields))
+{
+  memcpy(m_set, that.m_set, sizeof(m_set));
+  that.clear();
+}
+
+CItem::FieldMap &CItem::FieldMap::operator=(FieldMap &&that) noexcept
+{
+  if (this != &that) {
+    m_fields = std::move(that.m_fields);
+    memcpy(m_set, that.m_set, sizeof(m_set));
+    that.clear();
+  }
+  return *this;
+}
+
+CItemField &CItem::FieldMap::operator[](int ft)
+{
+  ASSERT(ft >= 0 && ft < NTYPES);
+  const size_t index = Index(ft);
+  if (!IsSet(ft)) {
+    m_set[ft / 64] |= uint64(1) << (ft % 64);
+    m_fields.insert(m_fields.begin() + index,
+                    value_type(ft, CItemField(static_cast<unsigned char>(ft))));
+  }
+  return m_fields[index].second;
+}
+
+size_t CItem::FieldMap::erase(int ft)
+{
+  if (!IsSet(ft))
+    return 0;
+  m_fields.erase(m_fields.begin() + Index(ft));
+  m_set[ft / 64] &= ~(uint64(1) << (ft % 64));
+  return 1;
+}
 
 CItem::CItem()
 {
-  PWSrand::GetInstance()->GetRandomData( m_key, sizeof(m_key) );
 }
 
 CItem::CItem(const CItem &that) :
   m_fields(that.m_fields),
   m_URFL(that.m_URFL)
 {
-  memcpy(m_key, that.m_key, sizeof(m_key));
+}
+
+CItem::CItem(CItem &&that) noexcept :
+  m_fields(std::move(that.m_fields)),
+  m_URFL(std::move(that.m_URFL))
+{
 }
 
 CItem::~CItem()
 {
-  delete m_blowfish;
-  // Following protects against possible use-after-delete
-  // bug, since new BF will be created, rather than
-  // using one with trashed values
-  m_blowfish = nullptr;
+}
+
+CItem& CItem::operator=(CItem &&that) noexcept
+{
+  if (this != &that) {
+    m_fields = std::move(that.m_fields);
+    m_URFL = std::move(that.m_URFL);
+  }
+  return *this;
 }
 
 CItem& CItem::operator=(const CItem &that)
@@ -44,41 +100,17 @@ CItem& CItem::operator=(const CItem &that)
   if (this != &that) { // Check for self-assignment
     m_fields = that.m_fields;
     m_URFL = that.m_URFL;
-
-    memcpy(m_key, that.m_key, sizeof(m_key));
-    delete m_blowfish;
-    m_blowfish = nullptr;
   }
   return *this;
 }
 
-bool CItem::CompareFields(const CItemField &fthis,
-                          const CItem &that, const CItemField &fthat) const
-{
-  if (fthis.GetLength() != fthat.GetLength() ||
-      fthis.GetType() != fthat.GetType())
-    return false;
-  size_t flength = fthis.GetLength() + BlowFish::BLOCKSIZE;
-  auto *dthis = new unsigned char[flength];
-  auto *dthat = new unsigned char[flength];
-  GetField(fthis, dthis, flength);
-  flength = fthis.GetLength() + BlowFish::BLOCKSIZE; // GetField updates length, reset
-  that.GetField(fthat, dthat, flength);
-  bool retval = (memcmp(dthis, dthat, flength) == 0);
-  trashMemory(dthis, flength); trashMemory(dthis, flength);
-  delete[] dthis; delete[] dthat;
-  return retval;
-}
-
 bool CItem::operator==(const CItem &that) const
 {
   if (m_fields.size() == that.m_fields.size() &&
       m_URFL.size() == that.m_URFL.size()) {
     /**
-     * It would be nice to be able to compare the m_fields
-     * and m_URFL directly, but the fields would be
-     * encrypted with different keys, making byte-wise
-     * field comparisons infeasible.
+     * The fields are encrypted with different keys, so
+     * their bytes can't be compared, but their digests can.
      */
     FieldConstIter ithis, ithat;
     for (ithis = m_fields.begin(), ithat = that.m_fields.begin();
@@ -88,7 +120,7 @@ bool CItem::operator==(const CItem &that) const
         return false;
       const CItemField &fthis = ithis->second;
       const CItemField &fthat = ithat->second;
-      if (!CompareFields(fthis, that, fthat))
+      if (!fthis.HasSameValue(fthat))
         return false;
     } // for m_fields
   } else
@@ -102,13 +134,42 @@ bool CItem::operator==(const CItem &that) const
     for (;
          ithis != m_URFL.end();
          ithis++, ithat++) {
-      if (!CompareFields(*ithis, that, *ithat))
+      if (!ithis->HasSameValue(*ithat))
         return false;
     } // for m_URFL
   }
   return true;
 }
 
+bool CItem::IsSameField(int ft, const CItem &that) const
+{
+  FieldConstIter ithis = m_fields.find(ft);
+  FieldConstIter ithat = that.m_fields.find(ft);
+  if (ithis == m_fields.end() || ithat == that.m_fields.end())
+    return ithis == m_fields.end() && ithat == that.m_fields.end();
+  return ithis->second.HasSameValue(ithat->second);
+}
+
+void CItem::GetFingerprint(unsigned char fp[SHA256::HASHLEN]) const
+{
+  SHA256 ctx;
+  auto hashField = [&ctx](int type, const CItemField &field) {
+    unsigned char buf[2 * sizeof(int32)];
+    putInt32(buf, static_cast<int32>(type));
+    putInt32(buf + sizeof(int32), static_cast<int32>(field.GetLength()));
+    ctx.Update(buf, sizeof(buf));
+    ctx.Update(field.GetDigest(), CItemField::DIGESTLEN);
+  };
+
+  for (FieldConstIter fiter = m_fields.begin(); fiter != m_fields.end(); fiter++)
+    hashField(fiter->first, fiter->second);
+
+  for (auto ufiter = m_URFL.begin(); ufiter != m_URFL.end(); ufiter++)
+    hashField(ufiter->GetType(), *ufiter);
+
+  ctx.Final(fp);
+}
+
 size_t CItem::GetSize() const
 {
   size_t length(0);
@@ -123,16 +184,6 @@ size_t CItem::GetSize() const
   return length;
 }
 
-BlowFish *CItem::MakeBlowFish() const
-{
-  // Creating a BlowFish object's relatively expensive, so we use
-  // the singleton design pattern for the life of the CItem object
-  if(!m_blowfish) {
-    m_blowfish = BlowFish::MakeBlowFish(m_key, sizeof(m_key));
-  }
-  return m_blowfish;
-}
-
 void CItem::SetUnknownField(unsigned char type,
                             size_t length,
                             const unsigned char *ufield)
@@ -143,7 +194,7 @@ void CItem::SetUnknownField(unsigned char type,
   **/
 
   CItemField unkrfe(type);
-  unkrfe.Set(ufield, length, MakeBlowFish());
+  unkrfe.Set(ufield, length);
   m_URFL.push_back(unkrfe);
 }
 
@@ -170,9 +221,7 @@ void CItem::Clear()
 void CItem::SetField(int ft, const unsigned char *value, size_t length)
 {
   if (length != 0) {
-    m_fields[ft].Set(value, length,
-                     MakeBlowFish(),
-                     static_cast<unsigned char>(ft));
+    m_fields[ft].Set(value, length, static_cast<unsigned char>(ft));
   } else
     m_fields.erase(ft);
 }
@@ -180,9 +229,7 @@ void CItem::SetField(int ft, const unsigned char *value, size_t length)
 void CItem::SetField(int ft, const StringX &value)
 {
   if (!value.empty()) {
-    m_fields[ft].Set(value,
-                     MakeBlowFish(),
-                     static_cast<unsigned char>(ft));
+    m_fields[ft].Set(value, static_cast<unsigned char>(ft));
   } else
     m_fields.erase(ft);
 }
@@ -246,7 +293,7 @@ bool CItem::SetTimeField(int ft, const unsigned char *value,
 void CItem::GetField(const CItemField &field,
                      unsigned char *value, size_t &length) const
 {
-  field.Get(value, length, MakeBlowFish());
+  field.Get(value, length);
 }
 
 StringX CItem::GetField(const int ft) const
@@ -258,7 +305,7 @@ StringX CItem::GetField(const int ft) const
 StringX CItem::GetField(const CItemField &field) const
 {
   StringX retval;
-  field.Get(retval, MakeBlowFish());
+  field.Get(retval);
   return retval;
 }
 
@@ -14,6 +14,8 @@
 #include "ItemField.h"
 #include "Util.h"
 #include "StringX.h"
+#include "crypto/sha256.h"
+#include "os/typedefs.h"
 
 #include <vector>
 #include <string>
@@ -29,9 +31,12 @@
  * What makes this class interesting is that all fields are kept encrypted
  * from the moment of construction, and are decrypted by the appropriate
  * accessor. This encryption is orthogonal to the encryption of data on disk.
+ * All items share one cipher for this, see CItemField, so there's no key
+ * material per item, and copying an item just copies its fields.
  *
  * Since the number of fields is relatively large and evolves over time, we
- * keep them in a map that's keyed on their type. For convenience, setters
+ * keep them in a map that's keyed on their type, see FieldMap below.
+ * For convenience, setters
  * and getters can be defined in derived classes. These also convert the
  * raw bytes (stored encrypted) to/from the relevant representation, e.g.,
  * string, time, etc.
@@ -41,8 +46,6 @@
  *
 */
 
-class BlowFish;
-
 class CItem
 {
 public:
@@ -132,6 +135,7 @@ public:
   //Construction
   CItem();
   CItem(const CItem& stuffhere);
+  CItem(CItem &&stuffhere) noexcept;
 
   virtual ~CItem();
 
@@ -140,16 +144,68 @@ public:
   size_t NumberUnknownFields() const {return m_URFL.size();}
 
   CItem& operator=(const CItem& second);
+  CItem& operator=(CItem &&second) noexcept;
   virtual void Clear();
   void ClearField(int ft) {m_fields.erase(ft);}
 
   bool operator==(const CItem &that) const;
 
+  // Whether field ft has the same value here and in that, decided by the
+  // fields' digests, i.e., without decrypting either. Unset only matches unset.
+  bool IsSameField(int ft, const CItem &that) const;
+
   size_t GetSize() const;
   void GetSize(size_t &isize) const {isize = GetSize();}
 
+  // Hash of the fields' digests, so it tells cheaply if an item's been
+  // modified since an earlier call, or if two items in memory are equal.
+  void GetFingerprint(unsigned char fp[SHA256::HASHLEN]) const;
+
 protected:
-  typedef std::map<int, CItemField> FieldMap;
+  /**
+   * The fields that are set, in order of type, in one vector, with a bitmap
+   * of which types these are. A field's index is the number of bits set
+   * before its own, so finding it is a couple of popcounts rather than a
+   * search, and there's one allocation rather than one per field.
+   * The interface is the subset of std::map's that we need.
+   */
+  class FieldMap {
+  public:
+    typedef std::pair<int, CItemField> value_type;
+    typedef std::vector<value_type>::iterator iterator;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+    FieldMap() {Reset();}
+    FieldMap(const FieldMap &) = default;
+    FieldMap(FieldMap &&that) noexcept;
+    FieldMap &operator=(const FieldMap &) = default;
+    FieldMap &operator=(FieldMap &&that) noexcept;
+
+    iterator begin() {return m_fields.begin();}
+    const_iterator begin() const {return m_fields.begin();}
+    iterator end() {return m_fields.end();}
+    const_iterator end() const {return m_fields.end();}
+    size_t size() const {return m_fields.size();}
+    bool empty() const {return m_fields.empty();}
+
+    iterator find(int ft)
+    {return IsSet(ft) ? m_fields.begin() + Index(ft) : m_fields.end();}
+    const_iterator find(int ft) const
+    {return IsSet(ft) ? m_fields.begin() + Index(ft) : m_fields.end();}
+    CItemField &operator[](int ft); // adds an empty one if not set
+    size_t erase(int ft);
+    void clear() {m_fields.clear(); Reset();}
+
+  private:
+    enum {NTYPES = 256}; // types are stored as unsigned char
+    bool IsSet(int ft) const
+    {return ft >= 0 && ft < NTYPES && (m_set[ft / 64] & (uint64(1) << (ft % 64))) != 0;}
+    size_t Index(int ft) const; // number of types set below ft
+    void Reset() {memset(m_set, 0, sizeof(m_set));}
+
+    uint64 m_set[NTYPES / 64];
+    std::vector<value_type> m_fields;
+  };
   typedef FieldMap::const_iterator FieldConstIter;
   typedef FieldMap::iterator FieldIter;
 
@@ -179,20 +235,6 @@ protected:
   {return type >= START && type < LAST_DATA;}
   bool IsItemAttField(unsigned char type) const
   {return type >= START_ATT && type < LAST_ATT;}
-
-private:
-  // Helper function for operator==
-  bool CompareFields(const CItemField &fthis,
-                     const CItem &that, const CItemField &fthat) const;
-
-  // Create local Encryption/Decryption object
-  BlowFish *MakeBlowFish() const;
-
-  // random key for storing stuff in memory
-  // We need to keep the key because it's easier to copy
-  // than the BlowFish object for copy c'tor and assignment
-  unsigned char m_key[32];
-  mutable BlowFish *m_blowfish = nullptr;
 };
 
 #endif /* __ITEM_H */
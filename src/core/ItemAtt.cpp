@@ -15,6 +15,7 @@
 #include "PWSfile.h"
 #include "PWSfileV4.h"
 #include "PWScore.h"
+#include "SecureArena.h"
 
 #include "os/typedefs.h"
 #include "os/pws_tchar.h"
@@ -25,21 +26,53 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <memory>
 
 using namespace std;
 using pws_os::CUUID;
 
+// Content that's been spilled to a temporary file (see Spill()), which is
+// deleted when the last copy of the attachment that refers to it goes.
+// It's encrypted with keys that only the attachment has, so what's left
+// if we don't get to delete it is of no use to anyone.
+class CItemAtt::SpillFile
+{
+public:
+  explicit SpillFile(const StringX &filename) : m_filename(filename) {}
+  ~SpillFile() {pws_os::DeleteAFile(m_filename.c_str());}
+
+private:
+  SpillFile(const SpillFile &) = delete;
+  SpillFile &operator=(const SpillFile &) = delete;
+  const StringX m_filename;
+};
+
 //-----------------------------------------------------------------------------
 // Constructors
 
 CItemAtt::CItemAtt()
-  : m_entrystatus(ES_CLEAN), m_offset(-1L), m_refcount(0)
+  : m_entrystatus(ES_CLEAN), m_offset(-1L), m_contentOffset(-1L),
+    m_contentLength(0), m_contentCipher(PWSfile::PWTwoFish), m_refcount(0)
 {
 }
 
 CItemAtt::CItemAtt(const CItemAtt &that) :
   CItem(that), m_entrystatus(that.m_entrystatus),
-  m_offset(that.m_offset), m_refcount(that.m_refcount)
+  m_offset(that.m_offset), m_contentFile(that.m_contentFile),
+  m_contentOffset(that.m_contentOffset),
+  m_contentLength(that.m_contentLength),
+  m_contentCipher(that.m_contentCipher), m_spill(that.m_spill),
+  m_refcount(that.m_refcount)
+{
+}
+
+CItemAtt::CItemAtt(CItemAtt &&that) noexcept :
+  CItem(std::move(that)), m_entrystatus(that.m_entrystatus),
+  m_offset(that.m_offset), m_contentFile(std::move(that.m_contentFile)),
+  m_contentOffset(that.m_contentOffset),
+  m_contentLength(that.m_contentLength),
+  m_contentCipher(that.m_contentCipher), m_spill(std::move(that.m_spill)),
+  m_refcount(that.m_refcount)
 {
 }
 
@@ -53,6 +86,27 @@ CItemAtt& CItemAtt::operator=(const CItemAtt &that)
     CItem::operator=(that);
     m_entrystatus = that.m_entrystatus;
     m_offset = that.m_offset;
+    m_contentFile = that.m_contentFile;
+    m_contentOffset = that.m_contentOffset;
+    m_contentLength = that.m_contentLength;
+    m_contentCipher = that.m_contentCipher;
+    m_spill = that.m_spill;
+    m_refcount = that.m_refcount;
+  }
+  return *this;
+}
+
+CItemAtt& CItemAtt::operator=(CItemAtt &&that) noexcept
+{
+  if (this != &that) {
+    CItem::operator=(std::move(that));
+    m_entrystatus = that.m_entrystatus;
+    m_offset = that.m_offset;
+    m_contentFile = std::move(that.m_contentFile);
+    m_contentOffset = that.m_contentOffset;
+    m_contentLength = that.m_contentLength;
+    m_contentCipher = that.m_contentCipher;
+    m_spill = std::move(that.m_spill);
     m_refcount = that.m_refcount;
   }
   return *this;
@@ -60,10 +114,42 @@ CItemAtt& CItemAtt::operator=(const CItemAtt &that)
 
 bool CItemAtt::operator==(const CItemAtt &that) const
 {
-  return (m_entrystatus == that.m_entrystatus &&
-          m_offset == that.m_offset &&
-          m_refcount == that.m_refcount &&
-          CItem::operator==(that));
+  if (m_entrystatus != that.m_entrystatus ||
+      m_offset != that.m_offset ||
+      m_refcount != that.m_refcount)
+    return false;
+
+  if (CItem::operator==(that) && m_contentFile == that.m_contentFile &&
+      m_contentOffset == that.m_contentOffset)
+    return true; // same content, in the same place
+
+  // Content's encrypted with keys of its own, so it's compared by value,
+  // by way of its digest, apart from the other fields
+  if (m_contentLength != that.m_contentLength)
+    return false;
+  CItemAtt a(*this), b(that);
+  a.ForgetDeferredContent();
+  b.ForgetDeferredContent();
+  if (!a.CItem::operator==(b))
+    return false;
+  if (!IsContentDeferred())
+    return true;
+
+  unsigned char key[SHA256::HASHLEN];
+  unsigned char digest[SHA256::HASHLEN], thatDigest[SHA256::HASHLEN];
+  PWSrand::GetInstance()->GetRandomData(key, sizeof(key));
+  const bool bSame =
+    GetContentDigest(key, sizeof(key), digest) == PWSfile::SUCCESS &&
+    that.GetContentDigest(key, sizeof(key), thatDigest) == PWSfile::SUCCESS &&
+    memcmp(digest, thatDigest, sizeof(digest)) == 0;
+  trashMemory(key, sizeof(key));
+  return bSame;
+}
+
+void CItemAtt::Clear()
+{
+  CItem::Clear();
+  ForgetDeferredContent();
 }
 
 void CItemAtt::SetTitle(const StringX &title)
@@ -110,9 +196,17 @@ void CItemAtt::SetCTime(time_t t)
   SetField(ATTCTIME, buf, sizeof(time_t));
 }
 
-void CItemAtt::SetContent(const unsigned char *content, size_t clen)
+int CItemAtt::SetContent(const unsigned char *content, size_t clen)
 {
-  SetField(CONTENT, content, clen);
+  return Spill([content, clen](const ContentSink &sink) {
+                 for (size_t pos = 0; pos < clen; pos += PWSfileV4::CONTENT_CHUNK) {
+                   const size_t n = std::min(size_t(PWSfileV4::CONTENT_CHUNK),
+                                             clen - pos);
+                   if (!sink(content + pos, n))
+                     return int(PWSfile::WRITE_FAIL);
+                 }
+                 return int(PWSfile::SUCCESS);
+               }, clen);
 }
 
 StringX CItemAtt::GetTime(int whichtime, PWSUtil::TMC result_format) const
@@ -125,22 +219,14 @@ StringX CItemAtt::GetTime(int whichtime, PWSUtil::TMC result_format) const
 
 size_t CItemAtt::GetContentLength() const
 {
-  auto fiter = m_fields.find(CONTENT);
-
-  if (fiter != m_fields.end())
-    return fiter->second.GetLength();
-  else
-    return 0;
+  return m_contentLength; // 0 if there's none
 }
 
 size_t CItemAtt::GetContentSize() const
 {
-  auto fiter = m_fields.find(CONTENT);
-
-  if (fiter != m_fields.end())
-    return fiter->second.GetSize();
-  else
-    return 0;
+  // Whole blocks, as if it were a CItemField, for compatibility
+  return ((m_contentLength + BlowFish::BLOCKSIZE - 1) / BlowFish::BLOCKSIZE)
+    * BlowFish::BLOCKSIZE;
 }
 
 bool CItemAtt::GetContent(unsigned char *content, size_t csize) const
@@ -150,8 +236,12 @@ bool CItemAtt::GetContent(unsigned char *content, size_t csize) const
   if (!HasContent() || csize < GetContentSize())
     return false;
 
-  GetField(m_fields.find(CONTENT)->second, content, csize);
-  return true;
+  unsigned char *p = content;
+  return StreamDeferredContent([&p](const unsigned char *data, size_t len) {
+                                 memcpy(p, data, len);
+                                 p += len;
+                                 return true;
+                               }) == PWSfile::SUCCESS;
 }
 
 int CItemAtt::Import(const stringT &fname)
@@ -159,6 +249,7 @@ int CItemAtt::Import(const stringT &fname)
   stringT spath, sdrive, sdir, sfname, sextn;
   time_t atime(0), ctime(0), mtime(0);
   int status = PWScore::SUCCESS;
+  size_t flen;
 
   ASSERT(!fname.empty());
   if (!pws_os::FileExists(fname))
@@ -168,29 +259,36 @@ int CItemAtt::Import(const stringT &fname)
   if (!fhandle)
     return PWScore::CANT_OPEN_FILE;
 
-  auto flen = static_cast<size_t>(pws_os::fileLength(fhandle));
-  if (flen > CItemAtt::MAX_SIZE) {
+  const ulong64 flen64 = pws_os::fileLength(fhandle);
+  if (flen64 > CItemAtt::MAX_SIZE) {
     pws_os::FClose(fhandle, false);
     return PWScore::MAX_SIZE_EXCEEDED;
   }
-
-  auto *data = new unsigned char[flen];
-  if (data == nullptr)
-    return PWScore::FAILURE;
-
-  size_t nread = fread(data, flen, 1, fhandle);
-  if (nread != 1) {
-    pws_os::FClose(fhandle, false);
-    status = PWScore::READ_FAIL;
-    goto done;
-  }
-
-  if (pws_os::FClose(fhandle, true) != 0) {
-    status = PWScore::READ_FAIL;
-    goto done;
-  }
-
-  SetField(CONTENT, data, flen);
+  flen = static_cast<size_t>(flen64);
+
+  // Take a copy now, as the file may change or go away before it's saved:
+  // a chunk at a time, encrypted into a temporary file of our own
+  status = Spill([fhandle, flen](const ContentSink &sink) {
+                   const size_t chunkLen = PWSfileV4::CONTENT_CHUNK;
+                   auto *chunk = static_cast<unsigned char *>(SecureArena::Allocate(chunkLen));
+                   int rc = PWScore::SUCCESS;
+                   for (size_t pos = 0; pos < flen; pos += chunkLen) {
+                     const size_t n = std::min(chunkLen, flen - pos);
+                     if (fread(chunk, 1, n, fhandle) != n) {
+                       rc = PWScore::READ_FAIL;
+                       break;
+                     }
+                     if (!sink(chunk, n)) {
+                       rc = PWScore::WRITE_FAIL;
+                       break;
+                     }
+                   }
+                   SecureArena::Release(chunk, chunkLen);
+                   return rc;
+                 }, flen);
+  pws_os::FClose(fhandle, false);
+  if (status != PWScore::SUCCESS)
+    return status;
 
   // derive the file's path and name
   pws_os::splitpath(fname, sdrive, sdir, sfname, sextn);
@@ -210,12 +308,8 @@ int CItemAtt::Import(const stringT &fname)
     CItem::SetField(FILEATIME, buf, sizeof(buf));
   } else {
     ASSERT(0);
-    goto done;
   }
 
- done:
-  trashMemory(data, flen);
-  delete[] data;
   return status;
 }
 
@@ -224,41 +318,134 @@ int CItemAtt::Export(const stringT &fname) const
   int status = PWScore::SUCCESS;
 
   ASSERT(!fname.empty());
-  ASSERT(IsFieldSet(CONTENT));
+  ASSERT(HasContent());
   // fail safely @runtime:
-  if (!IsFieldSet(CONTENT))
+  if (!HasContent())
     return PWScore::FAILURE;
 
-  const CItemField &field = m_fields.find(CONTENT)->second;
+  if (m_contentFile == fname.c_str()) {
+    // Can't stream from a file that's being overwritten
+    CItemAtt copy(*this);
+    status = copy.SpillContent();
+    return (status == PWSfile::SUCCESS) ? copy.Export(fname) : status;
+  }
+
   std::FILE *fhandle = pws_os::FOpen(fname, L"wb");
   if (!fhandle)
     return PWScore::CANT_OPEN_FILE;
 
-  size_t flen = field.GetLength() + 8; // Add 8 for block size
-  auto *value = new unsigned char[flen];
-  if (value == nullptr) {
-    fclose(fhandle);
-    return PWScore::FAILURE;
-  }
-
-  CItem::GetField(field, value, flen); // flen adjusted to real value
-  size_t nwritten = fwrite(value, flen, 1, fhandle);
-  if (nwritten != 1) {
+  // A chunk at a time, however large it is
+  status = StreamDeferredContent([fhandle](const unsigned char *data,
+                                           size_t len) {
+                                   return fwrite(data, 1, len, fhandle) == len;
+                                 });
+  if (fclose(fhandle) != 0 && status == PWScore::SUCCESS)
     status = PWScore::WRITE_FAIL;
-    goto done;
-  }
+  if (status != PWScore::SUCCESS)
+    pws_os::DeleteAFile(fname); // don't leave part of it lying around
+  return status;
+}
 
-  if (fclose(fhandle) != 0) {
-    status = PWScore::WRITE_FAIL;
-    goto done;
+int CItemAtt::SpillContent()
+{
+  if (!IsContentDeferred() || m_spill != nullptr)
+    return PWSfile::SUCCESS; // nothing to copy, or it's already ours
+
+  // Decrypted and checked as it's read, and encrypted with new keys
+  return Spill([this](const ContentSink &sink) {
+                 return StreamDeferredContent(sink);
+               }, m_contentLength);
+}
+
+int CItemAtt::Spill(const ContentProducer &producer, size_t clen)
+{
+  if (clen == 0) {
+    ForgetDeferredContent();
+    return PWSfile::SUCCESS;
   }
 
- done:
-  trashMemory(value, flen);
-  delete[] value;
+  PWSfileV4::ContentKeys keys;
+  StringX filename;
+  const int status = PWSfileV4::SpillContent(producer, clen, keys, filename);
+  if (status != PWSfile::SUCCESS)
+    return status;
+
+  ForgetDeferredContent();
+  CItem::SetField(ATTIV, keys.IV, sizeof(keys.IV));
+  CItem::SetField(ATTEK, keys.EK, sizeof(keys.EK));
+  CItem::SetField(ATTAK, keys.AK, sizeof(keys.AK));
+  CItem::SetField(CONTENTHMAC, keys.HMAC, sizeof(keys.HMAC));
+  m_spill = std::make_shared<const SpillFile>(filename);
+  m_contentFile = filename;
+  m_contentOffset = 0;
+  m_contentLength = clen;
+  m_contentCipher = PWSfile::PWTwoFish;
+  return PWSfile::SUCCESS;
+}
+
+int CItemAtt::GetContentDigest(const unsigned char *key, size_t keylen,
+                               unsigned char *digest) const
+{
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+  hmac.Init(key, static_cast<unsigned long>(keylen));
+
+  int status = PWSfile::SUCCESS;
+  if (IsContentDeferred())
+    status = StreamDeferredContent([&hmac](const unsigned char *data,
+                                           size_t len) {
+                                     hmac.Update(data, static_cast<unsigned long>(len));
+                                     return true;
+                                   });
+  hmac.Final(digest);
   return status;
 }
 
+void CItemAtt::MoveContent(const StringX &filename, long offset, int cipher)
+{
+  ASSERT(IsContentDeferred() && offset >= 0);
+  m_spill.reset(); // it's in filename now
+  m_contentFile = filename;
+  m_contentOffset = offset;
+  m_contentCipher = cipher;
+}
+
+void CItemAtt::GetContentKeys(unsigned char *IV, unsigned char *EK,
+                              unsigned char *AK, unsigned char *HMAC) const
+{
+  const struct {int ft; unsigned char *key; size_t len;} keys[] = {
+    {ATTIV, IV, TwoFish::BLOCKSIZE}, {ATTEK, EK, PWSfileV4::KLEN},
+    {ATTAK, AK, PWSfileV4::KLEN}, {CONTENTHMAC, HMAC, SHA256::HASHLEN},
+  };
+  for (const auto &k : keys) {
+    // Fields are stored padded to the block size, which these already are
+    size_t len = k.len;
+    CItem::GetField(m_fields.find(k.ft)->second, k.key, len);
+    ASSERT(len == k.len);
+  }
+}
+
+int CItemAtt::StreamDeferredContent(const ContentSink &sink) const
+{
+  ASSERT(IsContentDeferred());
+  PWSfileV4::ContentKeys keys;
+  GetContentKeys(keys.IV, keys.EK, keys.AK, keys.HMAC);
+  return PWSfileV4::StreamContent(m_contentFile, m_contentOffset,
+                                  PWSfile::Cipher(m_contentCipher),
+                                  keys, m_contentLength, sink);
+}
+
+void CItemAtt::ForgetDeferredContent()
+{
+  ClearField(ATTIV);
+  ClearField(ATTEK);
+  ClearField(ATTAK);
+  ClearField(CONTENTHMAC);
+  m_spill.reset();
+  m_contentFile = _T("");
+  m_contentOffset = -1L;
+  m_contentLength = 0;
+}
+
 bool CItemAtt::SetField(unsigned char type, const unsigned char *data,
                         size_t len)
 {
@@ -286,7 +473,8 @@ bool CItemAtt::SetField(unsigned char type, const unsigned char *data,
     if (!SetTimeField(ft, data, len)) return false;
     break;
   case CONTENT:
-    CItem::SetField(type, data, len);
+    if (SetContent(data, len) != PWSfile::SUCCESS)
+      return false;
     break;
   case ATTIV:
   case ATTEK:
@@ -321,18 +509,19 @@ int CItemAtt::Read(PWSfile *in)
   unsigned char EK[PWSfileV4::KLEN] = {0};
   unsigned char AK[PWSfileV4::KLEN] = {0};
 
-  unsigned char *content = nullptr;
   size_t content_len = 0;
+  long content_offset = -1L;
+  int content_cipher = PWSfile::PWTwoFish;
   unsigned char expected_digest[SHA256::HASHLEN] = {0};
 
-  unsigned char *utf8 = nullptr;
+  const unsigned char *utf8 = nullptr; // owned by in, no need to trash
   size_t utf8Len = 0;
 
   Clear();
 
   do {
-    fieldLen = static_cast<signed long>(in->ReadField(type, utf8,
-                                                      utf8Len));
+    fieldLen = static_cast<signed long>(in->ReadFieldView(type, utf8,
+                                                          utf8Len));
 
     if (fieldLen > 0) {
       numread += fieldLen;
@@ -379,19 +568,17 @@ int CItemAtt::Read(PWSfile *in)
           goto exit;
         content_len = static_cast<size_t>(getInt32(utf8));
 
-        TwoFish fish(EK, sizeof(EK));
-        trashMemory(EK, sizeof(EK));
-        const unsigned int BS = fish.GetBlockSize();
-
+        // Content's left in the file until needed, see GetContent()
         auto *in4 = dynamic_cast<PWSfileV4 *>(in);
         ASSERT(in4 != nullptr);
-        size_t nread = in4->ReadContent(&fish, IV, content, content_len);
-        // nread should be content_len rounded up to nearest BS:
-        ASSERT(nread == (content_len/BS + 1)*BS);
-        if (nread != (content_len/BS + 1)*BS) {
+        if (content_len == 0 || in4 == nullptr)
+          goto exit;
+        content_offset = in4->SkipContent(content_len);
+        if (content_offset < 0) {
           status = PWSfile::READ_FAIL;
           goto exit;
         }
+        content_cipher = in4->GetCipher();
         gotContent = true;
         break;
       }
@@ -409,11 +596,6 @@ int CItemAtt::Read(PWSfile *in)
           goto exit;
       } // switch {type)
     } // if (fieldLen > 0)
-
-    if (utf8 != nullptr) {
-      trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-      delete[] utf8; utf8 = nullptr; utf8Len = 0;
-    }
   } while (type != END && fieldLen > 0 && --emergencyExit > 0);
 
   // Post-field read processing:
@@ -423,31 +605,23 @@ int CItemAtt::Read(PWSfile *in)
   // - Clean-up
 
   if (gotContent && gotAK && gotHMAC) {
-    unsigned char calculated_digest[SHA256::HASHLEN] = {0};
-    HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
-
-    hmac.Init(AK, sizeof(AK));
-    trashMemory(AK, sizeof(AK));
-    
-    // calculate HMAC
-    hmac.Update(content, static_cast<unsigned long>(content_len));
-    hmac.Final(calculated_digest);
-
-    if (memcmp(expected_digest, calculated_digest,
-               sizeof(calculated_digest)) == 0) {
-      SetField(CONTENT, content, content_len);
-      status = PWSfile::SUCCESS;
-    } else {
-      status = PWSfile::BAD_DIGEST;
-    }
+    // The HMAC's checked when the content's read
+    CItem::SetField(ATTIV, IV, sizeof(IV));
+    CItem::SetField(ATTEK, EK, sizeof(EK));
+    CItem::SetField(ATTAK, AK, sizeof(AK));
+    CItem::SetField(CONTENTHMAC, expected_digest, sizeof(expected_digest));
+    m_contentFile = in->GetFilename();
+    m_contentOffset = content_offset;
+    m_contentLength = content_len;
+    m_contentCipher = content_cipher;
+    status = PWSfile::SUCCESS;
   } else {
     status = PWSfile::READ_FAIL;
   }
 
  exit:
-  trashMemory(content, content_len);
-  delete[] content;
-  delete[] utf8; // if here via goto exit
+  trashMemory(EK, sizeof(EK));
+  trashMemory(AK, sizeof(AK));
 
   if (numread > 0) {
     m_offset = in->GetOffset();
@@ -513,18 +687,16 @@ int CItemAtt::Write(PWSfile *out) const
   WriteIfSet(FILEMTIME, out, false);
   WriteIfSet(FILEATIME, out, false);
 
-  auto fiter = m_fields.find(CONTENT);
   // XXX TBD - fail if no content, as this is a mandatory field
-  if (fiter != m_fields.end()) {
+  if (IsContentDeferred()) {
     auto *out4 = dynamic_cast<PWSfileV4 *>(out);
     ASSERT(out4 != nullptr);
 
-    size_t clength = fiter->second.GetLength() + BlowFish::BLOCKSIZE;
-    auto *content = new unsigned char[clength];
-    CItem::GetField(fiter->second, content, clength);
-    out4->WriteContentFields(content, clength);
-    trashMemory(content, clength);
-    delete[] content;
+    PWSfileV4::ContentKeys keys;
+    GetContentKeys(keys.IV, keys.EK, keys.AK, keys.HMAC);
+    out4->CopyContentFields(GetUUID(), m_contentFile, m_contentOffset,
+                            PWSfile::Cipher(m_contentCipher),
+                            keys, m_contentLength);
   }
 
   if (out->WriteField(END, _T("")) > 0) {
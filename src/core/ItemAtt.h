@@ -17,6 +17,8 @@
 #include "os/UUID.h"
 #include "StringX.h"
 
+#include <functional>
+#include <memory>
 #include <time.h> // for time_t
 
 //-----------------------------------------------------------------------------
@@ -48,6 +50,7 @@ public:
   //Construction
   CItemAtt();
   CItemAtt(const CItemAtt& stuffhere);
+  CItemAtt(CItemAtt &&stuffhere) noexcept;
 
   ~CItemAtt();
 
@@ -57,7 +60,27 @@ public:
   int Import(const stringT &fname);
   int Export(const stringT &fname) const;
 
-  bool HasContent() const {return IsFieldSet(CONTENT);}
+  bool HasContent() const {return IsContentDeferred();}
+  void Clear() override;
+
+  // Content's never all in memory, but kept encrypted in a file: a V4
+  // file's left there until it's needed (see Read()), and Import() and
+  // SetContent() encrypt it, a chunk at a time, into a temporary file of
+  // the attachment's own, which is deleted when the last copy of it goes.
+  // GetContent() and Export() get it from the file, and Write() copies
+  // it over, a chunk at a time. SpillContent() copies content that's in
+  // some other file into a temporary file, so that it doesn't matter if
+  // that file then changes.
+  bool IsContentDeferred() const {return m_contentOffset >= 0;}
+  StringX GetContentFile() const {return m_contentFile;}
+  long GetContentOffset() const {return m_contentOffset;}
+  int SpillContent();
+  // HMAC-SHA256 of the content with key, to tell if two attachments have
+  // the same content without comparing it, see PWScore::FindDuplicateAtt()
+  int GetContentDigest(const unsigned char *key, size_t keylen,
+                       unsigned char *digest) const;
+  // For when the file's been rewritten, with the content at offset
+  void MoveContent(const StringX &filename, long offset, int cipher);
 
   // Convenience: Get the name associated with FieldType
   static stringT FieldName(FieldType ft);
@@ -69,7 +92,7 @@ public:
   void SetUUID(const pws_os::CUUID &uuid);
   void SetTitle(const StringX &title);
   void SetCTime(time_t t);
-  void SetContent(const unsigned char *content, size_t clen);
+  int SetContent(const unsigned char *content, size_t clen);
 
   StringX GetTitle() const {return GetField(ATTTITLE);}
   void GetUUID(uuid_array_t &) const;
@@ -117,8 +140,10 @@ public:
   unsigned GetRefcount() const {return m_refcount;}
   void IncRefcount() {m_refcount++;}
   void DecRefcount() {ASSERT(m_refcount > 0); m_refcount--;}
+  void ClearRefcount() {m_refcount = 0;}
 
   CItemAtt& operator=(const CItemAtt& second);
+  CItemAtt& operator=(CItemAtt &&second) noexcept;
 
   bool operator==(const CItemAtt &that) const;
   bool operator!=(const CItemAtt &that) const {return !operator==(that);}
@@ -136,9 +161,29 @@ public:
 private:
   bool SetField(unsigned char type, const unsigned char *data, size_t len);
   size_t WriteIfSet(FieldType ft, PWSfile *out, bool isUTF8) const;
+  // As PWSfileV4's, see StreamContent() and SpillContent()
+  typedef std::function<bool(const unsigned char *, size_t)> ContentSink;
+  typedef std::function<int(const ContentSink &)> ContentProducer;
+  // Deferred content, a chunk at a time, see PWSfileV4::StreamContent()
+  int StreamDeferredContent(const ContentSink &sink) const;
+  // Makes what producer passes, of clen, the content, in a temporary file
+  int Spill(const ContentProducer &producer, size_t clen);
+  // See PWSfileV4::ContentKeys
+  void GetContentKeys(unsigned char *IV, unsigned char *EK,
+                      unsigned char *AK, unsigned char *HMAC) const;
+  void ForgetDeferredContent();
 
   EntryStatus m_entrystatus;
   long m_offset; // location on file, for lazy evaluation
+  // Where deferred content is, see IsContentDeferred(). Its keys and HMAC
+  // are kept as (encrypted) ATTIV, ATTEK, ATTAK and CONTENTHMAC fields.
+  StringX m_contentFile;
+  long m_contentOffset; // -1 if not deferred
+  size_t m_contentLength;
+  int m_contentCipher; // PWSfile::Cipher
+  // The temporary file that m_contentFile is, if it's one, see Spill()
+  class SpillFile;
+  std::shared_ptr<const SpillFile> m_spill;
   unsigned m_refcount; // how many CItemData objects refer to this?
 };
 #endif /* __ITEMATT_H */
@@ -48,6 +48,12 @@ CItemData::CItemData(const CItemData &that) :
 {
 }
 
+CItemData::CItemData(CItemData &&that) noexcept :
+  CItem(std::move(that)), m_entrytype(that.m_entrytype),
+  m_entrystatus(that.m_entrystatus)
+{
+}
+
 CItemData::~CItemData()
 {
 }
@@ -62,6 +68,16 @@ CItemData& CItemData::operator=(const CItemData &that)
   return *this;
 }
 
+CItemData& CItemData::operator=(CItemData &&that) noexcept
+{
+  if (this != &that) {
+    CItem::operator=(std::move(that));
+    m_entrytype = that.m_entrytype;
+    m_entrystatus = that.m_entrystatus;
+  }
+  return *this;
+}
+
 void CItemData::Clear()
 {
   CItem::Clear();
@@ -158,10 +174,10 @@ int CItemData::Read(PWSfile *in)
 
   Clear();
   do {
-    unsigned char *utf8 = nullptr;
+    const unsigned char *utf8 = nullptr; // owned by in, no need to trash
     size_t utf8Len = 0;
-    fieldLen = static_cast<signed long>(in->ReadField(type, utf8,
-                                                      utf8Len));
+    fieldLen = static_cast<signed long>(in->ReadFieldView(type, utf8,
+                                                          utf8Len));
 
     if (fieldLen > 0) {
       numread += fieldLen;
@@ -172,20 +188,11 @@ int CItemData::Read(PWSfile *in)
         }
       } else if (IsItemAttField(type)) {
         // Allow rewind and retry
-        if (utf8 != nullptr) {
-          trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-          delete[] utf8;
-        }
         return -numread;
       } else if (type != END) { // unknown field
         SetUnknownField(type, utf8Len, utf8);
       }
     } // if (fieldLen > 0)
-
-    if (utf8 != nullptr) {
-      trashMemory(utf8, utf8Len * sizeof(utf8[0]));
-      delete[] utf8; utf8 = nullptr; utf8Len = 0;
-    }
   } while (type != END && fieldLen > 0 && --emergencyExit > 0);
 
   if (numread > 0) {
@@ -345,6 +352,11 @@ int CItemData::Write(PWSfile *out) const
 }
 
 int CItemData::Write(PWSfileV4 *out) const
+{
+  return WriteV4(out);
+}
+
+int CItemData::WriteV4(PWSfile *out) const
 {
   uuid_array_t item_uuid;
 
@@ -418,7 +430,7 @@ StringX CItemData::GetFieldValue(FieldType ft) const
     {
       uuid_array_t uuid_array = {0};
       GetUUID(uuid_array);
-      str = CUUID(uuid_array, true);
+      str = CUUID(uuid_array);
       break;
     }
     case NOTES:        /* 0x05 */
@@ -468,7 +480,7 @@ StringX CItemData::GetFieldValue(FieldType ft) const
     {
       uuid_array_t uuid_array = { 0 };
       GetUUID(uuid_array, ft);
-      str = CUUID(uuid_array, true);
+      str = CUUID(uuid_array);
       break;
     }
     default:
@@ -478,6 +490,20 @@ StringX CItemData::GetFieldValue(FieldType ft) const
   }
 }
 
+bool CItemData::IsSameFieldValue(FieldType ft, const CItemData &that) const
+{
+  switch (ft) {
+  case GROUPTITLE:
+    return IsSameField(GROUP, that) && IsSameField(TITLE, that);
+  case XTIME: // shown with whether it recurs
+    return IsSameField(XTIME, that) && IsSameField(XTIME_INT, that);
+  case UUID:
+    return false; // not worth the bother
+  default:
+    return IsSameField(ft, that);
+  }
+}
+
 StringX CItemData::GetEffectiveFieldValue(FieldType ft, const CItemData *pbci) const
 {
   if (IsNormal() || IsBase())
@@ -71,12 +71,14 @@ public:
   //Construction
   CItemData();
   CItemData(const CItemData& stuffhere);
+  CItemData(CItemData &&stuffhere) noexcept;
 
   ~CItemData();
 
   int Read(PWSfile *in);
   int Write(PWSfile *out) const;
   int Write(PWSfileV4 *out) const;
+  int WriteV4(PWSfile *out) const; // V4 layout to any PWSfile, e.g., a journal
   int WriteCommon(PWSfile *out) const;
 
   // Convenience: Get the name associated with FieldType
@@ -150,6 +152,9 @@ public:
   StringX GetKBShortcut() const;
 
   StringX GetFieldValue(FieldType ft) const;
+  // True if GetFieldValue(ft) is the same for both, as told by the fields'
+  // digests, without decrypting them. False if it may not be.
+  bool IsSameFieldValue(FieldType ft, const CItemData &that) const;
 
   // Following encapsulates difference between Alias and Shortcut w.r.t. field 'ownership':
   StringX GetEffectiveFieldValue(FieldType ft, const CItemData *pbci) const;
@@ -213,6 +218,7 @@ public:
   void SetFieldValue(FieldType ft, const StringX &value);
 
   CItemData& operator=(const CItemData& second);
+  CItemData& operator=(CItemData &&second) noexcept;
 
   void Clear() override;
 
@@ -8,78 +8,138 @@
 /// \file ItemField.cpp
 //-----------------------------------------------------------------------------
 
-#include <math.h>
-
 #include "ItemField.h"
 #include "Util.h"
 #include "crypto/Fish.h"
 #include "PWSrand.h"
+#include "SecureArena.h"
+#include "crypto/hmac.h"
+#include "crypto/sha256.h"
+#include "crypto/TwoFish.h"
 #include "os/funcwrap.h"
+#include "os/mem.h"
+
+#include <atomic>
+
+// The cipher shared by fields Set() without one. Its key's random, so only
+// we can decrypt them. It's never deleted, as fields may outlive anything
+// else that's static, and it's locked so its key schedule isn't swapped out.
+static const TwoFish &SharedCipher()
+{
+  static const TwoFish *cipher = []() {
+    unsigned char key[32];
+    PWSrand::GetInstance()->GetRandomData(key, sizeof(key));
+    auto *tf = new TwoFish(key, sizeof(key));
+    pws_os::mlock(tf, sizeof(*tf));
+    trashMemory(key, sizeof(key));
+    return tf;
+  }();
+  return *cipher;
+}
+
+// Counter mode needs a nonce that's never reused with the key
+static std::atomic<uint64> s_nextNonce(1);
 
-//Returns the number of bytes of 8 byte blocks needed to store 'size' bytes
-size_t CItemField::GetBlockSize(size_t size) const
+// Digests only need to be comparable for as long as we're running
+static const unsigned char *DigestKey()
 {
-  return static_cast<size_t>(ceil(static_cast<double>(size) / 8.0)) * 8;
+  static const struct Key {
+    Key() {PWSrand::GetInstance()->GetRandomData(k, sizeof(k));}
+    unsigned char k[SHA256::HASHLEN];
+  } key;
+  return key.k;
+}
+
+static void MakeDigest(const unsigned char *value, size_t length,
+                       unsigned char digest[CItemField::DIGESTLEN])
+{
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac(DigestKey(),
+                                                      SHA256::HASHLEN);
+  unsigned char full[SHA256::HASHLEN];
+  hmac.Update(value, static_cast<unsigned long>(length));
+  hmac.Final(full);
+  memcpy(digest, full, CItemField::DIGESTLEN);
+  trashMemory(full, sizeof(full));
+}
+
+void CItemField::Alloc(size_t length)
+{
+  Free();
+  m_Length = length;
+  if (m_Length > 0 && !IsInline())
+    m_Data = new unsigned char[GetBlockSize(m_Length)];
 }
 
 CItemField::CItemField(const CItemField &that)
-  : m_Type(that.m_Type), m_Length(that.m_Length)
+  : m_Type(that.m_Type), m_Length(0), m_Data(nullptr), m_Nonce(that.m_Nonce)
 {
-  if (m_Length > 0) {
-    size_t bs = GetBlockSize(m_Length);
-    m_Data = new unsigned char[bs];
-    memcpy(m_Data, that.m_Data, bs);
-  } else {
-    m_Data = nullptr;
+  memcpy(m_Digest, that.m_Digest, sizeof(m_Digest));
+  Alloc(that.m_Length);
+  if (m_Length > 0)
+    memcpy(Data(), that.Data(), GetSize());
+}
+
+CItemField::CItemField(CItemField &&that) noexcept
+  : m_Length(0), m_Data(nullptr)
+{
+  Take(that);
+}
+
+void CItemField::Take(CItemField &that)
+{
+  m_Type = that.m_Type;
+  m_Length = that.m_Length;
+  m_Nonce = that.m_Nonce;
+  memcpy(m_Digest, that.m_Digest, sizeof(m_Digest));
+  memcpy(m_Inline, that.m_Inline, sizeof(m_Inline)); // or m_Data
+  that.m_Length = 0;
+  that.m_Data = nullptr;
+  memset(that.m_Digest, 0, sizeof(that.m_Digest));
+}
+
+CItemField &CItemField::operator=(CItemField &&that) noexcept
+{
+  if (this != &that) {
+    Free();
+    Take(that);
   }
+  return *this;
 }
 
 CItemField &CItemField::operator=(const CItemField &that)
 {
   if (this != &that) {
     m_Type = that.m_Type;
-    m_Length = that.m_Length;
-    delete[] m_Data;
-    if (m_Length > 0) {
-      size_t bs = GetBlockSize(m_Length);
-      m_Data = new unsigned char[bs];
-      memcpy(m_Data, that.m_Data, bs);
-    } else {
-      m_Data = nullptr;
-    }
+    m_Nonce = that.m_Nonce;
+    memcpy(m_Digest, that.m_Digest, sizeof(m_Digest));
+    Alloc(that.m_Length);
+    if (m_Length > 0)
+      memcpy(Data(), that.Data(), GetSize());
   }
   return *this;
 }
 
 void CItemField::Empty()
 {
-  if (m_Data != nullptr) {
-    delete[] m_Data;
-    m_Data = nullptr;
-    m_Length = 0;
-  }
+  Free();
+  memset(m_Digest, 0, sizeof(m_Digest));
+}
+
+bool CItemField::HasSameValue(const CItemField &that) const
+{
+  return m_Type == that.m_Type && m_Length == that.m_Length &&
+    memcmp(m_Digest, that.m_Digest, sizeof(m_Digest)) == 0;
 }
 
 void CItemField::Set(const unsigned char* value, size_t length,
                      const Fish *bf, unsigned char type)
 {
-  size_t BlockLength;
-
-  m_Length = length;
-  BlockLength = GetBlockSize(m_Length);
+  Alloc(length);
+  memset(m_Digest, 0, sizeof(m_Digest));
 
-  delete[] m_Data;
-
-  if (m_Length == 0) {
-    m_Data = nullptr;
-  } else {
-    m_Data = new unsigned char[BlockLength];
-    if (m_Data == nullptr) { // out of memory - try to fail gracefully
-      m_Length = 0; // at least keep structure consistent
-      return;
-    }
-
-    auto *tempmem = new unsigned char[BlockLength];
+  if (m_Length > 0) {
+    const size_t BlockLength = GetBlockSize(m_Length);
+    auto *tempmem = static_cast<unsigned char *>(SecureArena::Allocate(BlockLength));
     // invariant: BlockLength >= plainlength
     memcpy_s(tempmem, BlockLength, value, m_Length);
 
@@ -87,11 +147,10 @@ void CItemField::Set(const unsigned char* value, size_t length,
     PWSrand::GetInstance()->GetRandomData(tempmem + m_Length, static_cast<unsigned long>(BlockLength - m_Length));
 
     //Do the actual encryption
-    for (size_t x = 0; x < BlockLength; x += 8)
-      bf->Encrypt(tempmem + x, m_Data + x);
+    bf->EncryptBlocks(tempmem, Data(), BlockLength / 8);
+    MakeDigest(value, m_Length, m_Digest);
 
-    trashMemory(tempmem, BlockLength);
-    delete[] tempmem;
+    SecureArena::Release(tempmem, BlockLength);
   }
   if (type != 0xff)
     m_Type = type;
@@ -107,9 +166,9 @@ void CItemField::Set(const StringX &value, const Fish *bf, unsigned char type)
 
 void CItemField::Get(unsigned char *value, size_t &length, const Fish *bf) const
 {
-  // Sanity check: length is 0 iff data ptr is nullptr
-  ASSERT((m_Length == 0 && m_Data == nullptr) ||
-         (m_Length > 0 && m_Data != nullptr));
+  // Sanity check: length is 0 iff there's no data
+  ASSERT((m_Length == 0 && Data() == nullptr) ||
+         (m_Length > 0 && Data() != nullptr));
   /*
   * length is an in/out parameter:
   * In: size of value array - must be at least BlockLength
@@ -122,43 +181,135 @@ void CItemField::Get(unsigned char *value, size_t &length, const Fish *bf) const
   } else { // we have data to decrypt
     size_t BlockLength = GetBlockSize(m_Length);
     ASSERT(length >= BlockLength);
-    auto *tempmem = new unsigned char[BlockLength];
+    auto *tempmem = static_cast<unsigned char *>(SecureArena::Allocate(BlockLength));
 
-    size_t x;
-    for (x = 0; x < BlockLength; x += 8)
-      bf->Decrypt(m_Data + x, tempmem + x);
+    bf->DecryptBlocks(Data(), tempmem, BlockLength / 8);
 
+    size_t x;
     for (x = 0; x < BlockLength; x++)
       value[x] = (x < m_Length) ? tempmem[x] : 0;
 
     length = m_Length;
-    delete [] tempmem;
+    SecureArena::Release(tempmem, BlockLength);
   }
 }
 
 void CItemField::Get(StringX &value, const Fish *bf) const
 {
-  // Sanity check: length is 0 iff data ptr is nullptr
-  ASSERT((m_Length == 0 && m_Data == nullptr) ||
-         (m_Length > 0 && m_Data != nullptr && m_Length % sizeof(TCHAR) == 0));
+  // Sanity check: length is 0 iff there's no data
+  ASSERT((m_Length == 0 && Data() == nullptr) ||
+         (m_Length > 0 && Data() != nullptr && m_Length % sizeof(TCHAR) == 0));
 
   if (m_Length == 0) {
     value = _T("");
   } else { // we have data to decrypt
     size_t BlockLength = GetBlockSize(m_Length);
-    auto *tempmem = new unsigned char[BlockLength];
+    auto *tempmem = static_cast<unsigned char *>(SecureArena::Allocate(BlockLength));
     TCHAR *pt = reinterpret_cast<TCHAR *>(tempmem);
     size_t x;
 
-    // decrypt block by block
-    for (x = 0; x < BlockLength; x += 8)
-      bf->Decrypt(m_Data + x, tempmem + x);
+    bf->DecryptBlocks(Data(), tempmem, BlockLength / 8);
 
     // copy to value TCHAR by TCHAR
     for (x = 0; x < m_Length/sizeof(TCHAR); x++)
       value += pt[x];
 
-    trashMemory(tempmem, BlockLength);
-    delete [] tempmem;
+    SecureArena::Release(tempmem, BlockLength);
+  }
+}
+
+size_t CItemField::KeyStream(unsigned char * &ks) const
+{
+  // Blocks of nonce || counter, encrypted in place
+  const size_t BS = TwoFish::BLOCKSIZE;
+  const size_t nblocks = (GetBlockSize(m_Length) + BS - 1) / BS;
+  // It's decrypted into, so it's from the SecureArena
+  ks = static_cast<unsigned char *>(SecureArena::Allocate(nblocks * BS));
+  for (size_t i = 0; i < nblocks; i++) {
+    putInt(ks + i * BS, m_Nonce);
+    putInt(ks + i * BS + sizeof(uint64), static_cast<uint64>(i));
+  }
+  SharedCipher().EncryptBlocks(ks, ks, nblocks);
+  return nblocks * BS;
+}
+
+void CItemField::Set(const unsigned char* value, size_t length,
+                     unsigned char type)
+{
+  Alloc(length);
+  memset(m_Digest, 0, sizeof(m_Digest));
+
+  if (m_Length > 0) {
+    const size_t BlockLength = GetBlockSize(m_Length);
+    unsigned char *data = Data();
+    m_Nonce = s_nextNonce++;
+
+    unsigned char *ks;
+    const size_t kslen = KeyStream(ks);
+    // Padding's encrypted zeros
+    for (size_t x = 0; x < BlockLength; x++)
+      data[x] = ks[x] ^ ((x < m_Length) ? value[x] : 0);
+    MakeDigest(value, m_Length, m_Digest);
+
+    SecureArena::Release(ks, kslen);
+  }
+  if (type != 0xff)
+    m_Type = type;
+}
+
+void CItemField::Set(const StringX &value, unsigned char type)
+{
+  const LPCTSTR plainstr = value.c_str();
+
+  Set(reinterpret_cast<const unsigned char *>(plainstr),
+      value.length() * sizeof(*plainstr), type);
+}
+
+void CItemField::Get(unsigned char *value, size_t &length) const
+{
+  // Sanity check: length is 0 iff there's no data
+  ASSERT((m_Length == 0 && Data() == nullptr) ||
+         (m_Length > 0 && Data() != nullptr));
+  // length is in/out, as for Get() with a Fish
+  if (m_Length == 0) {
+    value[0] = TCHAR('\0');
+    length = 0;
+  } else {
+    const size_t BlockLength = GetBlockSize(m_Length);
+    ASSERT(length >= BlockLength);
+    unsigned char *ks;
+    const size_t kslen = KeyStream(ks);
+
+    const unsigned char *data = Data();
+    for (size_t x = 0; x < BlockLength; x++)
+      value[x] = (x < m_Length) ? (data[x] ^ ks[x]) : 0;
+
+    length = m_Length;
+    SecureArena::Release(ks, kslen);
+  }
+}
+
+void CItemField::Get(StringX &value) const
+{
+  // Sanity check: length is 0 iff there's no data
+  ASSERT((m_Length == 0 && Data() == nullptr) ||
+         (m_Length > 0 && Data() != nullptr && m_Length % sizeof(TCHAR) == 0));
+
+  if (m_Length == 0) {
+    value = _T("");
+  } else {
+    unsigned char *ks;
+    const size_t kslen = KeyStream(ks);
+
+    // Decrypt in place, then copy to value TCHAR by TCHAR
+    const unsigned char *data = Data();
+    for (size_t x = 0; x < m_Length; x++)
+      ks[x] ^= data[x];
+    const TCHAR *pt = reinterpret_cast<const TCHAR *>(ks);
+    value.reserve(value.length() + m_Length / sizeof(TCHAR));
+    for (size_t x = 0; x < m_Length/sizeof(TCHAR); x++)
+      value += pt[x];
+
+    SecureArena::Release(ks, kslen);
   }
 }
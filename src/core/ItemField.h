@@ -12,6 +12,7 @@
 #define __ITEMFIELD_H
 
 #include "StringX.h"
+#include "os/typedefs.h"
 
 //-----------------------------------------------------------------------------
 
@@ -19,6 +20,19 @@
 * CItemField contains the data for a given CItemData field in encrypted
 * form.
 * Set() encrypts, Get() decrypts
+*
+* Fields are either encrypted with a Fish provided by the caller, or,
+* without one, with a cipher shared by all such fields in the process.
+* The latter has a random key that's kept in locked memory, and is used
+* in counter mode, with a nonce per Set(). A field must always be Get()
+* the way it was Set().
+*
+* Set() also keeps a keyed digest of the value, so that fields can be
+* compared without decrypting them. The key's per session, so digests
+* are only meaningful in memory.
+*
+* Most fields are a few bytes, e.g., times and UUIDs, so those are kept
+* in the object rather than allocated separately.
 */
 
 class Fish;
@@ -26,31 +40,69 @@ class Fish;
 class CItemField
 {
 public:
-  explicit CItemField(unsigned char type = 0xff): m_Type(type), m_Length(0), m_Data(nullptr)
-  {}
+  enum {DIGESTLEN = 16}; // truncated HMAC-SHA256
+
+  explicit CItemField(unsigned char type = 0xff)
+    : m_Type(type), m_Length(0), m_Data(nullptr), m_Nonce(0)
+  {memset(m_Digest, 0, sizeof(m_Digest));}
   CItemField(const CItemField &that); // copy ctor
-  ~CItemField() {if (m_Length > 0) delete[] m_Data;}
+  CItemField(CItemField &&that) noexcept; // takes that's data
+  ~CItemField() {Free();}
 
   CItemField &operator=(const CItemField &that);
+  CItemField &operator=(CItemField &&that) noexcept;
 
   void Set(const StringX &value, const Fish *bf, unsigned char type = 0xff);
   void Set(const unsigned char* value, size_t length, const Fish *bf, unsigned char type = 0xff);
 
   void Get(StringX &value, const Fish *bf) const;
   void Get(unsigned char *value, size_t &length, const Fish *bf) const;
+
+  // As above, with the shared cipher
+  void Set(const StringX &value, unsigned char type = 0xff);
+  void Set(const unsigned char* value, size_t length, unsigned char type = 0xff);
+
+  void Get(StringX &value) const;
+  void Get(unsigned char *value, size_t &length) const;
+
   unsigned char GetType() const {return m_Type;}
   size_t GetLength() const {return m_Length;}
   size_t GetSize() const {return GetBlockSize(m_Length);}
   bool IsEmpty() const {return m_Length == 0;}
+  const unsigned char *GetData() const {return Data();} // GetSize() bytes, encrypted
+  const unsigned char *GetDigest() const {return m_Digest;} // DIGESTLEN bytes
+  // Same type and value, whatever each was encrypted with
+  bool HasSameValue(const CItemField &that) const;
   void Empty();
 
 private:
   //Number of 8 byte blocks needed for size
-  size_t GetBlockSize(size_t size) const;
+  size_t GetBlockSize(size_t size) const {return (size + 7) / 8 * 8;}
+
+  enum {INLINE_SIZE = 16};
+  bool IsInline() const
+  {return m_Length > 0 && GetBlockSize(m_Length) <= INLINE_SIZE;}
+  unsigned char *Data() {return IsInline() ? m_Inline : m_Data;}
+  const unsigned char *Data() const {return IsInline() ? m_Inline : m_Data;}
+  // Makes room for length bytes, after freeing what was there
+  void Alloc(size_t length);
+  void Free()
+  {if (m_Length > 0 && !IsInline()) delete[] m_Data; m_Length = 0; m_Data = nullptr;}
+  // Takes that's data, whether it's inline or not, leaving that empty
+  void Take(CItemField &that);
+
+  // Shared cipher's key stream for m_Nonce, enough for the data.
+  // Returns its length, caller to SecureArena::Release() it.
+  size_t KeyStream(unsigned char * &ks) const;
 
   unsigned char m_Type; // almost const
   size_t m_Length;
-  unsigned char *m_Data;
+  union {
+    unsigned char *m_Data; // if more than INLINE_SIZE, else
+    unsigned char m_Inline[INLINE_SIZE];
+  };
+  unsigned char m_Digest[DIGESTLEN];
+  uint64 m_Nonce; // if encrypted with the shared cipher
 };
 
 #endif /* __ITEMFIELD_H */
@@ -20,6 +20,8 @@
 #include "Report.h"
 #include "VerifyFormat.h"
 #include "StringXStream.h"
+#include "PWSjournal.h"
+#include "PWSfileV4.h"
 
 #include "os/pws_tchar.h"
 #include "os/typedefs.h"
@@ -37,13 +39,18 @@
 #include <functional>
 #include <algorithm>
 #include <set>
+#include <tuple>
 #include <iterator>
+#include <thread>
+#include <atomic>
 
 const TCHAR *PWScore::GROUPTITLEUSERINCHEVRONS = _T("\xab%ls\xbb \xab%ls\xbb \xab%ls\xbb");
 
 using pws_os::CUUID;
 
 unsigned char PWScore::m_session_key[32];
+unsigned char PWScore::m_attDigestKey[32];
+unsigned char PWScore::m_GTUKeyKey[32];
 bool PWScore::m_session_initialized = false;
 Asker *PWScore::m_pAsker = nullptr;
 Reporter *PWScore::m_pReporter = nullptr;
@@ -124,6 +131,58 @@ struct st_ValidateResults {
   }
 };
 
+// A snapshot of what WriteFile() would write, and the result of writing it
+// on another thread. See ScheduleSave().
+struct PWScore::SaveJob {
+  SaveJob()
+    : version(PWSfile::UNKNOWN_VERSION), hashIters(0),
+      cipher(PWSfile::PWTwoFish), bUpdateSig(true),
+      bPasskeyUTF8(true), bBackup(false), pCurFileSig(nullptr),
+      cmdPosition(0), bNeedFullSave(false),
+      status(PWScore::FAILURE), closeStatus(PWSfile::FAILURE),
+      pFileSig(nullptr), contentCipher(PWSfile::PWTwoFish), bDone(false) {}
+  ~SaveJob() {delete pFileSig; delete pCurFileSig;}
+
+  void Run(std::vector<Observer *> observers); // on thread
+
+  // Set by StartSave(), only used by thread until bDone
+  StringX filename;
+  PWSfile::VERSION version;
+  StringX passkey;
+  PWSfileHeader hdr; // also updated by thread, as written
+  UnknownFieldList uhfl;
+  uint32 hashIters;
+  PWSfile::Cipher cipher;
+  PWSFilters filters;
+  PSWDPolicyMap policies;
+  std::vector<StringX> emptyGroups;
+  ItemList pwlist;
+  AttList attlist;
+  bool bUpdateSig;
+  bool bPasskeyUTF8; // see SetThreadPasskeyEncoding()
+  bool bBackup;
+  BackupOptions backup;
+  PWSFileSig *pCurFileSig; // m_pFileSig, for BackupFile()
+
+  // Only used by the core
+  size_t cmdPosition; // see SetSavedState(size_t)
+  bool bNeedFullSave; // m_bNeedFullSave before the snapshot
+
+  // Set by thread
+  int status, closeStatus;
+  PWSfile::JournalBinding jb;
+  PWSFileSig *pFileSig;
+  std::map<CUUID, long> contentOffsets; // see MoveContent()
+  PWSfile::Cipher contentCipher;
+
+  std::thread thread;
+  std::atomic<bool> bDone;
+
+private:
+  SaveJob(const SaveJob &) = delete;
+  SaveJob &operator=(const SaveJob &) = delete;
+};
+
 //-----------------------------------------------------------------
 
 PWScore::PWScore() :
@@ -131,15 +190,21 @@ PWScore::PWScore() :
                      m_currfile(_T("")),
                      m_passkey(nullptr), m_passkey_len(0),
                      m_hashIters(MIN_HASH_ITERATIONS),
+                     m_cipher(PWSfile::PWTwoFish),
                      m_lockFileHandle(INVALID_HANDLE_VALUE),
                      m_lockFileHandle2(INVALID_HANDLE_VALUE),
                      m_ReadFileVersion(PWSfile::UNKNOWN_VERSION),
+                     m_bJournalFPs(false), m_bNeedFullSave(false),
                      m_bIsReadOnly(false),
                      m_bNotifyDB(false),
                      m_bIsOpen(false),
+                     m_bGTUIndexValid(false),
                      m_nRecordsWithUnknownFields(0),
                      m_DBCurrentState(CLEAN),
                      m_pFileSig(nullptr),
+                     m_pSaveJob(nullptr),
+                     m_pendingSaveVersion(PWSfile::UNKNOWN_VERSION),
+                     m_bSavePending(false), m_bPendingBackup(false),
                      m_iAppHotKey(0)
 {
   // following should ideally be wrapped in a mutex
@@ -147,6 +212,8 @@ PWScore::PWScore() :
     PWScore::m_session_initialized = true;
     pws_os::mlock(m_session_key, sizeof(m_session_key));
     PWSrand::GetInstance()->GetRandomData(m_session_key, sizeof(m_session_key));
+    PWSrand::GetInstance()->GetRandomData(m_attDigestKey, sizeof(m_attDigestKey));
+    PWSrand::GetInstance()->GetRandomData(m_GTUKeyKey, sizeof(m_GTUKeyKey));
     if (!pws_os::mcryptProtect(m_session_key, sizeof(m_session_key))) {
       pws_os::Trace(_T("pws_os::mcryptProtect failed"));
     }
@@ -170,6 +237,12 @@ PWScore::~PWScore()
   m_UHFL.clear();
   m_vModifiedNodes.clear();
 
+  // Let a background save finish, but don't bother anyone about it
+  if (m_pSaveJob != nullptr) {
+    m_pSaveJob->thread.join();
+    delete m_pSaveJob;
+  }
+
   delete m_pFileSig;
 }
 
@@ -256,6 +329,7 @@ void PWScore::DoAddEntry(const CItemData &item, const CItemAtt *att)
   // Also "UndoDeleteEntry" !
   ASSERT(m_pwlist.find(item.GetUUID()) == m_pwlist.end());
   m_pwlist[item.GetUUID()] = item;
+  IndexEntry(item);
 
   if (item.NumberUnknownFields() > 0)
     IncrementNumRecordsWithUnknownFields();
@@ -265,10 +339,23 @@ void PWScore::DoAddEntry(const CItemData &item, const CItemAtt *att)
   }
 
   if (att != nullptr && att->HasContent()) {
-    m_pwlist[item.GetUUID()].SetAttUUID(att->GetUUID());
-    if (m_attlist.find(att->GetUUID()) == m_attlist.end())
-      m_attlist.insert(std::make_pair(att->GetUUID(), *att));
-    m_attlist[att->GetUUID()].IncRefcount();
+    m_bNeedFullSave = true; // attachments aren't journalled
+    CUUID attuuid = att->GetUUID();
+    if (m_attlist.find(attuuid) == m_attlist.end()) {
+      // Share an attachment with the same content, if there's one
+      attuuid = FindDuplicateAtt(*att);
+      if (attuuid == CUUID::NullUUID()) {
+        attuuid = att->GetUUID();
+        CItemAtt &added = m_attlist.insert(std::make_pair(attuuid, *att)).first->second;
+        // Only our own file's content's left where it is, as we can't
+        // tell when another might change, e.g., when merging from it.
+        // Content that's in a temporary file of its own stays there.
+        if (added.IsContentDeferred() && added.GetContentFile() != m_currfile)
+          added.SpillContent();
+      }
+    }
+    m_pwlist[item.GetUUID()].SetAttUUID(attuuid);
+    m_attlist[attuuid].IncRefcount();
   }
 
   int32 iKBShortcut;
@@ -356,6 +443,11 @@ void PWScore::DoDeleteEntry(const CItemData &item)
     if (iKBShortcut != 0)
       VERIFY(DelKBShortcut(iKBShortcut, item.GetUUID()));
 
+    // As added, which may not be as item has it, see DoAddEntry()
+    const bool bHasAttRef = pos->second.HasAttRef();
+    const CUUID attuuid = bHasAttRef ? pos->second.GetAttUUID() : CUUID::NullUUID();
+
+    UnindexEntry(item.GetUUID());
     m_pwlist.erase(pos); // at last!
 
     if (item.NumberUnknownFields() > 0)
@@ -365,13 +457,8 @@ void PWScore::DoDeleteEntry(const CItemData &item)
       DecrementPasswordPolicy(item.GetPolicyName());
     }
 
-    if (item.HasAttRef()) {
-      CItemAtt &att = GetAtt(item.GetAttUUID());
-      if (att.GetRefcount() == 1)
-        RemoveAtt(item.GetAttUUID());
-      else
-        att.DecRefcount();
-    }
+    if (bHasAttRef && HasAtt(attuuid))
+      RemoveAtt(attuuid);
   } // pos != m_pwlist.end()
 }
 
@@ -380,6 +467,8 @@ void PWScore::DoReplaceEntry(const CItemData &old_ci, const CItemData &new_ci)
   // Assumes that old_uuid == new_uuid
   ASSERT(old_ci.GetUUID() == new_ci.GetUUID());
   m_pwlist[old_ci.GetUUID()] = new_ci;
+  UnindexEntry(old_ci.GetUUID());
+  IndexEntry(new_ci);
   if (old_ci.GetEntryType() != new_ci.GetEntryType() || old_ci.GetStatus() != new_ci.GetStatus() ||
       old_ci.IsProtected() != new_ci.IsProtected())
     GUIRefreshEntry(new_ci);
@@ -434,6 +523,10 @@ void PWScore::DoDeleteAtt(const CItemAtt &att)
 
 void PWScore::ClearDBData()
 {
+  // A save in progress is of the data we're about to clear
+  m_bSavePending = false;
+  CompleteSave();
+
   const unsigned int BS = TwoFish::BLOCKSIZE;
   if (m_passkey_len > 0) {
     trashMemory(m_passkey, ((m_passkey_len + (BS - 1)) / BS) * BS);
@@ -445,7 +538,15 @@ void PWScore::ClearDBData()
 
   //Composed of ciphertext, so doesn't need to be overwritten
   m_pwlist.clear();
+  InvalidateGTUIndex();
   m_attlist.clear();
+  m_attDigests.clear();
+
+  m_journal.Clear();
+  m_journalFile = _T("");
+  m_journalFPs.clear();
+  m_journalAtts.clear();
+  m_bJournalFPs = m_bNeedFullSave = false;
 
   // Clear out out dependents mappings
   m_base2aliases_mmap.clear();
@@ -507,6 +608,7 @@ void PWScore::NewFile(const StringX &passkey)
 {
   ClearDBData();
   SetPassKey(passkey);
+  m_cipher = PWSfile::PWTwoFish; // the default, not whatever was last read
   time(&m_hdr.m_whenpwdlastchanged); // update master password changed timestamp
   m_ReadFileVersion = PWSfile::VCURRENT;
 }
@@ -547,9 +649,24 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
 {
   PWS_LOGIT_ARGS("bUpdateSig=%ls", bUpdateSig ? L"true" : L"false");
 
+  // Don't write filename concurrently with a background save,
+  // nor save it again afterwards, as this is more recent
+  if (m_bSavePending && m_pendingSaveFile == filename)
+    m_bSavePending = false;
+  while (IsSaveInProgress())
+    CompleteSave();
+
   int status;
 
-  PWSfile *out = PWSfile::MakePWSfile(filename, GetPassKey(), version,
+  // Formats without attachments won't copy content left in the file
+  // they're overwriting, so copy it out while it's still there
+  if (version < PWSfile::V40)
+    for (auto &p : m_attlist)
+      if (p.second.IsContentDeferred() && p.second.GetContentFile() == filename)
+        p.second.SpillContent();
+
+  const StringX target = SaveTarget(filename, version, m_attlist);
+  PWSfile *out = PWSfile::MakePWSfile(target, GetPassKey(), version,
                                       PWSfile::Write, status);
 
   if (status != PWSfile::SUCCESS) {
@@ -574,6 +691,7 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
   out->SetHeader(m_hdr);
   out->SetUnknownHeaderFields(m_UHFL);
   out->SetNHashIters(GetHashIters());
+  out->SetCipher(GetCipher());
   out->SetDBFilters(m_MapDBFilters);
   out->SetPasswordPolicies(m_MapPSWDPLC);
   out->SetEmptyGroups(m_vEmptyGroups);
@@ -584,6 +702,7 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
 
     if (status != PWSfile::SUCCESS) {
       delete out;
+      CommitSave(target, filename, false);
 
       if (version < m_ReadFileVersion) // Exporting - restore saved header
         m_hdr = saved_hdr;
@@ -591,8 +710,11 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
       return status;
     }
 
+    // In UUID order, so the file doesn't depend on the order entries
+    // were added in
     RecordWriter write_record(out, this, version);
-    for_each(m_pwlist.begin(), m_pwlist.end(), write_record);
+    for (auto iter : m_pwlist.SortedByKey())
+      write_record(*iter);
 
     // Write attachments (only from V4)
     if (version >= PWSfile::V40)
@@ -611,6 +733,7 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
   catch (...) {
     out->Close();
     delete out;
+    CommitSave(target, filename, false);
 
     if (version < m_ReadFileVersion) // Exporting - restore saved header
       m_hdr = saved_hdr;
@@ -618,9 +741,21 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
     return FAILURE;
   }
 
-  out->Close();
+  const int closeStatus = out->Close();
+  const PWSfile::JournalBinding jb = out->GetJournalBinding();
+  std::map<CUUID, long> contentOffsets;
+  if (auto *out4 = dynamic_cast<PWSfileV4 *>(out))
+    contentOffsets = out4->GetContentOffsets();
+  const PWSfile::Cipher contentCipher = out->GetCipher();
   delete out;
 
+  if (CommitSave(target, filename, closeStatus == PWSfile::SUCCESS) != SUCCESS) {
+    m_hdr = saved_hdr;
+    return WRITE_FAIL;
+  }
+  MoveContent(m_attlist, contentOffsets, filename, contentCipher,
+              bUpdateSig && version >= m_ReadFileVersion);
+
   // Update info if we're saving or upgrading.
   if (version >= m_ReadFileVersion) {
     // Set/Reset everything as "unchanged"
@@ -637,43 +772,442 @@ int PWScore::WriteFile(const StringX &filename, PWSfile::VERSION version,
 
   // If not exporting, set to clean
   if (version == m_ReadFileVersion) {
-    // Set current state to CLEAN
-    m_DBCurrentState = CLEAN;
-
-    std::vector<DBStates>::iterator iter;
-
-    if (m_redo_DBState_iter != m_vDBState.end()) {
-      // Update command after of this one to be {before = CLEAN, after = DIRTY}
-      m_redo_DBState_iter->before = CLEAN;
-      m_redo_DBState_iter->after = DIRTY;
-
-      // Update all additional commands after of the next one to be
-      // {before = DIRTY, after = DIRTY}
-      iter = m_redo_DBState_iter + 1;
-      for (; iter != m_vDBState.end(); iter++) {
-        iter->before = DIRTY;
-        iter->after = DIRTY;
-      }
+    SetSavedState();
+
+    // The current file now has everything in its journal, if any
+    if (filename == m_currfile) {
+      PWSjournal::Remove(filename);
+      if (closeStatus == PWSfile::SUCCESS)
+        m_journal = jb;
+      else
+        m_journal.Clear();
+      m_journalFile = filename;
+      m_bNeedFullSave = false;
+      SetJournalFingerprints();
+    }
+  }
+  return SUCCESS;
+}
+
+void PWScore::SetSavedState()
+{
+  SetSavedState(GetCommandPosition());
+}
+
+void PWScore::SetSavedState(size_t savedPos)
+{
+  // The only clean state is the one after the first savedPos commands,
+  // i.e., before command savedPos, and after command savedPos - 1.
+  // Any other state, before or after any other command, is dirty.
+  for (size_t i = 0; i < m_vDBState.size(); i++) {
+    m_vDBState[i].before = (i == savedPos) ? CLEAN : DIRTY;
+    m_vDBState[i].after = (i + 1 == savedPos) ? CLEAN : DIRTY;
+  }
+
+  m_DBCurrentState = (GetCommandPosition() == savedPos) ? CLEAN : DIRTY;
+}
+
+size_t PWScore::GetCommandPosition() const
+{
+  if (m_undo_DBState_iter == m_vDBState.end())
+    return 0; // nothing to undo
+  return static_cast<size_t>(m_undo_DBState_iter - m_vDBState.begin()) + 1;
+}
+
+void PWScore::SaveJob::Run(std::vector<Observer *> observers)
+{
+  // Not PWS_PK_CP_ACP, which the UI thread sets while checking passkeys
+  SetThreadPasskeyEncoding(bPasskeyUTF8);
+
+  // Here, so as not to hold up the UI while the file's copied
+  stringT bu_fname;
+  if (bBackup && !BackupFile(filename, pCurFileSig, attlist, backup, bu_fname)) {
+    status = PWScore::CANT_BACKUP;
+    bDone = true;
+    for (auto &observer : observers) {
+      observer->SaveReady();
     }
+    return;
+  }
 
-    if (m_undo_DBState_iter != m_vDBState.end()) {
-      // Update command before this one to be {before = DIRTY, after = CLEAN}
-      m_undo_DBState_iter->before = DIRTY;
-      m_undo_DBState_iter->after = CLEAN;
+  const StringX target = SaveTarget(filename, version, attlist);
+  PWSfile *out = PWSfile::MakePWSfile(target, passkey, version,
+                                      PWSfile::Write, status);
 
-      // Update all additional commands before the previous one to be
-      // {before = DIRTY, after = DIRTY}
-      iter = m_undo_DBState_iter;
-      while (iter != m_vDBState.begin()) {
-        iter--;
-        iter->before = DIRTY;
-        iter->after = DIRTY;
+  if (status == PWSfile::SUCCESS) {
+    out->SetHeader(hdr);
+    out->SetUnknownHeaderFields(uhfl);
+    out->SetNHashIters(hashIters);
+    out->SetCipher(cipher);
+    out->SetDBFilters(filters);
+    out->SetPasswordPolicies(policies);
+    out->SetEmptyGroups(emptyGroups);
+
+    try { // exception thrown on write error
+      status = out->Open(passkey);
+
+      if (status == PWSfile::SUCCESS) {
+        for (auto iter : pwlist.SortedByKey()) // as WriteFile()
+          out->WriteRecord(iter->second);
+
+        // Write attachments (only from V4)
+        if (version >= PWSfile::V40)
+          for (auto &p : attlist)
+            p.second.Write(out);
+
+        hdr = out->GetHeader(); // update time saved, etc.
+        closeStatus = out->Close();
+        jb = out->GetJournalBinding();
+        if (auto *out4 = dynamic_cast<PWSfileV4 *>(out))
+          contentOffsets = out4->GetContentOffsets();
+        contentCipher = out->GetCipher();
       }
     }
+
+    catch (...) {
+      out->Close();
+      status = PWScore::FAILURE;
+    }
+  }
+  delete out;
+
+  if (status == PWSfile::SUCCESS || target != filename) {
+    const int commitStatus = CommitSave(target, filename,
+                                        status == PWSfile::SUCCESS &&
+                                        closeStatus == PWSfile::SUCCESS);
+    if (status == PWSfile::SUCCESS)
+      status = commitStatus;
+  }
+
+  // As the UIs do when a save they took a backup for fails
+  if (status != PWSfile::SUCCESS && !bu_fname.empty())
+    pws_os::RenameFile(bu_fname, filename.c_str());
+
+  if (status == PWSfile::SUCCESS && bUpdateSig)
+    pFileSig = new PWSFileSig(filename.c_str());
+
+  bDone = true;
+
+  for (auto &observer : observers) {
+    observer->SaveReady();
+  }
+}
+
+// The file that's replaced when saving to filename: if that's a symbolic
+// link, what it links to, so that it stays a link
+static StringX SaveDestination(const StringX &filename)
+{
+  const stringT path = pws_os::fullpath(filename.c_str());
+  return path.empty() ? filename : StringX(path.c_str());
+}
+
+StringX PWScore::SaveTarget(const StringX &filename, PWSfile::VERSION version,
+                            const AttList &attlist)
+{
+  if (version >= PWSfile::V40)
+    for (const auto &p : attlist)
+      if (p.second.IsContentDeferred())
+        return SaveDestination(filename) + _T(".tmp"); // same volume
+  return filename;
+}
+
+int PWScore::CommitSave(const StringX &target, const StringX &filename,
+                        bool bOK)
+{
+  if (target == filename)
+    return SUCCESS;
+  const StringX dest = SaveDestination(filename);
+  if (bOK && pws_os::ReplaceAFile(target.c_str(), dest.c_str()))
+    return SUCCESS;
+  // If the old file's gone, the new one's all there is
+  if (!bOK || pws_os::FileExists(dest.c_str()))
+    pws_os::DeleteAFile(target.c_str());
+  return WRITE_FAIL;
+}
+
+void PWScore::MoveContent(const AttList &attlist,
+                          const std::map<CUUID, long> &offsets,
+                          const StringX &filename, PWSfile::Cipher cipher,
+                          bool bAll)
+{
+  for (const auto &p : offsets) {
+    auto saved = attlist.find(p.first);
+    auto iter = m_attlist.find(p.first);
+    if (saved == attlist.end() || iter == m_attlist.end())
+      continue;
+    CItemAtt &att = iter->second;
+    // Still where it was saved from?
+    if (att.IsContentDeferred() &&
+        att.GetContentFile() == saved->second.GetContentFile() &&
+        att.GetContentOffset() == saved->second.GetContentOffset() &&
+        (bAll || att.GetContentFile() == filename))
+      att.MoveContent(filename, p.second, cipher);
+  }
+}
+
+int PWScore::ScheduleSave(const StringX &filename, PWSfile::VERSION version,
+                          const BackupOptions *pBackup)
+{
+  PWS_LOGIT;
+
+  if (version < PWSfile::V30 || version < m_ReadFileVersion) {
+    // Exporting: older formats need the core to write aliases and
+    // shortcuts, and the header's restored afterwards, so do it now
+    const int status = WriteFile(filename, version);
+    for (auto &observer : m_Observers) {
+      observer->DatabaseSaved(status, filename);
+    }
+    return status;
+  }
+
+  if (m_pSaveJob != nullptr) {
+    // Whatever's been requested while a save's in progress
+    // gets saved in one go when it's done, with one backup
+    if (!m_bSavePending)
+      m_bPendingBackup = false;
+    if (pBackup != nullptr) {
+      m_bPendingBackup = true;
+      m_pendingBackup = *pBackup;
+    }
+    m_bSavePending = true;
+    m_pendingSaveFile = filename;
+    m_pendingSaveVersion = version;
+    return SUCCESS;
   }
+
+  StartSave(filename, version, pBackup);
   return SUCCESS;
 }
 
+void PWScore::StartSave(const StringX &filename, PWSfile::VERSION version,
+                        const BackupOptions *pBackup)
+{
+  ASSERT(m_pSaveJob == nullptr);
+
+  // Snapshot everything WriteFile() would write, as it is now
+  auto *job = new SaveJob;
+  job->filename = filename;
+  job->version = version;
+  job->passkey = GetPassKey();
+
+  job->hdr = m_hdr;
+  job->hdr.m_prefString = PWSprefs::GetInstance()->Store();
+  job->hdr.m_whatlastsaved = m_AppNameAndVersion.c_str();
+  job->hdr.m_RUEList = m_RUEList;
+  job->uhfl = m_UHFL;
+  job->hashIters = GetHashIters();
+  job->cipher = GetCipher();
+  job->filters = m_MapDBFilters;
+  job->policies = m_MapPSWDPLC;
+  job->emptyGroups = m_vEmptyGroups;
+  job->pwlist = m_pwlist;
+  job->attlist = m_attlist;
+
+  if (pBackup != nullptr) {
+    job->bBackup = true;
+    job->backup = *pBackup;
+    if (m_pFileSig != nullptr)
+      job->pCurFileSig = new PWSFileSig(*m_pFileSig);
+  }
+
+  job->cmdPosition = GetCommandPosition();
+  if (filename == m_currfile) {
+    // This save covers whatever needed one, see FinishSave() if it fails
+    job->bNeedFullSave = m_bNeedFullSave;
+    m_bNeedFullSave = false;
+  }
+
+  // As WriteFile(), whatever PWS_PK_CP_ACP's set to
+  job->bPasskeyUTF8 = true;
+  m_pSaveJob = job;
+  job->thread = std::thread(&SaveJob::Run, job, m_Observers);
+}
+
+int PWScore::CompleteSave(bool bWait)
+{
+  if (m_pSaveJob == nullptr)
+    return SUCCESS;
+
+  if (!bWait && !m_pSaveJob->bDone)
+    return SAVE_IN_PROGRESS;
+
+  const int status = FinishSave();
+
+  if (m_bSavePending) {
+    m_bSavePending = false;
+    StartSave(m_pendingSaveFile, m_pendingSaveVersion,
+              m_bPendingBackup ? &m_pendingBackup : nullptr);
+  }
+  return status;
+}
+
+int PWScore::FinishSave()
+{
+  SaveJob *job = m_pSaveJob;
+  m_pSaveJob = nullptr;
+  job->thread.join();
+
+  const int status = job->status;
+  const StringX filename = job->filename;
+
+  if (job->bUpdateSig) {
+    delete m_pFileSig;
+    m_pFileSig = job->pFileSig; // nullptr if failed, as with WriteFile()
+    job->pFileSig = nullptr;
+  }
+
+  if (status == SUCCESS) {
+    // Only take what writing changed in the header, as the rest may
+    // have been changed since the snapshot
+    m_hdr.m_nCurrentMajorVersion = job->hdr.m_nCurrentMajorVersion;
+    m_hdr.m_nCurrentMinorVersion = job->hdr.m_nCurrentMinorVersion;
+    m_hdr.m_file_uuid = job->hdr.m_file_uuid;
+    m_hdr.m_prefString = job->hdr.m_prefString;
+    m_hdr.m_whenlastsaved = job->hdr.m_whenlastsaved;
+    m_hdr.m_lastsavedby = job->hdr.m_lastsavedby;
+    m_hdr.m_lastsavedon = job->hdr.m_lastsavedon;
+    m_hdr.m_whatlastsaved = job->hdr.m_whatlastsaved;
+    m_hdr.m_RUEList = job->hdr.m_RUEList;
+
+    // As SetInitialValues(), but for the state that was saved
+    m_InitialDBName = job->hdr.m_DB_Name;
+    m_InitialDBDesc = job->hdr.m_DB_Description;
+    m_InitialDBPreferences = job->hdr.m_prefString;
+    m_InitialEmptyGroups = job->emptyGroups;
+    m_InitialMapPSWDPLC = job->policies;
+    m_InitialMapDBFilters = job->filters;
+    m_InitialDisplayStatus = job->hdr.m_displaystatus;
+    m_InitialRUEList = job->hdr.m_RUEList;
+
+    m_ReadFileVersion = job->version;
+
+    // If the user's carried on editing, the DB's still dirty, unless
+    // they undo back to what was saved
+    if (GetCommandPosition() == job->cmdPosition) {
+      for (auto &p : m_pwlist)
+        p.second.ClearStatus();
+      m_vModifiedNodes.clear();
+    }
+    SetSavedState(job->cmdPosition);
+
+    // The current file now has everything in its journal, if any
+    if (filename == m_currfile) {
+      PWSjournal::Remove(filename);
+      if (job->closeStatus == PWSfile::SUCCESS)
+        m_journal = job->jb;
+      else
+        m_journal.Clear();
+      m_journalFile = filename;
+      SetJournalFingerprints(job->pwlist, job->attlist);
+    }
+
+    // Unless it's been changed since the snapshot
+    MoveContent(job->attlist, job->contentOffsets, filename,
+                job->contentCipher, true);
+  } else {
+    // Whatever needed a full save still does
+    m_bNeedFullSave = m_bNeedFullSave || job->bNeedFullSave;
+  }
+
+  delete job;
+
+  for (auto &observer : m_Observers) {
+    observer->DatabaseSaved(status, filename);
+  }
+  return status;
+}
+
+int PWScore::WriteCurJournal()
+{
+  PWS_LOGIT;
+
+  // Past this, a full save's worth it, as the journal's replayed on each read
+  const long MAX_JOURNAL_LENGTH = 256 * 1024;
+
+  // Journal's bound to the file as last written
+  while (IsSaveInProgress())
+    CompleteSave();
+
+  if (!m_bJournalFPs || m_bNeedFullSave || m_bIsReadOnly ||
+      m_currfile.empty() || m_journalFile != m_currfile ||
+      !m_journal.IsValid() || PWSjournal::Length(m_journal) < 0 ||
+      PWSjournal::Length(m_journal) > MAX_JOURNAL_LENGTH)
+    return NOT_SUCCESS;
+
+  // The journal only holds entries, anything else needs a full save.
+  // (Group display and RUE list are saved when the DB's closed, as before)
+  if (HaveDBPrefsChanged() || HaveEmptyGroupsChanged() ||
+      HavePasswordPolicyNamesChanged() || HaveDBFiltersChanged() ||
+      m_hdr.m_DB_Name != m_InitialDBName ||
+      m_hdr.m_DB_Description != m_InitialDBDesc ||
+      m_attlist.size() != m_journalAtts.size())
+    return NOT_SUCCESS;
+  for (const auto &p : m_attlist)
+    if (m_journalAtts.find(p.first) == m_journalAtts.end())
+      return NOT_SUCCESS;
+
+  UUIDSet changed;
+  for (const auto &p : m_pwlist) {
+    auto fpiter = m_journalFPs.find(p.first);
+    unsigned char fp[SHA256::HASHLEN];
+    p.second.GetFingerprint(fp);
+    if (fpiter == m_journalFPs.end() ||
+        fpiter->second.et != p.second.GetEntryType() ||
+        memcmp(fpiter->second.fp, fp, sizeof(fp)) != 0)
+      changed.insert(p.first);
+  }
+  for (const auto &p : m_journalFPs)
+    if (m_pwlist.find(p.first) == m_pwlist.end())
+      changed.insert(p.first); // deleted
+
+  if (!changed.empty()) {
+    int status = PWSjournal::Append(m_currfile, m_ReadFileVersion, m_journal,
+                                    m_pwlist, changed);
+    if (status != PWSfile::SUCCESS)
+      return status;
+
+    for (const auto &uuid : changed) {
+      auto iter = m_pwlist.find(uuid);
+      if (iter != m_pwlist.end()) {
+        JournalFP &jfp = m_journalFPs[uuid];
+        jfp.et = iter->second.GetEntryType();
+        iter->second.GetFingerprint(jfp.fp);
+        iter->second.ClearStatus();
+      } else
+        m_journalFPs.erase(uuid);
+    }
+  }
+
+  m_vModifiedNodes.clear();
+  SetSavedState();
+  return SUCCESS;
+}
+
+bool PWScore::HasJournal() const
+{
+  return m_journal.IsValid() && m_journalFile == m_currfile &&
+    PWSjournal::Length(m_journal) != 0;
+}
+
+void PWScore::SetJournalFingerprints(const ItemList &pwlist,
+                                     const AttList &attlist)
+{
+  m_journalFPs.clear();
+  m_journalAtts.clear();
+  m_bJournalFPs = !m_isAuxCore &&
+    PWSprefs::GetInstance()->GetPref(PWSprefs::UseChangeJournal);
+  if (!m_bJournalFPs)
+    return;
+
+  for (const auto &p : pwlist) {
+    JournalFP &jfp = m_journalFPs[p.first];
+    jfp.et = p.second.GetEntryType();
+    p.second.GetFingerprint(jfp.fp);
+  }
+  for (const auto &p : attlist)
+    m_journalAtts.insert(p.first);
+}
+
 // functor object type for for_each:
 // Writes out subset of records to a PasswordSafe database at the current version
 // Used by Export entry or Export Group
@@ -830,6 +1364,8 @@ void PWScore::ClearCommands()
   m_undo_iter = m_redo_iter = m_vpcommands.end();
 
   // Clear DB states
+  if (m_pSaveJob != nullptr)
+    m_pSaveJob->cmdPosition = NO_POSITION;
   m_vDBState.clear();
   m_undo_DBState_iter = m_redo_DBState_iter = m_vDBState.end();
 }
@@ -877,6 +1413,11 @@ int PWScore::Execute(Command *pcmd)
   if (m_redo_iter != m_vpcommands.end()) {
     std::vector<Command *>::iterator cmd_Iter;
 
+    // A background save of a state past this one can't be undone/redone to
+    if (m_pSaveJob != nullptr &&
+        static_cast<size_t>(m_redo_iter - m_vpcommands.begin()) < m_pSaveJob->cmdPosition)
+      m_pSaveJob->cmdPosition = NO_POSITION;
+
     for (cmd_Iter = m_redo_iter; cmd_Iter != m_vpcommands.end(); cmd_Iter++) {
       delete (*cmd_Iter);
     }
@@ -1005,16 +1546,39 @@ bool PWScore::AnyToRedo() const
   return (m_redo_iter != m_vpcommands.end());
 }
 
+// Retrying with PWS_PK_CP_ACP set only makes sense if it changes the
+// passkey's encoding, otherwise we'd just be running the KDF again.
+static bool ACPEncodingDiffers(const StringX &passkey)
+{
+  unsigned char *utf8 = nullptr, *acp = nullptr;
+  size_t utf8Len = 0, acpLen = 0;
+
+  ConvertPasskey(passkey, utf8, utf8Len);
+  pws_os::setenv("PWS_PK_CP_ACP", "1");
+  ConvertPasskey(passkey, acp, acpLen);
+  pws_os::setenv("PWS_PK_CP_ACP", ""); // no unsetenv() in Windows...
+
+  const bool retval = (utf8Len != acpLen || memcmp(utf8, acp, utf8Len) != 0);
+  trashMemory(utf8, utf8Len);
+  trashMemory(acp, acpLen);
+  delete[] utf8;
+  delete[] acp;
+  return retval;
+}
+
 int PWScore::CheckPasskey(const StringX &filename, const StringX &passkey)
 {
   int status;
 
   if (!filename.empty()) {
-    status = PWSfile::CheckPasskey(filename, passkey, m_ReadFileVersion);
-    if (status == PWSfile::WRONG_PASSWORD) {
+    // On success, m_verifiedKey holds the derived key for ReadFile()
+    status = PWSfile::CheckPasskey(filename, passkey, m_ReadFileVersion,
+                                   &m_verifiedKey);
+    if (status == PWSfile::WRONG_PASSWORD && ACPEncodingDiffers(passkey)) {
       // See if passkey was encoded incorrectly
       pws_os::setenv("PWS_PK_CP_ACP", "1");
-      status = PWSfile::CheckPasskey(filename, passkey, m_ReadFileVersion);
+      status = PWSfile::CheckPasskey(filename, passkey, m_ReadFileVersion,
+                                     &m_verifiedKey);
       pws_os::setenv("PWS_PK_CP_ACP", ""); // no unsetenv() in Windows...
     }
   } else { // can happen if tries to export b4 save
@@ -1128,7 +1692,9 @@ void PWScore::ProcessReadEntry(CItemData &ci_temp,
   }
 
   // Finally, add it to the list!
-  m_pwlist.insert(std::make_pair(ci_temp.GetUUID(), ci_temp));
+  const CUUID uuid = ci_temp.GetUUID();
+  m_pwlist.emplace(uuid, std::move(ci_temp));
+  InvalidateGTUIndex();
 }
 
 static void ReportReadErrors(CReport *pRpt,
@@ -1190,16 +1756,28 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
   // Clear any old entry keyboard shortcuts
   m_KBShortcutMap.clear();
 
+  // If CheckPasskey() just verified this passkey for this file,
+  // hand over the derived key so that Open() needn't run the KDF again.
+  // It's good for one attempt only.
+  const bool bVerified = m_verifiedKey.Matches(a_filename, a_passkey);
+  if (bVerified)
+    m_ReadFileVersion = m_verifiedKey.GetVersion();
+
   PWSfile *in = PWSfile::MakePWSfile(a_filename, a_passkey, m_ReadFileVersion,
                                      PWSfile::Read, status, m_pAsker, m_pReporter);
 
   if (status != PWSfile::SUCCESS) {
+    m_verifiedKey.Clear();
     delete in;
     return status;
   }
 
+  if (bVerified)
+    in->SetVerifiedKey(m_verifiedKey);
+  m_verifiedKey.Clear();
+
   status = in->Open(a_passkey);
-  if (status == PWSfile::WRONG_PASSWORD) {
+  if (status == PWSfile::WRONG_PASSWORD && ACPEncodingDiffers(a_passkey)) {
     // See if passkey was encoded incorrectly
     pws_os::setenv("PWS_PK_CP_ACP", "1");
     status = in->Open(a_passkey);
@@ -1266,6 +1844,7 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
   bool go = true;
 
   m_hashIters = in->GetNHashIters();
+  m_cipher = in->GetCipher();
   if (in->GetDBFilters() != nullptr) m_MapDBFilters = *in->GetDBFilters();
   if (in->GetPasswordPolicies() != nullptr) m_MapPSWDPLC = *in->GetPasswordPolicies();
   if (in->GetEmptyGroups() != nullptr) m_vEmptyGroups = *in->GetEmptyGroups();
@@ -1282,6 +1861,16 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
     pRpt->StartReport(cs_title.c_str(), m_currfile.c_str());
   }
 
+  // Changes saved to the file's journal since it was written supersede
+  // its records. If the journal's damaged, use what can be verified of it,
+  // and have the next save be a full one, to fold it in and remove it.
+  PWSfile::JournalBinding jb = in->GetJournalBinding();
+  PWSjournal::Changes journal;
+  bool bJournalOK = true;
+  if (jb.IsValid())
+    bJournalOK = (PWSjournal::Replay(a_filename, m_ReadFileVersion,
+                                     jb, journal) == PWSfile::SUCCESS);
+
   do {
     ci_temp.Clear(); // Rather than creating a new one each time.
     status = in->ReadRecord(ci_temp);
@@ -1301,7 +1890,8 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
       }
       //[[fallthrough]];
       case PWSfile::SUCCESS:
-        ProcessReadEntry(ci_temp, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
+        if (!journal.Supersedes(ci_temp.GetUUID()))
+          ProcessReadEntry(ci_temp, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
         break;
       case PWSfile::WRONG_RECORD: {
         // See if this is a V4 attachment:
@@ -1322,6 +1912,9 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
     } // switch
   } while (go);
 
+  for (auto &p : journal.puts)
+    ProcessReadEntry(p.second, vGTU_INVALID_UUID, vGTU_DUPLICATE_UUID, st_vr);
+
   ParseDependants();
 
   m_nRecordsWithUnknownFields = in->GetNumRecordsWithUnknownFields();
@@ -1349,6 +1942,11 @@ int PWScore::ReadFile(const StringX &a_filename, const StringX &a_passkey,
   if (a_filename == m_currfile) {
     delete m_pFileSig;
     m_pFileSig = new PWSFileSig(a_filename.c_str());
+
+    m_journal = jb;
+    m_journalFile = a_filename;
+    m_bNeedFullSave = !bJournalOK || bValidateRC;
+    SetJournalFingerprints();
   }
 
   // Make return code negative if validation errors
@@ -1445,16 +2043,34 @@ static void ManageIncBackupFiles(const stringT &cs_filenamebase,
 bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
                             const stringT &userBackupPrefix,
                             const stringT &userBackupDir, stringT &bu_fname)
+{
+  // A save in progress may still be reading the file
+  while (IsSaveInProgress())
+    CompleteSave();
+
+  BackupOptions backup;
+  backup.maxNumIncBackups = maxNumIncBackups;
+  backup.backupSuffix = backupSuffix;
+  backup.userBackupPrefix = userBackupPrefix;
+  backup.userBackupDir = userBackupDir;
+  return BackupFile(m_currfile, m_pFileSig, m_attlist, backup, bu_fname);
+}
+
+bool PWScore::BackupFile(const StringX &filename, PWSFileSig *pFileSig,
+                         const AttList &attlist, const BackupOptions &backup,
+                         stringT &bu_fname)
 {
   stringT cs_temp;
-  const stringT path(m_currfile.c_str());
+  const stringT path(filename.c_str());
   stringT drv, dir, name, ext;
+  const stringT &userBackupDir = backup.userBackupDir;
+  const stringT &userBackupPrefix = backup.userBackupPrefix;
 
   // Check if the file we're about to backup is unchanged since
   // we opened it, to avoid overwriting a good file with a bad one
-  if (m_pFileSig != nullptr) {
-    PWSFileSig curSig(m_currfile.c_str());
-    bool passed = (curSig == *m_pFileSig);
+  if (pFileSig != nullptr) {
+    PWSFileSig curSig(path);
+    bool passed = (curSig == *pFileSig);
     if (!passed) // XXX yell scream & shout
       return false;
   }
@@ -1484,7 +2100,7 @@ bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
   }
 
   // Add on suffix
-  switch (backupSuffix) { // case values from order in listbox.
+  switch (backup.backupSuffix) { // case values from order in listbox.
     case 1: // YYYYMMDD_HHMMSS suffix
       {
         time_t now;
@@ -1504,7 +2120,7 @@ bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
         break;
       }
     case 2: // _nnn suffix
-      ManageIncBackupFiles(cs_temp, maxNumIncBackups, bu_fname);
+      ManageIncBackupFiles(cs_temp, backup.maxNumIncBackups, bu_fname);
       break;
     case 0: // no suffix
     default:
@@ -1514,9 +2130,13 @@ bool PWScore::BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
 
   bu_fname +=  _T(".ibak");
 
-  // Current file becomes backup
+  // Current file becomes backup, unless the save has attachment content
+  // to copy from it
   // Directories along the specified backup path are created as needed
-  return pws_os::RenameFile(m_currfile.c_str(), bu_fname);
+  for (const auto &p : attlist)
+    if (p.second.IsContentDeferred() && p.second.GetContentFile() == filename)
+      return pws_os::CopyAFile(path, bu_fname);
+  return pws_os::RenameFile(path, bu_fname);
 }
 
 void PWScore::ChangePasskey(const StringX &newPasskey)
@@ -1551,7 +2171,99 @@ ItemListIter PWScore::Find(const StringX &a_group,const StringX &a_title,
 {
   FieldsMatch fields_match(a_group, a_title, a_user);
 
-  return find_if(m_pwlist.begin(), m_pwlist.end(), fields_match);
+  if (!m_bGTUIndexValid)
+    BuildGTUIndex();
+
+  // If there's more than one, which is only possible until Validate()
+  // has been called, return the one with the lowest UUID, as that
+  // doesn't depend on the order they were added in
+  ItemListIter retval = m_pwlist.end();
+  auto range = m_GTUIndex.equal_range(GTUKey(a_group, a_title, a_user));
+  for (auto it = range.first; it != range.second; it++) {
+    ItemListIter iter = m_pwlist.find(it->second);
+    if (iter != m_pwlist.end() && fields_match(*iter) &&
+        (retval == m_pwlist.end() || iter->first < retval->first))
+      retval = iter;
+  }
+  return retval;
+}
+
+uint64 PWScore::GTUKey(const StringX &group, const StringX &title,
+                       const StringX &user)
+{
+  // Each field's length first, so that, e.g., ("ab", "c") and ("a", "bc")
+  // are different
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac(m_GTUKeyKey,
+                                                      sizeof(m_GTUKeyKey));
+  const StringX *fields[] = {&group, &title, &user};
+  for (const StringX *field : fields) {
+    const uint32 len = static_cast<uint32>(field->length());
+    hmac.Update(reinterpret_cast<const unsigned char *>(&len), sizeof(len));
+    hmac.Update(reinterpret_cast<const unsigned char *>(field->data()),
+                static_cast<unsigned long>(len * sizeof(TCHAR)));
+  }
+  unsigned char digest[SHA256::HASHLEN];
+  hmac.Final(digest);
+
+  uint64 key;
+  memcpy(&key, digest, sizeof(key));
+  return key;
+}
+
+void PWScore::BuildGTUIndex()
+{
+  m_GTUIndex.clear();
+  m_GTUKeys.clear();
+  m_GTUIndex.reserve(m_pwlist.size());
+  m_bGTUIndexValid = true;
+  for (const auto &p : m_pwlist)
+    IndexEntry(p.second);
+}
+
+void PWScore::IndexEntry(const CItemData &ci)
+{
+  if (!m_bGTUIndexValid)
+    return; // built when next needed
+
+  const uint64 key = GTUKey(ci.GetGroup(), ci.GetTitle(), ci.GetUser());
+  m_GTUIndex.insert(std::make_pair(key, ci.GetUUID()));
+  m_GTUKeys[ci.GetUUID()] = key;
+}
+
+void PWScore::UnindexEntry(const CUUID &entry_uuid)
+{
+  auto kiter = m_GTUKeys.find(entry_uuid);
+  if (kiter == m_GTUKeys.end())
+    return;
+
+  auto range = m_GTUIndex.equal_range(kiter->second);
+  for (auto it = range.first; it != range.second; it++) {
+    if (it->second == entry_uuid) {
+      m_GTUIndex.erase(it);
+      break;
+    }
+  }
+  m_GTUKeys.erase(kiter);
+}
+
+void PWScore::InvalidateGTUIndex()
+{
+  if (!m_bGTUIndexValid)
+    return;
+  m_bGTUIndexValid = false;
+  m_GTUIndex.clear();
+  m_GTUKeys.clear();
+}
+
+void PWScore::ReindexEntry(const CUUID &entry_uuid)
+{
+  if (!m_bGTUIndexValid)
+    return;
+
+  UnindexEntry(entry_uuid);
+  ItemListConstIter iter = m_pwlist.find(entry_uuid);
+  if (iter != m_pwlist.end())
+    IndexEntry(iter->second);
 }
 
 struct TitleMatch {
@@ -2218,6 +2930,7 @@ bool PWScore::Validate(const size_t iMAXCHARS, CReport *pRpt, st_ValidateResults
       // We assume that this is run during file read. If not, then we
       // need to run using the Command mechanism for Undo/Redo.
       m_pwlist[fixedItem.GetUUID()] = fixedItem;
+      InvalidateGTUIndex();
     }
   } // iteration over m_pwlist
 
@@ -2859,6 +3572,7 @@ int PWScore::DoAddDependentEntries(UUIDVector &dependentlist, CReport *pRpt,
             // Invalid - delete!
             if (pmapDeletedItems != nullptr)
               pmapDeletedItems->insert(ItemList_Pair(*paiter, *pci_curitem));
+            UnindexEntry(iter->first);
             m_pwlist.erase(iter);
             continue;
           }
@@ -2883,6 +3597,7 @@ int PWScore::DoAddDependentEntries(UUIDVector &dependentlist, CReport *pRpt,
             // Invalid - delete!
             if (pmapDeletedItems != nullptr)
               pmapDeletedItems->insert(ItemList_Pair(*paiter, *pci_curitem));
+            UnindexEntry(iter->first);
             m_pwlist.erase(iter);
             continue;
           }
@@ -2992,6 +3707,7 @@ void PWScore::UndoAddDependentEntries(ItemList *pmapDeletedItems,
        add_iter != pmapDeletedItems->end();
        add_iter++) {
     m_pwlist[add_iter->first] = add_iter->second;
+    InvalidateGTUIndex();
   }
 
   for (restore_iter = pmapSaveTypePW->begin();
@@ -3612,9 +4328,8 @@ void PWScore::GetDBProperties(st_DBProperties &st_dbp)
   if(m_hdr.m_file_uuid == CUUID::NullUUID())
     st_dbp.file_uuid = _T("N/A");
   else {
-    CUUID huuid(*m_hdr.m_file_uuid.GetARep(), true); // true for canonical format
     ostringstreamT os;
-    os << std::uppercase << huuid;
+    os << std::uppercase << m_hdr.m_file_uuid.Canonic();
     st_dbp.file_uuid = os.str().c_str();
   }
 
@@ -3983,15 +4698,187 @@ uint32 PWScore::GetHashIters() const
 
 void PWScore::SetHashIters(uint32 value)
 {
+  if (value != m_hashIters)
+    m_bNeedFullSave = true;
   m_hashIters = value;
 }
 
+PWSfile::Cipher PWScore::GetCipher() const
+{
+  return m_cipher;
+}
+
+void PWScore::SetCipher(PWSfile::Cipher cipher)
+{
+  if (cipher != m_cipher)
+    m_bNeedFullSave = true;
+  m_cipher = cipher;
+}
+
+uint32 PWScore::CalibrateHashIters(uint32 msecs) const
+{
+  // Anything pre-V4 will be written as V3
+  const PWSfile::VERSION version = (m_ReadFileVersion == PWSfile::V40) ?
+    PWSfile::V40 : PWSfile::V30;
+  return PWSfile::CalibrateHashIters(version, msecs);
+}
+
 void PWScore::RemoveAtt(const pws_os::CUUID &attuuid)
 {
   // Should be a Command setting new CommandDBChange enum value
   ASSERT(HasAtt(attuuid));
   //m_stDBCS.bDBChanged = true; // Can't do this outside a Command
-  m_attlist.erase(m_attlist.find(attuuid));
+  auto iter = m_attlist.find(attuuid);
+  m_bNeedFullSave = true; // attachments aren't journalled
+  if (iter->second.GetRefcount() > 1) {
+    iter->second.DecRefcount(); // still another entry's
+    return;
+  }
+  m_attlist.erase(iter);
+  m_attDigests.erase(attuuid);
+}
+
+void PWScore::SetEntryAtt(CItemData &ci, const CItemAtt &att)
+{
+  ASSERT(att.HasUUID());
+  CItemAtt edited(att);
+  edited.ClearRefcount();
+
+  // Only an attachment that's ci's alone may be changed in place
+  auto iter = m_attlist.find(att.GetUUID());
+  if (iter != m_attlist.end() &&
+      !(ci.HasAttRef() && ci.GetAttUUID() == att.GetUUID() &&
+        iter->second.GetRefcount() == 1))
+    edited.CreateUUID();
+
+  ClearEntryAtt(ci);
+
+  CUUID attuuid = FindDuplicateAtt(edited);
+  if (attuuid == CUUID::NullUUID()) {
+    attuuid = edited.GetUUID();
+    m_attlist.insert(std::make_pair(attuuid, edited));
+  }
+  ci.SetAttUUID(attuuid);
+  m_attlist[attuuid].IncRefcount();
+  m_bNeedFullSave = true; // attachments aren't journalled
+}
+
+void PWScore::ClearEntryAtt(CItemData &ci)
+{
+  if (!ci.HasAttRef())
+    return;
+  if (HasAtt(ci.GetAttUUID()))
+    RemoveAtt(ci.GetAttUUID());
+  ci.ClearAttUUID();
+}
+
+bool PWScore::GetAttDigest(const CItemAtt &att,
+                           std::vector<unsigned char> &digest) const
+{
+  const CUUID attuuid = att.GetUUID();
+  auto iter = m_attDigests.find(attuuid);
+  if (iter != m_attDigests.end()) {
+    digest = iter->second;
+    return true;
+  }
+
+  digest.resize(SHA256::HASHLEN);
+  if (att.GetContentDigest(m_attDigestKey, sizeof(m_attDigestKey),
+                           digest.data()) != PWSfile::SUCCESS)
+    return false; // e.g., content's been tampered with, share nothing
+  if (HasAtt(attuuid))
+    m_attDigests[attuuid] = digest;
+  return true;
+}
+
+CUUID PWScore::FindDuplicateAtt(const CItemAtt &att) const
+{
+  const size_t len = att.GetContentLength();
+  const CUUID attuuid = att.GetUUID();
+  std::vector<unsigned char> digest, other;
+  if (len == 0)
+    return CUUID::NullUUID();
+
+  // Lengths are cheap to compare, so only digest those that match
+  for (const auto &p : m_attlist) {
+    if (p.first == attuuid || p.second.GetContentLength() != len ||
+        p.second.GetTitle() != att.GetTitle() ||
+        p.second.GetFileName() != att.GetFileName() ||
+        p.second.GetMediaType() != att.GetMediaType())
+      continue;
+    if (digest.empty() && !GetAttDigest(att, digest))
+      return CUUID::NullUUID();
+    if (GetAttDigest(p.second, other) && other == digest)
+      return p.first;
+  }
+  return CUUID::NullUUID();
+}
+
+int PWScore::DoMergeDuplicateAtts(SaveAttRefMap &mapSavedAttRefs,
+                                  AttList &removedAtts)
+{
+  // Keep the first of each set of attachments with the same content,
+  // title, file name and media type, replacing the others with it
+  typedef std::tuple<size_t, StringX, StringX, StringX,
+                     std::vector<unsigned char>> AttKey;
+  std::map<CUUID, CUUID> replacements;
+  std::map<AttKey, CUUID> keepers;
+  std::multiset<size_t> lengths;
+  std::vector<unsigned char> digest;
+
+  for (const auto &p : m_attlist)
+    lengths.insert(p.second.GetContentLength());
+
+  for (const auto &p : m_attlist) {
+    const size_t len = p.second.GetContentLength();
+    if (len == 0 || lengths.count(len) < 2 || !GetAttDigest(p.second, digest))
+      continue;
+    const AttKey key(len, p.second.GetTitle(), p.second.GetFileName(),
+                     p.second.GetMediaType(), digest);
+    auto iter = keepers.insert(std::make_pair(key, p.first));
+    if (!iter.second)
+      replacements[p.first] = iter.first->second;
+  }
+
+  // As they are, for Undo
+  for (const auto &p : replacements)
+    removedAtts.insert(*m_attlist.find(p.first));
+
+  for (auto &p : m_pwlist) {
+    CItemData &ci = p.second;
+    if (!ci.HasAttRef())
+      continue;
+    auto iter = replacements.find(ci.GetAttUUID());
+    if (iter != replacements.end()) {
+      mapSavedAttRefs[p.first] = iter->first;
+      ci.SetAttUUID(iter->second);
+      m_attlist[iter->second].IncRefcount();
+      RemoveAtt(iter->first);
+    }
+  }
+  // Any no entry referred to
+  for (const auto &p : replacements)
+    if (HasAtt(p.first))
+      RemoveAtt(p.first);
+
+  return static_cast<int>(replacements.size());
+}
+
+void PWScore::UndoMergeDuplicateAtts(const SaveAttRefMap &mapSavedAttRefs,
+                                     const AttList &removedAtts)
+{
+  m_attlist.insert(removedAtts.begin(), removedAtts.end());
+
+  for (const auto &p : mapSavedAttRefs) {
+    auto listPos = m_pwlist.find(p.first);
+    if (listPos == m_pwlist.end())
+      continue;
+    CItemData &ci = listPos->second;
+    if (ci.HasAttRef() && HasAtt(ci.GetAttUUID()))
+      RemoveAtt(ci.GetAttUUID()); // the one that was kept
+    ci.SetAttUUID(p.second);
+  }
+  m_bNeedFullSave = true; // attachments aren't journalled
 }
 
 std::set<StringX> PWScore::GetAllMediaTypes() const
@@ -25,6 +25,8 @@
 
 #include "coredefs.h"
 
+#include <unordered_map>
+
 // Parameter list for ParseBaseEntryPWD
 struct BaseEntryParms {
   // All fields except "InputType" are 'output'.
@@ -90,7 +92,9 @@ public:
     OK_WITH_ERRORS,                           //  22
     OK_WITH_VALIDATION_ERRORS,                //  23
     OPEN_NODB,                                //  24
-    MAX_SIZE_EXCEEDED                         //  25
+    MAX_SIZE_EXCEEDED,                        //  25
+    SAVE_IN_PROGRESS,                         //  26
+    CANT_BACKUP                               //  27
   };
 
   PWScore();
@@ -139,6 +143,14 @@ public:
   bool BackupCurFile(unsigned int maxNumIncBackups, int backupSuffix,
                      const stringT &userBackupPrefix,
                      const stringT &userBackupDir, stringT &bu_fname);
+  // BackupCurFile()'s arguments, for ScheduleSave()
+  struct BackupOptions {
+    BackupOptions() : maxNumIncBackups(0), backupSuffix(0) {}
+    unsigned int maxNumIncBackups;
+    int backupSuffix;
+    stringT userBackupPrefix;
+    stringT userBackupDir;
+  };
 
   void NewFile(const StringX &passkey);
   int WriteCurFile() {return WriteFile(m_currfile, m_ReadFileVersion);}
@@ -149,6 +161,32 @@ public:
                       std::vector<StringX> &vEmptyGroups, 
                       bool bExportDBFilters,
                       std::vector<pws_os::CUUID> &vuuidAddedBases, CReport *pRpt = nullptr);
+  // Saves changes to entries since the current file was last read or written
+  // to its journal (see PWSjournal), much faster than WriteCurFile().
+  // Returns NOT_SUCCESS if only WriteCurFile() will do, e.g., after changes
+  // to the header or attachments, or if the journal's grown too long.
+  int WriteCurJournal();
+  // True if the current file has a journal, which WriteCurFile() folds in
+  bool HasJournal() const;
+  // Background saving: ScheduleSave() takes a snapshot of the database
+  // and writes it on another thread, so the caller can carry on editing.
+  // A save requested while one's in progress is coalesced into a single
+  // save of the latest state once the current one's done. When the write's
+  // done, observers get SaveReady() (on the writing thread), after which
+  // CompleteSave() must be called to update the core's state (file
+  // signature, clean/dirty state, etc.) and notify DatabaseSaved().
+  // Formats before V30 are written synchronously.
+  // Given pBackup, the save first takes an intermediate backup of filename
+  // as BackupCurFile() would, but on the writing thread, once for saves
+  // that are coalesced. If that fails, nothing's written, and the save's
+  // status is CANT_BACKUP. If the write fails, the backup's put back.
+  int ScheduleSave(const StringX &filename, PWSfile::VERSION version,
+                   const BackupOptions *pBackup = nullptr);
+  int ScheduleSaveCurFile() {return ScheduleSave(m_currfile, m_ReadFileVersion);}
+  bool IsSaveInProgress() const {return m_pSaveJob != nullptr;}
+  // Returns the status of the save in progress, SUCCESS if there's none, or
+  // SAVE_IN_PROGRESS if bWait is false and it's not done yet.
+  int CompleteSave(bool bWait = true);
   int WriteV17File(const StringX &filename)
   {return WriteFile(filename, PWSfile::V17, false);}
   int WriteV2File(const StringX &filename)
@@ -321,7 +359,9 @@ public:
   Command * GetRedoCommand();
   Command * GetUndoCommand();
 
-  // Find in m_pwlist by group, title and user name, exact match
+  // Find in m_pwlist by group, title and user name, exact match.
+  // Looked up in an index that the Do* functions keep up to date, so
+  // changes to these fields should be made via Commands.
   ItemListIter Find(const StringX &a_group,
                     const StringX &a_title, const StringX &a_user);
   ItemListIter Find(const pws_os::CUUID &entry_uuid)
@@ -438,13 +478,32 @@ public:
 
   uint32 GetHashIters() const;
   void SetHashIters(uint32 value);
+  // Iterations for which unlocking the current file's format takes
+  // about msecs on this machine. Doesn't change m_hashIters.
+  uint32 CalibrateHashIters(uint32 msecs) const;
+  // Only V4 files honour this, see PWSfileV4::SetCipher()
+  PWSfile::Cipher GetCipher() const;
+  void SetCipher(PWSfile::Cipher cipher);
 
   const CItemAtt &GetAtt(const pws_os::CUUID &attuuid) const {return m_attlist.find(attuuid)->second;}
   CItemAtt &GetAtt(const pws_os::CUUID &attuuid) {return m_attlist[attuuid];}
-  void PutAtt(const CItemAtt &att) {m_attlist[att.GetUUID()] = att;}
+  void PutAtt(const CItemAtt &att)
+  {m_attlist[att.GetUUID()] = att; m_attDigests.erase(att.GetUUID()); m_bNeedFullSave = true;}
+  // Drops a reference to the attachment, which is removed with the last
   void RemoveAtt(const pws_os::CUUID &attuuid);
   bool HasAtt(const pws_os::CUUID &attuuid) const {return m_attlist.find(attuuid) != m_attlist.end();}
   AttList::size_type GetNumAtts() const {return m_attlist.size();}
+  // For the UIs' Add/Edit dialogs: gives ci att, as edited, in place of any
+  // attachment it had. If att's shared with other entries, they keep it as
+  // it was, and ci gets a copy with a new UUID. ClearEntryAtt() takes ci's
+  // attachment away, see RemoveAtt().
+  void SetEntryAtt(CItemData &ci, const CItemAtt &att);
+  void ClearEntryAtt(CItemData &ci);
+  // Attachment other than att with the same content, title, file name and
+  // media type as it, or NullUUID. DoAddEntry() and SetEntryAtt() use this
+  // so that entries share such attachments. MergeDuplicateAttsCommand makes
+  // entries with such attachments share one of them.
+  pws_os::CUUID FindDuplicateAtt(const CItemAtt &att) const;
   std::set<StringX> GetAllMediaTypes() const;
   
 protected:
@@ -485,6 +544,11 @@ private:
                                       SavePWHistoryMap &mapSavedHistory);
   virtual void UndoUpdatePasswordHistory(SavePWHistoryMap &mapSavedHistory);
 
+  virtual int DoMergeDuplicateAtts(SaveAttRefMap &mapSavedAttRefs,
+                                   AttList &removedAtts);
+  virtual void UndoMergeDuplicateAtts(const SaveAttRefMap &mapSavedAttRefs,
+                                      const AttList &removedAtts);
+
   virtual int DoRenameGroup(const StringX &sxOldPath, const StringX &sxNewPath,
                             MultiCommands * &pmulticmds);
   virtual void UndoRenameGroup(MultiCommands *pmulticmds);
@@ -503,6 +567,41 @@ private:
   //   This excludes Group Display and RUE List which should not be via 
   //   Commands as no requirement to Undo/Redo and whose save is UI driven.
   void SetInitialValues(); // Called after successful read/write of a database
+  void SetSavedState(); // Marks DB state & Undo/Redo states as clean
+  // As above, for the state after the first savedPos commands of the
+  // Undo/Redo chain. If there's no such state (NO_POSITION), all are dirty.
+  static const size_t NO_POSITION = static_cast<size_t>(-1);
+  void SetSavedState(size_t savedPos);
+  size_t GetCommandPosition() const; // # commands executed & not undone
+
+  // See ScheduleSave()
+  struct SaveJob;
+  void StartSave(const StringX &filename, PWSfile::VERSION version,
+                 const BackupOptions *pBackup);
+  int FinishSave(); // called once m_pSaveJob's thread is done
+
+  // Attachment content that's left in the file it was read from (see
+  // CItemAtt::Read()) is copied from it while saving, which may be
+  // filename, and may fail, so that's done to a temporary file, which
+  // CommitSave() then puts in place of filename.
+  static StringX SaveTarget(const StringX &filename, PWSfile::VERSION version,
+                            const AttList &attlist);
+  static int CommitSave(const StringX &target, const StringX &filename,
+                        bool bOK);
+  // See BackupCurFile(), pFileSig is filename's as last read or written
+  static bool BackupFile(const StringX &filename, PWSFileSig *pFileSig,
+                         const AttList &attlist, const BackupOptions &backup,
+                         stringT &bu_fname);
+  // Points content that was saved from attlist to where it now is, if
+  // it was in filename, or if bAll, e.g., when filename's the saved DB
+  void MoveContent(const AttList &attlist,
+                   const std::map<pws_os::CUUID, long> &offsets,
+                   const StringX &filename, PWSfile::Cipher cipher, bool bAll);
+
+  // Fingerprints of the entries as saved, to find those changed since,
+  // see WriteCurJournal(). Only kept if the UseChangeJournal pref is set.
+  void SetJournalFingerprints() {SetJournalFingerprints(m_pwlist, m_attlist);}
+  void SetJournalFingerprints(const ItemList &pwlist, const AttList &attlist);
 
   // Update header
   int SetHeaderItem(const StringX &sxNewValue, PWSfile::HeaderType ht);
@@ -524,6 +623,7 @@ private:
 
   //*****
 
+  // Adds ci_temp to the list by moving it, leaving it to be Clear()ed
   void ProcessReadEntry(CItemData &ci_temp,
                         std::vector<st_GroupTitleUser> &vGTU_INVALID_UUID,
                         std::vector<st_GroupTitleUser> &vGTU_DUPLICATE_UUID,
@@ -551,6 +651,7 @@ private:
   size_t m_passkey_len; // Length of cleartext passkey
 
   uint32 m_hashIters; // for new or currently open db.
+  PWSfile::Cipher m_cipher; // ditto
 
   static unsigned char m_session_key[32];
   static bool m_session_initialized;
@@ -560,6 +661,20 @@ private:
 
   stringT m_AppNameAndVersion;
   PWSfile::VERSION m_ReadFileVersion;
+  // Set by a successful CheckPasskey(), consumed by the next ReadFile()
+  PWSfile::VerifiedKey m_verifiedKey;
+
+  // See WriteCurJournal()
+  struct JournalFP {
+    CItemData::EntryType et;
+    unsigned char fp[SHA256::HASHLEN];
+  };
+  PWSfile::JournalBinding m_journal; // for m_journalFile as last read/written
+  StringX m_journalFile;
+  std::map<pws_os::CUUID, JournalFP> m_journalFPs; // as in file + journal
+  UUIDSet m_journalAtts;
+  bool m_bJournalFPs; // above are valid
+  bool m_bNeedFullSave; // e.g., changes that a journal can't hold
 
   bool m_bIsReadOnly;
   bool m_bUniqueGTUValidated;
@@ -577,6 +692,26 @@ private:
 
   // Attachments, if any
   AttList m_attlist;
+  // Keyed digests of their content, computed when needed, see
+  // FindDuplicateAtt(). The key's per session, as m_session_key.
+  bool GetAttDigest(const CItemAtt &att, std::vector<unsigned char> &digest) const;
+  mutable std::map<pws_os::CUUID, std::vector<unsigned char>> m_attDigests;
+  static unsigned char m_attDigestKey[32];
+
+  // Index of m_pwlist by a keyed digest of group, title and user, for
+  // Find(group, title, user). Built when first needed, kept up to date by
+  // the Do* functions and ReindexEntry(), and dropped by anything else
+  // that changes m_pwlist. Digests can collide, so Find() checks the fields.
+  static uint64 GTUKey(const StringX &group, const StringX &title,
+                       const StringX &user);
+  void BuildGTUIndex();
+  void IndexEntry(const CItemData &ci);
+  void UnindexEntry(const pws_os::CUUID &entry_uuid);
+  void InvalidateGTUIndex();
+  std::unordered_multimap<uint64, pws_os::CUUID> m_GTUIndex;
+  std::map<pws_os::CUUID, uint64> m_GTUKeys; // to unindex an entry
+  bool m_bGTUIndexValid;
+  static unsigned char m_GTUKeyKey[32];
   
   // Alias/Shortcut structures
   // Permanent Multimap: since potentially more than one alias/shortcut per base
@@ -634,6 +769,14 @@ private:
   static Asker *m_pAsker;
   PWSFileSig *m_pFileSig;
 
+  // See ScheduleSave()
+  SaveJob *m_pSaveJob; // save in progress, if any
+  StringX m_pendingSaveFile; // save requested while m_pSaveJob in progress
+  PWSfile::VERSION m_pendingSaveVersion;
+  bool m_bSavePending;
+  bool m_bPendingBackup; // if any save that's pending asked for one
+  BackupOptions m_pendingBackup;
+
   // Entries with an expiry date
   ExpiredList m_ExpireCandidates;
   void AddExpiryEntry(const CItemData &ci)
@@ -645,6 +788,9 @@ private:
   void RemoveExpiryEntry(const CItemData &ci)
   {m_ExpireCandidates.Remove(ci);}
 
+  // Entry's group, title or user has been changed in place
+  void ReindexEntry(const pws_os::CUUID &entry_uuid);
+
   stringT GetXMLPWPolicies(const OrderedItemList *pOIL = nullptr);
   PSWDPolicyMap m_MapPSWDPLC;
   PSWDPolicyMap m_InitialMapPSWDPLC;  // Needed for HavePasswordPolicyNamesChanged
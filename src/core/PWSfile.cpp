@@ -12,21 +12,29 @@
 #include "SysInfo.h"
 #include "core.h"
 #include "os/file.h"
+#include "os/mem.h"
 #include "os/dir.h"  // for splitpath
 
 #include "crypto/sha1.h" // for simple encrypt/decrypt
+#include "crypto/hmac.h"
 #include "PWSrand.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <limits>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <system_error>
+#include <thread>
 
 PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
                               VERSION &version, RWmode mode, int &status,
                               Asker *pAsker, Reporter *pReporter)
 {
   PWSfile *retval = nullptr;
+  VerifiedKey vk;
 
   if (mode == Read && !pws_os::FileExists(a_filename.c_str())) {
     status = CANT_OPEN_FILE;
@@ -49,7 +57,9 @@ PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
       break;
     case UNKNOWN_VERSION:
       ASSERT(mode == Read);
-      version = PWSfile::ReadVersion(a_filename, passkey);
+      // ReadVersion may need to derive the key to identify a V4 file,
+      // so keep the result for Open()
+      version = PWSfile::ReadVersion(a_filename, passkey, &vk);
       switch (version) {
       case V40:
         status = SUCCESS;
@@ -80,31 +90,215 @@ PWSfile *PWSfile::MakePWSfile(const StringX &a_filename, const StringX &passkey,
   if (retval != nullptr) {
     retval->m_pAsker = pAsker;
     retval->m_pReporter = pReporter;
+    if (vk.IsValid())
+      retval->SetVerifiedKey(vk);
   }
   return retval;
 }
 
-PWSfile::VERSION PWSfile::ReadVersion(const StringX &filename, const StringX &passkey)
+PWSfile::VERSION PWSfile::ReadVersion(const StringX &filename, const StringX &passkey,
+                                      VerifiedKey *pvk)
 {
+  // V1V2 check is cheap, V4's runs the KDF, so V4 goes last
   if (pws_os::FileExists(filename.c_str())) {
     VERSION v;
     if (PWSfileV3::IsV3x(filename, v))
       return v;
-    else if (PWSfileV4::IsV4x(filename, passkey, v))
-      return v;
     else if (PWSfileV1V2::CheckPasskey(filename, passkey) == SUCCESS)
       return V20;
+    else if (PWSfileV4::IsV4x(filename, passkey, v, pvk))
+      return v;
     else
       return UNKNOWN_VERSION;
   } else
     return UNKNOWN_VERSION;
 }
 
+PWSfile::VerifiedKey::VerifiedKey()
+  : m_version(UNKNOWN_VERSION), m_nHashIters(0), m_cipher(PWTwoFish)
+{
+  memset(m_key, 0, sizeof(m_key));
+  memset(m_ell, 0, sizeof(m_ell));
+}
+
+PWSfile::VerifiedKey::VerifiedKey(const VerifiedKey &that)
+  : m_filename(that.m_filename), m_passkey(that.m_passkey),
+    m_version(that.m_version), m_nHashIters(that.m_nHashIters),
+    m_cipher(that.m_cipher)
+{
+  memcpy(m_key, that.m_key, sizeof(m_key));
+  memcpy(m_ell, that.m_ell, sizeof(m_ell));
+}
+
+PWSfile::VerifiedKey &PWSfile::VerifiedKey::operator=(const VerifiedKey &that)
+{
+  if (this != &that) {
+    m_filename = that.m_filename;
+    m_passkey = that.m_passkey;
+    m_version = that.m_version;
+    m_nHashIters = that.m_nHashIters;
+    m_cipher = that.m_cipher;
+    memcpy(m_key, that.m_key, sizeof(m_key));
+    memcpy(m_ell, that.m_ell, sizeof(m_ell));
+  }
+  return *this;
+}
+
+PWSfile::VerifiedKey::~VerifiedKey()
+{
+  trashMemory(m_key, sizeof(m_key));
+  trashMemory(m_ell, sizeof(m_ell));
+}
+
+void PWSfile::VerifiedKey::Set(const StringX &filename, const StringX &passkey,
+                               VERSION version, uint32 nHashIters,
+                               const unsigned char *key, const unsigned char *ell,
+                               Cipher cipher)
+{
+  m_filename = filename;
+  m_passkey = passkey;
+  m_version = version;
+  m_nHashIters = nHashIters;
+  m_cipher = cipher;
+  if (key != nullptr)
+    memcpy(m_key, key, sizeof(m_key));
+  else
+    memset(m_key, 0, sizeof(m_key));
+  if (ell != nullptr)
+    memcpy(m_ell, ell, sizeof(m_ell));
+  else
+    memset(m_ell, 0, sizeof(m_ell));
+}
+
+void PWSfile::VerifiedKey::Clear()
+{
+  m_filename = m_passkey = _T("");
+  m_version = UNKNOWN_VERSION;
+  m_nHashIters = 0;
+  m_cipher = PWTwoFish;
+  trashMemory(m_key, sizeof(m_key));
+  trashMemory(m_ell, sizeof(m_ell));
+}
+
+bool PWSfile::VerifiedKey::Matches(const StringX &filename, const StringX &passkey) const
+{
+  return IsValid() && m_filename == filename && m_passkey == passkey;
+}
+
+const PWSfile::VerifiedKey *PWSfile::GetVerifiedKey() const
+{
+  if (m_rw == Read && m_vk.GetVersion() == m_curversion &&
+      m_vk.Matches(m_filename, m_passkey))
+    return &m_vk;
+  else
+    return nullptr;
+}
+
+PWSfile::JournalBinding::JournalBinding()
+  : m_valid(false), m_cipher(PWTwoFish), m_length(0)
+{
+  memset(m_digest, 0, sizeof(m_digest));
+  memset(m_ekey, 0, sizeof(m_ekey));
+  memset(m_akey, 0, sizeof(m_akey));
+  memset(m_mac, 0, sizeof(m_mac));
+}
+
+PWSfile::JournalBinding::JournalBinding(const JournalBinding &that)
+  : m_valid(that.m_valid), m_cipher(that.m_cipher), m_length(that.m_length)
+{
+  memcpy(m_digest, that.m_digest, sizeof(m_digest));
+  memcpy(m_ekey, that.m_ekey, sizeof(m_ekey));
+  memcpy(m_akey, that.m_akey, sizeof(m_akey));
+  memcpy(m_mac, that.m_mac, sizeof(m_mac));
+}
+
+PWSfile::JournalBinding &PWSfile::JournalBinding::operator=(const JournalBinding &that)
+{
+  if (this != &that) {
+    m_valid = that.m_valid;
+    m_cipher = that.m_cipher;
+    m_length = that.m_length;
+    memcpy(m_digest, that.m_digest, sizeof(m_digest));
+    memcpy(m_ekey, that.m_ekey, sizeof(m_ekey));
+    memcpy(m_akey, that.m_akey, sizeof(m_akey));
+    memcpy(m_mac, that.m_mac, sizeof(m_mac));
+  }
+  return *this;
+}
+
+PWSfile::JournalBinding::~JournalBinding()
+{
+  trashMemory(m_ekey, sizeof(m_ekey));
+  trashMemory(m_akey, sizeof(m_akey));
+}
+
+void PWSfile::JournalBinding::Set(const unsigned char *fileKey, size_t keyLen,
+                                  const unsigned char *digest, Cipher cipher)
+{
+  // Journal keys are HMAC(K, label | file HMAC), so that neither K nor
+  // the file's own keys are used directly, and a journal written against
+  // one version of the file can't be applied to another.
+  static const unsigned char EKEY_LABEL[] = "PWS journal E";
+  static const unsigned char AKEY_LABEL[] = "PWS journal A";
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+
+  hmac.Init(fileKey, static_cast<unsigned long>(keyLen));
+  hmac.Update(EKEY_LABEL, sizeof(EKEY_LABEL) - 1);
+  hmac.Update(digest, LEN);
+  hmac.Final(m_ekey);
+
+  hmac.Init(fileKey, static_cast<unsigned long>(keyLen));
+  hmac.Update(AKEY_LABEL, sizeof(AKEY_LABEL) - 1);
+  hmac.Update(digest, LEN);
+  hmac.Final(m_akey);
+
+  memcpy(m_digest, digest, LEN);
+  m_cipher = cipher;
+  m_length = 0;
+  memset(m_mac, 0, sizeof(m_mac));
+  m_valid = true;
+}
+
+void PWSfile::JournalBinding::Clear()
+{
+  m_valid = false;
+  m_cipher = PWTwoFish;
+  m_length = 0;
+  memset(m_digest, 0, sizeof(m_digest));
+  trashMemory(m_ekey, sizeof(m_ekey));
+  trashMemory(m_akey, sizeof(m_akey));
+  memset(m_mac, 0, sizeof(m_mac));
+}
+
+void PWSfile::BindJournal(const unsigned char *fileKey, size_t keyLen,
+                          const unsigned char *digest)
+{
+  unsigned char d[JournalBinding::LEN];
+  if (digest == nullptr) {
+    // Peek at the HMAC at the end of the file, leaving m_fd where it was
+    const long pos = ftell(m_fd);
+    const bool ok = (pos >= 0 &&
+                     fseek(m_fd, -long(sizeof(d)), SEEK_END) == 0 &&
+                     fread(d, sizeof(d), 1, m_fd) == 1);
+    if (pos >= 0)
+      fseek(m_fd, pos, SEEK_SET);
+    if (!ok) {
+      m_jb.Clear();
+      return;
+    }
+    digest = d;
+  }
+  m_jb.Set(fileKey, keyLen, digest, GetCipher());
+}
+
 PWSfile::PWSfile(const StringX &filename, RWmode mode, VERSION v)
   : m_filename(filename), m_passkey(_T("")), m_fd(nullptr),
   m_curversion(v), m_rw(mode), m_defusername(_T("")),
   m_fish(nullptr), m_terminal(nullptr), m_status(SUCCESS),
-  m_nRecordsWithUnknownFields(0)
+  m_nRecordsWithUnknownFields(0),
+  m_preCT(nullptr), m_preLen(0), m_preDK(nullptr), m_preDKLen(0),
+  m_prePos(0), m_preDone(0), m_preBase(0),
+  m_preMap(nullptr), m_viewBuf(nullptr), m_viewLen(0), m_outLen(0)
 {
 }
 
@@ -129,6 +323,51 @@ void PWSfile::HashRandom256(unsigned char *p256)
   salter.Final(p256);
 }
 
+uint32 PWSfile::CalibrateHashIters(VERSION version, uint32 msecs)
+{
+  switch (version) {
+  case V30:
+    return PWSfileV3::CalibrateHashIters(msecs);
+  case V40:
+    return PWSfileV4::CalibrateHashIters(msecs);
+  default: // iteration count's fixed for V1V2
+    return MIN_HASH_ITERATIONS;
+  }
+}
+
+uint32 PWSfile::TimeHashIters(uint32 msecs,
+                              const std::function<void(uint32 N)> &stretch)
+{
+  /**
+   * Run stretch() with doubling iteration counts until a run takes long
+   * enough for timer resolution and scheduling noise not to matter, then
+   * extrapolate linearly (the KDFs' cost is linear in N) to msecs.
+   * The sample is capped so that calibrating for a long unlock time
+   * doesn't take that long itself.
+   */
+  typedef std::chrono::steady_clock Clock;
+  const double sample = std::max(10.0, std::min(100.0, msecs / 4.0));
+  const uint32 maxN = std::numeric_limits<uint32>::max();
+
+  uint32 N = MIN_HASH_ITERATIONS;
+  double elapsed;
+  for (;;) {
+    const Clock::time_point start = Clock::now();
+    stretch(N);
+    elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    if (elapsed >= sample || N > maxN / 2)
+      break;
+    N *= 2;
+  }
+
+  const double target = (elapsed > 0) ? N * (msecs / elapsed) : maxN;
+  if (target <= MIN_HASH_ITERATIONS)
+    return MIN_HASH_ITERATIONS;
+  if (target >= maxN)
+    return maxN;
+  return static_cast<uint32>(target);
+}
+
 void PWSfile::FOpen()
 {
   ASSERT(!m_filename.empty());
@@ -143,23 +382,108 @@ void PWSfile::FOpen()
 
 int PWSfile::Close()
 {
+  UnloadCBC();
+  int rc(SUCCESS);
+  if (!FlushCBC())
+    rc = FAILURE;
+  ReleaseOutBuf();
   delete m_fish;
   m_fish = nullptr;
-  int rc(SUCCESS);
+  m_vk.Clear();
 
   if (m_fd != nullptr) {
-    rc = pws_os::FClose(m_fd, m_rw == Write);
+    const int frc = pws_os::FClose(m_fd, m_rw == Write);
+    if (rc == SUCCESS)
+      rc = frc;
     m_fd = nullptr;
   }
 
   return rc;
 }
 
+// Large enough for many records per write, small enough to lock
+static const size_t OUTBUF_SIZE = 256 * 1024;
+
 size_t PWSfile::WriteCBC(unsigned char type, const unsigned char *data,
                          size_t length)
 {
+  // Same layout as _writecbc(), but into m_outBuf, see FlushCBC()
   ASSERT(m_fish != nullptr && m_IV != nullptr);
-  return _writecbc(m_fd, data, length, type, m_fish, m_IV);
+  const unsigned int BS = m_fish->GetBlockSize();
+  unsigned char block[16];
+  ASSERT(BS <= sizeof(block));
+
+  if (m_outBuf.empty()) {
+    m_outBuf.resize(OUTBUF_SIZE);
+    pws_os::mlock(m_outBuf.data(), m_outBuf.size());
+  }
+
+  // Length block: length, type, and for BS == 16, the first 11 bytes
+  PWSrand::GetInstance()->GetRandomData(block, BS);
+  putInt32(block, static_cast<int32>(length));
+  block[sizeof(int32)] = type;
+  if (BS == 16) {
+    const size_t len1 = (length > 11) ? 11 : length;
+    memcpy(block + 5, data, len1);
+    length -= len1;
+    data += len1;
+  }
+  BufferCBC(block, BS);
+  size_t numWritten = BS;
+
+  if (length > 0 ||
+      (BS == 8 && length == 0)) { // This part for bwd compat w/pre-3 format
+    const size_t wholeLength = (length / BS) * BS;
+    BufferCBC(data, wholeLength);
+    numWritten += wholeLength;
+    if (length == 0 || wholeLength != length) {
+      // Uneven last block (or an empty pre-3 one), padded with random data
+      PWSrand::GetInstance()->GetRandomData(block, BS);
+      memcpy(block, data + wholeLength, length - wholeLength);
+      BufferCBC(block, BS);
+      numWritten += BS;
+    }
+  }
+  trashMemory(block, sizeof(block));
+  return numWritten;
+}
+
+void PWSfile::BufferCBC(const unsigned char *data, size_t length)
+{
+  while (length > 0) {
+    if (m_outLen == m_outBuf.size() && !FlushCBC())
+      throw(EIO); // as _writecbc()
+    const size_t n = std::min(length, m_outBuf.size() - m_outLen);
+    memcpy(m_outBuf.data() + m_outLen, data, n);
+    m_outLen += n;
+    data += n;
+    length -= n;
+  }
+}
+
+bool PWSfile::FlushCBC()
+{
+  if (m_outLen == 0)
+    return true;
+  ASSERT(m_fish != nullptr && m_IV != nullptr && m_fd != nullptr);
+  const unsigned int BS = m_fish->GetBlockSize();
+  ASSERT(m_outLen % BS == 0);
+  m_fish->CBCEncrypt(m_outBuf.data(), m_outLen / BS, m_IV); // also updates m_IV
+  const size_t numWritten = fwrite(m_outBuf.data(), 1, m_outLen, m_fd);
+  trashMemory(m_outBuf.data(), m_outLen);
+  const bool retval = (numWritten == m_outLen);
+  m_outLen = 0;
+  return retval;
+}
+
+void PWSfile::ReleaseOutBuf()
+{
+  if (m_outBuf.empty())
+    return;
+  trashMemory(m_outBuf.data(), m_outBuf.size());
+  pws_os::munlock(m_outBuf.data(), m_outBuf.size());
+  std::vector<unsigned char>().swap(m_outBuf);
+  m_outLen = 0;
 }
 
 size_t PWSfile::ReadCBC(unsigned char &type, unsigned char* &data,
@@ -170,8 +494,16 @@ size_t PWSfile::ReadCBC(unsigned char &type, unsigned char* &data,
   size_t retval;
 
   ASSERT(m_fish != nullptr && m_IV != nullptr);
-  retval = _readcbc(m_fd, buffer, buffer_len, type,
-    m_fish, m_IV, m_terminal, m_fileLength);
+  if (IsPreloaded()) {
+    const unsigned char *view;
+    retval = ReadPreloadedCBC(type, view, buffer_len);
+    if (buffer_len > 0) {
+      buffer = new unsigned char[buffer_len];
+      memcpy(buffer, view, buffer_len);
+    }
+  } else
+    retval = _readcbc(m_fd, buffer, buffer_len, type,
+                      m_fish, m_IV, m_terminal, m_fileLength);
 
   if (buffer_len > 0) {
     if (buffer_len < length || data == nullptr)
@@ -189,34 +521,56 @@ size_t PWSfile::ReadCBC(unsigned char &type, unsigned char* &data,
     // no need to delete[] buffer, since _readcbc will not allocate if
     // buffer_len is zero
   }
+  if (retval > 0)
+    DigestField(type, data, length);
   return retval;
 }
 
-int PWSfile::CheckPasskey(const StringX &filename, const StringX &passkey, VERSION &version)
+int PWSfile::CheckPasskey(const StringX &filename, const StringX &passkey,
+                          VERSION &version, VerifiedKey *pvk)
 {
   /**
-   * We start with V3 because it's the quickest to rule out
-   * due to header/footer.
-   * V4 can take a looong time if the iter value's too big.
+   * A V3 file is identified by its tag, so we only run the V3 check
+   * on a tagged file, and never on anything else. Of the untagged formats,
+   * V1V2 is cheap to check, whereas V4 can take a looong time if the iter
+   * value's too big, so V4 goes last. This way at most one KDF is run.
    * XXX Need to address this later with a popup prompting the user.
+   *
+   * If pvk is non-null, it's set to the derived key on success, so that
+   * a subsequent Open() needn't derive it again.
    */
+  if (pvk != nullptr)
+    pvk->Clear();
+
   if (passkey.empty())
     return WRONG_PASSWORD;
 
+  if (!pws_os::FileExists(filename.c_str()))
+    return CANT_OPEN_FILE;
+
   int status;
   version = UNKNOWN_VERSION;
-  status = PWSfileV3::CheckPasskey(filename, passkey);
-  if (status == SUCCESS) {
-    version = V30;
+  VERSION v;
+  if (PWSfileV3::IsV3x(filename, v)) {
+    unsigned char Ptag[SHA256::HASHLEN];
+    uint32 nIter = 0;
+    status = PWSfileV3::CheckPasskey(filename, passkey, nullptr, Ptag, &nIter);
+    if (status == SUCCESS) {
+      version = V30;
+      if (pvk != nullptr)
+        pvk->Set(filename, passkey, V30, nIter, Ptag);
+    }
+    trashMemory(Ptag, sizeof(Ptag));
   } else {
-    status = PWSfileV4::CheckPasskey(filename, passkey);
-    if (status == SUCCESS)
+    status = PWSfileV1V2::CheckPasskey(filename, passkey);
+    if (status == SUCCESS) {
+      version = V20; // or V17?
+      if (pvk != nullptr)
+        pvk->Set(filename, passkey, V20);
+    } else if (PWSfileV4::CheckPasskey(filename, passkey, nullptr, pvk) == SUCCESS) {
+      status = SUCCESS;
       version = V40;
-    else {
-      status = PWSfileV1V2::CheckPasskey(filename, passkey);
-      if (status == SUCCESS)
-        version = V20; // or V17?
-    }
+    } // else report V1V2's status, as we always have
   }
   return status;
 }
@@ -239,11 +593,255 @@ void PWSfile::SetUnknownHeaderFields(UnknownFieldList &UHFL)
 
 long PWSfile::GetOffset() const
 {
+  if (IsPreloaded())
+    return m_preBase + static_cast<long>(m_prePos);
   long retval = ftell(m_fd);
   ASSERT(ulong64(retval) <= pws_os::fileLength(m_fd));
   return retval;
 }
 
+void PWSfile::SetOffset(long offset)
+{
+  if (IsPreloaded()) {
+    ASSERT(offset >= m_preBase && size_t(offset - m_preBase) <= m_preLen);
+    m_prePos = static_cast<size_t>(offset - m_preBase);
+  } else {
+    int seekstat = fseek(m_fd, offset, SEEK_SET);
+    if (seekstat != 0)
+      ASSERT(0);
+  }
+}
+
+// Blocks decrypted per thread at a time, see DecryptPreloaded()
+static const size_t PRE_CHUNK_BLOCKS = 4096;
+
+bool PWSfile::PreloadCBC(ulong64 end)
+{
+  ASSERT(m_fd != nullptr && m_fish != nullptr && m_rw == Read);
+  const unsigned int BS = m_fish->GetBlockSize();
+  const long base = ftell(m_fd);
+  if (base < 0 || ulong64(base) >= end || end != size_t(end))
+    return false;
+  const size_t len = static_cast<size_t>(end - base);
+  const size_t nblocks = len / BS;
+  if (nblocks == 0)
+    return false;
+
+  // On failure, UnloadCBC() puts m_fd back to base
+  m_preBase = base;
+  m_prePos = m_preDone = 0;
+  m_preLen = len;
+  m_preMap = pws_os::MapFile(m_fd, end);
+  try {
+    if (m_preMap != nullptr) {
+      m_preCT = m_preMap + base;
+    } else {
+      m_preBuf.resize(len);
+      m_preCT = m_preBuf.data();
+      if (fread(m_preBuf.data(), 1, len, m_fd) != len) {
+        UnloadCBC();
+        return false;
+      }
+    }
+    // Not initialised, so that pages that are never decrypted into
+    // (e.g., under V4 attachment content) needn't ever be committed
+    m_preDK = new unsigned char[nblocks * BS];
+    m_preDKLen = nblocks * BS;
+    m_preChunkDone.assign((nblocks + PRE_CHUNK_BLOCKS - 1) / PRE_CHUNK_BLOCKS,
+                          false);
+  } catch (std::bad_alloc &) {
+    UnloadCBC();
+    return false;
+  }
+  return true;
+}
+
+void PWSfile::DecryptPreloaded(size_t from, size_t to)
+{
+  /**
+   * Each plaintext block is D(C[i]) ^ C[i-1], so the expensive part's
+   * independent for every block. It's done here a chunk at a time, for the
+   * chunks holding [from, to) and enough after them for one chunk per
+   * core, in parallel, leaving the xor to ReadPreloadedCBC(), which knows
+   * what each block's chained to (not always the block before it in V4,
+   * where attachment content's encrypted separately). Decrypting on
+   * demand rather than all at once means content that's skipped, rather
+   * than read (see PWSfileV4::SkipContent()), is mostly left alone.
+   */
+  const unsigned int BS = m_fish->GetBlockSize();
+  const size_t chunkLen = PRE_CHUNK_BLOCKS * BS;
+  const size_t nchunks = m_preChunkDone.size();
+  if (to <= from || from >= m_preDKLen)
+    return;
+  const size_t first = from / chunkLen;
+  const size_t needed = std::min((to - 1) / chunkLen, nchunks - 1);
+
+  bool done = true;
+  for (size_t c = first; c <= needed && done; c++)
+    done = m_preChunkDone[c];
+  if (done)
+    return;
+
+  const size_t ncores = std::max(1U, std::thread::hardware_concurrency());
+  const size_t last = std::min(std::max(needed, first + ncores - 1),
+                               nchunks - 1);
+  std::vector<size_t> todo;
+  for (size_t c = first; c <= last; c++)
+    if (!m_preChunkDone[c])
+      todo.push_back(c);
+
+  const Fish *fish = m_fish;
+  const unsigned char *ct = m_preCT;
+  unsigned char *dk = m_preDK;
+  const size_t dklen = m_preDKLen;
+  auto decrypt = [=](size_t c) {
+    const size_t offset = c * chunkLen;
+    const size_t len = std::min(chunkLen, dklen - offset);
+    // Best effort, as elsewhere: keep what's about to be plaintext off swap
+    pws_os::mlock(dk + offset, len);
+    fish->DecryptBlocks(ct + offset, dk + offset, len / BS);
+  };
+
+  std::vector<std::thread> threads;
+  size_t i = 1; // this thread does the first chunk
+  for (; i < todo.size(); i++) {
+    try {
+      threads.emplace_back(decrypt, todo[i]);
+    } catch (std::system_error &) {
+      break; // do the rest here
+    }
+  }
+  decrypt(todo[0]);
+  for (; i < todo.size(); i++)
+    decrypt(todo[i]);
+  for (auto &thread : threads)
+    thread.join();
+  for (auto c : todo)
+    m_preChunkDone[c] = true;
+}
+
+void PWSfile::UnloadCBC()
+{
+  if (m_viewBuf != nullptr) {
+    trashMemory(m_viewBuf, m_viewLen);
+    delete[] m_viewBuf;
+    m_viewBuf = nullptr;
+    m_viewLen = 0;
+  }
+  if (!IsPreloaded())
+    return;
+  if (m_preDK != nullptr) {
+    const size_t chunkLen = PRE_CHUNK_BLOCKS * m_fish->GetBlockSize();
+    for (size_t c = 0; c < m_preChunkDone.size(); c++) {
+      if (m_preChunkDone[c]) {
+        const size_t len = std::min(chunkLen, m_preDKLen - c * chunkLen);
+        trashMemory(m_preDK + c * chunkLen, len);
+        pws_os::munlock(m_preDK + c * chunkLen, len);
+      }
+    }
+    delete[] m_preDK;
+    m_preDK = nullptr;
+  }
+  // Set m_fd to where we've got to, e.g., for V3's HMAC
+  if (m_fd != nullptr)
+    fseek(m_fd, m_preBase + static_cast<long>(m_prePos), SEEK_SET);
+  if (m_preMap != nullptr) {
+    pws_os::UnmapFile(m_preMap, ulong64(m_preBase) + m_preLen);
+    m_preMap = nullptr;
+  }
+  std::vector<unsigned char>().swap(m_preBuf);
+  std::vector<bool>().swap(m_preChunkDone);
+  m_preCT = nullptr;
+  m_preLen = m_prePos = m_preDone = m_preDKLen = 0;
+}
+
+size_t PWSfile::ReadPreloadedCBC(unsigned char &type,
+                                 const unsigned char* &data, size_t &length)
+{
+  // Same as _readcbc(), with the block cipher already applied, leaving
+  // the field's data in place in m_preDK. That's contiguous, as the
+  // length block holds the first bytes after the length and type.
+  // Only used for V3 and later, so BS is 16.
+  const unsigned int BS = m_fish->GetBlockSize();
+  ASSERT(BS == 16);
+  const size_t avail = m_preDKLen - std::min(m_prePos, m_preDKLen);
+
+  // Blocks may be read more than once, if V4 restores a saved position.
+  // Chaining gives the same result each time, so only xor them once.
+  auto cbc = [this, BS](size_t nblocks) {
+    for (size_t i = 0; i < nblocks; i++, m_prePos += BS) {
+      if (m_prePos >= m_preDone) {
+        unsigned char *out = &m_preDK[m_prePos];
+        for (unsigned j = 0; j < BS; j++)
+          out[j] ^= m_IV[j];
+        m_preDone = m_prePos + BS;
+      }
+      memcpy(m_IV, m_preCT + m_prePos, BS);
+    }
+  };
+
+  data = nullptr;
+  length = 0;
+  if (avail < BS)
+    return 0;
+
+  if (m_terminal != nullptr &&
+      memcmp(m_preCT + m_prePos, m_terminal, BS) == 0) {
+    m_prePos += BS;
+    return static_cast<size_t>(-1);
+  }
+
+  DecryptPreloaded(m_prePos, m_prePos + BS);
+  const unsigned char *lengthblock = &m_preDK[m_prePos];
+  cbc(1);
+  size_t numRead = BS;
+
+  length = getInt32(lengthblock);
+  type = lengthblock[sizeof(int32)]; // type is first byte after the length
+
+  if (m_fileLength != 0 && length >= m_fileLength) {
+    pws_os::Trace0(_T("ReadPreloadedCBC: Read size larger than file length - aborting\n"));
+    length = 0;
+    return 0;
+  }
+
+  // length block contains up to 11 (= 16 - 4 - 1) bytes of data
+  const size_t len1 = (length > 11) ? 11 : length;
+  // A truncated file gives a short read, as from _readcbc()
+  const size_t BlockLength = std::min(((length - len1 + (BS - 1)) / BS) * BS,
+                                      avail - BS);
+  DecryptPreloaded(m_prePos, m_prePos + BlockLength);
+  cbc(BlockLength / BS);
+  numRead += BlockLength;
+  length = std::min(length, len1 + BlockLength);
+  if (length > 0)
+    data = lengthblock + sizeof(int32) + 1;
+  return numRead;
+}
+
+size_t PWSfile::ReadFieldView(unsigned char &type,
+                              const unsigned char* &data, size_t &length)
+{
+  if (!IsPreloaded()) {
+    if (m_viewBuf != nullptr) {
+      trashMemory(m_viewBuf, m_viewLen);
+      delete[] m_viewBuf;
+    }
+    m_viewBuf = nullptr;
+    m_viewLen = 0;
+    const size_t numRead = ReadCBC(type, m_viewBuf, m_viewLen);
+    data = m_viewBuf;
+    length = m_viewLen;
+    return numRead;
+  }
+
+  ASSERT(m_fish != nullptr && m_IV != nullptr);
+  const size_t numRead = ReadPreloadedCBC(type, data, length);
+  if (numRead > 0)
+    DigestField(type, data, length);
+  return numRead;
+}
+
 // Following for 'legacy' use of pwsafe as file encryptor/decryptor
 // this is for the undocumented 'command line file encryption'
 static const stringT CIPHERTEXT_SUFFIX(_S(".PSF"));
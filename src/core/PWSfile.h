@@ -15,6 +15,7 @@
 
 #include <stdio.h> // for FILE *
 #include <vector>
+#include <functional>
 
 #include "ItemData.h"
 #include "os/UUID.h"
@@ -33,7 +34,11 @@
 #define MIN_HASH_ITERATIONS 2048
 // MAX_USABLE_HASH_ITERS is a guesstimate on what's acceptable to a user
 // with a reasonably powerful CPU. Real limit's 2^32-1.
+// PWSfile::CalibrateHashIters() finds the value for a given unlock time
+// on the current machine instead.
 #define MAX_USABLE_HASH_ITERS (1 << 22)
+// Suggested target for PWSfile::CalibrateHashIters(), in milliseconds
+#define DEFAULT_UNLOCK_MSECS 500
 
 #define V3_SUFFIX      _T("psafe3")
 #define V4_SUFFIX      _T("psafe4")
@@ -52,6 +57,10 @@ public:
 
   enum RWmode {Read, Write};
 
+  // Block cipher for the database proper. Only V4 lets the user choose,
+  // earlier formats are TwoFish (BlowFish for V1 & V2) regardless.
+  enum Cipher {PWTwoFish, PWAES};
+
   enum {SUCCESS = 0, FAILURE = 1, 
     UNSUPPORTED_VERSION,                     //  2
     WRONG_VERSION,                           //  3
@@ -97,13 +106,96 @@ public:
                    HDR_LAST,                             // Start of unknown fields!
                    HDR_END                   = 0xff};    // header field types, per formatV{2,3}.txt
 
+  /**
+  * A VerifiedKey is filled in by a successful CheckPasskey(), and holds
+  * the result of the expensive key derivation (P' for V3, K & L for V4).
+  * Handing it to a PWSfile opened for read on the same file with the same
+  * passkey allows Open() to skip the KDF. The key is still verified against
+  * the file, so a stale VerifiedKey only costs a fallback to the slow path.
+  * Key material is trashed by Clear() and the d'tor.
+  */
+  class VerifiedKey
+  {
+  public:
+    VerifiedKey();
+    VerifiedKey(const VerifiedKey &that);
+    VerifiedKey &operator=(const VerifiedKey &that);
+    ~VerifiedKey();
+
+    void Set(const StringX &filename, const StringX &passkey,
+             VERSION version, uint32 nHashIters = 0,
+             const unsigned char *key = nullptr,
+             const unsigned char *ell = nullptr,
+             Cipher cipher = PWTwoFish);
+    void Clear();
+    bool IsValid() const {return m_version != UNKNOWN_VERSION;}
+    bool Matches(const StringX &filename, const StringX &passkey) const;
+    VERSION GetVersion() const {return m_version;}
+
+    enum {KEYLEN = 32};
+  private:
+    friend class PWSfileV3;
+    friend class PWSfileV4;
+    StringX m_filename;
+    StringX m_passkey;
+    VERSION m_version;
+    uint32 m_nHashIters;
+    Cipher m_cipher; // V4: the one that unwrapped K & L
+    unsigned char m_key[KEYLEN]; // V3: P', V4: K
+    unsigned char m_ell[KEYLEN]; // V4: L
+  };
+
+  /**
+  * A JournalBinding ties a journal of changes (see PWSjournal) to the
+  * V3 or V4 file it applies to. It's filled in when such a file's been
+  * opened for read, or written and closed: it identifies the file's
+  * contents by the HMAC at its end, and holds keys for the journal
+  * derived from the file's key and that HMAC, so a journal's useless
+  * for any other file, or version of the same file.
+  * PWSjournal also keeps track of where the journal ends in it.
+  * Key material is trashed by Clear() and the d'tor.
+  */
+  class JournalBinding
+  {
+  public:
+    JournalBinding();
+    JournalBinding(const JournalBinding &that);
+    JournalBinding &operator=(const JournalBinding &that);
+    ~JournalBinding();
+
+    void Set(const unsigned char *fileKey, size_t keyLen,
+             const unsigned char *digest, Cipher cipher);
+    void Clear();
+    bool IsValid() const {return m_valid;}
+
+    enum {LEN = 32};
+  private:
+    friend class PWSjournal;
+    bool m_valid;
+    Cipher m_cipher;
+    unsigned char m_digest[LEN]; // the file's HMAC
+    unsigned char m_ekey[LEN];   // journal's encryption key
+    unsigned char m_akey[LEN];   // journal's HMAC key
+    // Following set by PWSjournal: where the journal ends, and its last HMAC,
+    // to append to it. Length 0 means there's no journal, -1 that it's
+    // damaged, so can't be appended to.
+    long m_length;
+    unsigned char m_mac[LEN];
+  };
+
   static PWSfile *MakePWSfile(const StringX &a_filename, const StringX &passkey,
                               VERSION &version, RWmode mode, int &status, 
                               Asker *pAsker = nullptr, Reporter *pReporter = nullptr);
 
-  static VERSION ReadVersion(const StringX &filename, const StringX &passkey);
+  static VERSION ReadVersion(const StringX &filename, const StringX &passkey,
+                             VerifiedKey *pvk = nullptr);
   static int CheckPasskey(const StringX &filename, const StringX &passkey,
-                          VERSION &version);
+                          VERSION &version, VerifiedKey *pvk = nullptr);
+
+  // Returns the number of hash iterations for which unlocking a file of the
+  // given version takes about msecs on this machine, by timing its KDF.
+  // Result is at least MIN_HASH_ITERATIONS (always so for pre-V3 files).
+  static uint32 CalibrateHashIters(VERSION version, uint32 msecs);
 
   // Following for 'legacy' use of pwsafe as file encryptor/decryptor
   static bool Encrypt(const stringT &fn, const StringX &passwd, stringT &errmess);
@@ -117,9 +209,16 @@ public:
   virtual int WriteRecord(const CItemData &item) = 0;
   virtual int ReadRecord(CItemData &item) = 0;
 
+  const StringX &GetFilename() const {return m_filename;}
   const PWSfileHeader &GetHeader() const {return m_hdr;}
   void SetHeader(const PWSfileHeader &h) {m_hdr = h;}
 
+  // Following lets Open() for read skip the KDF, see VerifiedKey
+  void SetVerifiedKey(const VerifiedKey &vk) {m_vk = vk;}
+
+  // V3 and later: valid after Open() for read, or Close() after write
+  const JournalBinding &GetJournalBinding() const {return m_jb;}
+
   void SetDefUsername(const StringX &du) {m_defusername = du;} // for V17 conversion (read) only
   void SetCurVersion(VERSION v) {m_curversion = v;}
   void GetUnknownHeaderFields(UnknownFieldList &UHFL);
@@ -132,6 +231,8 @@ public:
   // Following implemented in V3 and later
   virtual uint32 GetNHashIters() const {return 0;}
   virtual void SetNHashIters(uint32 ) {}
+  virtual Cipher GetCipher() const {return PWTwoFish;}
+  virtual void SetCipher(Cipher ) {}
 
   void SetDBFilters(const PWSFilters &MapDBFilters) { m_MapDBFilters = MapDBFilters;}
   const PWSFilters *GetDBFilters() const {return &m_MapDBFilters;}
@@ -153,6 +254,12 @@ public:
   size_t ReadField(unsigned char &type,
                    unsigned char* &data,
                    size_t &length) {return ReadCBC(type, data, length);}
+  // Like ReadField(type, data = nullptr, length), but data belongs to us:
+  // When preloaded (see PreloadCBC()), it points into the decrypted
+  // file, valid until Close(). Otherwise, it's valid until the next call.
+  size_t ReadFieldView(unsigned char &type,
+                       const unsigned char* &data,
+                       size_t &length);
   
 protected:
   PWSfile(const StringX &filename, RWmode mode, VERSION v = UNKNOWN_VERSION);
@@ -162,9 +269,45 @@ protected:
                           size_t length);
   virtual size_t ReadCBC(unsigned char &type, unsigned char* &data,
                          size_t &length);
+  // Called for each field read by ReadCBC() or ReadFieldView()
+  virtual void DigestField(unsigned char , const unsigned char *, size_t ) {}
   
   static void HashRandom256(unsigned char *p256); // when we don't want to expose our RNG
 
+  // Used by CalibrateHashIters() - times stretch(N) for increasing N
+  static uint32 TimeHashIters(uint32 msecs,
+                              const std::function<void(uint32 N)> &stretch);
+
+  // Returns m_vk iff it was set for this file, passkey & version
+  const VerifiedKey *GetVerifiedKey() const;
+
+  // Sets m_jb from the file's key and its HMAC. If digest's null, it's read
+  // from the end of the file (for read, before it's verified by Close()).
+  void BindJournal(const unsigned char *fileKey, size_t keyLen,
+                   const unsigned char *digest = nullptr);
+
+  // For reading V3 and later: PreloadCBC() maps the file from the current
+  // position up to end (or reads it, if it can't be mapped). Its blocks
+  // are then decrypted with m_fish, in parallel, into a locked buffer, as
+  // reading gets to them (see DecryptPreloaded()).
+  // ReadCBC(), ReadFieldView(), GetOffset() and SetOffset() then work
+  // on the buffer. Only the CBC xor remains to be done per field, in place,
+  // so chaining (m_IV) is exactly as when reading from m_fd.
+  // Returns false if the data couldn't be loaded, in which case
+  // reading just goes on from m_fd.
+  // UnloadCBC() trashes the buffers and seeks m_fd to where reading got to.
+  bool PreloadCBC(ulong64 end);
+  void UnloadCBC();
+  bool IsPreloaded() const {return m_preCT != nullptr;}
+  void SetOffset(long offset);
+
+  // For writing: WriteCBC() lays out fields in a locked buffer, which
+  // FlushCBC() encrypts with one CBCEncrypt() call and writes to m_fd
+  // with one fwrite(), whenever the buffer fills up. Anything that
+  // writes to m_fd directly after WriteCBC() must call FlushCBC() first.
+  // Returns false on write error.
+  bool FlushCBC();
+
   const StringX m_filename;
   StringX m_passkey;
   FILE *m_fd;
@@ -186,8 +329,31 @@ protected:
   ulong64 m_fileLength;
   Asker *m_pAsker;
   Reporter *m_pReporter;
+  VerifiedKey m_vk;
+  JournalBinding m_jb;
+  // See PreloadCBC()
+  const unsigned char *m_preCT;       // ciphertext, in m_preMap or m_preBuf
+  size_t m_preLen;                    // bytes in m_preCT
+  unsigned char *m_preDK;             // m_fish->Decrypt() of each block,
+                                      // plaintext below m_preDone
+  size_t m_preDKLen;
+  size_t m_prePos;                    // read position in above
+  size_t m_preDone;
+  long m_preBase;                     // file offset of m_preCT[0]
 
 private:
+  size_t ReadPreloadedCBC(unsigned char &type,
+                          const unsigned char* &data, size_t &length);
+  void DecryptPreloaded(size_t from, size_t to); // offsets in m_preCT
+  std::vector<bool> m_preChunkDone;   // which chunks of m_preDK are decrypted
+  const unsigned char *m_preMap;      // whole file, if mapped
+  std::vector<unsigned char> m_preBuf; // read from m_fd, if not
+  unsigned char *m_viewBuf;           // for ReadFieldView() if !IsPreloaded()
+  size_t m_viewLen;
+  void BufferCBC(const unsigned char *data, size_t length); // whole blocks
+  void ReleaseOutBuf();
+  std::vector<unsigned char> m_outBuf; // see FlushCBC()
+  size_t m_outLen;                     // bytes pending in m_outBuf
   PWSfile& operator=(const PWSfile&) = delete; // Do not implement
 };
 
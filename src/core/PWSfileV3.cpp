@@ -99,6 +99,9 @@ int PWSfileV3::Open(const StringX &passkey)
       Close();
       return m_status;
     }
+    BindJournal(m_key, sizeof(m_key));
+    // Records, TERMINAL_BLOCK and HMAC: decrypt ahead, see PreloadCBC()
+    PreloadCBC(m_fileLength);
   }
   return m_status;
 }
@@ -121,6 +124,10 @@ int PWSfileV3::Close()
 
   // Write or verify HMAC, depending on RWmode.
   if (m_rw == Write) {
+    if (!FlushCBC()) {
+      PWSfile::Close();
+      return FAILURE;
+    }
     size_t fret;
     fret = fwrite(TERMINAL_BLOCK, sizeof(TERMINAL_BLOCK), 1, m_fd);
     if (fret != 1) {
@@ -132,10 +139,12 @@ int PWSfileV3::Close()
       PWSfile::Close();
       return FAILURE;
     }
+    BindJournal(m_key, sizeof(m_key), digest);
     return PWSfile::Close();
   } else { // Read
     // We're here *after* TERMINAL_BLOCK has been read
     // and detected (by _readcbc) - just read hmac & verify
+    UnloadCBC();
     unsigned char d[SHA256::HASHLEN];
     fread(d, sizeof(d), 1, m_fd);
     if (memcmp(d, digest, SHA256::HASHLEN) == 0)
@@ -200,7 +209,8 @@ err:
 
 int PWSfileV3::CheckPasskey(const StringX &filename,
                             const StringX &passkey, FILE *a_fd,
-                            unsigned char *aPtag, uint32 *nITER)
+                            unsigned char *aPtag, uint32 *nITER,
+                            const VerifiedKey *pvk)
 {
   PWS_LOGIT;
 
@@ -238,7 +248,10 @@ int PWSfileV3::CheckPasskey(const StringX &filename,
     if (nITER != nullptr)
       *nITER = N;
 
-    StretchKey(salt, sizeof(salt), passkey, N, usedPtag);
+    if (pvk != nullptr && pvk->m_nHashIters == N)
+      memcpy(usedPtag, pvk->m_key, SHA256::HASHLEN);
+    else
+      StretchKey(salt, sizeof(salt), passkey, N, usedPtag);
   }
   unsigned char HPtag[SHA256::HASHLEN];
   H.Update(usedPtag, SHA256::HASHLEN);
@@ -280,16 +293,10 @@ int PWSfileV3::WriteRecord(const CItemData &item)
   return item.Write(this);
 }
 
-size_t PWSfileV3::ReadCBC(unsigned char &type, unsigned char* &data,
-                          size_t &length)
+void PWSfileV3::DigestField(unsigned char , const unsigned char *data,
+                            size_t length)
 {
-  size_t numRead = PWSfile::ReadCBC(type, data, length);
-
-  if (numRead > 0) {
-    m_hmac.Update(data, static_cast<unsigned long>(length));
-  }
-
-  return numRead;
+  m_hmac.Update(data, static_cast<unsigned long>(length));
 }
 
 int PWSfileV3::ReadRecord(CItemData &item)
@@ -299,6 +306,20 @@ int PWSfileV3::ReadRecord(CItemData &item)
   return item.Read(this);
 }
 
+uint32 PWSfileV3::CalibrateHashIters(uint32 msecs)
+{
+  unsigned char salt[PWSaltLength];
+  unsigned char Ptag[SHA256::HASHLEN];
+  const StringX passkey(_T("calibration"));
+
+  HashRandom256(salt);
+  const uint32 N = TimeHashIters(msecs, [&](uint32 n) {
+      StretchKey(salt, sizeof(salt), passkey, n, Ptag);
+    });
+  trashMemory(Ptag, sizeof(Ptag));
+  return N;
+}
+
 void PWSfileV3::StretchKey(const unsigned char *salt, unsigned long saltLen,
                            const StringX &passkey,
                            unsigned int N, unsigned char *Ptag)
@@ -323,15 +344,11 @@ void PWSfileV3::StretchKey(const unsigned char *salt, unsigned long saltLen,
   delete[] pstr;
 
   ASSERT(N >= MIN_HASH_ITERATIONS); // minimal value we're willing to use
-  for (unsigned int i = 0; i < N; i++) {
-    SHA256 H;
-    // The 2nd param in next line was sizeof(X) in Beta-1
-    // (bug #1451422). This change broke the ability to read beta-1
-    // generated databases. If this is really needed, we should
-    // hack the read functionality to try both variants (ugh).
-    H.Update(X, SHA256::HASHLEN);
-    H.Final(X);
-  }
+  // Each iteration hashes the SHA256::HASHLEN bytes of X. This was
+  // sizeof(X) in Beta-1 (bug #1451422). This change broke the ability
+  // to read beta-1 generated databases. If this is really needed, we
+  // should hack the read functionality to try both variants (ugh).
+  SHA256::IterateDigest(X, N);
 }
 
 // Following specific for PWSfileV3::WriteHeader
@@ -593,8 +610,16 @@ int PWSfileV3::ReadHeader()
   PWS_LOGIT;
 
   unsigned char Ptag[SHA256::HASHLEN];
+  const VerifiedKey *pvk = GetVerifiedKey();
   m_status = CheckPasskey(m_filename, m_passkey, m_fd,
-                          Ptag, &m_nHashIters);
+                          Ptag, &m_nHashIters, pvk);
+
+  if (m_status == WRONG_PASSWORD && pvk != nullptr) {
+    // Stale key (file changed since it was verified?) - do it the hard way
+    fseek(m_fd, 0, SEEK_SET);
+    m_status = CheckPasskey(m_filename, m_passkey, m_fd,
+                            Ptag, &m_nHashIters);
+  }
 
   if (m_status != SUCCESS) {
     Close();
@@ -22,11 +22,14 @@ class PWSfileV3 : public PWSfile
 {
 public:
 
+  // If pvk's non-null, its P' is checked instead of deriving one from passkey
   static int CheckPasskey(const StringX &filename,
                           const StringX &passkey,
                           FILE *a_fd = nullptr,
-                          unsigned char *aPtag = nullptr, uint32 *nIter = nullptr);
+                          unsigned char *aPtag = nullptr, uint32 *nIter = nullptr,
+                          const VerifiedKey *pvk = nullptr);
   static bool IsV3x(const StringX &filename, VERSION &v);
+  static uint32 CalibrateHashIters(uint32 msecs);
 
   PWSfileV3(const StringX &filename, RWmode mode, VERSION version);
   ~PWSfileV3();
@@ -51,8 +54,8 @@ public:
   virtual size_t WriteCBC(unsigned char type, const unsigned char *data,
                           size_t length);
 
-  virtual size_t ReadCBC(unsigned char &type, unsigned char* &data,
-                         size_t &length);
+  virtual void DigestField(unsigned char type, const unsigned char *data,
+                           size_t length); // HMAC
   int WriteHeader();
   int ReadHeader();
 
@@ -18,9 +18,10 @@
 #include "crypto/pbkdf2.h"
 #include "crypto/KeyWrap.h"
 #include "PWStime.h"
+#include "SecureArena.h"
 #include "crypto/TwoFish.h"
 
-#include "ItemAtt.h" // for WriteContentFields()
+#include "ItemAtt.h" // for CopyContentFields()
 
 #include "os/debug.h"
 #include "os/file.h"
@@ -38,6 +39,11 @@
 #include <errno.h>
 #include <iomanip>
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
 #include <type_traits> // for static_assert
 
 using namespace std;
@@ -64,11 +70,12 @@ PWSfileV4::CKeyBlocks::KeyBlock::operator=(const KeyBlock &kb)
 }
 
 PWSfileV4::CKeyBlocks::CKeyBlocks()
+  : m_cipher(PWTwoFish)
 {
 }
 
 PWSfileV4::CKeyBlocks::CKeyBlocks(const PWSfileV4::CKeyBlocks &ckb)
-  : m_kbs(ckb.m_kbs)
+  : m_kbs(ckb.m_kbs), m_cipher(ckb.m_cipher)
 {
 }
 
@@ -80,13 +87,15 @@ PWSfileV4::CKeyBlocks& PWSfileV4::CKeyBlocks::operator=(const PWSfileV4::CKeyBlo
 {
   if (this != &that) {
     m_kbs = that.m_kbs;
+    m_cipher = that.m_cipher;
   }
   return *this;
 }
 
 PWSfileV4::PWSfileV4(const StringX &filename, RWmode mode, VERSION version)
   : PWSfile(filename, mode, version),
-    m_effectiveFileLength(0), m_nHashIters(MIN_HASH_ITERATIONS)
+    m_effectiveFileLength(0), m_cipher(PWTwoFish),
+    m_nHashIters(MIN_HASH_ITERATIONS)
 {
   m_IV = m_ipthing;
   m_terminal = nullptr;
@@ -122,7 +131,11 @@ int PWSfileV4::Open(const StringX &passkey)
     // Nonce is used to detect end of keyblocks
     static_assert(int(NONCELEN) == int(SHA256::HASHLEN), "can't call HashRandom256");
     HashRandom256(m_nonce); // Generate nonce
-    if (!m_keyblocks.GetKeys(passkey, m_nHashIters, m_key, m_ell)) {
+    // A single-user file's keyblock is created here with m_cipher.
+    // Otherwise, the records must use the cipher the existing keyblocks
+    // were wrapped with, as that's how a reader will pick it.
+    m_keyblocks.SetCipher(m_cipher);
+    if (!m_keyblocks.GetKeys(passkey, m_nHashIters, m_key, m_ell, &m_cipher)) {
       PWSfile::Close();
       return WRONG_PASSWORD;
     }
@@ -139,8 +152,11 @@ int PWSfileV4::Open(const StringX &passkey)
   if (status != SUCCESS) {
     Close();
   } else {
-    if (m_rw == Read)
+    if (m_rw == Read) {
       m_effectiveFileLength = pws_os::fileLength(m_fd) - SHA256::HASHLEN;
+      BindJournal(m_key, sizeof(m_key));
+      PreloadCBC(m_effectiveFileLength); // see SkipContent() for attachments
+    }
   }
   return status;
 }
@@ -166,15 +182,21 @@ int PWSfileV4::Close()
   // Write or verify HMAC, depending on RWmode.
   size_t fret;
   if (m_rw == Write) {
+    if (!FlushCBC()) {
+      PWSfile::Close();
+      return FAILURE;
+    }
     fret = fwrite(digest, sizeof(digest), 1, m_fd);
     if (fret != 1) {
       PWSfile::Close();
       return FAILURE;
     }
+    BindJournal(m_key, sizeof(m_key), digest);
     return PWSfile::Close();
   } else { // Read
     // Clear keyblocks, in case we re-open for read
     m_keyblocks.m_kbs.clear();
+    UnloadCBC();
     // read hmac & verify
     unsigned char d[SHA256::HASHLEN];
     fret = fread(d, sizeof(d), 1, m_fd);
@@ -205,7 +227,7 @@ int PWSfileV4::SanityCheck(FILE *stream)
 
 int PWSfileV4::CheckPasskey(const StringX &filename,
                             const StringX &passkey, FILE *a_fd,
-                            unsigned char *, uint32 *)
+                            VerifiedKey *pvk)
 {
   PWS_LOGIT;
 
@@ -224,6 +246,9 @@ int PWSfileV4::CheckPasskey(const StringX &filename,
     pv4.m_fd = fd;
     retval = pv4.ParseKeyBlocks(passkey);
     pv4.m_fd = nullptr; // s.t. d'tor doesn't fclose()
+    if (retval == SUCCESS && pvk != nullptr)
+      pvk->Set(filename, passkey, V40, pv4.m_nHashIters, pv4.m_key, pv4.m_ell,
+               pv4.m_cipher);
   }
   if (a_fd == nullptr) // if we opened the file, we close it...
     fclose(fd);
@@ -269,98 +294,202 @@ int PWSfileV4::WriteRecord(const CItemAtt &att)
   return att.Write(this);
 }
 
-  // Following writes AttIV, AttEK, AttAK, AttContent
-  // and AttContentHMAC per format spec.
-  // All except the content are generated internally.
-size_t PWSfileV4::WriteContentFields(unsigned char *content, size_t len)
+size_t PWSfileV4::CopyContentFields(const CUUID &attuuid,
+                                    const StringX &filename, long offset,
+                                    Cipher cipher, const ContentKeys &keys,
+                                    size_t clen)
 {
-  if (len == 0)
-    return SUCCESS;
-  ASSERT(content != nullptr);
+  ASSERT(clen > 0 && offset >= 0);
 
-  unsigned char IV[TwoFish::BLOCKSIZE];
-  unsigned char EK[KLEN];
-  unsigned char AK[KLEN];
+  WriteField(CItemAtt::ATTIV, keys.IV, sizeof(keys.IV));
+  WriteField(CItemAtt::ATTEK, keys.EK, sizeof(keys.EK));
+  WriteField(CItemAtt::ATTAK, keys.AK, sizeof(keys.AK));
 
-  PWSrand::GetInstance()->GetRandomData(IV, sizeof(IV));
-  PWSrand::GetInstance()->GetRandomData(EK, sizeof(EK));
-  PWSrand::GetInstance()->GetRandomData(AK, sizeof(AK));
-
-  WriteField(CItemAtt::ATTIV, IV, sizeof(IV));
-  WriteField(CItemAtt::ATTEK, EK, sizeof(EK));
-  WriteField(CItemAtt::ATTAK, AK, sizeof(AK));
-
-  // Write content length as the "value" of the content field
-  int32 len32 = static_cast<int>(len);
+  int32 len32 = static_cast<int>(clen);
   unsigned char buf[4];
   putInt32(buf, len32);
   WriteField(CItemAtt::CONTENT, buf, sizeof(buf));
 
-  // Create fish with EK
-  TwoFish fish(EK, sizeof(EK));
-  trashMemory(EK, sizeof(EK));
+  if (!FlushCBC())
+    throw(EIO);
+  m_contentOffsets[attuuid] = ftell(m_fd);
+
+  if (cipher == m_cipher) {
+    // Same keys, same cipher, same ciphertext: no need to re-encrypt it,
+    // only to decrypt it to check it's still what was read
+    auto copy = [this](const unsigned char *data, size_t len) {
+      return fwrite(data, 1, len, m_fd) == len;
+    };
+    if (StreamContent(filename, offset, cipher, keys, clen,
+                      [](const unsigned char *, size_t) {return true;},
+                      copy) != SUCCESS)
+      throw(EIO);
+  } else {
+    // Encrypt with the content's keys, so that they and the HMAC still
+    // hold. Chunks are whole blocks but for the last, so CBC carries on
+    // from one to the next.
+    std::unique_ptr<Fish> fish(MakeFish(m_cipher, keys.EK, sizeof(keys.EK)));
+    unsigned char IV[sizeof(keys.IV)];
+    memcpy(IV, keys.IV, sizeof(IV));
+    auto encrypt = [this, &fish, &IV](const unsigned char *data, size_t len) {
+      try {
+        _writecbc(m_fd, data, len, fish.get(), IV);
+      } catch (...) {
+        return false;
+      }
+      return true;
+    };
+    if (StreamContent(filename, offset, cipher, keys, clen,
+                      encrypt) != SUCCESS)
+      throw(EIO);
+  }
 
-  // Create hmac with AK
-  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
-  hmac.Init(AK, sizeof(AK));
-  trashMemory(AK, sizeof(AK));
+  WriteField(CItemAtt::CONTENTHMAC, keys.HMAC, sizeof(keys.HMAC));
+  return clen;
+}
+
+long PWSfileV4::SkipContent(size_t clen)
+{
+  ASSERT(clen > 0);
+  // Content has its own key & IV, and isn't chained to the fields around
+  // it, so there's nothing to do with it until it's needed.
+  const long pos = GetOffset();
+  const size_t blen = ContentSpan(clen);
+  if (ulong64(pos) + blen > m_effectiveFileLength)
+    return -1;
+  SetOffset(pos + static_cast<long>(blen));
+  return pos;
+}
+
+int PWSfileV4::StreamContent(const StringX &filename, long offset,
+                             Cipher cipher, const ContentKeys &keys,
+                             size_t clen, const ContentSink &sink,
+                             const ContentSink &rawSink)
+{
+  ASSERT(clen > 0 && offset >= 0);
+  static_assert(CONTENT_CHUNK % TwoFish::BLOCKSIZE == 0,
+                "content's decrypted a whole number of blocks at a time");
+
+  FILE *fd = pws_os::FOpen(filename.c_str(), _T("rb"));
+  if (fd == nullptr)
+    return CANT_OPEN_FILE;
+  if (fseek(fd, offset, SEEK_SET) != 0) {
+    fclose(fd);
+    return READ_FAIL;
+  }
 
-  // write actual content using EK
-  _writecbc(m_fd, content, len, &fish, IV);
+  std::unique_ptr<Fish> fish(MakeFish(cipher, keys.EK, sizeof(keys.EK)));
+  unsigned char IV[sizeof(keys.IV)];
+  memcpy(IV, keys.IV, sizeof(IV));
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+  hmac.Init(keys.AK, sizeof(keys.AK));
 
-  // update content's HMAC
-  hmac.Update(content, static_cast<unsigned long>(len));
+  int status = SUCCESS;
+  const size_t blen = ContentSpan(clen);
+  // Plaintext's kept where it's locked, and wiped when released
+  auto *chunk = static_cast<unsigned char *>(SecureArena::Allocate(CONTENT_CHUNK));
+  for (size_t pos = 0; pos < blen; pos += CONTENT_CHUNK) {
+    const size_t n = std::min(size_t(CONTENT_CHUNK), blen - pos);
+    if (fread(chunk, 1, n, fd) != n) {
+      status = READ_FAIL;
+      break;
+    }
+    if (rawSink && !rawSink(chunk, n)) {
+      status = WRITE_FAIL;
+      break;
+    }
+    fish->CBCDecrypt(chunk, n / fish->GetBlockSize(), IV);
+    const size_t len = std::min(n, clen - pos); // less the last's padding
+    hmac.Update(chunk, static_cast<unsigned long>(len));
+    if (!sink(chunk, len)) {
+      status = WRITE_FAIL;
+      break;
+    }
+  }
+  fclose(fd);
+  SecureArena::Release(chunk, CONTENT_CHUNK);
 
-  // write content's HMAC
   unsigned char digest[SHA256::HASHLEN];
   hmac.Final(digest);
-  WriteField(CItemAtt::CONTENTHMAC, digest, sizeof(digest));
-
-  return len;
+  if (status == SUCCESS && memcmp(digest, keys.HMAC, sizeof(digest)) != 0)
+    status = BAD_DIGEST;
+  return status;
 }
 
-size_t PWSfileV4::ReadContent(Fish *fish,  unsigned char *cbcbuffer,
-                              unsigned char *&content, size_t clen)
+int PWSfileV4::SpillContent(const ContentProducer &producer, size_t clen,
+                            ContentKeys &keys, StringX &filename)
 {
-  ASSERT(clen > 0 && fish != nullptr && cbcbuffer != nullptr);
-  // round up clen to nearest BS:
-  const unsigned int BS = fish->GetBlockSize();
-  size_t blen = (clen/BS + 1)*BS;
+  ASSERT(clen > 0);
 
-  content = new unsigned char[blen]; // caller's responsible for delete[]
-  return _readcbc(m_fd, content, blen, fish, cbcbuffer);
-}
+  stringT spillname;
+  FILE *fd = pws_os::CreateTempFile(spillname);
+  if (fd == nullptr)
+    return CANT_OPEN_FILE;
 
-size_t PWSfileV4::ReadCBC(unsigned char &type, unsigned char* &data,
-                          size_t &length)
-{
-  size_t numRead = PWSfile::ReadCBC(type, data, length);
+  PWSrand::GetInstance()->GetRandomData(keys.IV, sizeof(keys.IV));
+  PWSrand::GetInstance()->GetRandomData(keys.EK, sizeof(keys.EK));
+  PWSrand::GetInstance()->GetRandomData(keys.AK, sizeof(keys.AK));
 
-  if (numRead > 0) {
-    int32 len32 = static_cast<int>(length);
-    unsigned char buf[4];
-    putInt32(buf, len32);
+  std::unique_ptr<Fish> fish(MakeFish(PWTwoFish, keys.EK, sizeof(keys.EK)));
+  unsigned char IV[sizeof(keys.IV)];
+  memcpy(IV, keys.IV, sizeof(IV));
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+  hmac.Init(keys.AK, sizeof(keys.AK));
+
+  // Chunks are whole blocks but for the last, so CBC carries on from one
+  // to the next, as StreamContent() decrypts it
+  size_t done = 0;
+  auto encrypt = [fd, &fish, &IV, &hmac, &done, clen](const unsigned char *data,
+                                                      size_t len) {
+    if (len > clen - done ||
+        (done + len < clen && len % TwoFish::BLOCKSIZE != 0))
+      return false;
+    hmac.Update(data, static_cast<unsigned long>(len));
+    try {
+      _writecbc(fd, data, len, fish.get(), IV);
+    } catch (...) {
+      return false;
+    }
+    done += len;
+    return true;
+  };
+  int status = producer(encrypt);
+  if (status == SUCCESS && done != clen)
+    status = READ_FAIL;
+  hmac.Final(keys.HMAC);
 
-    m_hmac.Update(&type, 1);
-    m_hmac.Update(buf, sizeof(buf));
-    m_hmac.Update(data, static_cast<unsigned long>(length));
+  if (pws_os::FClose(fd, true) != 0 && status == SUCCESS)
+    status = WRITE_FAIL;
+  if (status != SUCCESS) {
+    pws_os::DeleteAFile(spillname);
+    return status;
   }
+  filename = spillname.c_str();
+  return SUCCESS;
+}
+
+void PWSfileV4::DigestField(unsigned char type, const unsigned char *data,
+                            size_t length)
+{
+  int32 len32 = static_cast<int>(length);
+  unsigned char buf[4];
+  putInt32(buf, len32);
 
-  return numRead;
+  m_hmac.Update(&type, 1);
+  m_hmac.Update(buf, sizeof(buf));
+  m_hmac.Update(data, static_cast<unsigned long>(length));
 }
 
 void PWSfileV4::SaveState()
 {
-  m_savepos = ftell(m_fd);
+  m_savepos = GetOffset();
   memcpy(m_saveIV, m_IV, m_fish->GetBlockSize());
   m_savehmac = m_hmac;
 }
 
 void PWSfileV4::RestoreState()
 {
-  int seekstat = fseek(m_fd, m_savepos, SEEK_SET);
-  if (seekstat != 0)
-    ASSERT(0);
+  SetOffset(m_savepos);
   memcpy(m_IV, m_saveIV, m_fish->GetBlockSize());
   m_hmac = m_savehmac;
 }
@@ -371,7 +500,7 @@ int PWSfileV4::ReadRecord(CItemData &item)
   ASSERT(m_fd != nullptr);
   ASSERT(m_curversion == V40);
   SaveState();
-  unsigned fpos = unsigned(ftell(m_fd));
+  unsigned fpos = unsigned(GetOffset());
   if (fpos < m_effectiveFileLength) {
     status = item.Read(this);
     if (status < 0) { // detected an inappropriate field
@@ -395,9 +524,38 @@ int PWSfileV4::ReadRecord(CItemAtt &att)
     return END_OF_FILE;
 }
 
-void PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
+uint32 PWSfileV4::CalibrateHashIters(uint32 msecs)
+{
+  unsigned char salt[CKeyBlocks::PWSaltLength];
+  unsigned char Ptag[SHA256::HASHLEN];
+  const StringX passkey(_T("calibration"));
+
+  HashRandom256(salt);
+  const uint32 N = TimeHashIters(msecs, [&](uint32 n) {
+      StretchKey(salt, sizeof(salt), passkey, n, Ptag, sizeof(Ptag));
+    });
+  trashMemory(Ptag, sizeof(Ptag));
+  return N;
+}
+
+Fish *PWSfileV4::MakeFish(Cipher cipher, const unsigned char *key, size_t keylen)
+{
+  // m_ipthing and friends are sized for both
+  static_assert(int(TwoFish::BLOCKSIZE) == int(AES::BLOCKSIZE),
+                "V4 ciphers must share a block size");
+  switch (cipher) {
+  case PWAES:
+    return new AES(key, static_cast<int>(keylen));
+  case PWTwoFish:
+  default:
+    return new TwoFish(key, static_cast<int>(keylen));
+  }
+}
+
+bool PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
                            const StringX &passkey,
-                           unsigned int N, unsigned char *Ptag, unsigned long PtagLen)
+                           unsigned int N, unsigned char *Ptag, unsigned long PtagLen,
+                           const std::function<bool()> &aborted)
 {
   /*
   * P' is the "stretched key" of the user's passphrase and the SALT, as defined
@@ -408,14 +566,15 @@ void PWSfileV4::StretchKey(const unsigned char *salt, unsigned long saltLen,
   size_t passLen = 0;
   unsigned char *pstr = nullptr;
 
-  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
   ConvertPasskey(passkey, pstr, passLen);
-  pbkdf2(pstr, static_cast<unsigned long>(passLen), salt, saltLen, N, &hmac, Ptag, &PtagLen);
+  const bool completed = pbkdf2_sha256(pstr, static_cast<unsigned long>(passLen),
+                                       salt, saltLen, N, Ptag, &PtagLen, aborted);
 
 #ifdef UNICODE
   trashMemory(pstr, passLen);
   delete[] pstr;
 #endif
+  return completed;
 }
 
 const short VersionNum = 0x0400;
@@ -424,19 +583,11 @@ struct PWSfileV4::CKeyBlocks::KeyBlockFinder {
   KeyBlockFinder(const StringX &passkey) : passkey(passkey) {}
 
   bool operator()(const KeyBlock &kb) {
-    unsigned char Ptag[SHA256::HASHLEN];
     unsigned char K[PWSfileV4::KLEN];
-    PWSfileV4::StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
-                          Ptag, sizeof(Ptag));
-    // Try to unwrap K
-    TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-    KeyWrap kwK(&Fish);
-    
-    bool retval = kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k));
-    if (retval) {
-      trashMemory(Ptag, sizeof(Ptag));
-      trashMemory(K, sizeof(K));
-    }
+    unsigned char L[PWSfileV4::KLEN];
+    bool retval = TryKeyBlock(kb, passkey, K, L);
+    trashMemory(K, sizeof(K));
+    trashMemory(L, sizeof(L));
     return retval;
   }
 private:
@@ -445,7 +596,8 @@ private:
 };
 
 bool PWSfileV4::CKeyBlocks::GetKeys(const StringX &passkey, uint32 nHashIters,
-                                     unsigned char K[KLEN], unsigned char L[KLEN])
+                                     unsigned char K[KLEN], unsigned char L[KLEN],
+                                     Cipher *pcipher)
 {
   // Note that nHashIters is only used if m_kbs is empty
   // Which will happen if this file is used 'single user'
@@ -454,25 +606,116 @@ bool PWSfileV4::CKeyBlocks::GetKeys(const StringX &passkey, uint32 nHashIters,
   if (m_kbs.empty())
     AddKeyBlock(passkey, passkey, nHashIters);
 
-  KeyBlockFinder find_kb(passkey);
-  auto kb_iter = find_if(m_kbs.begin(), m_kbs.end(), find_kb);
-  if (kb_iter == m_kbs.end())
+  return FindKeyBlock(passkey, K, L, pcipher) >= 0;
+}
+
+bool PWSfileV4::CKeyBlocks::UnwrapKeys(const KeyBlock &kb, Cipher cipher,
+                                       const unsigned char Ptag[SHA256::HASHLEN],
+                                       unsigned char K[KLEN], unsigned char L[KLEN])
+{
+  std::unique_ptr<Fish> fish(MakeFish(cipher, Ptag, SHA256::HASHLEN));
+  KeyWrap kwK(fish.get());
+  if (!kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k)))
     return false;
 
-  unsigned char Ptag[SHA256::HASHLEN];
-  PWSfileV4::StretchKey(kb_iter->m_salt, sizeof(kb_iter->m_salt),
-                        passkey, kb_iter->m_nHashIters,
-                        Ptag, sizeof(Ptag));
-  TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-  KeyWrap kwK(&Fish);
-  if (!kwK.Unwrap(kb_iter->m_kw_k, K, sizeof(kb_iter->m_kw_k)))
-    ASSERT(0);
-  KeyWrap kwL(&Fish);
-  if (!kwL.Unwrap(kb_iter->m_kw_l, L, sizeof(kb_iter->m_kw_l)))
-    ASSERT(0);
+  KeyWrap kwL(fish.get());
+  if (!kwL.Unwrap(kb.m_kw_l, L, sizeof(kb.m_kw_l))) {
+    ASSERT(0); // Shouln't happen if K unwrapped OK
+    trashMemory(K, KLEN);
+    return false;
+  }
   return true;
 }
 
+bool PWSfileV4::CKeyBlocks::TryKeyBlock(const KeyBlock &kb, const StringX &passkey,
+                                        unsigned char K[KLEN], unsigned char L[KLEN],
+                                        const std::function<bool()> &aborted,
+                                        Cipher *pcipher)
+{
+  unsigned char Ptag[SHA256::HASHLEN];
+  if (!StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
+                  Ptag, sizeof(Ptag), aborted)) {
+    trashMemory(Ptag, sizeof(Ptag));
+    return false;
+  }
+
+  // The cipher isn't recorded in the file, but the key wrap's integrity
+  // check fails for the wrong one just as it does for the wrong passkey.
+  // Unwrapping is cheap compared to the KDF, so try each in turn.
+  bool found = false;
+  for (Cipher cipher : {PWTwoFish, PWAES}) {
+    if (UnwrapKeys(kb, cipher, Ptag, K, L)) {
+      if (pcipher != nullptr)
+        *pcipher = cipher;
+      found = true;
+      break;
+    }
+  }
+  trashMemory(Ptag, sizeof(Ptag));
+  return found;
+}
+
+int PWSfileV4::CKeyBlocks::FindKeyBlock(const StringX &passkey,
+                                        unsigned char K[KLEN],
+                                        unsigned char L[KLEN],
+                                        Cipher *pcipher) const
+{
+  /**
+   * With several keyblocks (e.g., a shared safe), trying them in turn
+   * could take as many KDFs as there are keyblocks. Instead, we try them
+   * concurrently on up to one thread per core. Threads take the next
+   * untried keyblock until one of them succeeds. Work on a keyblock is
+   * abandoned only when one with a lower index has worked, so that the
+   * result is always the first keyblock that passkey unlocks, just as
+   * if we had tried them in order.
+   */
+  const size_t nkbs = m_kbs.size();
+  if (nkbs == 0)
+    return -1;
+  if (nkbs == 1)
+    return TryKeyBlock(m_kbs[0], passkey, K, L, nullptr, pcipher) ? 0 : -1;
+
+  std::atomic<size_t> next(0), found(nkbs);
+  std::mutex result_mutex; // protects K, L, *pcipher
+
+  auto worker = [&]() {
+    unsigned char k[KLEN], l[KLEN];
+    Cipher c;
+    for (size_t i = next++; i < found; i = next++) {
+      auto superseded = [&found, i]() {return found < i;};
+      if (TryKeyBlock(m_kbs[i], passkey, k, l, superseded, &c)) {
+        std::lock_guard<std::mutex> guard(result_mutex);
+        if (i < found) {
+          memcpy(K, k, KLEN);
+          memcpy(L, l, KLEN);
+          if (pcipher != nullptr)
+            *pcipher = c;
+          found = i;
+        }
+        break; // everything after i is moot
+      }
+    }
+    trashMemory(k, KLEN);
+    trashMemory(l, KLEN);
+  };
+
+  const size_t ncores = std::max(1U, std::thread::hardware_concurrency());
+  const size_t nthreads = std::min(nkbs, ncores);
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < nthreads; t++) {
+    try {
+      threads.emplace_back(worker);
+    } catch (std::system_error &) {
+      break; // make do with what we have
+    }
+  }
+  worker(); // this thread works too
+  for (auto &thread : threads)
+    thread.join();
+
+  return (found < nkbs) ? static_cast<int>(found) : -1;
+}
+
 void PWSfileV4::ComputeEndKB(const unsigned char hnonce[SHA256::HASHLEN],
                              unsigned char digest[SHA256::HASHLEN])
 {
@@ -573,7 +816,7 @@ int PWSfileV4::WriteHeader()
   }
   SAFE_FWRITE(m_ipthing, 1, sizeof(m_ipthing), m_fd);
 
-  m_fish = new TwoFish(m_key, sizeof(m_key));
+  m_fish = MakeFish(m_cipher, m_key, sizeof(m_key));
 
   // write some actual data (at last!)
   numWritten = 0;
@@ -811,31 +1054,6 @@ int PWSfileV4::ReadKeyBlock()
   return SUCCESS;
 }
 
-int PWSfileV4::TryKeyBlock(unsigned index, const StringX &passkey,
-                           unsigned char K[KLEN], unsigned char L[KLEN],
-                           uint32 &nHashIters)
-{
-  CKeyBlocks::KeyBlock &kb = m_keyblocks.at(index);
-  unsigned char Ptag[SHA256::HASHLEN];
-
-  StretchKey(kb.m_salt, sizeof(kb.m_salt), passkey, kb.m_nHashIters,
-             Ptag, sizeof(Ptag));
-  // Try to unwrap K
-  TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-  KeyWrap kwK(&Fish);
-
-  if (!kwK.Unwrap(kb.m_kw_k, K, sizeof(kb.m_kw_k)))
-    return WRONG_PASSWORD;
-      
-  KeyWrap kwL(&Fish);
-  if (!kwL.Unwrap(kb.m_kw_l, L, sizeof(kb.m_kw_l))) {
-    ASSERT(0); // Shouln't happen if K unwrapped OK
-    return WRONG_PASSWORD;
-  }
-  nHashIters = kb.m_nHashIters;
-  return SUCCESS;
-}
-
 bool PWSfileV4::VerifyKeyBlocks()
 {
   unsigned char hnonce[SHA256::HASHLEN];
@@ -872,7 +1090,7 @@ int PWSfileV4::ParseKeyBlocks(const StringX &passkey)
    * and find one that works.
    * "All" means running until Hash(m_nonce) detected
    * or EOF.
-   * "works" means TryKeyBlock returns true.
+   * "works" means CKeyBlocks::TryKeyBlock returns true.
    * Once we have a working keyblock, we can verify the integrity
    * of all keyblocks.
    * Consider that we'll hit EOF if file's wrong type/corrupt
@@ -897,15 +1115,30 @@ int PWSfileV4::ParseKeyBlocks(const StringX &passkey)
     }
   } while (!EndKeyBlocks(calc_hnonce));
 
-  for (unsigned i = 0; i < m_keyblocks.size(); i++) {
-    status = TryKeyBlock(i, passkey, m_key, m_ell, m_nHashIters);
-    if (status == SUCCESS) {
-      if (!VerifyKeyBlocks())
-        status = BAD_DIGEST;
-      break;
+  // If we've a key that was verified for this file & passkey, check it
+  // against the keyblocks' HMAC instead of re-running the KDF.
+  const VerifiedKey *pvk = GetVerifiedKey();
+  if (pvk != nullptr) {
+    static_assert(int(VerifiedKey::KEYLEN) == int(KLEN), "VerifiedKey can't hold K or L");
+    const long pos = ftell(m_fd);
+    memcpy(m_key, pvk->m_key, KLEN);
+    memcpy(m_ell, pvk->m_ell, KLEN);
+    if (VerifyKeyBlocks()) {
+      m_nHashIters = pvk->m_nHashIters;
+      m_cipher = pvk->m_cipher;
+      m_keyblocks.SetCipher(m_cipher);
+      return SUCCESS;
     }
+    // Stale key (file changed since it was verified?) - do it the hard way
+    fseek(m_fd, pos, SEEK_SET);
   }
-  return status;
+
+  const int index = m_keyblocks.FindKeyBlock(passkey, m_key, m_ell, &m_cipher);
+  if (index < 0)
+    return WRONG_PASSWORD;
+  m_nHashIters = m_keyblocks[index].m_nHashIters;
+  m_keyblocks.SetCipher(m_cipher);
+  return VerifyKeyBlocks() ? SUCCESS : BAD_DIGEST;
 }
 
 bool PWSfileV4::CKeyBlocks::AddKeyBlock(const StringX &current_passkey,
@@ -926,29 +1159,20 @@ bool PWSfileV4::CKeyBlocks::AddKeyBlock(const StringX &current_passkey,
     StretchKey(kb.m_salt, sizeof(kb.m_salt), current_passkey, kb.m_nHashIters,
                Ptag, sizeof(Ptag));
   } else { // we need to get K & L from current
-    KeyBlockFinder find_kb(current_passkey);
-    auto kb_iter = find_if(m_kbs.begin(), m_kbs.end(), find_kb);
-    if (kb_iter == m_kbs.end())
+    // All keyblocks protect K & L with the same cipher
+    if (FindKeyBlock(current_passkey, K, L, &m_cipher) < 0)
       return false;
-    PWSfileV4::StretchKey(kb_iter->m_salt, sizeof(kb_iter->m_salt),
-                          current_passkey, kb_iter->m_nHashIters,
-                          Ptag, sizeof(Ptag));
-    TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
-    KeyWrap kwK(&Fish);
-    kwK.Unwrap(kb_iter->m_kw_k, K, sizeof(kb_iter->m_kw_k));
-    KeyWrap kwL(&Fish);
-    kwL.Unwrap(kb_iter->m_kw_l, L, sizeof(kb_iter->m_kw_l));
 
     StretchKey(kb.m_salt, sizeof(kb.m_salt), new_passkey, kb.m_nHashIters,
                Ptag, sizeof(Ptag));
   }
     
-  TwoFish Fish(Ptag, sizeof(Ptag)); // XXX generalize to support AES as well
+  std::unique_ptr<Fish> fish(MakeFish(m_cipher, Ptag, sizeof(Ptag)));
 
-  KeyWrap kwK(&Fish);
+  KeyWrap kwK(fish.get());
   kwK.Wrap(K, kb.m_kw_k, KLEN);
 
-  KeyWrap kwL(&Fish);
+  KeyWrap kwL(fish.get());
   kwL.Wrap(L, kb.m_kw_l, KLEN);
 
   trashMemory(Ptag, sizeof(Ptag));
@@ -982,7 +1206,7 @@ int PWSfileV4::ReadHeader()
     return TRUNCATED_FILE;
   }
 
-  m_fish = new TwoFish(m_key, sizeof(m_key));
+  m_fish = MakeFish(m_cipher, m_key, sizeof(m_key));
 
   unsigned char fieldType;
   StringX text;
@@ -1279,9 +1503,10 @@ int PWSfileV4::ReadHeader()
   return SUCCESS;
 }
 
-bool PWSfileV4::IsV4x(const StringX &filename, const StringX &passkey, VERSION &v)
+bool PWSfileV4::IsV4x(const StringX &filename, const StringX &passkey, VERSION &v,
+                      VerifiedKey *pvk)
 {
-  if (CheckPasskey(filename, passkey) == SUCCESS) {
+  if (CheckPasskey(filename, passkey, nullptr, pvk) == SUCCESS) {
     v = V40;
     return true;
   } else
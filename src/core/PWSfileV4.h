@@ -14,23 +14,30 @@
 
 #include "PWSfile.h"
 #include "crypto/TwoFish.h"
+#include "crypto/AES.h"
 #include "crypto/sha256.h"
 #include "crypto/hmac.h"
 #include "UTF8Conv.h"
 
+#include <functional>
+#include <map>
 #include <vector>
 
 class PWSfileV4 : public PWSfile
 {
 public:
-  enum Cipher {PWTwoFish, PWAES};
   enum  {KLEN = 32};
   
+  // If pvk's non-null, it's set to the unwrapped K & L upon success
   static int CheckPasskey(const StringX &filename,
                           const StringX &passkey,
                           FILE *a_fd = nullptr,
-                          unsigned char *aPtag = nullptr, uint32 *nIter = nullptr);
-  static bool IsV4x(const StringX &filename, const StringX &passkey, VERSION &v);
+                          VerifiedKey *pvk = nullptr);
+  static bool IsV4x(const StringX &filename, const StringX &passkey, VERSION &v,
+                    VerifiedKey *pvk = nullptr);
+  static uint32 CalibrateHashIters(uint32 msecs);
+  // Returns a new'ed block cipher keyed with key, caller must delete.
+  static Fish *MakeFish(Cipher cipher, const unsigned char *key, size_t keylen);
 
   PWSfileV4(const StringX &filename, RWmode mode, VERSION version);
   ~PWSfileV4();
@@ -44,16 +51,64 @@ public:
   int WriteRecord(const CItemAtt &att);
   int ReadRecord(CItemAtt &att);
 
-  // Following writes AttIV, AttEK, AttAK, AttContent
-  // and AttContentHMAC per format spec.
-  // All except the content are generated internally.
-  size_t WriteContentFields(unsigned char *content, size_t len);
-  // Following allocates content, caller responsible for deallocating
-  size_t ReadContent(Fish *fish, unsigned char *cbcbuffer,
-                     unsigned char *&content, size_t clen);
+  // An attachment's content is encrypted with its own keys, stored in
+  // its record along with the content's HMAC.
+  struct ContentKeys {
+    unsigned char IV[TwoFish::BLOCKSIZE];
+    unsigned char EK[KLEN];
+    unsigned char AK[KLEN];
+    unsigned char HMAC[SHA256::HASHLEN];
+    ~ContentKeys() {trashMemory(this, sizeof(*this));}
+  };
+  // Number of bytes content of clen takes up in the file
+  static size_t ContentSpan(size_t clen)
+  {return ((clen + TwoFish::BLOCKSIZE - 1) / TwoFish::BLOCKSIZE) * TwoFish::BLOCKSIZE;}
+
+  // Following writes AttIV, AttEK, AttAK, AttContent and AttContentHMAC
+  // per format spec, for content that's in the file it was read from (see
+  // SkipContent()) or spilled to (see SpillContent()), a chunk at a time,
+  // so that it's never all in memory. If that was
+  // encrypted with this file's cipher, it's copied as is, otherwise it's
+  // re-encrypted with keys. Either way, its HMAC's checked along the way,
+  // in case filename's changed since the content was read from it.
+  // Throws(EIO) on failure. Where the content ends up is available via
+  // GetContentOffsets().
+  size_t CopyContentFields(const pws_os::CUUID &attuuid,
+                           const StringX &filename, long offset,
+                           Cipher cipher, const ContentKeys &keys,
+                           size_t clen);
+  // Following skips over the content that follows the AttContent field,
+  // instead of reading it, returning its offset, or -1 if it's not all
+  // there. It's read when needed with StreamContent().
+  long SkipContent(size_t clen);
+  // Following passes content of clen at offset in filename to sink, a
+  // chunk of at most CONTENT_CHUNK at a time, decrypting it first, then
+  // checks its HMAC. Stops if sink returns false.
+  // rawSink, if given, gets each chunk as it's read, before it's decrypted.
+  enum {CONTENT_CHUNK = 65536};
+  typedef std::function<bool(const unsigned char *, size_t)> ContentSink;
+  static int StreamContent(const StringX &filename, long offset,
+                           Cipher cipher, const ContentKeys &keys,
+                           size_t clen, const ContentSink &sink,
+                           const ContentSink &rawSink = nullptr);
+  // Following encrypts content of clen, which producer passes to the sink
+  // it's given a chunk of at most CONTENT_CHUNK at a time, with new keys,
+  // into a new temporary file, laid out as StreamContent() expects, with
+  // PWTwoFish. Returns the keys, the content's HMAC and the file's name.
+  typedef std::function<int(const ContentSink &)> ContentProducer;
+  static int SpillContent(const ContentProducer &producer, size_t clen,
+                          ContentKeys &keys, StringX &filename);
+  // Where CopyContentFields() wrote content to, by attachment
+  const std::map<pws_os::CUUID, long> &GetContentOffsets() const
+  {return m_contentOffsets;}
 
   uint32 GetNHashIters() const {return m_nHashIters;}
   void SetNHashIters(uint32 N) {m_nHashIters = N;}
+  // Cipher's set by Open() for read, and used for new keyblocks and
+  // all content when writing. The format doesn't record it - instead, a
+  // reader tells from which cipher unwraps a keyblock's K (see TryKeyBlock).
+  Cipher GetCipher() const {return m_cipher;}
+  void SetCipher(Cipher cipher) {m_cipher = cipher;}
   
   // Following for low-level details that changed between format versions
   virtual size_t timeFieldLen() const {return 5;} // Experimental
@@ -72,6 +127,9 @@ public:
                      uint nHashIters = MIN_HASH_ITERATIONS);
     bool RemoveKeyBlock(const StringX &passkey); // fails if m_keyblocks.size() <= 1...
     // ... or if passkey doesn't match.
+    // Cipher used to wrap new keyblocks. Set from the file when read.
+    Cipher GetCipher() const {return m_cipher;}
+    void SetCipher(Cipher cipher) {m_cipher = cipher;}
   private:
     friend class PWSfileV4;
     struct KeyBlockFinder; // fwd decl for functor
@@ -87,9 +145,24 @@ public:
       unsigned char m_kw_l[KWLEN];
     };
     std::vector<KeyBlock> m_kbs;
+    Cipher m_cipher;
     
     bool GetKeys(const StringX &passkey, uint32 nHashIters,
-                 unsigned char K[KLEN], unsigned char L[KLEN]); // not const
+                 unsigned char K[KLEN], unsigned char L[KLEN],
+                 Cipher *pcipher = nullptr); // not const
+    // Returns the index of the first keyblock that passkey unlocks, or -1.
+    // Keyblocks are tried concurrently, see implementation.
+    // If pcipher's non-null, it's set to the cipher that unwrapped K & L.
+    int FindKeyBlock(const StringX &passkey,
+                     unsigned char K[KLEN], unsigned char L[KLEN],
+                     Cipher *pcipher = nullptr) const;
+    static bool TryKeyBlock(const KeyBlock &kb, const StringX &passkey,
+                            unsigned char K[KLEN], unsigned char L[KLEN],
+                            const std::function<bool()> &aborted = nullptr,
+                            Cipher *pcipher = nullptr);
+    static bool UnwrapKeys(const KeyBlock &kb, Cipher cipher,
+                           const unsigned char Ptag[SHA256::HASHLEN],
+                           unsigned char K[KLEN], unsigned char L[KLEN]);
 
     KeyBlock &operator[](unsigned i) {return m_kbs[i];}
     const KeyBlock &operator[](unsigned i) const {return m_kbs[i];}
@@ -112,6 +185,7 @@ public:
   unsigned char m_nonce[NONCELEN]; // 256 bit nonce
   ulong64 m_effectiveFileLength; // for read = fileLength - |HMAC|
   Cipher m_cipher;
+  std::map<pws_os::CUUID, long> m_contentOffsets; // see CopyContentFields()
   uint32 m_nHashIters; // mainly for single-user compatibility.
   unsigned char m_ipthing[TwoFish::BLOCKSIZE]; // for CBC
   HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> m_hmac; // L
@@ -120,9 +194,6 @@ public:
   struct KeyBlockWriter;
   int ParseKeyBlocks(const StringX &passkey);
   int ReadKeyBlock(); // can return SUCCESS or END_OF_FILE
-  int TryKeyBlock(unsigned index, const StringX &passkey,
-                  unsigned char K[KLEN], unsigned char L[KLEN],
-                  uint32 &nHashIters);
   void ComputeEndKB(const unsigned char hnonce[SHA256::HASHLEN],
                     unsigned char digest[SHA256::HASHLEN]);
   bool EndKeyBlocks(const unsigned char calc_hnonce[SHA256::HASHLEN]);
@@ -131,8 +202,8 @@ public:
   virtual size_t WriteCBC(unsigned char type, const unsigned char *data,
                           size_t length);
 
-  virtual size_t ReadCBC(unsigned char &type, unsigned char* &data,
-                         size_t &length);
+  virtual void DigestField(unsigned char type, const unsigned char *data,
+                           size_t length); // HMAC
 
   void GetCurrentKeys();
   bool WriteKeyBlocks();
@@ -149,8 +220,10 @@ public:
   void RestoreState();
 
   static int SanityCheck(FILE *stream); // Check for TAG and EOF marker
-  static void StretchKey(const unsigned char *salt, unsigned long saltLen,
+  // Returns false iff aborted() returned true before the KDF completed
+  static bool StretchKey(const unsigned char *salt, unsigned long saltLen,
                          const StringX &passkey, uint32 N,
-                         unsigned char *Ptag, unsigned long PtagLen);
+                         unsigned char *Ptag, unsigned long PtagLen,
+                         const std::function<bool()> &aborted = nullptr);
 };
 #endif /* __PWSFILEV4_H */
@@ -0,0 +1,349 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+#include "PWSjournal.h"
+#include "PWSfileV4.h" // for MakeFish()
+#include "PWSrand.h"
+#include "Util.h"
+
+#include "os/debug.h"
+#include "os/file.h"
+#include "os/logit.h"
+
+#include <errno.h>
+
+using pws_os::CUUID;
+
+static const char JOURNAL_TAG[4] = {'P','W','S','J'}; // ASCII chars, not wchar
+static const stringT JOURNAL_SUFFIX(_S(".pwj"));
+
+stringT PWSjournal::JournalName(const StringX &filename)
+{
+  return stringT(filename.c_str()) + JOURNAL_SUFFIX;
+}
+
+void PWSjournal::Remove(const StringX &filename)
+{
+  const stringT jname = JournalName(filename);
+  if (pws_os::FileExists(jname))
+    pws_os::DeleteAFile(jname);
+}
+
+PWSjournal::PWSjournal(const StringX &filename, RWmode mode, VERSION version,
+                       const JournalBinding &jb)
+  : PWSfile(filename, mode, version), m_jbind(jb)
+{
+  m_IV = m_ipthing;
+  m_terminal = nullptr; // a journal just ends
+  memset(m_ipthing, 0, sizeof(m_ipthing));
+  memset(m_lastMAC, 0, sizeof(m_lastMAC));
+}
+
+PWSjournal::~PWSjournal()
+{
+}
+
+int PWSjournal::Open(const StringX &)
+{
+  PWS_LOGIT;
+
+  ASSERT(m_jbind.IsValid());
+  ASSERT(m_curversion == V30 || m_curversion == V40);
+  const stringT fname(m_filename.c_str());
+  if (m_rw == Read) {
+    m_fd = pws_os::FOpen(fname, _T("rb"));
+  } else if (m_jbind.m_length == 0) { // new journal
+    m_fd = pws_os::FOpen(fname, _T("wb"));
+  } else { // append to existing one
+    m_fd = pws_os::FOpen(fname, _T("r+b"));
+  }
+  if (m_fd == nullptr)
+    return CANT_OPEN_FILE;
+  m_fileLength = pws_os::fileLength(m_fd);
+
+  m_fish = PWSfileV4::MakeFish(m_jbind.m_cipher, m_jbind.m_ekey,
+                               sizeof(m_jbind.m_ekey));
+  ASSERT(m_fish->GetBlockSize() == sizeof(m_ipthing));
+
+  if (m_rw == Read)
+    m_status = ReadHeader();
+  else if (m_jbind.m_length == 0)
+    m_status = WriteHeader();
+  else {
+    // Only append if the journal's still what we last wrote or read.
+    // Chaining goes on from the last block before the last HMAC.
+    const long BS = sizeof(m_ipthing), HL = sizeof(m_lastMAC);
+    m_status = FAILURE;
+    if (m_fileLength == ulong64(m_jbind.m_length) &&
+        fseek(m_fd, m_jbind.m_length - HL - BS, SEEK_SET) == 0 &&
+        fread(m_ipthing, BS, 1, m_fd) == 1 &&
+        fread(m_lastMAC, HL, 1, m_fd) == 1 &&
+        memcmp(m_lastMAC, m_jbind.m_mac, HL) == 0 &&
+        fseek(m_fd, m_jbind.m_length, SEEK_SET) == 0) // needed between read & write
+      m_status = SUCCESS;
+  }
+  return m_status;
+}
+
+int PWSjournal::ReadHeader()
+{
+  unsigned char tag[sizeof(JOURNAL_TAG)];
+  unsigned char digest[JournalBinding::LEN];
+  unsigned char mac[JournalBinding::LEN];
+
+  if (fread(tag, sizeof(tag), 1, m_fd) != 1 ||
+      memcmp(tag, JOURNAL_TAG, sizeof(tag)) != 0 ||
+      fread(digest, sizeof(digest), 1, m_fd) != 1 ||
+      fread(m_ipthing, sizeof(m_ipthing), 1, m_fd) != 1 ||
+      fread(mac, sizeof(mac), 1, m_fd) != 1)
+    return TRUNCATED_FILE;
+
+  // A journal of some other version of the file is of no use
+  if (memcmp(digest, m_jbind.m_digest, sizeof(digest)) != 0)
+    return WRONG_VERSION;
+
+  m_hmac.Init(m_jbind.m_akey, sizeof(m_jbind.m_akey));
+  m_hmac.Update(tag, sizeof(tag));
+  m_hmac.Update(digest, sizeof(digest));
+  m_hmac.Update(m_ipthing, sizeof(m_ipthing));
+  m_hmac.Final(m_lastMAC);
+  return (memcmp(mac, m_lastMAC, sizeof(mac)) == 0) ? SUCCESS : BAD_DIGEST;
+}
+
+int PWSjournal::WriteHeader()
+{
+  PWSrand::GetInstance()->GetRandomData(m_ipthing, sizeof(m_ipthing));
+
+  m_hmac.Init(m_jbind.m_akey, sizeof(m_jbind.m_akey));
+  m_hmac.Update(reinterpret_cast<const unsigned char *>(JOURNAL_TAG),
+                sizeof(JOURNAL_TAG));
+  m_hmac.Update(m_jbind.m_digest, sizeof(m_jbind.m_digest));
+  m_hmac.Update(m_ipthing, sizeof(m_ipthing));
+  m_hmac.Final(m_lastMAC);
+
+  if (fwrite(JOURNAL_TAG, sizeof(JOURNAL_TAG), 1, m_fd) != 1 ||
+      fwrite(m_jbind.m_digest, sizeof(m_jbind.m_digest), 1, m_fd) != 1 ||
+      fwrite(m_ipthing, sizeof(m_ipthing), 1, m_fd) != 1 ||
+      fwrite(m_lastMAC, sizeof(m_lastMAC), 1, m_fd) != 1)
+    return WRITE_FAIL;
+  return SUCCESS;
+}
+
+void PWSjournal::StartBatch()
+{
+  // Each batch's HMAC covers the previous one's, so batches can't be
+  // dropped or reordered without detection
+  m_hmac.Init(m_jbind.m_akey, sizeof(m_jbind.m_akey));
+  m_hmac.Update(m_lastMAC, sizeof(m_lastMAC));
+}
+
+bool PWSjournal::EndBatch(unsigned char mac[JournalBinding::LEN])
+{
+  m_hmac.Final(mac);
+  if (m_rw == Write) {
+    if (!FlushCBC() || fwrite(mac, JournalBinding::LEN, 1, m_fd) != 1)
+      return false;
+  } else {
+    unsigned char d[JournalBinding::LEN];
+    if (fread(d, sizeof(d), 1, m_fd) != 1 ||
+        memcmp(d, mac, sizeof(d)) != 0)
+      return false;
+  }
+  memcpy(m_lastMAC, mac, sizeof(m_lastMAC));
+  return true;
+}
+
+int PWSjournal::WriteRecord(const CItemData &item)
+{
+  ASSERT(m_fd != nullptr);
+  WriteCBC(OP_PUT, nullptr, 0);
+  // Entries are written as they would be to the file the journal's for
+  return (m_curversion == V40) ? item.WriteV4(this) : item.Write(this);
+}
+
+int PWSjournal::ReadRecord(CItemData &item)
+{
+  ASSERT(m_fd != nullptr);
+  // Following CItemData::Read(), with the OP_PUT ahead of the item
+  const int status = item.Read(this);
+  return (status < 0) ? WRONG_RECORD : status;
+}
+
+size_t PWSjournal::WriteCBC(unsigned char type, const StringX &data)
+{
+  const unsigned char *utf8(nullptr);
+  size_t utf8Len(0);
+
+  bool status = m_utf8conv.ToUTF8(data, utf8, utf8Len);
+  if (!status)
+    pws_os::Trace(_T("ToUTF8(%ls) failed\n"), data.c_str());
+  return WriteCBC(type, utf8, utf8Len);
+}
+
+size_t PWSjournal::WriteCBC(unsigned char type, const unsigned char *data,
+                            size_t length)
+{
+  DigestField(type, data, length);
+  return PWSfile::WriteCBC(type, data, length);
+}
+
+void PWSjournal::DigestField(unsigned char type, const unsigned char *data,
+                             size_t length)
+{
+  // As V4: type and length are covered too
+  int32 len32 = static_cast<int>(length);
+  unsigned char buf[4];
+  putInt32(buf, len32);
+
+  m_hmac.Update(&type, 1);
+  m_hmac.Update(buf, sizeof(buf));
+  m_hmac.Update(data, static_cast<unsigned long>(length));
+}
+
+int PWSjournal::Replay(const StringX &filename, VERSION version,
+                       JournalBinding &jb, Changes &changes)
+{
+  PWS_LOGIT;
+
+  changes.puts.clear();
+  changes.deletes.clear();
+  if (!jb.IsValid())
+    return FAILURE;
+  jb.m_length = 0;
+  const stringT jname = JournalName(filename);
+  if (!pws_os::FileExists(jname))
+    return SUCCESS;
+
+  PWSjournal j(StringX(jname.c_str()), Read, version, jb);
+  int status = j.Open(StringX());
+  if (status == WRONG_VERSION) {
+    // Left over from a save that didn't get to remove it
+    j.Close();
+    pws_os::DeleteAFile(jname);
+    return SUCCESS;
+  }
+  if (status != SUCCESS) {
+    j.Close();
+    jb.m_length = -1;
+    return FAILURE;
+  }
+  jb.m_length = long(HEADER_LEN);
+  memcpy(jb.m_mac, j.m_lastMAC, sizeof(jb.m_mac));
+
+  // Batches are applied only once their HMAC's verified
+  Changes batch;
+  bool inBatch = false;
+  j.StartBatch();
+  for (;;) {
+    unsigned char type;
+    const unsigned char *data;
+    size_t length;
+    const size_t numRead = j.ReadFieldView(type, data, length);
+    if (numRead == 0 || numRead == size_t(-1)) {
+      if (inBatch) // truncated, e.g., by a crash while appending
+        status = TRUNCATED_FILE;
+      break;
+    }
+    inBatch = true;
+    if (type == OP_PUT) {
+      CItemData item;
+      if (j.ReadRecord(item) != SUCCESS || !item.HasUUID()) {
+        status = FAILURE;
+        break;
+      }
+      const CUUID uuid = item.GetUUID();
+      batch.deletes.erase(uuid);
+      batch.puts[uuid] = item;
+    } else if (type == OP_DELETE && length == sizeof(uuid_array_t)) {
+      const CUUID uuid(*reinterpret_cast<const uuid_array_t *>(data));
+      batch.puts.erase(uuid);
+      batch.deletes.insert(uuid);
+    } else if (type == OP_COMMIT) {
+      unsigned char mac[JournalBinding::LEN];
+      if (!j.EndBatch(mac)) {
+        status = BAD_DIGEST;
+        break;
+      }
+      for (auto &p : batch.puts) {
+        changes.deletes.erase(p.first);
+        changes.puts[p.first] = p.second;
+      }
+      for (const auto &uuid : batch.deletes) {
+        changes.puts.erase(uuid);
+        changes.deletes.insert(uuid);
+      }
+      batch.puts.clear();
+      batch.deletes.clear();
+      inBatch = false;
+      jb.m_length = j.GetOffset();
+      memcpy(jb.m_mac, mac, sizeof(jb.m_mac));
+      j.StartBatch();
+    } else {
+      status = FAILURE;
+      break;
+    }
+  }
+  j.Close();
+
+  if (status != SUCCESS) {
+    pws_os::Trace(_T("PWSjournal::Replay: damaged after %ld bytes\n"), jb.m_length);
+    jb.m_length = -1;
+  }
+  return status;
+}
+
+int PWSjournal::Append(const StringX &filename, VERSION version,
+                       JournalBinding &jb, const ItemList &items,
+                       const UUIDSet &changed)
+{
+  PWS_LOGIT;
+
+  if (!jb.IsValid() || jb.m_length < 0)
+    return FAILURE;
+
+  PWSjournal j(StringX(JournalName(filename).c_str()), Write, version, jb);
+  int status = j.Open(StringX());
+  unsigned char mac[JournalBinding::LEN];
+  long length = 0;
+
+  try { // exception thrown on write error
+    if (status == SUCCESS) {
+      j.StartBatch();
+      for (const auto &uuid : changed) {
+        auto iter = items.find(uuid);
+        if (iter != items.end()) {
+          if (j.WriteRecord(iter->second) != SUCCESS)
+            throw(EIO);
+        } else {
+          uuid_array_t ua;
+          uuid.GetARep(ua);
+          j.WriteCBC(OP_DELETE, ua, sizeof(ua));
+        }
+      }
+      j.WriteCBC(OP_COMMIT, nullptr, 0);
+      if (!j.EndBatch(mac))
+        throw(EIO);
+      length = ftell(j.m_fd); // not GetOffset(), as it's not flushed yet
+    }
+  }
+  catch (...) {
+    status = WRITE_FAIL;
+  }
+  // Close() has the OS put the batch on disk before we report success
+  const int closeStatus = j.Close();
+  if (status == SUCCESS)
+    status = closeStatus;
+
+  if (status == SUCCESS) {
+    jb.m_length = length;
+    memcpy(jb.m_mac, mac, sizeof(jb.m_mac));
+  } else {
+    // Whatever made it to disk won't verify, but we can't append after it
+    jb.m_length = -1;
+  }
+  return status;
+}
@@ -0,0 +1,95 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+#ifndef __PWSJOURNAL_H
+#define __PWSJOURNAL_H
+
+// PWSjournal.h
+// An append-only journal of changes to the entries of a V3 or V4 file,
+// kept next to it, so that saving a few changes doesn't require
+// rewriting the whole file. See docs/formatJournal.txt
+//-----------------------------------------------------------------------------
+
+#include "PWSfile.h"
+#include "crypto/TwoFish.h"
+#include "crypto/sha256.h"
+#include "crypto/hmac.h"
+#include "UTF8Conv.h"
+#include "coredefs.h"
+
+class PWSjournal : public PWSfile
+{
+public:
+  // Entries added or changed (puts) and deleted, by the journal as a whole
+  struct Changes {
+    ItemList puts;
+    UUIDSet deletes;
+    bool empty() const {return puts.empty() && deletes.empty();}
+    bool Supersedes(const pws_os::CUUID &uuid) const
+    {return puts.find(uuid) != puts.end() || deletes.find(uuid) != deletes.end();}
+  };
+
+  static stringT JournalName(const StringX &filename);
+
+  // Reads the journal of filename, if any, into changes.
+  // Returns SUCCESS if there's none, or all of it verified.
+  // A journal for a different version of filename is deleted.
+  // If its tail is damaged or truncated, changes has what verified
+  // before that, and FAILURE's returned: jb's then marked as unappendable,
+  // so the next save has to be a full one.
+  static int Replay(const StringX &filename, VERSION version,
+                    JournalBinding &jb, Changes &changes);
+
+  // Appends the current state of the entries in changed to the journal,
+  // as one batch: those in items are written in full, others as deleted.
+  // Fails if the journal isn't where jb says it ends, or with its HMAC.
+  static int Append(const StringX &filename, VERSION version,
+                    JournalBinding &jb, const ItemList &items,
+                    const UUIDSet &changed);
+
+  // Deletes filename's journal, if any
+  static void Remove(const StringX &filename);
+
+  // Journal's length in bytes, 0 if there's none, -1 if it's not appendable
+  static long Length(const JournalBinding &jb) {return jb.m_length;}
+
+  ~PWSjournal();
+
+  virtual int Open(const StringX &passkey); // passkey's unused, see JournalBinding
+
+  virtual int WriteRecord(const CItemData &item);
+  virtual int ReadRecord(CItemData &item);
+
+  // Same as the file the journal belongs to
+  virtual size_t timeFieldLen() const {return m_curversion == V40 ? 5 : 4;}
+
+private:
+  enum {OP_PUT = 0x01, OP_DELETE = 0x02, OP_COMMIT = 0x03};
+  enum {HEADER_LEN = 4 + 32 + TwoFish::BLOCKSIZE + 32}; // tag, digest, IV, HMAC
+
+  PWSjournal(const StringX &filename, RWmode mode, VERSION version,
+             const JournalBinding &jb);
+
+  int ReadHeader();
+  int WriteHeader();
+  void StartBatch();
+  bool EndBatch(unsigned char mac[JournalBinding::LEN]);
+
+  virtual size_t WriteCBC(unsigned char type, const StringX &data);
+  virtual size_t WriteCBC(unsigned char type, const unsigned char *data,
+                          size_t length);
+  virtual void DigestField(unsigned char type, const unsigned char *data,
+                           size_t length); // HMAC
+
+  const JournalBinding &m_jbind;
+  unsigned char m_ipthing[TwoFish::BLOCKSIZE]; // for CBC
+  unsigned char m_lastMAC[JournalBinding::LEN];
+  HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> m_hmac;
+  CUTF8Conv m_utf8conv;
+  PWSjournal& operator=(const PWSjournal&) = delete; // Do not implement
+};
+#endif /* __PWSJOURNAL_H */
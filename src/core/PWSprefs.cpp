@@ -131,6 +131,7 @@ const PWSprefs::boolPref PWSprefs::m_bool_prefs[NumBoolPrefs] = {
   {_T("VKPlaySound"), false, ptApplication},                //application
   {_T("ListSortAscending"), true, ptApplication},           //application
   {_T("EnableWindowTransparency"), false, ptApplication },  //application
+  {_T("UseChangeJournal"), false, ptApplication},           //application
 };
 
 // Default value = -1 means set at runtime
@@ -128,6 +128,7 @@ public:
     VKPlaySound, // Windows only
     ListSortAscending,
     EnableWindowTransparency,
+    UseChangeJournal,
     NumBoolPrefs};
 
   enum IntPrefs {Column1Width, Column2Width, Column3Width, Column4Width,
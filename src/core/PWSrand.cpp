@@ -52,6 +52,7 @@ void PWSrand::AddEntropy(unsigned char *bytes, unsigned int numBytes)
 {
   ASSERT(bytes != nullptr);
 
+  std::lock_guard<std::mutex> guard(m_mutex);
   SHA256 s;
 
   s.Update(K, sizeof(K));
@@ -75,6 +76,12 @@ void PWSrand::NextRandBlock()
 }
 
 void PWSrand::GetRandomData( void * const buffer, unsigned long length )
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  FillRandomData(buffer, length);
+}
+
+void PWSrand::FillRandomData(void * const buffer, unsigned long length)
 {
   if (!m_IsInternalPRNG) {
     bool status;
@@ -114,9 +121,10 @@ unsigned int PWSrand::RandUInt()
   // we don't want to keep filling the random buffer for each number we
   // want, so fill the buffer with random data and use it up
 
+  std::lock_guard<std::mutex> guard(m_mutex);
   if (ibRandomData > (SHA256::HASHLEN - sizeof(uint32))) {
     // no data left, refill the buffer
-    GetRandomData(rgbRandomData, SHA256::HASHLEN);
+    FillRandomData(rgbRandomData, SHA256::HASHLEN);
     ibRandomData = 0;
   }
 
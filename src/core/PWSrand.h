@@ -13,6 +13,8 @@
 
 #include "crypto/sha256.h"
 
+#include <mutex>
+
 class PWSrand
 {
 public:
@@ -32,7 +34,11 @@ private:
   ~PWSrand();
 
   void NextRandBlock();
+  void FillRandomData(void * const buffer, unsigned long length);
   static PWSrand *self;
+  // Entries are edited on the UI thread while a background save
+  // (see PWScore::ScheduleSave) generates IVs and keys on its own
+  std::mutex m_mutex;
   bool m_IsInternalPRNG;
   unsigned char K[SHA256::HASHLEN];
   unsigned char R[SHA256::HASHLEN];
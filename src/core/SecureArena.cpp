@@ -0,0 +1,217 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+/// \file SecureArena.cpp
+//-----------------------------------------------------------------------------
+
+#include "SecureArena.h"
+#include "os/mem.h"
+
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace {
+const size_t MIN_BLOCK = 16;
+const unsigned NCLASSES = 8; // 16 to 2048 bytes
+const size_t MAX_BLOCK = MIN_BLOCK << (NCLASSES - 1);
+const size_t CHUNK_SIZE = 256 * 1024; // locked pages reserved at a time
+const unsigned REFILL = 16; // blocks a thread takes from the arena at a time
+const unsigned MAX_CACHED = 64; // per class, before a thread gives half back
+
+// Free blocks are linked through their first bytes
+struct Block {
+  Block *next;
+};
+
+// Calling memset through a volatile pointer stops it being optimized away
+void *(*const volatile wipe)(void *, int, size_t) = std::memset;
+
+unsigned SizeClass(size_t size)
+{
+  unsigned c = 0;
+  while ((MIN_BLOCK << c) < size)
+    c++;
+  return c;
+}
+
+// The pages all threads' blocks come from, with the free blocks they've
+// given back
+class Arena
+{
+public:
+  Arena() : m_chunk(nullptr), m_left(0)
+  {
+    for (unsigned c = 0; c < NCLASSES; c++)
+      m_free[c] = nullptr;
+    NewChunk(); // so that the first few secrets needn't wait for it
+  }
+
+  // Pushes up to n blocks of class c onto list, returns how many
+  unsigned Take(unsigned c, Block *&list, unsigned n)
+  {
+    const size_t size = MIN_BLOCK << c;
+    std::lock_guard<std::mutex> guard(m_mutex);
+    unsigned i;
+    for (i = 0; i < n; i++) {
+      Block *b = m_free[c];
+      if (b != nullptr) {
+        m_free[c] = b->next;
+      } else {
+        // Whatever's left of a chunk that's too small is wasted, but
+        // that's at most a largest block per chunk
+        if (m_left < size && !NewChunk())
+          break;
+        b = reinterpret_cast<Block *>(m_chunk); // fresh pages are zeroed
+        m_chunk += size;
+        m_left -= size;
+      }
+      b->next = list;
+      list = b;
+    }
+    return i;
+  }
+
+  // Takes back the blocks of class c linked from first to last
+  void Give(unsigned c, Block *first, Block *last)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    last->next = m_free[c];
+    m_free[c] = first;
+  }
+
+private:
+  bool NewChunk()
+  {
+    void *p = pws_os::allocLockedPages(CHUNK_SIZE);
+    if (p == nullptr)
+      return false;
+    m_chunk = static_cast<unsigned char *>(p);
+    m_left = CHUNK_SIZE;
+    return true;
+  }
+
+  std::mutex m_mutex;
+  Block *m_free[NCLASSES];
+  unsigned char *m_chunk; // where the next new block's carved from
+  size_t m_left;
+};
+
+// Never deleted, as StringXs may be released by static destructors
+Arena &TheArena()
+{
+  static Arena *arena = new Arena;
+  return *arena;
+}
+
+// Each thread's free blocks. Trivially destructible, so that it can
+// still be checked as the thread exits, after CacheReturner has run.
+struct Cache {
+  Block *free[NCLASSES];
+  unsigned count[NCLASSES];
+  bool active, gone;
+};
+
+thread_local Cache t_cache;
+
+struct CacheReturner {
+  void Register() {} // using it is what has its destructor called
+  ~CacheReturner()
+  {
+    for (unsigned c = 0; c < NCLASSES; c++) {
+      if (t_cache.free[c] != nullptr) {
+        Block *last = t_cache.free[c];
+        while (last->next != nullptr)
+          last = last->next;
+        TheArena().Give(c, t_cache.free[c], last);
+        t_cache.free[c] = nullptr;
+        t_cache.count[c] = 0;
+      }
+    }
+    t_cache.active = false;
+    t_cache.gone = true;
+  }
+};
+
+thread_local CacheReturner t_returner;
+
+// The thread's cache, or nullptr if the thread's exiting
+Cache *ThreadCache()
+{
+  if (!t_cache.active) {
+    if (t_cache.gone)
+      return nullptr;
+    t_returner.Register();
+    t_cache.active = true;
+  }
+  return &t_cache;
+}
+} // anonymous namespace
+
+void *SecureArena::Allocate(size_t size)
+{
+  if (size > MAX_BLOCK) {
+    // Rare enough, and big enough, to be worth a mapping of its own
+    void *p = pws_os::allocLockedPages(size);
+    if (p == nullptr)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  const unsigned c = SizeClass(size);
+  Block *b = nullptr;
+  Cache *cache = ThreadCache();
+  if (cache == nullptr) {
+    if (TheArena().Take(c, b, 1) == 0)
+      throw std::bad_alloc();
+  } else {
+    if (cache->free[c] == nullptr) {
+      cache->count[c] = TheArena().Take(c, cache->free[c], REFILL);
+      if (cache->count[c] == 0)
+        throw std::bad_alloc();
+    }
+    b = cache->free[c];
+    cache->free[c] = b->next;
+    cache->count[c]--;
+  }
+  b->next = nullptr; // as it was wiped, the block's now all zeros
+  return b;
+}
+
+void SecureArena::Release(void *p, size_t size)
+{
+  if (p == nullptr)
+    return;
+
+  // Only what was asked for can have been written to
+  wipe(p, 0, size);
+
+  if (size > MAX_BLOCK) {
+    pws_os::freeLockedPages(p, size);
+    return;
+  }
+
+  const unsigned c = SizeClass(size);
+  Block *b = static_cast<Block *>(p);
+  Cache *cache = ThreadCache();
+  if (cache == nullptr) {
+    TheArena().Give(c, b, b);
+    return;
+  }
+
+  b->next = cache->free[c];
+  cache->free[c] = b;
+  if (++cache->count[c] > MAX_CACHED) {
+    // Give half back, for other threads to use
+    Block *last = b;
+    for (unsigned i = 1; i < MAX_CACHED / 2; i++)
+      last = last->next;
+    cache->free[c] = last->next;
+    cache->count[c] -= MAX_CACHED / 2;
+    TheArena().Give(c, b, last);
+  }
+}
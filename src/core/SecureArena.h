@@ -0,0 +1,39 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// SecureArena.h
+//-----------------------------------------------------------------------------
+
+#ifndef __SECUREARENA_H
+#define __SECUREARENA_H
+
+/**
+ * Memory for secrets: StringX's buffers, decrypted fields, etc.
+ *
+ * Small blocks come in a few size classes, carved from pages that are
+ * locked in RAM and kept out of core dumps (see pws_os::allocLockedPages),
+ * and are recycled through per-thread free lists, so most allocations
+ * take neither a lock nor a trip to the heap. Larger ones, e.g., an
+ * attachment's content, get locked pages of their own, rounded up to
+ * whole pages and unmapped when released. Either way, blocks are wiped
+ * when released.
+ *
+ * Doesn't include anything that uses StringX, so that StringX.h can
+ * include it.
+ */
+
+#include <cstddef>
+
+namespace SecureArena
+{
+  // Throws std::bad_alloc on failure, as new would
+  void *Allocate(size_t size);
+  // size must be the same as was passed to Allocate()
+  void Release(void *p, size_t size);
+}
+
+#endif /* __SECUREARENA_H */
@@ -14,7 +14,8 @@
  *
  * STL-based implementation of secure strings.
  * Like std::string in all respects, except that
- * memory is scrubbed before being returned to system.
+ * memory comes from the SecureArena, so it's kept out of
+ * swap and core dumps, and is scrubbed when released.
  *
  */
 
@@ -22,11 +23,11 @@
 #include <memory>
 #include <limits>
 #include <cstddef> // for ptrdiff_t
-#include <cstdlib> // for malloc
 #include <cstring> // for memset
 
 #include "os/typedefs.h"
 #include "PwsPlatform.h"
+#include "SecureArena.h"
 
 // Using extern definition here instead of including "Util.h" because Util.h
 // references the StringX class and by including "Util.h" here, the StringX
@@ -97,16 +98,10 @@ namespace S_Alloc
       // Allocate raw memory
       pointer allocate(size_type n, const_pointer hint = nullptr) {
         UNREFERENCED_PARAMETER(hint);
-        pointer p = static_cast<pointer>(std::malloc(n * sizeof(T)));
-        if (p == nullptr)
-          throw std::bad_alloc();
-        return p;
+        return static_cast<pointer>(SecureArena::Allocate(n * sizeof(T)));
       }
 
-#ifdef _WIN32
-#pragma optimize("", off)
-#endif
-      // Free raw memory.
+      // Free raw memory, which Release() wipes.
       // Note that C++ standard defines this function as:
       //   deallocate(pointer p, size_type n).
       void deallocate(pointer p, size_type n) {
@@ -117,15 +112,8 @@ namespace S_Alloc
         if (p == nullptr)
           return;
 
-        if (n > 0) {
-          const size_type N = n * sizeof(T);
-          trashMemory(static_cast<void *>(p), N);
-        }
-        std::free(p);
+        SecureArena::Release(static_cast<void *>(p), n * sizeof(T));
       }
-#ifdef _WIN32
-#pragma optimize("", on)
-#endif
 
     private:
       // No data
@@ -52,6 +52,16 @@ public:
   // UpdateWizard: called to update text in Wizard during export Text/XML.
   virtual void UpdateWizard(const stringT &) {}
 
+  // SaveReady: called when a save started by PWScore::ScheduleSave() has
+  // been written. NOTE: this is called on the thread that did the writing,
+  // so it must not touch the core. The UI should arrange for
+  // PWScore::CompleteSave() to be called on its own thread.
+  virtual void SaveReady() {}
+
+  // DatabaseSaved: called by PWScore::CompleteSave() with the status of
+  // the save started by PWScore::ScheduleSave() and the file written.
+  virtual void DatabaseSaved(int /* status */, const StringX &/* filename */) {}
+
   virtual ~Observer() {}
 };
 
@@ -0,0 +1,300 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// UUIDMap.h
+//-----------------------------------------------------------------------------
+
+#ifndef __UUIDMAP_H
+#define __UUIDMAP_H
+
+/**
+ * A hash map keyed on UUIDs, for the lists of entries, which are looked
+ * up by UUID far more often than they're changed.
+ *
+ * Lookups probe an open-addressed table of pointers to the entries.
+ * The entries themselves are kept in a list, so that, as with std::map,
+ * iterators and pointers to an entry stay valid until it's erased - the
+ * UIs keep pointers to entries.
+ *
+ * Iteration's in the order entries were added. Use SortedByKey() where
+ * the order should only depend on what's in the map, e.g., to write it.
+ */
+
+#include "os/UUID.h"
+
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<class T>
+class UUIDMap
+{
+  struct Link {
+    Link *prev, *next;
+  };
+
+  struct Node : Link {
+    template<class... Args>
+    explicit Node(Args&&... args) : value(std::forward<Args>(args)...) {}
+    std::pair<const pws_os::CUUID, T> value;
+  };
+
+  template<class V, class L>
+  class Iterator
+  {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef V value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef V *pointer;
+    typedef V &reference;
+
+    Iterator() : m_link(nullptr) {}
+    // iterator converts to const_iterator, but not the other way round
+    template<class V2, class L2, class = typename
+             std::enable_if<std::is_convertible<L2 *, L *>::value>::type>
+    Iterator(const Iterator<V2, L2> &that) : m_link(that.m_link) {}
+
+    reference operator*() const {return static_cast<Node *>(const_cast<Link *>(m_link))->value;}
+    pointer operator->() const {return &**this;}
+    Iterator &operator++() {m_link = m_link->next; return *this;}
+    Iterator operator++(int) {Iterator tmp(*this); ++*this; return tmp;}
+    Iterator &operator--() {m_link = m_link->prev; return *this;}
+    Iterator operator--(int) {Iterator tmp(*this); --*this; return tmp;}
+    template<class V2, class L2>
+    bool operator==(const Iterator<V2, L2> &that) const {return m_link == that.m_link;}
+    template<class V2, class L2>
+    bool operator!=(const Iterator<V2, L2> &that) const {return m_link != that.m_link;}
+
+  private:
+    friend class UUIDMap;
+    template<class V2, class L2> friend class Iterator;
+    explicit Iterator(L *link) : m_link(link) {}
+    L *m_link;
+  };
+
+public:
+  typedef pws_os::CUUID key_type;
+  typedef T mapped_type;
+  typedef std::pair<const pws_os::CUUID, T> value_type;
+  typedef size_t size_type;
+  typedef Iterator<value_type, Link> iterator;
+  typedef Iterator<const value_type, const Link> const_iterator;
+
+  UUIDMap() : m_size(0) {m_head.prev = m_head.next = &m_head;}
+  UUIDMap(const UUIDMap &that) : UUIDMap() {*this = that;}
+  UUIDMap(UUIDMap &&that) noexcept : UUIDMap() {swap(that);}
+  ~UUIDMap() {clear();}
+
+  UUIDMap &operator=(const UUIDMap &that)
+  {
+    if (this != &that) {
+      clear();
+      reserve(that.size());
+      for (const auto &v : that)
+        emplace(v.first, v.second);
+    }
+    return *this;
+  }
+
+  UUIDMap &operator=(UUIDMap &&that) noexcept
+  {
+    if (this != &that) {
+      clear();
+      swap(that);
+    }
+    return *this;
+  }
+
+  void swap(UUIDMap &that) noexcept
+  {
+    std::swap(m_head, that.m_head);
+    std::swap(m_size, that.m_size);
+    m_slots.swap(that.m_slots);
+    // The ends of the lists point at the other's head
+    Relink();
+    that.Relink();
+  }
+
+  iterator begin() {return iterator(m_head.next);}
+  iterator end() {return iterator(&m_head);}
+  const_iterator begin() const {return const_iterator(m_head.next);}
+  const_iterator end() const {return const_iterator(&m_head);}
+
+  size_type size() const {return m_size;}
+  bool empty() const {return m_size == 0;}
+
+  void clear()
+  {
+    Link *link = m_head.next;
+    while (link != &m_head) {
+      Link *next = link->next;
+      delete static_cast<Node *>(link);
+      link = next;
+    }
+    m_head.prev = m_head.next = &m_head;
+    m_size = 0;
+    m_slots.clear();
+  }
+
+  void reserve(size_type n)
+  {
+    // Keep the table at most half full, so probes stay short
+    size_type capacity = 8;
+    while (capacity < 2 * n)
+      capacity *= 2;
+    if (capacity > m_slots.size())
+      Rehash(capacity);
+  }
+
+  iterator find(const key_type &key)
+  {
+    const size_t i = Probe(key);
+    return m_slots.empty() || m_slots[i] == nullptr ? end() : iterator(m_slots[i]);
+  }
+
+  const_iterator find(const key_type &key) const
+  {
+    const size_t i = Probe(key);
+    return m_slots.empty() || m_slots[i] == nullptr ? end() : const_iterator(m_slots[i]);
+  }
+
+  size_type count(const key_type &key) const {return find(key) == end() ? 0 : 1;}
+
+  template<class... Args>
+  std::pair<iterator, bool> emplace(const key_type &key, Args&&... args)
+  {
+    reserve(m_size + 1);
+    const size_t i = Probe(key);
+    if (m_slots[i] != nullptr)
+      return std::make_pair(iterator(m_slots[i]), false);
+
+    Node *node = new Node(std::piecewise_construct, std::forward_as_tuple(key),
+                          std::forward_as_tuple(std::forward<Args>(args)...));
+    node->prev = m_head.prev;
+    node->next = &m_head;
+    m_head.prev->next = node;
+    m_head.prev = node;
+    m_slots[i] = node;
+    m_size++;
+    return std::make_pair(iterator(node), true);
+  }
+
+  std::pair<iterator, bool> insert(const value_type &value)
+  {return emplace(value.first, value.second);}
+
+  std::pair<iterator, bool> insert(value_type &&value)
+  {return emplace(value.first, std::move(value.second));}
+
+  T &operator[](const key_type &key) {return emplace(key).first->second;}
+
+  iterator erase(const_iterator pos)
+  {
+    Node *node = static_cast<Node *>(const_cast<Link *>(pos.m_link));
+    Link *next = node->next;
+    Unslot(Probe(node->value.first));
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    delete node;
+    m_size--;
+    return iterator(next);
+  }
+
+  iterator erase(iterator pos) {return erase(const_iterator(pos));}
+
+  size_type erase(const key_type &key)
+  {
+    const_iterator pos = find(key);
+    if (pos == end())
+      return 0;
+    erase(pos);
+    return 1;
+  }
+
+  // All entries, in order of their UUIDs
+  std::vector<iterator> SortedByKey()
+  {
+    std::vector<iterator> sorted;
+    sorted.reserve(m_size);
+    for (iterator iter = begin(); iter != end(); ++iter)
+      sorted.push_back(iter);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const iterator &a, const iterator &b) {return a->first < b->first;});
+    return sorted;
+  }
+
+  std::vector<const_iterator> SortedByKey() const
+  {
+    std::vector<const_iterator> sorted;
+    sorted.reserve(m_size);
+    for (const_iterator iter = begin(); iter != end(); ++iter)
+      sorted.push_back(iter);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const const_iterator &a, const const_iterator &b) {return a->first < b->first;});
+    return sorted;
+  }
+
+private:
+  // Slot holding key's node, or the empty one where it'd go
+  size_t Probe(const key_type &key) const
+  {
+    if (m_slots.empty())
+      return 0;
+    const size_t mask = m_slots.size() - 1;
+    size_t i = key.Hash() & mask;
+    while (m_slots[i] != nullptr && !(m_slots[i]->value.first == key))
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  // Empties slot i, moving back any nodes that probed past it
+  void Unslot(size_t i)
+  {
+    const size_t mask = m_slots.size() - 1;
+    size_t j = i;
+    for (;;) {
+      j = (j + 1) & mask;
+      if (m_slots[j] == nullptr)
+        break;
+      const size_t home = m_slots[j]->value.first.Hash() & mask;
+      // Can j's node move to i, i.e., is i between its home and j (cyclically)?
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        m_slots[i] = m_slots[j];
+        i = j;
+      }
+    }
+    m_slots[i] = nullptr;
+  }
+
+  void Rehash(size_t capacity)
+  {
+    m_slots.assign(capacity, nullptr);
+    for (Link *link = m_head.next; link != &m_head; link = link->next) {
+      Node *node = static_cast<Node *>(link);
+      m_slots[Probe(node->value.first)] = node;
+    }
+  }
+
+  void Relink()
+  {
+    if (m_size == 0) {
+      m_head.prev = m_head.next = &m_head;
+    } else {
+      m_head.next->prev = &m_head;
+      m_head.prev->next = &m_head;
+    }
+  }
+
+  Link m_head; // of a circular list, so end() can be decremented
+  size_type m_size;
+  std::vector<Node *> m_slots; // size's a power of two, or 0 if unused
+};
+
+#endif /* __UUIDMAP_H */
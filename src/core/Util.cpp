@@ -35,18 +35,12 @@
 #endif
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 
 #include <errno.h>
 
 using namespace std;
 
-// used by CBC routines...
-static void xormem(unsigned char *mem1, const unsigned char *mem2, int length)
-{
-  for (int x = 0; x < length; x++)
-    mem1[x] ^= mem2[x];
-}
-
 //-----------------------------------------------------------------------------
 //Overwrite the memory
 // used to be a loop here, but this was deemed (1) overly paranoid
@@ -93,11 +87,20 @@ void burnStack(unsigned long len)
     burnStack(len - sizeof(buf));
 }
 
+// -1 if PWS_PK_CP_ACP decides, else whether ConvertPasskey() uses UTF-8
+static thread_local int t_passkeyUTF8 = -1;
+
+void SetThreadPasskeyEncoding(bool isUTF8)
+{
+  t_passkeyUTF8 = isUTF8 ? 1 : 0;
+}
+
 void ConvertPasskey(const StringX &text,
                    unsigned char *&txt,
                    size_t &txtlen)
 {
-  bool isUTF8 = pws_os::getenv("PWS_PK_CP_ACP", false).empty();
+  bool isUTF8 = (t_passkeyUTF8 < 0) ?
+    pws_os::getenv("PWS_PK_CP_ACP", false).empty() : (t_passkeyUTF8 != 0);
   LPCTSTR txtstr = text.c_str();
   txtlen = text.length();
 
@@ -191,9 +194,7 @@ size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length, unsigned
     buffer += len1;
   }
 
-  xormem(curblock, cbcbuffer, BS); // do the CBC thing
-  Algorithm->Encrypt(curblock, curblock);
-  memcpy(cbcbuffer, curblock, BS); // update CBC for next round
+  Algorithm->CBCEncrypt(curblock, 1, cbcbuffer); // also updates cbcbuffer
 
   numWritten = fwrite(curblock, 1, BS, fp);
   if (numWritten != BS) {
@@ -216,44 +217,42 @@ size_t _writecbc(FILE *fp, const unsigned char *buffer, size_t length,
   const unsigned int BS = Algorithm->GetBlockSize();
   size_t numWritten = 0;
 
-  // some trickery to avoid new/delete
-  unsigned char block1[16];
-
-  unsigned char *curblock = nullptr;
-  ASSERT(BS <= sizeof(block1)); // if needed we can be more sophisticated here...
-
-  // First encrypt and write the length of the buffer
-  curblock = block1;
-  // Fill unused bytes of length with random data, to make
-  // a dictionary attack harder
-  PWSrand::GetInstance()->GetRandomData(curblock, BS);
+  // Whole blocks are copied and encrypted a chunk at a time, so that the
+  // cipher and fwrite are called per chunk rather than per block.
+  unsigned char chunk[4096];
+  ASSERT(BS <= sizeof(chunk) && (sizeof(chunk) % BS) == 0);
 
   if (length > 0 ||
       (BS == 8 && length == 0)) { // This part for bwd compat w/pre-3 format
-    size_t BlockLength = ((length + (BS - 1)) / BS) * BS;
-    if (BlockLength == 0 && BS == 8)
-      BlockLength = BS;
-
-    // Now, encrypt and write the (rest of the) buffer
-    for (unsigned int x = 0; x < BlockLength; x += BS) {
-      if ((length == 0) || ((length % BS != 0) && (length - x < BS))) {
-        //This is for an uneven last block
-        PWSrand::GetInstance()->GetRandomData(curblock, BS);
-        memcpy(curblock, buffer + x, length % BS);
-      } else
-        memcpy(curblock, buffer + x, BS);
-      xormem(curblock, cbcbuffer, BS);
-      Algorithm->Encrypt(curblock, curblock);
-      memcpy(cbcbuffer, curblock, BS);
-      size_t nw =  fwrite(curblock, 1, BS, fp);
+    const size_t wholeLength = (length / BS) * BS;
+
+    for (size_t x = 0; x < wholeLength; x += sizeof(chunk)) {
+      const size_t n = std::min(sizeof(chunk), wholeLength - x);
+      memcpy(chunk, buffer + x, n);
+      Algorithm->CBCEncrypt(chunk, n / BS, cbcbuffer);
+      size_t nw = fwrite(chunk, 1, n, fp);
+      if (nw != n) {
+        trashMemory(chunk, sizeof(chunk));
+        throw(EIO);
+      }
+      numWritten += nw;
+    }
+
+    if (length == 0 || wholeLength != length) {
+      // This is for an uneven last block (or an empty pre-3 one),
+      // with unused bytes filled with random data
+      PWSrand::GetInstance()->GetRandomData(chunk, BS);
+      memcpy(chunk, buffer + wholeLength, length - wholeLength);
+      Algorithm->CBCEncrypt(chunk, 1, cbcbuffer);
+      size_t nw = fwrite(chunk, 1, BS, fp);
       if (nw != BS) {
-        trashMemory(curblock, BS);
+        trashMemory(chunk, sizeof(chunk));
         throw(EIO);
       }
       numWritten += nw;
     }
   }
-  trashMemory(curblock, BS);
+  trashMemory(chunk, sizeof(chunk));
   return numWritten;
 }
 
@@ -284,8 +283,6 @@ size_t _readcbc(FILE *fp,
   // some trickery to avoid new/delete
  // Initialize memory.  (Lockheed Martin) Secure Coding  11-14-2007
   unsigned char block1[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-  unsigned char block2[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-  unsigned char block3[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
   unsigned char *lengthblock = nullptr;
 
   ASSERT(BS <= sizeof(block1)); // if needed we can be more sophisticated here...
@@ -306,12 +303,7 @@ size_t _readcbc(FILE *fp,
     memcmp(lengthblock, TERMINAL_BLOCK, BS) == 0)
     return static_cast<size_t>(-1);
 
-  unsigned char *lcpy = block2;
-  memcpy(lcpy, lengthblock, BS);
-
-  Algorithm->Decrypt(lengthblock, lengthblock);
-  xormem(lengthblock, cbcbuffer, BS);
-  memcpy(cbcbuffer, lcpy, BS);
+  Algorithm->CBCDecrypt(lengthblock, 1, cbcbuffer); // also updates cbcbuffer
 
   size_t length = getInt32(lengthblock);
 
@@ -354,14 +346,8 @@ size_t _readcbc(FILE *fp,
 
   if (length > 0 ||
       (BS == 8 && length == 0)) { // pre-3 pain
-    unsigned char *tempcbc = block3;
     numRead += fread(b, 1, BlockLength, fp);
-    for (unsigned int x = 0; x < BlockLength; x += BS) {
-      memcpy(tempcbc, b + x, BS);
-      Algorithm->Decrypt(b + x, b + x);
-      xormem(b + x, cbcbuffer, BS);
-      memcpy(cbcbuffer, tempcbc, BS);
-    }
+    Algorithm->CBCDecrypt(b, BlockLength / BS, cbcbuffer);
   }
 
   if (buffer_len == 0) {
@@ -378,25 +364,10 @@ size_t _readcbc(FILE *fp, unsigned char *buffer,
 {
   const unsigned int BS = Algorithm->GetBlockSize();
   ASSERT((buffer_len % BS) == 0);
-  size_t nread = 0;
-  unsigned char *p = buffer;
-  auto *tmpcbc = new unsigned char[BS];
-
-  do {
-    size_t nr = fread(p, 1, BS, fp);
-    nread += nr;
-    if (nr != BS)
-      break;
-
-    memcpy(tmpcbc, p, BS);
-    Algorithm->Decrypt(p, p);
-    xormem(p, cbcbuffer, BS);
-    memcpy(cbcbuffer, tmpcbc, BS);
-
-    p += nr;
-  } while (nread < buffer_len);
 
-  delete[] tmpcbc;
+  // A short read leaves a trailing partial block, which isn't decrypted
+  const size_t nread = fread(buffer, 1, buffer_len, fp);
+  Algorithm->CBCDecrypt(buffer, nread / BS, cbcbuffer);
   return nread;
 }
 
@@ -43,8 +43,13 @@ extern void trashMemory(void *buffer, size_t length);
 extern void trashMemory(LPTSTR buffer, size_t length);
 extern void burnStack(unsigned long len); // borrowed from libtomcrypt
 
+// Encodes text as UTF-8, or as the ANSI code page if PWS_PK_CP_ACP is set
+// (see PWScore::CheckPasskey). A thread that shouldn't read the environment
+// while another may be setting it (e.g., a background save) can choose
+// the encoding for itself with SetThreadPasskeyEncoding().
 extern void ConvertPasskey(const StringX &text,
                           unsigned char *&txt, size_t &txtlen);
+extern void SetThreadPasskeyEncoding(bool isUTF8);
 
 extern void GenRandhash(const StringX &passkey,
                         const unsigned char *m_randstuff,
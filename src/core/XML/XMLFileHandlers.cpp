@@ -964,7 +964,7 @@ void XMLFileHandlers::AddXMLEntries()
       }
     }
 
-    Command *pcmd = AddEntryCommand::Create(m_pXMLcore, ci_temp);
+    Command *pcmd = AddEntryCommand::Create(m_pXMLcore, std::move(ci_temp));
     pcmd->SetNoGUINotify();
     m_pmulticmds->Add(pcmd);
     delete cur_entry;
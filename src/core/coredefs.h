@@ -14,6 +14,7 @@
 #include <list>
 
 #include "os/UUID.h"
+#include "UUIDMap.h"
 #include "ItemData.h"
 #include "ItemAtt.h"
 
@@ -78,7 +79,7 @@ struct st_PWH_status {
   CItemData::EntryStatus es;
 };
 
-typedef std::map<pws_os::CUUID, CItemData, std::less<pws_os::CUUID> > ItemList;
+typedef UUIDMap<CItemData> ItemList;
 typedef ItemList::iterator ItemListIter;
 typedef ItemList::const_iterator ItemListConstIter;
 typedef std::pair<pws_os::CUUID, CItemData> ItemList_Pair;
@@ -100,6 +101,9 @@ typedef std::pair<pws_os::CUUID, st_SaveTypePW> SaveTypePWMap_Pair;
 
 typedef std::map<pws_os::CUUID, st_PWH_status, std::less<pws_os::CUUID> > SavePWHistoryMap;
 
+// Entry UUID -> UUID of the attachment it referred to
+typedef std::map<pws_os::CUUID, pws_os::CUUID, std::less<pws_os::CUUID> > SaveAttRefMap;
+
 typedef std::set<st_GroupTitleUser> GTUSet;
 typedef std::pair<GTUSet::iterator, bool > GTUSetPair;
 
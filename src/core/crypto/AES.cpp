@@ -14,6 +14,23 @@
 #include "bitops.h"
 #include "../Util.h"
 
+/*
+ * Besides the portable LibTomCrypt code, we've an AES-NI implementation.
+ * As for SHA-256, it's built with per-function target attributes and
+ * picked at runtime if the processor supports it.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PWS_AES_X86
+#define PWS_AES_X86_TARGET __attribute__((target("aes,sse2")))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PWS_AES_X86
+#define PWS_AES_X86_TARGET
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
 #define LTC_CLEAN_STACK
 
 enum class CryptStatus {
@@ -589,26 +606,296 @@ static CryptStatus rijndael_ecb_decrypt(const unsigned char *ct, unsigned char *
 #endif
 #endif /* ENCRYPT_ONLY */
 
+#ifdef PWS_AES_X86
+/*
+  AES-NI versions. Round keys are the LibTomCrypt schedule's, stored as
+  bytes. Decryption uses the equivalent inverse cipher, i.e., the
+  encryption keys in reverse order, with InvMixColumns applied to all but
+  the first and last.
+  Blocks are independent in ECB and CBC decryption, so these work on four
+  at a time, keeping the AES units' pipelines busy.
+*/
+static bool aes_x86_supported()
+{
+  // Need SSE2 (leaf 1, edx) and AES (leaf 1, ecx)
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 1);
+  const unsigned int ecx1 = static_cast<unsigned int>(regs[2]);
+  const unsigned int edx1 = static_cast<unsigned int>(regs[3]);
+#else
+  unsigned int eax, ebx, ecx1, edx1;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx1, &edx1))
+    return false;
+#endif
+  return (edx1 & (1U << 26)) && (ecx1 & (1U << 25));
+}
+
+#define AESNI_LOAD(p) _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))
+#define AESNI_STORE(p, x) _mm_storeu_si128(reinterpret_cast<__m128i *>(p), x)
+
+PWS_AES_X86_TARGET
+static void aesni_setup(const rijndael_key *skey,
+                        unsigned char *ek, unsigned char *dk)
+{
+  const int Nr = skey->Nr;
+  for (int i = 0; i < 4 * (Nr + 1); i++)
+    STORE32H(skey->eK[i], ek + 4 * i);
+
+  AESNI_STORE(dk, AESNI_LOAD(ek + 16 * Nr));
+  for (int i = 1; i < Nr; i++)
+    AESNI_STORE(dk + 16 * i, _mm_aesimc_si128(AESNI_LOAD(ek + 16 * (Nr - i))));
+  AESNI_STORE(dk + 16 * Nr, AESNI_LOAD(ek));
+}
+
+PWS_AES_X86_TARGET
+static inline __m128i aesni_encrypt1(__m128i b, const unsigned char *rk, int Nr)
+{
+  b = _mm_xor_si128(b, AESNI_LOAD(rk));
+  for (int r = 1; r < Nr; r++)
+    b = _mm_aesenc_si128(b, AESNI_LOAD(rk + 16 * r));
+  return _mm_aesenclast_si128(b, AESNI_LOAD(rk + 16 * Nr));
+}
+
+PWS_AES_X86_TARGET
+static inline __m128i aesni_decrypt1(__m128i b, const unsigned char *rk, int Nr)
+{
+  b = _mm_xor_si128(b, AESNI_LOAD(rk));
+  for (int r = 1; r < Nr; r++)
+    b = _mm_aesdec_si128(b, AESNI_LOAD(rk + 16 * r));
+  return _mm_aesdeclast_si128(b, AESNI_LOAD(rk + 16 * Nr));
+}
+
+PWS_AES_X86_TARGET
+static void aesni_encrypt_blocks(const unsigned char *rk, int Nr,
+                                 const unsigned char *in, unsigned char *out,
+                                 size_t nblocks)
+{
+  for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64) {
+    __m128i k = AESNI_LOAD(rk);
+    __m128i b0 = _mm_xor_si128(AESNI_LOAD(in), k);
+    __m128i b1 = _mm_xor_si128(AESNI_LOAD(in + 16), k);
+    __m128i b2 = _mm_xor_si128(AESNI_LOAD(in + 32), k);
+    __m128i b3 = _mm_xor_si128(AESNI_LOAD(in + 48), k);
+    for (int r = 1; r < Nr; r++) {
+      k = AESNI_LOAD(rk + 16 * r);
+      b0 = _mm_aesenc_si128(b0, k); b1 = _mm_aesenc_si128(b1, k);
+      b2 = _mm_aesenc_si128(b2, k); b3 = _mm_aesenc_si128(b3, k);
+    }
+    k = AESNI_LOAD(rk + 16 * Nr);
+    AESNI_STORE(out, _mm_aesenclast_si128(b0, k));
+    AESNI_STORE(out + 16, _mm_aesenclast_si128(b1, k));
+    AESNI_STORE(out + 32, _mm_aesenclast_si128(b2, k));
+    AESNI_STORE(out + 48, _mm_aesenclast_si128(b3, k));
+  }
+  for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    AESNI_STORE(out, aesni_encrypt1(AESNI_LOAD(in), rk, Nr));
+}
+
+PWS_AES_X86_TARGET
+static void aesni_decrypt_blocks(const unsigned char *rk, int Nr,
+                                 const unsigned char *in, unsigned char *out,
+                                 size_t nblocks)
+{
+  for (; nblocks >= 4; nblocks -= 4, in += 64, out += 64) {
+    __m128i k = AESNI_LOAD(rk);
+    __m128i b0 = _mm_xor_si128(AESNI_LOAD(in), k);
+    __m128i b1 = _mm_xor_si128(AESNI_LOAD(in + 16), k);
+    __m128i b2 = _mm_xor_si128(AESNI_LOAD(in + 32), k);
+    __m128i b3 = _mm_xor_si128(AESNI_LOAD(in + 48), k);
+    for (int r = 1; r < Nr; r++) {
+      k = AESNI_LOAD(rk + 16 * r);
+      b0 = _mm_aesdec_si128(b0, k); b1 = _mm_aesdec_si128(b1, k);
+      b2 = _mm_aesdec_si128(b2, k); b3 = _mm_aesdec_si128(b3, k);
+    }
+    k = AESNI_LOAD(rk + 16 * Nr);
+    AESNI_STORE(out, _mm_aesdeclast_si128(b0, k));
+    AESNI_STORE(out + 16, _mm_aesdeclast_si128(b1, k));
+    AESNI_STORE(out + 32, _mm_aesdeclast_si128(b2, k));
+    AESNI_STORE(out + 48, _mm_aesdeclast_si128(b3, k));
+  }
+  for (; nblocks > 0; nblocks--, in += 16, out += 16)
+    AESNI_STORE(out, aesni_decrypt1(AESNI_LOAD(in), rk, Nr));
+}
+
+PWS_AES_X86_TARGET
+static void aesni_cbc_encrypt(const unsigned char *rk, int Nr,
+                              unsigned char *data, size_t nblocks,
+                              unsigned char *iv)
+{
+  __m128i c = AESNI_LOAD(iv);
+  for (; nblocks > 0; nblocks--, data += 16) {
+    c = aesni_encrypt1(_mm_xor_si128(AESNI_LOAD(data), c), rk, Nr);
+    AESNI_STORE(data, c);
+  }
+  AESNI_STORE(iv, c);
+}
+
+PWS_AES_X86_TARGET
+static void aesni_cbc_decrypt(const unsigned char *rk, int Nr,
+                              unsigned char *data, size_t nblocks,
+                              unsigned char *iv)
+{
+  // All of a group's ciphertext is loaded before any of it's overwritten,
+  // so this works in place without saving anything but the chaining value
+  __m128i prev = AESNI_LOAD(iv);
+  for (; nblocks >= 4; nblocks -= 4, data += 64) {
+    const __m128i c0 = AESNI_LOAD(data), c1 = AESNI_LOAD(data + 16);
+    const __m128i c2 = AESNI_LOAD(data + 32), c3 = AESNI_LOAD(data + 48);
+    __m128i k = AESNI_LOAD(rk);
+    __m128i b0 = _mm_xor_si128(c0, k), b1 = _mm_xor_si128(c1, k);
+    __m128i b2 = _mm_xor_si128(c2, k), b3 = _mm_xor_si128(c3, k);
+    for (int r = 1; r < Nr; r++) {
+      k = AESNI_LOAD(rk + 16 * r);
+      b0 = _mm_aesdec_si128(b0, k); b1 = _mm_aesdec_si128(b1, k);
+      b2 = _mm_aesdec_si128(b2, k); b3 = _mm_aesdec_si128(b3, k);
+    }
+    k = AESNI_LOAD(rk + 16 * Nr);
+    AESNI_STORE(data, _mm_xor_si128(_mm_aesdeclast_si128(b0, k), prev));
+    AESNI_STORE(data + 16, _mm_xor_si128(_mm_aesdeclast_si128(b1, k), c0));
+    AESNI_STORE(data + 32, _mm_xor_si128(_mm_aesdeclast_si128(b2, k), c1));
+    AESNI_STORE(data + 48, _mm_xor_si128(_mm_aesdeclast_si128(b3, k), c2));
+    prev = c3;
+  }
+  for (; nblocks > 0; nblocks--, data += 16) {
+    const __m128i c = AESNI_LOAD(data);
+    AESNI_STORE(data, _mm_xor_si128(aesni_decrypt1(c, rk, Nr), prev));
+    prev = c;
+  }
+  AESNI_STORE(iv, prev);
+}
+#endif /* PWS_AES_X86 */
+
+static bool aes_impl_supported(AES::Impl impl)
+{
+  switch (impl) {
+  case AES::PORTABLE:
+    return true;
+#ifdef PWS_AES_X86
+  case AES::X86_AESNI:
+    return aes_x86_supported();
+#endif
+  default:
+    return false;
+  }
+}
+
+static AES::Impl &aes_current_impl()
+{
+  static AES::Impl impl = aes_impl_supported(AES::X86_AESNI) ?
+    AES::X86_AESNI : AES::PORTABLE;
+  return impl;
+}
+
+AES::Impl AES::GetImpl()
+{
+  return aes_current_impl();
+}
+
+bool AES::SetImpl(Impl impl)
+{
+  if (!aes_impl_supported(impl))
+    return false;
+  aes_current_impl() = impl;
+  return true;
+}
+
 AES::AES(const unsigned char* key, int keylen)
+  : m_impl(aes_current_impl())
 {
   CryptStatus status = rijndael_setup(key, keylen, 0, &key_schedule);
 
   ASSERT(status == CryptStatus::OK);
   if (status != CryptStatus::OK)
     throw status;
+
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI)
+    aesni_setup(&key_schedule, m_niEK, m_niDK);
+#endif
 }
 
 AES::~AES()
 {
   trashMemory(&key_schedule, sizeof(key_schedule));
+  trashMemory(m_niEK, sizeof(m_niEK));
+  trashMemory(m_niDK, sizeof(m_niDK));
 }
 
 void AES::Encrypt(const unsigned char *in, unsigned char *out) const
 {
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI) {
+    aesni_encrypt_blocks(m_niEK, key_schedule.Nr, in, out, 1);
+    return;
+  }
+#endif
   rijndael_ecb_encrypt(in, out, &key_schedule);
 }
 
 void AES::Decrypt(const unsigned char *in, unsigned char *out) const
 {
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI) {
+    aesni_decrypt_blocks(m_niDK, key_schedule.Nr, in, out, 1);
+    return;
+  }
+#endif
   rijndael_ecb_decrypt(in, out, &key_schedule);
 }
+
+void AES::EncryptBlocks(const unsigned char *in, unsigned char *out,
+                        size_t nblocks) const
+{
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI) {
+    aesni_encrypt_blocks(m_niEK, key_schedule.Nr, in, out, nblocks);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < nblocks; i++, in += BLOCKSIZE, out += BLOCKSIZE)
+    rijndael_ecb_encrypt(in, out, &key_schedule);
+}
+
+void AES::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                        size_t nblocks) const
+{
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI) {
+    aesni_decrypt_blocks(m_niDK, key_schedule.Nr, in, out, nblocks);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < nblocks; i++, in += BLOCKSIZE, out += BLOCKSIZE)
+    rijndael_ecb_decrypt(in, out, &key_schedule);
+}
+
+void AES::CBCEncrypt(unsigned char *data, size_t nblocks,
+                     unsigned char *iv) const
+{
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI) {
+    aesni_cbc_encrypt(m_niEK, key_schedule.Nr, data, nblocks, iv);
+    return;
+  }
+#endif
+  cbc_encrypt(data, nblocks, iv, BLOCKSIZE,
+              [this](const unsigned char *in, unsigned char *out) {
+                rijndael_ecb_encrypt(in, out, &key_schedule);
+              });
+}
+
+void AES::CBCDecrypt(unsigned char *data, size_t nblocks,
+                     unsigned char *iv) const
+{
+#ifdef PWS_AES_X86
+  if (m_impl == X86_AESNI) {
+    aesni_cbc_decrypt(m_niDK, key_schedule.Nr, data, nblocks, iv);
+    return;
+  }
+#endif
+  cbc_decrypt(data, nblocks, iv, BLOCKSIZE,
+              [this](const unsigned char *in, unsigned char *out, size_t n) {
+                AES::DecryptBlocks(in, out, n);
+              });
+}
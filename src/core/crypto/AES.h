@@ -28,10 +28,30 @@ public:
   ~AES();
   void Encrypt(const unsigned char *in, unsigned char *out) const;
   void Decrypt(const unsigned char *in, unsigned char *out) const;
+  void EncryptBlocks(const unsigned char *in, unsigned char *out,
+                     size_t nblocks) const;
+  void DecryptBlocks(const unsigned char *in, unsigned char *out,
+                     size_t nblocks) const;
+  void CBCEncrypt(unsigned char *data, size_t nblocks, unsigned char *iv) const;
+  void CBCDecrypt(unsigned char *data, size_t nblocks, unsigned char *iv) const;
   unsigned int GetBlockSize() const {return BLOCKSIZE;}
 
+  // Besides the portable LibTomCrypt code, there's an implementation
+  // using the AES-NI instructions, used by objects constructed while it's
+  // selected - by default, iff the processor supports it. SetImpl() lets
+  // tests and benchmarks override this, returning false if the requested
+  // one isn't available here.
+  enum Impl {PORTABLE, X86_AESNI};
+  static Impl GetImpl();
+  static bool SetImpl(Impl impl);
+
 private:
   rijndael_key key_schedule;
+  Impl m_impl;
+  // Round keys in AES-NI layout: for encryption, and for the
+  // equivalent inverse cipher. Only set if m_impl == X86_AESNI.
+  unsigned char m_niEK[15 * BLOCKSIZE];
+  unsigned char m_niDK[15 * BLOCKSIZE];
 };
 #endif /* __AES_H */
 //-----------------------------------------------------------------------------
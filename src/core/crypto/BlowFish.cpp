@@ -474,6 +474,39 @@ void BlowFish::Decrypt(const unsigned char *in, unsigned char *out) const
 
 }
 
+// Bulk versions call the above non-virtually, so that they inline
+void BlowFish::EncryptBlocks(const unsigned char *in, unsigned char *out,
+                             size_t nblocks) const
+{
+  for (size_t i = 0; i < nblocks; i++, in += BLOCKSIZE, out += BLOCKSIZE)
+    BlowFish::Encrypt(in, out);
+}
+
+void BlowFish::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                             size_t nblocks) const
+{
+  for (size_t i = 0; i < nblocks; i++, in += BLOCKSIZE, out += BLOCKSIZE)
+    BlowFish::Decrypt(in, out);
+}
+
+void BlowFish::CBCEncrypt(unsigned char *data, size_t nblocks,
+                          unsigned char *iv) const
+{
+  cbc_encrypt(data, nblocks, iv, BLOCKSIZE,
+              [this](const unsigned char *in, unsigned char *out) {
+                BlowFish::Encrypt(in, out);
+              });
+}
+
+void BlowFish::CBCDecrypt(unsigned char *data, size_t nblocks,
+                          unsigned char *iv) const
+{
+  cbc_decrypt(data, nblocks, iv, BLOCKSIZE,
+              [this](const unsigned char *in, unsigned char *out, size_t n) {
+                BlowFish::DecryptBlocks(in, out, n);
+              });
+}
+
 /*
 * Returns a BlowFish object set up for encryption or decryption.
 *
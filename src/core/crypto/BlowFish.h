@@ -33,6 +33,12 @@ public:
   
   void Encrypt(const unsigned char *in, unsigned char *out) const;
   void Decrypt(const unsigned char *in, unsigned char *out) const;
+  void EncryptBlocks(const unsigned char *in, unsigned char *out,
+                     size_t nblocks) const;
+  void DecryptBlocks(const unsigned char *in, unsigned char *out,
+                     size_t nblocks) const;
+  void CBCEncrypt(unsigned char *data, size_t nblocks, unsigned char *iv) const;
+  void CBCDecrypt(unsigned char *data, size_t nblocks, unsigned char *iv) const;
   unsigned int GetBlockSize() const {return BLOCKSIZE;}
 
 private:
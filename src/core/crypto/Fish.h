@@ -15,6 +15,9 @@
 * rather than "Cipher"...)
 */
 
+#include <cstddef> // for size_t
+#include <cstring> // for memcpy
+
 class Fish
 {
 public:
@@ -25,6 +28,89 @@ public:
   // (blocksize dependent on cipher)
   virtual void Encrypt(const unsigned char *pt, unsigned char *ct) const = 0;
   virtual void Decrypt(const unsigned char *ct, unsigned char *pt) const = 0;
+
+  // Following work on nblocks consecutive blocks, in place if in == out.
+  // The defaults just loop over the above - ciphers override them so that
+  // bulk callers pay one virtual call per buffer rather than per block.
+  virtual void EncryptBlocks(const unsigned char *pt, unsigned char *ct,
+                             size_t nblocks) const
+  {
+    const unsigned int BS = GetBlockSize();
+    for (size_t i = 0; i < nblocks; i++)
+      Encrypt(pt + i * BS, ct + i * BS);
+  }
+  virtual void DecryptBlocks(const unsigned char *ct, unsigned char *pt,
+                             size_t nblocks) const
+  {
+    const unsigned int BS = GetBlockSize();
+    for (size_t i = 0; i < nblocks; i++)
+      Decrypt(ct + i * BS, pt + i * BS);
+  }
+
+  // CBC mode over nblocks of data, in place. iv is both the chaining
+  // input and output, i.e., it's left holding the last ciphertext block,
+  // ready for the next call.
+  virtual void CBCEncrypt(unsigned char *data, size_t nblocks,
+                          unsigned char *iv) const
+  {
+    cbc_encrypt(data, nblocks, iv, GetBlockSize(),
+                [this](const unsigned char *in, unsigned char *out) {
+                  Encrypt(in, out);
+                });
+  }
+  virtual void CBCDecrypt(unsigned char *data, size_t nblocks,
+                          unsigned char *iv) const
+  {
+    cbc_decrypt(data, nblocks, iv, GetBlockSize(),
+                [this](const unsigned char *in, unsigned char *out, size_t n) {
+                  DecryptBlocks(in, out, n);
+                });
+  }
+
+protected:
+  // CBC chaining shared by the defaults above and by the ciphers'
+  // overrides, which pass direct, inlinable calls to their primitives.
+  // For encryption that's the single block function.
+  template<class BlockFn>
+  static void cbc_encrypt(unsigned char *data, size_t nblocks,
+                          unsigned char *iv, unsigned int BS, BlockFn encrypt)
+  {
+    const unsigned char *prev = iv;
+    for (size_t i = 0; i < nblocks; i++, data += BS) {
+      for (unsigned int j = 0; j < BS; j++)
+        data[j] ^= prev[j];
+      encrypt(data, data);
+      prev = data;
+    }
+    if (nblocks > 0)
+      for (unsigned int j = 0; j < BS; j++)
+        iv[j] = prev[j];
+  }
+
+  // Decryption isn't chained, so here the cipher supplies a bulk ECB
+  // function, decrypt(in, out, nblocks), free to work on several blocks at
+  // once. Ciphertext is saved a chunk at a time for the XOR step, as it's
+  // overwritten by decrypting in place.
+  template<class BlocksFn>
+  static void cbc_decrypt(unsigned char *data, size_t nblocks,
+                          unsigned char *iv, unsigned int BS, BlocksFn decrypt)
+  {
+    unsigned char saved[256]; // multiple of any block size
+    const size_t chunk = sizeof(saved) / BS;
+    while (nblocks > 0) {
+      const size_t n = (nblocks < chunk) ? nblocks : chunk;
+      const size_t len = n * BS;
+      std::memcpy(saved, data, len);
+      decrypt(data, data, n);
+      for (unsigned int j = 0; j < BS; j++)
+        data[j] ^= iv[j];
+      for (size_t j = BS; j < len; j++)
+        data[j] ^= saved[j - BS];
+      std::memcpy(iv, saved + len - BS, BS);
+      data += len;
+      nblocks -= n;
+    }
+  }
 };
 
 #endif /* __FISH_H */
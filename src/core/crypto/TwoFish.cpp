@@ -615,6 +615,118 @@ static void twofish_ecb_decrypt(const unsigned char *ct, unsigned char *pt, cons
 }
 #endif
 
+#ifndef TWOFISH_SMALL
+/*
+  Two-block versions of the above, for bulk ECB and CBC decryption.
+  With full keying, each round is a chain of dependent S-box lookups, so
+  a lone block mostly waits on load latency; interleaving two independent
+  blocks fills those gaps.
+  @param in  The input (32 bytes)
+  @param out The output (32 bytes)
+  @param skey The key as scheduled
+*/
+#ifdef LTC_CLEAN_STACK
+static void _twofish_ecb_encrypt2(const unsigned char *pt, unsigned char *ct, const twofish_key *skey)
+#else
+static void twofish_ecb_encrypt2(const unsigned char *pt, unsigned char *ct, const twofish_key *skey)
+#endif
+{
+  uint32 a0,b0,c0,d0,a1,b1,c1,d1,t1,t2,u1,u2;
+  uint32 const *k;
+  int r;
+
+  LOAD32L(a0,&pt[0]);  LOAD32L(b0,&pt[4]);
+  LOAD32L(c0,&pt[8]);  LOAD32L(d0,&pt[12]);
+  LOAD32L(a1,&pt[16]); LOAD32L(b1,&pt[20]);
+  LOAD32L(c1,&pt[24]); LOAD32L(d1,&pt[28]);
+  a0 ^= skey->K[0]; b0 ^= skey->K[1]; c0 ^= skey->K[2]; d0 ^= skey->K[3];
+  a1 ^= skey->K[0]; b1 ^= skey->K[1]; c1 ^= skey->K[2]; d1 ^= skey->K[3];
+
+  k  = skey->K + 8;
+  for (r = 8; r != 0; --r) {
+    t2 = g1_func(b0, skey);          u2 = g1_func(b1, skey);
+    t1 = g_func(a0, skey) + t2;      u1 = g_func(a1, skey) + u2;
+    c0 = RORc(c0 ^ (t1 + k[0]), 1);  c1 = RORc(c1 ^ (u1 + k[0]), 1);
+    d0 = ROLc(d0, 1) ^ (t2 + t1 + k[1]);
+    d1 = ROLc(d1, 1) ^ (u2 + u1 + k[1]);
+
+    t2 = g1_func(d0, skey);          u2 = g1_func(d1, skey);
+    t1 = g_func(c0, skey) + t2;      u1 = g_func(c1, skey) + u2;
+    a0 = RORc(a0 ^ (t1 + k[2]), 1);  a1 = RORc(a1 ^ (u1 + k[2]), 1);
+    b0 = ROLc(b0, 1) ^ (t2 + t1 + k[3]);
+    b1 = ROLc(b1, 1) ^ (u2 + u1 + k[3]);
+    k += 4;
+  }
+
+  /* output with "undo last swap" */
+  c0 ^= skey->K[4]; d0 ^= skey->K[5]; a0 ^= skey->K[6]; b0 ^= skey->K[7];
+  c1 ^= skey->K[4]; d1 ^= skey->K[5]; a1 ^= skey->K[6]; b1 ^= skey->K[7];
+  STORE32L(c0,&ct[0]);  STORE32L(d0,&ct[4]);
+  STORE32L(a0,&ct[8]);  STORE32L(b0,&ct[12]);
+  STORE32L(c1,&ct[16]); STORE32L(d1,&ct[20]);
+  STORE32L(a1,&ct[24]); STORE32L(b1,&ct[28]);
+}
+
+#ifdef LTC_CLEAN_STACK
+static void twofish_ecb_encrypt2(const unsigned char *pt, unsigned char *ct, const twofish_key *skey)
+{
+  _twofish_ecb_encrypt2(pt, ct, skey);
+  burnStack(sizeof(uint32) * 12 + sizeof(uint32));
+}
+#endif
+
+#ifdef LTC_CLEAN_STACK
+static void _twofish_ecb_decrypt2(const unsigned char *ct, unsigned char *pt, const twofish_key *skey)
+#else
+static void twofish_ecb_decrypt2(const unsigned char *ct, unsigned char *pt, const twofish_key *skey)
+#endif
+{
+  uint32 a0,b0,c0,d0,a1,b1,c1,d1,t1,t2,u1,u2;
+  uint32 const *k;
+  int r;
+
+  /* load input, undoing the final swap */
+  LOAD32L(c0,&ct[0]);  LOAD32L(d0,&ct[4]);
+  LOAD32L(a0,&ct[8]);  LOAD32L(b0,&ct[12]);
+  LOAD32L(c1,&ct[16]); LOAD32L(d1,&ct[20]);
+  LOAD32L(a1,&ct[24]); LOAD32L(b1,&ct[28]);
+  a0 ^= skey->K[6]; b0 ^= skey->K[7]; c0 ^= skey->K[4]; d0 ^= skey->K[5];
+  a1 ^= skey->K[6]; b1 ^= skey->K[7]; c1 ^= skey->K[4]; d1 ^= skey->K[5];
+
+  k = skey->K + 36;
+  for (r = 8; r != 0; --r) {
+    t2 = g1_func(d0, skey);          u2 = g1_func(d1, skey);
+    t1 = g_func(c0, skey) + t2;      u1 = g_func(c1, skey) + u2;
+    a0 = ROLc(a0, 1) ^ (t1 + k[2]);  a1 = ROLc(a1, 1) ^ (u1 + k[2]);
+    b0 = RORc(b0 ^ (t2 + t1 + k[3]), 1);
+    b1 = RORc(b1 ^ (u2 + u1 + k[3]), 1);
+
+    t2 = g1_func(b0, skey);          u2 = g1_func(b1, skey);
+    t1 = g_func(a0, skey) + t2;      u1 = g_func(a1, skey) + u2;
+    c0 = ROLc(c0, 1) ^ (t1 + k[0]);  c1 = ROLc(c1, 1) ^ (u1 + k[0]);
+    d0 = RORc(d0 ^ (t2 + t1 + k[1]), 1);
+    d1 = RORc(d1 ^ (u2 + u1 + k[1]), 1);
+    k -= 4;
+  }
+
+  /* pre-white */
+  a0 ^= skey->K[0]; b0 ^= skey->K[1]; c0 ^= skey->K[2]; d0 ^= skey->K[3];
+  a1 ^= skey->K[0]; b1 ^= skey->K[1]; c1 ^= skey->K[2]; d1 ^= skey->K[3];
+  STORE32L(a0,&pt[0]);  STORE32L(b0,&pt[4]);
+  STORE32L(c0,&pt[8]);  STORE32L(d0,&pt[12]);
+  STORE32L(a1,&pt[16]); STORE32L(b1,&pt[20]);
+  STORE32L(c1,&pt[24]); STORE32L(d1,&pt[28]);
+}
+
+#ifdef LTC_CLEAN_STACK
+static void twofish_ecb_decrypt2(const unsigned char *ct, unsigned char *pt, const twofish_key *skey)
+{
+  _twofish_ecb_decrypt2(ct, pt, skey);
+  burnStack(sizeof(uint32) * 12 + sizeof(uint32));
+}
+#endif
+#endif /* TWOFISH_SMALL */
+
 TwoFish::TwoFish(const unsigned char* key, int keylen)
 {
   CryptStatus status = twofish_setup(key, keylen, 0, &key_schedule);
@@ -638,3 +750,43 @@ void TwoFish::Decrypt(const unsigned char *in, unsigned char *out) const
 {
   twofish_ecb_decrypt(in, out, &key_schedule);
 }
+
+void TwoFish::EncryptBlocks(const unsigned char *in, unsigned char *out,
+                            size_t nblocks) const
+{
+#ifndef TWOFISH_SMALL
+  for (; nblocks >= 2; nblocks -= 2, in += 2*BLOCKSIZE, out += 2*BLOCKSIZE)
+    twofish_ecb_encrypt2(in, out, &key_schedule);
+#endif
+  for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+    twofish_ecb_encrypt(in, out, &key_schedule);
+}
+
+void TwoFish::DecryptBlocks(const unsigned char *in, unsigned char *out,
+                            size_t nblocks) const
+{
+#ifndef TWOFISH_SMALL
+  for (; nblocks >= 2; nblocks -= 2, in += 2*BLOCKSIZE, out += 2*BLOCKSIZE)
+    twofish_ecb_decrypt2(in, out, &key_schedule);
+#endif
+  for (; nblocks > 0; nblocks--, in += BLOCKSIZE, out += BLOCKSIZE)
+    twofish_ecb_decrypt(in, out, &key_schedule);
+}
+
+void TwoFish::CBCEncrypt(unsigned char *data, size_t nblocks,
+                         unsigned char *iv) const
+{
+  cbc_encrypt(data, nblocks, iv, BLOCKSIZE,
+              [this](const unsigned char *in, unsigned char *out) {
+                twofish_ecb_encrypt(in, out, &key_schedule);
+              });
+}
+
+void TwoFish::CBCDecrypt(unsigned char *data, size_t nblocks,
+                         unsigned char *iv) const
+{
+  cbc_decrypt(data, nblocks, iv, BLOCKSIZE,
+              [this](const unsigned char *in, unsigned char *out, size_t n) {
+                TwoFish::DecryptBlocks(in, out, n);
+              });
+}
@@ -15,6 +15,9 @@
 #include "Fish.h"
 #include "os/typedefs.h"
 
+// By default ("full keying"), the key is expanded at construction into
+// four key-dependent 256-entry S-box/MDS tables, making each g() four
+// table lookups. TWOFISH_SMALL trades this 4K for per-byte computation.
 #ifndef TWOFISH_SMALL
 struct twofish_key {
   uint32 S[4][256], K[40];
@@ -34,6 +37,12 @@ public:
   ~TwoFish();
   void Encrypt(const unsigned char *in, unsigned char *out) const;
   void Decrypt(const unsigned char *in, unsigned char *out) const;
+  void EncryptBlocks(const unsigned char *in, unsigned char *out,
+                     size_t nblocks) const;
+  void DecryptBlocks(const unsigned char *in, unsigned char *out,
+                     size_t nblocks) const;
+  void CBCEncrypt(unsigned char *data, size_t nblocks, unsigned char *iv) const;
+  void CBCDecrypt(unsigned char *data, size_t nblocks, unsigned char *iv) const;
   unsigned int GetBlockSize() const {return BLOCKSIZE;}
 
 private:
@@ -9,9 +9,12 @@
 // Based on LibTomCrypt by
 // Tom St Denis, tomstdenis@iahu.ca, http://libtomcrypt.org
 
+#include "pbkdf2.h"
 #include "bitops.h"
 #include "hmac.h"
+#include "sha256.h"
 
+#include <algorithm>
 #include <cstring>
 
 /**
@@ -90,3 +93,88 @@ void pbkdf2(const unsigned char *password, unsigned long password_len,
 
   delete[] buf[0];
 }
+
+bool pbkdf2_sha256(const unsigned char *password, unsigned long password_len,
+                   const unsigned char *salt,     unsigned long salt_len,
+                   int iteration_count,
+                   unsigned char *out,            unsigned long *outlen,
+                   const std::function<bool()> &aborted)
+{
+  // Iterations between calls to aborted()
+  const int AbortCheckInterval = 4096;
+  const unsigned int BlockSize = SHA256::BLOCKSIZE;
+  const unsigned int HashLen = SHA256::HASHLEN;
+  unsigned char K[BlockSize], pad[BlockSize];
+  unsigned char U[HashLen], T[HashLen], blkbuf[4];
+  unsigned long stored, left, y;
+  ulong32 blkno;
+  bool completed = true;
+
+  ASSERT(password != nullptr || password_len == 0);
+  ASSERT(salt     != nullptr);
+  ASSERT(out      != nullptr);
+  ASSERT(outlen   != nullptr);
+
+  /* HMAC key block, as in HMAC::Init() */
+  memset(K, 0, BlockSize);
+  if (password_len > BlockSize) {
+    SHA256 H0;
+    H0.Update(password, password_len);
+    H0.Final(K);
+  } else {
+    memcpy(K, password, password_len);
+  }
+
+  /* hash the keyed ipad and opad blocks once, for all iterations */
+  SHA256 inner, outer;
+  for (y = 0; y < BlockSize; y++)
+    pad[y] = K[y] ^ 0x36;
+  inner.Update(pad, BlockSize);
+  for (y = 0; y < BlockSize; y++)
+    pad[y] = K[y] ^ 0x5c;
+  outer.Update(pad, BlockSize);
+  trashMemory(K, BlockSize);
+  trashMemory(pad, BlockSize);
+
+  left   = *outlen;
+  blkno  = 1;
+  stored = 0;
+
+  while (left != 0) {
+    /* get U_1 = PRF(P, S||int(blkno)) */
+    STORE32H(blkno, blkbuf);
+    ++blkno;
+
+    SHA256 ih(inner);
+    ih.Update(salt, salt_len);
+    ih.Update(blkbuf, 4);
+    ih.Final(U);
+    SHA256 oh(outer);
+    oh.Update(U, HashLen);
+    oh.Final(U);
+
+    /* now compute the remaining U_i and XOR them into T */
+    memcpy(T, U, HashLen);
+    for (int itts = 1; itts < iteration_count; itts += AbortCheckInterval) {
+      if (aborted && aborted()) {
+        completed = false;
+        break;
+      }
+      const int n = std::min(iteration_count - itts, AbortCheckInterval);
+      SHA256::HMACIterate(inner, outer, U, T, static_cast<unsigned int>(n));
+    }
+    if (!completed)
+      break;
+
+    /* now emit up to HashLen bytes of T to output */
+    for (y = 0; y < HashLen && left != 0; ++y) {
+      out[stored++] = T[y];
+      --left;
+    }
+  }
+  *outlen = stored;
+
+  trashMemory(U, HashLen);
+  trashMemory(T, HashLen);
+  return completed;
+}
@@ -14,6 +14,9 @@
 
 #ifndef __PBKDF2_H
 #define __PBKDF2_H
+
+#include <functional>
+
 class HMAC_BASE;
 /**
    @param password          The input password (or key)
@@ -30,4 +33,18 @@ void pbkdf2(const unsigned char *password, unsigned long password_len,
             const unsigned char *salt,     unsigned long salt_len,
             int iteration_count,           HMAC_BASE *hmac,
             unsigned char *out,            unsigned long *outlen);
+
+/**
+   Same as pbkdf2() with HMAC<SHA256, ...>, but hashes the keyed ipad and
+   opad blocks once, rather than for each iteration.
+   Parameters as for pbkdf2(), sans hmac, plus:
+   @param aborted           If set, polled every few thousand iterations.
+                            Returning true stops the computation.
+   @return                  false iff aborted, in which case out is undefined
+*/
+bool pbkdf2_sha256(const unsigned char *password, unsigned long password_len,
+                   const unsigned char *salt,     unsigned long salt_len,
+                   int iteration_count,
+                   unsigned char *out,            unsigned long *outlen,
+                   const std::function<bool()> &aborted = nullptr);
 #endif /* __PBKDF2_H */
@@ -15,13 +15,44 @@
 
 #include <algorithm>
 
+/*
+ * Besides the portable LibTomCrypt code, we've compression functions
+ * using the SHA extensions on x86 and ARMv8 processors. These are
+ * built with per-function target attributes, so the rest of the code
+ * needn't be compiled for any particular CPU, and are picked at
+ * runtime based on what the processor supports.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PWS_SHA256_X86
+#define PWS_SHA256_X86_TARGET __attribute__((target("sha,sse4.1")))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define PWS_SHA256_X86
+#define PWS_SHA256_X86_TARGET
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && \
+  (defined(__linux__) || defined(__APPLE__))
+#define PWS_SHA256_ARMV8
+#if defined(__clang__)
+#define PWS_SHA256_ARMV8_TARGET __attribute__((target("crypto")))
+#else
+#define PWS_SHA256_ARMV8_TARGET __attribute__((target("+crypto")))
+#endif
+#include <arm_neon.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
 #define LTC_CLEAN_STACK
 
 /* hashsize = 32, blocksize = 64 */
 
-#ifdef LTC_SMALL_CODE
 /* the K array */
-static const unsigned long K[64] = {
+static const ulong32 K[64] = {
   0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
   0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL, 0xd807aa98UL, 0x12835b01UL,
   0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL,
@@ -36,7 +67,6 @@ static const unsigned long K[64] = {
   0x682e6ff3UL, 0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
   0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
 };
-#endif
 
 /* Various logical functions */
 #define Ch(x,y,z)       (z ^ (x & (y ^ z)))
@@ -49,11 +79,7 @@ static const unsigned long K[64] = {
 #define Gamma1(x)       (S(x, 17) ^ S(x, 19) ^ R(x, 10))
 
 /* compress 512-bits */
-#ifdef LTC_CLEAN_STACK
-static void _sha256_compress(ulong32 state[8], const unsigned char *buf)
-#else
-static void  sha256_compress(ulong32 state[8], const unsigned char *buf)
-#endif
+static void sha256_compress(ulong32 state[8], const unsigned char *buf)
 {
   unsigned long S[8], W[64], t0, t1;
 #ifdef LTC_SMALL_CODE
@@ -171,13 +197,510 @@ static void  sha256_compress(ulong32 state[8], const unsigned char *buf)
   }
 }
 
+/*
+ * All compression functions take a run of nblocks consecutive 64 byte
+ * blocks, so that Update() can hand over its input in one go.
+ *
+ * The iterate functions replace the digest in words[] (as big-endian
+ * words, i.e., the first 8 words of the next message block) by its own
+ * hash, N times. As the message length is always 32 bytes, the padding
+ * is fixed and we needn't go through Update() and Final().
+ *
+ * The hmac_iterate functions do the same for HMAC, starting from the
+ * states after the keyed ipad and opad blocks, and XOR each result into
+ * acc[], as per the PBKDF2 F function. Here the messages are 96 bytes
+ * long, counting the keyed block.
+ */
+typedef void (*sha256_compress_fn)(ulong32 state[8], const unsigned char *buf,
+                                   size_t nblocks);
+typedef void (*sha256_iterate_fn)(ulong32 words[8], unsigned int N);
+typedef void (*sha256_hmac_iterate_fn)(const ulong32 istate[8],
+                                       const ulong32 ostate[8],
+                                       ulong32 words[8], ulong32 acc[8],
+                                       unsigned int N);
+
+struct sha256_funcs {
+  sha256_compress_fn compress;
+  sha256_iterate_fn iterate;
+  sha256_hmac_iterate_fn hmac_iterate;
+};
+
+static const ulong32 sha256_IV[8] = {
+  0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+  0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+};
+
+static void sha256_compress_portable(ulong32 state[8], const unsigned char *buf,
+                                     size_t nblocks)
+{
+  for (; nblocks > 0; nblocks--, buf += SHA256::BLOCKSIZE)
+    sha256_compress(state, buf);
 #ifdef LTC_CLEAN_STACK
-static void sha256_compress(ulong32 state[8], const unsigned char *buf)
+  burnStack(sizeof(unsigned long) * 74);
+#endif
+}
+
+static void sha256_iterate_portable(ulong32 words[8], unsigned int N)
 {
-  _sha256_compress(state, buf);
+  // Bytes 32..63 hold the padding and the length (256 bits), and
+  // don't change between iterations
+  unsigned char block[SHA256::BLOCKSIZE] = {0};
+  block[32] = 0x80;
+  block[62] = 0x01;
+  for (unsigned int n = 0; n < N; n++) {
+    for (int i = 0; i < 8; i++)
+      STORE32H(words[i], block + 4 * i);
+    memcpy(words, sha256_IV, sizeof(sha256_IV));
+    sha256_compress(words, block);
+  }
+  trashMemory(block, sizeof(block));
+#ifdef LTC_CLEAN_STACK
   burnStack(sizeof(unsigned long) * 74);
+#endif
 }
+
+static void sha256_hmac_iterate_portable(const ulong32 istate[8],
+                                         const ulong32 ostate[8],
+                                         ulong32 words[8], ulong32 acc[8],
+                                         unsigned int N)
+{
+  unsigned char block[SHA256::BLOCKSIZE] = {0};
+  block[32] = 0x80;
+  block[62] = 0x03; // 768 bits
+  for (unsigned int n = 0; n < N; n++) {
+    for (int i = 0; i < 8; i++)
+      STORE32H(words[i], block + 4 * i);
+    memcpy(words, istate, sizeof(sha256_IV));
+    sha256_compress(words, block);
+    for (int i = 0; i < 8; i++)
+      STORE32H(words[i], block + 4 * i);
+    memcpy(words, ostate, sizeof(sha256_IV));
+    sha256_compress(words, block);
+    for (int i = 0; i < 8; i++)
+      acc[i] ^= words[i];
+  }
+  trashMemory(block, sizeof(block));
+#ifdef LTC_CLEAN_STACK
+  burnStack(sizeof(unsigned long) * 74);
 #endif
+}
+
+static const sha256_funcs sha256_portable_funcs = {
+  sha256_compress_portable, sha256_iterate_portable,
+  sha256_hmac_iterate_portable
+};
+
+#ifdef PWS_SHA256_X86
+/*
+ * SHA-NI keeps the state as ABEF/CDGH pairs. Each sha256rnds2 does two
+ * rounds, so four message words are consumed per pair of calls, while
+ * sha256msg1/sha256msg2 compute the message schedule four words at a time.
+ */
+#define SHA_NI_ROUNDS(m, i)                                              \
+  msg = _mm_add_epi32(m, _mm_loadu_si128(                                \
+                      reinterpret_cast<const __m128i *>(K + 4 * (i))));   \
+  state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                   \
+  msg = _mm_shuffle_epi32(msg, 0x0E);                                    \
+  state0 = _mm_sha256rnds2_epu32(state0, state1, msg)
+
+#define SHA_NI_MSG1(m0, m1) m0 = _mm_sha256msg1_epu32(m0, m1)
+
+#define SHA_NI_MSG2(m0, m2, m3)                                          \
+  m0 = _mm_add_epi32(m0, _mm_alignr_epi8(m3, m2, 4));                    \
+  m0 = _mm_sha256msg2_epu32(m0, m3)
+
+// All 64 rounds over the message words in m0..m3
+#define SHA_NI_BLOCK()                                                        \
+  SHA_NI_ROUNDS(m0, 0);                                                       \
+  SHA_NI_ROUNDS(m1, 1);  SHA_NI_MSG1(m0, m1);                                 \
+  SHA_NI_ROUNDS(m2, 2);  SHA_NI_MSG1(m1, m2);                                 \
+  SHA_NI_ROUNDS(m3, 3);  SHA_NI_MSG2(m0, m2, m3); SHA_NI_MSG1(m2, m3);        \
+  SHA_NI_ROUNDS(m0, 4);  SHA_NI_MSG2(m1, m3, m0); SHA_NI_MSG1(m3, m0);        \
+  SHA_NI_ROUNDS(m1, 5);  SHA_NI_MSG2(m2, m0, m1); SHA_NI_MSG1(m0, m1);        \
+  SHA_NI_ROUNDS(m2, 6);  SHA_NI_MSG2(m3, m1, m2); SHA_NI_MSG1(m1, m2);        \
+  SHA_NI_ROUNDS(m3, 7);  SHA_NI_MSG2(m0, m2, m3); SHA_NI_MSG1(m2, m3);        \
+  SHA_NI_ROUNDS(m0, 8);  SHA_NI_MSG2(m1, m3, m0); SHA_NI_MSG1(m3, m0);        \
+  SHA_NI_ROUNDS(m1, 9);  SHA_NI_MSG2(m2, m0, m1); SHA_NI_MSG1(m0, m1);        \
+  SHA_NI_ROUNDS(m2, 10); SHA_NI_MSG2(m3, m1, m2); SHA_NI_MSG1(m1, m2);        \
+  SHA_NI_ROUNDS(m3, 11); SHA_NI_MSG2(m0, m2, m3); SHA_NI_MSG1(m2, m3);        \
+  SHA_NI_ROUNDS(m0, 12); SHA_NI_MSG2(m1, m3, m0); SHA_NI_MSG1(m3, m0);        \
+  SHA_NI_ROUNDS(m1, 13); SHA_NI_MSG2(m2, m0, m1);                             \
+  SHA_NI_ROUNDS(m2, 14); SHA_NI_MSG2(m3, m1, m2);                             \
+  SHA_NI_ROUNDS(m3, 15)
+
+// Between the natural ABCD/EFGH word order and SHA-NI's ABEF/CDGH
+#define SHA_NI_TO_ABEF(s0, s1)                                           \
+  tmp = _mm_shuffle_epi32(s0, 0xB1);            /* CDAB */               \
+  s1 = _mm_shuffle_epi32(s1, 0x1B);             /* EFGH */               \
+  s0 = _mm_alignr_epi8(tmp, s1, 8);             /* ABEF */               \
+  s1 = _mm_blend_epi16(s1, tmp, 0xF0)           /* CDGH */
+
+#define SHA_NI_FROM_ABEF(s0, s1)                                         \
+  tmp = _mm_shuffle_epi32(s0, 0x1B);            /* FEBA */               \
+  s1 = _mm_shuffle_epi32(s1, 0xB1);             /* DCHG */               \
+  s0 = _mm_blend_epi16(tmp, s1, 0xF0);          /* DCBA */               \
+  s1 = _mm_alignr_epi8(s1, tmp, 8)              /* HGFE */
+
+// Hash the 32 byte message in w0, w1 (natural order) starting from the
+// state iv0, iv1 (ABEF/CDGH), with pad3 holding the message length
+#define SHA_NI_DIGEST32(iv0, iv1, pad3)                                  \
+  m0 = w0; m1 = w1; m2 = pad2; m3 = pad3;                                \
+  state0 = iv0; state1 = iv1;                                            \
+  SHA_NI_BLOCK();                                                        \
+  state0 = _mm_add_epi32(state0, iv0);                                   \
+  state1 = _mm_add_epi32(state1, iv1);                                   \
+  SHA_NI_FROM_ABEF(state0, state1);                                      \
+  w0 = state0; w1 = state1
+
+PWS_SHA256_X86_TARGET
+static void sha256_compress_x86(ulong32 state[8], const unsigned char *buf,
+                                size_t nblocks)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp;
+  __m128i m0, m1, m2, m3;
+
+  state0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+  state1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+  SHA_NI_TO_ABEF(state0, state1);
+
+  for (; nblocks > 0; nblocks--, buf += SHA256::BLOCKSIZE) {
+    abef = state0;
+    cdgh = state1;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128(
+           reinterpret_cast<const __m128i *>(buf)), bswap);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128(
+           reinterpret_cast<const __m128i *>(buf + 16)), bswap);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128(
+           reinterpret_cast<const __m128i *>(buf + 32)), bswap);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128(
+           reinterpret_cast<const __m128i *>(buf + 48)), bswap);
+
+    SHA_NI_BLOCK();
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  SHA_NI_FROM_ABEF(state0, state1);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+
+PWS_SHA256_X86_TARGET
+static void sha256_iterate_x86(ulong32 words[8], unsigned int N)
+{
+  __m128i state0, state1, iv0, iv1, msg, tmp;
+  __m128i m0, m1, m2, m3;
+  const __m128i pad2 = _mm_set_epi32(0, 0, 0, static_cast<int>(0x80000000));
+  const __m128i pad3 = _mm_set_epi32(256, 0, 0, 0);
+
+  iv0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&sha256_IV[0]));
+  iv1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&sha256_IV[4]));
+  SHA_NI_TO_ABEF(iv0, iv1);
+
+  // Digest words come out of SHA_NI_FROM_ABEF in message order
+  __m128i w0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&words[0]));
+  __m128i w1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&words[4]));
+
+  for (unsigned int n = 0; n < N; n++) {
+    SHA_NI_DIGEST32(iv0, iv1, pad3);
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&words[0]), w0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&words[4]), w1);
+}
+
+PWS_SHA256_X86_TARGET
+static void sha256_hmac_iterate_x86(const ulong32 istate[8],
+                                    const ulong32 ostate[8],
+                                    ulong32 words[8], ulong32 acc[8],
+                                    unsigned int N)
+{
+  __m128i state0, state1, in0, in1, out0, out1, msg, tmp;
+  __m128i m0, m1, m2, m3;
+  const __m128i pad2 = _mm_set_epi32(0, 0, 0, static_cast<int>(0x80000000));
+  const __m128i pad3 = _mm_set_epi32(768, 0, 0, 0);
+
+  in0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&istate[0]));
+  in1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&istate[4]));
+  SHA_NI_TO_ABEF(in0, in1);
+  out0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&ostate[0]));
+  out1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&ostate[4]));
+  SHA_NI_TO_ABEF(out0, out1);
+
+  __m128i w0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&words[0]));
+  __m128i w1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&words[4]));
+  __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&acc[0]));
+  __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&acc[4]));
+
+  for (unsigned int n = 0; n < N; n++) {
+    SHA_NI_DIGEST32(in0, in1, pad3);
+    SHA_NI_DIGEST32(out0, out1, pad3);
+    a0 = _mm_xor_si128(a0, w0);
+    a1 = _mm_xor_si128(a1, w1);
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&words[0]), w0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&words[4]), w1);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&acc[0]), a0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&acc[4]), a1);
+}
+
+#undef SHA_NI_ROUNDS
+#undef SHA_NI_MSG1
+#undef SHA_NI_MSG2
+#undef SHA_NI_BLOCK
+#undef SHA_NI_TO_ABEF
+#undef SHA_NI_FROM_ABEF
+#undef SHA_NI_DIGEST32
+
+static bool sha256_x86_supported()
+{
+  // Need SSSE3 & SSE4.1 (leaf 1, ecx) and SHA (leaf 7, ebx)
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7)
+    return false;
+  __cpuid(regs, 1);
+  const unsigned int ecx1 = static_cast<unsigned int>(regs[2]);
+  __cpuidex(regs, 7, 0);
+  const unsigned int ebx7 = static_cast<unsigned int>(regs[1]);
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid_max(0, nullptr) < 7)
+    return false;
+  __cpuid(1, eax, ebx, ecx, edx);
+  const unsigned int ecx1 = ecx;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  const unsigned int ebx7 = ebx;
+#endif
+  return (ecx1 & (1U << 9)) && (ecx1 & (1U << 19)) && (ebx7 & (1U << 29));
+}
+
+static const sha256_funcs sha256_x86_funcs = {
+  sha256_compress_x86, sha256_iterate_x86, sha256_hmac_iterate_x86
+};
+#endif /* PWS_SHA256_X86 */
+
+#ifdef PWS_SHA256_ARMV8
+/*
+ * ARMv8 keeps the state in its natural ABCD/EFGH order. sha256h/sha256h2
+ * do four rounds, sha256su0/sha256su1 extend the schedule by four words.
+ */
+#define SHA_ARM_ROUNDS(m, i)                                             \
+  wk = vaddq_u32(m, vld1q_u32(K + 4 * (i)));                              \
+  tmp = state0;                                                          \
+  state0 = vsha256hq_u32(state0, state1, wk);                            \
+  state1 = vsha256h2q_u32(state1, tmp, wk)
+
+#define SHA_ARM_SCHED(m0, m1, m2, m3)                                    \
+  m0 = vsha256su1q_u32(vsha256su0q_u32(m0, m1), m2, m3)
+
+// All 64 rounds over the message words in m0..m3. Each group of four
+// rounds uses m before it's replaced by the words needed four groups later
+#define SHA_ARM_BLOCK()                                                  \
+  SHA_ARM_ROUNDS(m0, 0);  SHA_ARM_SCHED(m0, m1, m2, m3);                 \
+  SHA_ARM_ROUNDS(m1, 1);  SHA_ARM_SCHED(m1, m2, m3, m0);                 \
+  SHA_ARM_ROUNDS(m2, 2);  SHA_ARM_SCHED(m2, m3, m0, m1);                 \
+  SHA_ARM_ROUNDS(m3, 3);  SHA_ARM_SCHED(m3, m0, m1, m2);                 \
+  SHA_ARM_ROUNDS(m0, 4);  SHA_ARM_SCHED(m0, m1, m2, m3);                 \
+  SHA_ARM_ROUNDS(m1, 5);  SHA_ARM_SCHED(m1, m2, m3, m0);                 \
+  SHA_ARM_ROUNDS(m2, 6);  SHA_ARM_SCHED(m2, m3, m0, m1);                 \
+  SHA_ARM_ROUNDS(m3, 7);  SHA_ARM_SCHED(m3, m0, m1, m2);                 \
+  SHA_ARM_ROUNDS(m0, 8);  SHA_ARM_SCHED(m0, m1, m2, m3);                 \
+  SHA_ARM_ROUNDS(m1, 9);  SHA_ARM_SCHED(m1, m2, m3, m0);                 \
+  SHA_ARM_ROUNDS(m2, 10); SHA_ARM_SCHED(m2, m3, m0, m1);                 \
+  SHA_ARM_ROUNDS(m3, 11); SHA_ARM_SCHED(m3, m0, m1, m2);                 \
+  SHA_ARM_ROUNDS(m0, 12);                                                \
+  SHA_ARM_ROUNDS(m1, 13);                                                \
+  SHA_ARM_ROUNDS(m2, 14);                                                \
+  SHA_ARM_ROUNDS(m3, 15)
+
+// Hash the 32 byte message in w0, w1 starting from the state iv0, iv1,
+// with pad3 holding the message length
+#define SHA_ARM_DIGEST32(iv0, iv1, pad3)                                 \
+  m0 = w0; m1 = w1; m2 = pad2; m3 = pad3;                                \
+  state0 = iv0; state1 = iv1;                                            \
+  SHA_ARM_BLOCK();                                                       \
+  w0 = vaddq_u32(state0, iv0);                                           \
+  w1 = vaddq_u32(state1, iv1)
+
+PWS_SHA256_ARMV8_TARGET
+static void sha256_compress_armv8(ulong32 state[8], const unsigned char *buf,
+                                  size_t nblocks)
+{
+  uint32x4_t state0, state1, abcd, efgh, wk, tmp;
+  uint32x4_t m0, m1, m2, m3;
+
+  state0 = vld1q_u32(&state[0]);
+  state1 = vld1q_u32(&state[4]);
+
+  for (; nblocks > 0; nblocks--, buf += SHA256::BLOCKSIZE) {
+    abcd = state0;
+    efgh = state1;
+
+    m0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf)));
+    m1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + 16)));
+    m2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + 32)));
+    m3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + 48)));
+
+    SHA_ARM_BLOCK();
+
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+
+  vst1q_u32(&state[0], state0);
+  vst1q_u32(&state[4], state1);
+}
+
+PWS_SHA256_ARMV8_TARGET
+static void sha256_iterate_armv8(ulong32 words[8], unsigned int N)
+{
+  static const ulong32 pad[8] = {0x80000000UL, 0, 0, 0, 0, 0, 0, 256};
+  uint32x4_t state0, state1, wk, tmp;
+  uint32x4_t m0, m1, m2, m3;
+  const uint32x4_t iv0 = vld1q_u32(&sha256_IV[0]);
+  const uint32x4_t iv1 = vld1q_u32(&sha256_IV[4]);
+  const uint32x4_t pad2 = vld1q_u32(&pad[0]);
+  const uint32x4_t pad3 = vld1q_u32(&pad[4]);
+  uint32x4_t w0 = vld1q_u32(&words[0]);
+  uint32x4_t w1 = vld1q_u32(&words[4]);
+
+  for (unsigned int n = 0; n < N; n++) {
+    SHA_ARM_DIGEST32(iv0, iv1, pad3);
+  }
+
+  vst1q_u32(&words[0], w0);
+  vst1q_u32(&words[4], w1);
+}
+
+PWS_SHA256_ARMV8_TARGET
+static void sha256_hmac_iterate_armv8(const ulong32 istate[8],
+                                      const ulong32 ostate[8],
+                                      ulong32 words[8], ulong32 acc[8],
+                                      unsigned int N)
+{
+  static const ulong32 pad[8] = {0x80000000UL, 0, 0, 0, 0, 0, 0, 768};
+  uint32x4_t state0, state1, wk, tmp;
+  uint32x4_t m0, m1, m2, m3;
+  const uint32x4_t in0 = vld1q_u32(&istate[0]);
+  const uint32x4_t in1 = vld1q_u32(&istate[4]);
+  const uint32x4_t out0 = vld1q_u32(&ostate[0]);
+  const uint32x4_t out1 = vld1q_u32(&ostate[4]);
+  const uint32x4_t pad2 = vld1q_u32(&pad[0]);
+  const uint32x4_t pad3 = vld1q_u32(&pad[4]);
+  uint32x4_t w0 = vld1q_u32(&words[0]);
+  uint32x4_t w1 = vld1q_u32(&words[4]);
+  uint32x4_t a0 = vld1q_u32(&acc[0]);
+  uint32x4_t a1 = vld1q_u32(&acc[4]);
+
+  for (unsigned int n = 0; n < N; n++) {
+    SHA_ARM_DIGEST32(in0, in1, pad3);
+    SHA_ARM_DIGEST32(out0, out1, pad3);
+    a0 = veorq_u32(a0, w0);
+    a1 = veorq_u32(a1, w1);
+  }
+
+  vst1q_u32(&words[0], w0);
+  vst1q_u32(&words[4], w1);
+  vst1q_u32(&acc[0], a0);
+  vst1q_u32(&acc[4], a1);
+}
+
+#undef SHA_ARM_ROUNDS
+#undef SHA_ARM_SCHED
+#undef SHA_ARM_BLOCK
+#undef SHA_ARM_DIGEST32
+
+static bool sha256_armv8_supported()
+{
+#if defined(__APPLE__)
+  return true; // All Apple ARM64 processors have the SHA2 instructions
+#else
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#endif
+}
+
+static const sha256_funcs sha256_armv8_funcs = {
+  sha256_compress_armv8, sha256_iterate_armv8, sha256_hmac_iterate_armv8
+};
+#endif /* PWS_SHA256_ARMV8 */
+
+static bool sha256_impl_supported(SHA256::Impl impl)
+{
+  switch (impl) {
+  case SHA256::PORTABLE:
+    return true;
+#ifdef PWS_SHA256_X86
+  case SHA256::X86_SHA:
+    return sha256_x86_supported();
+#endif
+#ifdef PWS_SHA256_ARMV8
+  case SHA256::ARMV8_SHA:
+    return sha256_armv8_supported();
+#endif
+  default:
+    return false;
+  }
+}
+
+static const sha256_funcs *sha256_impl_funcs(SHA256::Impl impl)
+{
+  switch (impl) {
+#ifdef PWS_SHA256_X86
+  case SHA256::X86_SHA:
+    return &sha256_x86_funcs;
+#endif
+#ifdef PWS_SHA256_ARMV8
+  case SHA256::ARMV8_SHA:
+    return &sha256_armv8_funcs;
+#endif
+  default:
+    return &sha256_portable_funcs;
+  }
+}
+
+static SHA256::Impl sha256_detect_impl()
+{
+  if (sha256_impl_supported(SHA256::X86_SHA))
+    return SHA256::X86_SHA;
+  if (sha256_impl_supported(SHA256::ARMV8_SHA))
+    return SHA256::ARMV8_SHA;
+  return SHA256::PORTABLE;
+}
+
+// Function-local static so that SHA256 objects may be used during
+// static initialization of other translation units
+static SHA256::Impl &sha256_current_impl()
+{
+  static SHA256::Impl impl = sha256_detect_impl();
+  return impl;
+}
+
+static const sha256_funcs *&sha256_current_funcs()
+{
+  static const sha256_funcs *funcs = sha256_impl_funcs(sha256_current_impl());
+  return funcs;
+}
+
+SHA256::Impl SHA256::GetImpl()
+{
+  return sha256_current_impl();
+}
+
+bool SHA256::SetImpl(Impl impl)
+{
+  if (!sha256_impl_supported(impl))
+    return false;
+  sha256_current_impl() = impl;
+  sha256_current_funcs() = sha256_impl_funcs(impl);
+  return true;
+}
 
 /*
   Initialize the hash state
@@ -198,7 +721,10 @@ SHA256::SHA256()
 
 SHA256::~SHA256()
 {
-  // sanitizing done in Final()
+  // Final() sanitizes too, but keyed states used by HMACIterate()
+  // never get there
+  trashMemory(state, sizeof(state));
+  trashMemory(buf, sizeof(buf));
 }
 
 /*
@@ -209,15 +735,17 @@ SHA256::~SHA256()
 void SHA256::Update(const unsigned char *in, size_t inlen)
 {
   const size_t block_size = 64;
+  const sha256_compress_fn compress = sha256_current_funcs()->compress;
   size_t n;
   ASSERT(in != nullptr || inlen == 0);
   ASSERT(curlen <= sizeof(buf));
   while (inlen > 0) {
     if (curlen == 0 && inlen >= block_size) {
-      sha256_compress(state, in);
-      length += block_size * 8;
-      in             += block_size;
-      inlen          -= block_size;
+      const size_t nblocks = inlen / block_size;
+      compress(state, in, nblocks);
+      length += nblocks * block_size * 8;
+      in             += nblocks * block_size;
+      inlen          -= nblocks * block_size;
     } else {
       n = std::min(inlen, (block_size - curlen));
       memcpy(buf + curlen, in, static_cast<size_t>(n));
@@ -225,7 +753,7 @@ void SHA256::Update(const unsigned char *in, size_t inlen)
       in             += n;
       inlen          -= n;
       if (curlen == block_size) {
-        sha256_compress(state, buf);
+        compress(state, buf, 1);
         length += 8*block_size;
         curlen = 0;
       }
@@ -239,6 +767,7 @@ void SHA256::Update(const unsigned char *in, size_t inlen)
 */
 void SHA256::Final(unsigned char digest[HASHLEN])
 {
+  const sha256_compress_fn compress = sha256_current_funcs()->compress;
   int i;
 
   ASSERT(digest != nullptr);
@@ -259,7 +788,7 @@ void SHA256::Final(unsigned char digest[HASHLEN])
     while (curlen < 64) {
       buf[curlen++] = 0;
     }
-    sha256_compress(state, buf);
+    compress(state, buf, 1);
     curlen = 0;
   }
 
@@ -270,7 +799,7 @@ void SHA256::Final(unsigned char digest[HASHLEN])
 
   /* store length */
   STORE64H(length, buf+56);
-  sha256_compress(state, buf);
+  compress(state, buf, 1);
 
   /* copy output */
   for (i = 0; i < 8; i++) {
@@ -281,3 +810,56 @@ void SHA256::Final(unsigned char digest[HASHLEN])
   trashMemory(buf, sizeof(buf));
 #endif
 }
+
+/*
+  Replace X by SHA256(X), N times
+  @param X  The 32 byte value to hash, overwritten by the result
+  @param N  The number of iterations
+*/
+void SHA256::IterateDigest(unsigned char X[HASHLEN], unsigned int N)
+{
+  ulong32 words[8];
+  int i;
+
+  ASSERT(X != nullptr);
+  for (i = 0; i < 8; i++) {
+    LOAD32H(words[i], X + (4*i));
+  }
+  sha256_current_funcs()->iterate(words, N);
+  for (i = 0; i < 8; i++) {
+    STORE32H(words[i], X + (4*i));
+  }
+  trashMemory(words, sizeof(words));
+}
+
+/*
+  The PBKDF2-HMAC-SHA256 inner loop
+  @param inner  A SHA256 that has hashed exactly the key block XOR ipad
+  @param outer  A SHA256 that has hashed exactly the key block XOR opad
+  @param U      U_1 on entry, replaced by HMAC(key, U), N times
+  @param T      Each successive U is XORed into T
+  @param N      The number of iterations
+*/
+void SHA256::HMACIterate(const SHA256 &inner, const SHA256 &outer,
+                         unsigned char U[HASHLEN], unsigned char T[HASHLEN],
+                         unsigned int N)
+{
+  ulong32 words[8], acc[8];
+  int i;
+
+  ASSERT(U != nullptr && T != nullptr);
+  ASSERT(inner.curlen == 0 && inner.length == 8 * BLOCKSIZE);
+  ASSERT(outer.curlen == 0 && outer.length == 8 * BLOCKSIZE);
+  for (i = 0; i < 8; i++) {
+    LOAD32H(words[i], U + (4*i));
+    LOAD32H(acc[i], T + (4*i));
+  }
+  sha256_current_funcs()->hmac_iterate(inner.state, outer.state,
+                                       words, acc, N);
+  for (i = 0; i < 8; i++) {
+    STORE32H(words[i], U + (4*i));
+    STORE32H(acc[i], T + (4*i));
+  }
+  trashMemory(words, sizeof(words));
+  trashMemory(acc, sizeof(acc));
+}
@@ -25,6 +25,25 @@ public:
   void Update(const unsigned char *in, size_t inlen);
   void Final(unsigned char digest[HASHLEN]);
 
+  // Equivalent to N rounds of {SHA256 H; H.Update(X, HASHLEN); H.Final(X);}
+  // but much faster, as used for key stretching
+  static void IterateDigest(unsigned char X[HASHLEN], unsigned int N);
+
+  // For PBKDF2-HMAC-SHA256: inner/outer are SHA256s that have hashed just
+  // the HMAC key XOR ipad/opad. Replaces U by HMAC(key, U) N times, XORing
+  // each result into T, without rehashing the key blocks.
+  static void HMACIterate(const SHA256 &inner, const SHA256 &outer,
+                          unsigned char U[HASHLEN], unsigned char T[HASHLEN],
+                          unsigned int N);
+
+  // The compression function is picked at startup according to what the
+  // processor supports. SetImpl() lets tests and benchmarks override
+  // this, returning false if the requested one isn't available here.
+  // It's not thread-safe, and shouldn't be called while hashing.
+  enum Impl {PORTABLE, X86_SHA, ARMV8_SHA};
+  static Impl GetImpl();
+  static bool SetImpl(Impl impl);
+
 private:
   ulong64 length;
   size_t curlen;
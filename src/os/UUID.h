@@ -24,7 +24,9 @@ typedef uuid_t uuid_array_t;
 typedef uuid_t UUID;
 #endif
 
-#include <memory> // for memcmp
+#include <memory>
+#include <cstring> // for memcmp
+#include <functional> // for std::hash
 #include <iostream>
 #include "typedefs.h"
 #include "../core/StringX.h"
@@ -32,39 +34,61 @@ typedef uuid_t UUID;
 #include <vector>
 
 namespace pws_os {
+// A plain 16-byte value, so that it's cheap to copy, compare and hash,
+// as it's the key of most of the core's containers.
 class CUUID
 {
 public:
   CUUID(); // UUID generated at creation time
-  CUUID(const CUUID &uuid);
-  CUUID(const uuid_array_t &ua, bool canonic = false); // for storing an existing UUID
+  CUUID(const uuid_array_t &ua); // for storing an existing UUID
   CUUID(const StringX &s); // s is a hex string as returned by cast to StringX
   static const CUUID &NullUUID(); // singleton all-zero
-  ~CUUID();
 
   // Following get Array Representation of the uuid:
-  void GetARep(uuid_array_t &ua) const;
-  const uuid_array_t *GetARep() const; // internally allocated, deleted in d'tor
-  
-  CUUID &operator=(const CUUID &that);
+  void GetARep(uuid_array_t &ua) const {std::memcpy(ua, m_ua, sizeof(m_ua));}
+  const uuid_array_t *GetARep() const {return &m_ua;}
+
   operator StringX() const; // GetHexStr, e.g., "204012e6600f4e01a5eb515267cb0d50"
-  bool operator==(const CUUID &that) const;
+  bool operator==(const CUUID &that) const
+  {return std::memcmp(m_ua, that.m_ua, sizeof(m_ua)) == 0;}
   bool operator!=(const CUUID &that) const { return !(*this == that); }
-  bool operator<(const CUUID &that) const;
+  bool operator<(const CUUID &that) const
+  {return std::memcmp(m_ua, that.m_ua, sizeof(m_ua)) < 0;}
+
+  size_t Hash() const
+  {
+    // Most UUIDs are random, but not all, so mix both halves
+    uint64 h0, h1;
+    std::memcpy(&h0, m_ua, sizeof(h0));
+    std::memcpy(&h1, m_ua + sizeof(h0), sizeof(h1));
+    uint64 h = h0 ^ (h1 * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return static_cast<size_t>(h);
+  }
 
-  friend std::ostream &operator<<(std::ostream &os, const pws_os::CUUID &uuid);
-  friend std::wostream &operator<<(std::wostream &os, const pws_os::CUUID &uuid);
+  // For output in canonical form, e.g., "204012e6-600f-4e01-a5eb-515267cb0d50",
+  // as in: os << std::uppercase << uuid.Canonic();
+  struct CanonicRep {const CUUID &uuid;};
+  CanonicRep Canonic() const {return CanonicRep{*this};}
 
 private:
-  UUID m_uuid;
-  mutable uuid_array_t *m_ua; // for GetUUID();
-  mutable bool m_canonic;
+  uuid_array_t m_ua; // in network byte order on all platforms
 };
 
 std::ostream &operator<<(std::ostream &os, const CUUID &uuid);
 std::wostream &operator<<(std::wostream &os, const CUUID &uuid);
+std::ostream &operator<<(std::ostream &os, const CUUID::CanonicRep &cr);
+std::wostream &operator<<(std::wostream &os, const CUUID::CanonicRep &cr);
 } // end of pws_os namespace
 
+namespace std {
+template<> struct hash<pws_os::CUUID> {
+  size_t operator()(const pws_os::CUUID &uuid) const {return uuid.Hash();}
+};
+}
+
 typedef std::vector<pws_os::CUUID> UUIDVector;
 typedef UUIDVector::iterator UUIDVectorIter;
 
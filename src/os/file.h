@@ -24,6 +24,9 @@ namespace pws_os {
   extern bool RenameFile(const stringT &oldname, const stringT &newname);
   extern bool CopyAFile(const stringT &from, const stringT &to); // creates dirs as needed!
   extern bool DeleteAFile(const stringT &filename);
+  // Puts from in place of to in one step, so that to's either the old file
+  // or the new one, whatever happens. They must be on the same volume.
+  extern bool ReplaceAFile(const stringT &from, const stringT &to);
   extern void FindFiles(const stringT &filter, std::vector<stringT> &res);
   extern bool LockFile(const stringT &filename, stringT &locker,
                        HANDLE &lockFileHandle);
@@ -32,8 +35,16 @@ namespace pws_os {
   extern void TryUnlockFile(const stringT &filename, HANDLE &lockFileHandle);
 
   extern std::FILE *FOpen(const stringT &filename, const TCHAR *mode);
+  // Creates a new file with a name of its own in the user's directory for
+  // temporary files, readable only by them, open for writing. Returns
+  // nullptr if it can't be done.
+  extern std::FILE *CreateTempFile(stringT &filename);
   extern int FClose(std::FILE *fd, const bool &bIsWrite);
   extern ulong64 fileLength(std::FILE *fp);
+  // Maps the first length bytes of fp's file read-only, returning
+  // nullptr if that can't be done. Caller must UnmapFile() when done.
+  extern const unsigned char *MapFile(std::FILE *fp, ulong64 length);
+  extern void UnmapFile(const unsigned char *p, ulong64 length);
   extern bool GetFileTimes(const stringT &filename,
       time_t &ctime, time_t &mtime, time_t &atime);
   extern bool SetFileTimes(const stringT &filename,
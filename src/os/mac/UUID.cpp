@@ -14,13 +14,18 @@
 //
 
 #include "../UUID.h"
-#include "../../core/Util.h" /* for trashMemory() */
+#include "../../core/Util.h"
 #include "../../core/StringXStream.h"
 #include <iomanip>
+#include <type_traits>
 #include <assert.h>
 
 using namespace std;
 
+static_assert(sizeof(pws_os::CUUID) == sizeof(uuid_array_t) &&
+              std::is_trivially_copyable<pws_os::CUUID>::value,
+              "CUUID should be a plain 16-byte value");
+
 static const uuid_array_t zua = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 static pws_os::CUUID nullUUID(zua);
 
@@ -29,122 +34,66 @@ const pws_os::CUUID &pws_os::CUUID::NullUUID()
   return nullUUID;
 }
 
-pws_os::CUUID::CUUID() : m_ua(NULL), m_canonic(false)
-{
-  uuid_generate(m_uuid);
-}
-
-pws_os::CUUID::CUUID(const CUUID &uuid)
-  : m_ua(NULL), m_canonic(uuid.m_canonic)
+pws_os::CUUID::CUUID()
 {
-  uuid_copy(m_uuid, uuid.m_uuid);
+  uuid_generate(m_ua);
 }
 
-pws_os::CUUID &pws_os::CUUID::operator=(const CUUID &that)
+pws_os::CUUID::CUUID(const uuid_array_t &uuid_array)
 {
-  if (this != &that) {
-    uuid_copy(m_uuid, that.m_uuid);
-    if (m_ua) {
-#ifndef TEST
-      trashMemory(m_ua, sizeof(uuid_array_t));
-#endif
-      delete[] m_ua;
-      m_ua = NULL;
-    }
-    m_canonic = that.m_canonic;
-  }
-  return *this;
-}
-
-pws_os::CUUID::CUUID(const uuid_array_t &uuid_array, bool canonic)
-  : m_ua(NULL), m_canonic(canonic)
-{
-  uuid_copy(m_uuid, uuid_array);
+  uuid_copy(m_ua, uuid_array);
 }
 
 pws_os::CUUID::CUUID(const StringX &s)
-  : m_ua(NULL), m_canonic(false)
 {
   // s is a hex string as returned by cast to StringX
   ASSERT(s.length() == 32);
-  unsigned char *uu = m_uuid;
+  unsigned char *uu = m_ua;
 
   int x;
-  for (int i = 0; i < 16; i++) {
+  for (unsigned int i = 0; i < 16; i++) {
     iStringXStream is(s.substr(i*2, 2));
     is >> hex >> x;
     uu[i] = static_cast<unsigned char>(x);
   }
 }
 
-pws_os::CUUID::~CUUID()
-{
-#ifndef TEST
-  trashMemory(reinterpret_cast<unsigned char *>(&m_uuid), sizeof(m_uuid));
-#endif
-  if (m_ua) {
-#ifndef TEST
-    trashMemory(m_ua, sizeof(uuid_array_t));
-#endif
-    delete[] m_ua;
-  }
-}
-
-void pws_os::CUUID::GetARep(uuid_array_t &uuid_array) const
+template<class OS>
+static OS &Output(OS &os, const pws_os::CUUID &uuid, bool canonic)
 {
-  uuid_copy(uuid_array, m_uuid);
-}
-
-const uuid_array_t *pws_os::CUUID::GetARep() const
-{
-  if (m_ua == NULL) {
-    m_ua = (uuid_array_t *)(new uuid_array_t);
-    GetARep(*m_ua);
+  const uuid_array_t &uuid_a = *uuid.GetARep();
+  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
+    os << setw(2) << setfill(typename OS::char_type('0')) << hex << int(uuid_a[i]);
+    if (canonic && (i == 3 || i == 5 || i == 7 || i == 9))
+      os << typename OS::char_type('-');
   }
-  return m_ua;
+  return os;
 }
 
-bool pws_os::CUUID::operator==(const CUUID &that) const
+std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID &uuid)
 {
-  return uuid_compare(this->m_uuid, that.m_uuid) == 0;
+  return Output(os, uuid, false);
 }
 
-bool pws_os::CUUID::operator<(const pws_os::CUUID &that) const
+std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID &uuid)
 {
-  return uuid_compare(m_uuid, that.m_uuid) < 0;
+  return Output(os, uuid, false);
 }
 
-std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID &uuid)
+std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID::CanonicRep &cr)
 {
-  uuid_array_t uuid_a;
-  uuid.GetARep(uuid_a);
-  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
-    os << setw(2) << setfill('0') << hex << int(uuid_a[i]);
-    if (uuid.m_canonic && (i == 3 || i == 5 || i == 7 || i == 9))
-      os << "-";
-  }
-  return os;
+  return Output(os, cr.uuid, true);
 }
 
-std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID &uuid)
+std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID::CanonicRep &cr)
 {
-  uuid_array_t uuid_a;
-  uuid.GetARep(uuid_a);
-  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
-    os << setw(2) << setfill(wchar_t('0')) << hex << int(uuid_a[i]);
-    if (uuid.m_canonic && (i == 3 || i == 5 || i == 7 || i == 9))
-      os << L"-";
-  }
-  return os;
+  return Output(os, cr.uuid, true);
 }
 
 pws_os::CUUID::operator StringX() const
 {
   oStringXStream os;
-  bool sc = m_canonic;
-  m_canonic = false;
   os << *this;
-  m_canonic = sc;
   return os.str();
 }
 
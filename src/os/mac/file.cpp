@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -143,6 +144,11 @@ bool pws_os::CopyAFile(const stringT &from, const stringT &to)
   return retval;
 }
 
+bool pws_os::ReplaceAFile(const stringT &from, const stringT &to)
+{
+  return RenameFile(from, to); // rename() replaces atomically
+}
+
 bool pws_os::DeleteAFile(const stringT &filename)
 {
 #ifndef UNICODE
@@ -365,15 +371,50 @@ std::FILE *pws_os::FOpen(const stringT &filename, const TCHAR *mode)
   return retval;
 }
 
+std::FILE *pws_os::CreateTempFile(stringT &filename)
+{
+  stringT dir = pws_os::getenv("TMPDIR", true);
+  if (dir.empty())
+    dir = _T("/tmp/");
+  const stringT templ = dir + _T("pwsafeXXXXXX");
+
+  size_t N = wcstombs(nullptr, templ.c_str(), 0) + 1;
+  std::vector<char> name(N);
+  wcstombs(name.data(), templ.c_str(), N);
+
+  // mkstemp() creates it with only the user's read & write permissions
+  const int fd = ::mkstemp(name.data());
+  if (fd == -1)
+    return nullptr;
+  FILE *retval = ::fdopen(fd, "wb");
+  if (retval == nullptr) {
+    ::close(fd);
+    ::unlink(name.data());
+    return nullptr;
+  }
+
+  std::vector<wchar_t> wname(N);
+  ::mbstowcs(wname.data(), name.data(), N);
+  filename = wname.data();
+  return retval;
+}
+
 int pws_os::FClose(std::FILE *fd, const bool &bIsWrite)
 {
   if (fd != NULL) {
+    int retval = 0;
     if (bIsWrite) {
-      // Flush the data buffers
-      fflush(fd);
+      // Flush the data buffers, then have the OS put them on disk,
+      // so that a save is complete when we return. Records are only
+      // written out here, so if either fails, the save has.
+      // Don't bother trying fsync if fflush failed
+      if (fflush(fd) != 0 || fsync(fileno(fd)) != 0)
+        retval = EOF;
     }
-    // Now close file
-    return fclose(fd);
+    // Now close file, regardless
+    if (fclose(fd) != 0)
+      retval = EOF;
+    return retval;
   }
   return 0;
 }
@@ -389,6 +430,26 @@ ulong64 pws_os::fileLength(std::FILE *fp)
   return ulong64(st.st_size);
 }
 
+const unsigned char *pws_os::MapFile(std::FILE *fp, ulong64 length)
+{
+  if (fp == nullptr || length == 0 || length != size_t(length))
+    return nullptr;
+  int fd = fileno(fp);
+  if (fd == -1)
+    return nullptr;
+  void *p = mmap(nullptr, size_t(length), PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  madvise(p, size_t(length), MADV_SEQUENTIAL);
+  return static_cast<const unsigned char *>(p);
+}
+
+void pws_os::UnmapFile(const unsigned char *p, ulong64 length)
+{
+  if (p != nullptr)
+    munmap(const_cast<unsigned char *>(p), size_t(length));
+}
+
 bool pws_os::GetFileTimes(const stringT &filename,
 			time_t &ctime, time_t &mtime, time_t &atime)
 {
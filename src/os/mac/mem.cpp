@@ -26,6 +26,28 @@ bool pws_os::munlock(void *p, size_t size)
   return ::munlock(p, size) == 0;
 }
 
+void *pws_os::allocLockedPages(size_t size)
+{
+  void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  // Best effort: a low RLIMIT_MEMLOCK stops locking, which isn't fatal
+  ::mlock(p, size);
+#ifdef MADV_DONTDUMP
+  ::madvise(p, size, MADV_DONTDUMP);
+#endif
+  return p;
+}
+
+void pws_os::freeLockedPages(void *p, size_t size)
+{
+  if (p == nullptr)
+    return;
+  ::munlock(p, size);
+  ::munmap(p, size);
+}
+
 // Following has OS support only in Windows
 bool pws_os::mcryptProtect(void *, size_t)
 {
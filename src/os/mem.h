@@ -18,6 +18,15 @@ namespace pws_os {
   extern bool mlock(void *p, size_t size);
   extern bool munlock(void *p, size_t size);
 
+  /**
+   * Returns size bytes of fresh pages, locked in RAM (as far as the
+   * process' limits allow) and, where the OS supports it, left out of
+   * core dumps, or nullptr on failure.
+   */
+  extern void *allocLockedPages(size_t size);
+  // Unlocks and unmaps what allocLockedPages(size) returned
+  extern void freeLockedPages(void *p, size_t size);
+
   /**
    * Following are wrappers for Window's 'protect memory' functions,
    * that use an unspecified algorithm with an unspecified key
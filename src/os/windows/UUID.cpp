@@ -14,25 +14,14 @@
 //
 
 #include "../UUID.h"
-#include "../../core/Util.h" /* for trashMemory() */
+#include "../../core/Util.h"
 #include "../../core/StringXStream.h"
 #include <iomanip>
+#include <type_traits>
 #include <assert.h>
 
 using namespace std;
 
-static void array2UUUID(const uuid_array_t &ua, UUID &uuid)
-{
-  unsigned long *p0 = (unsigned long *)ua;
-  uuid.Data1 = htonl(*p0);
-  unsigned short *p1 = (unsigned short *)&ua[4];
-  uuid.Data2 = htons(*p1);
-  unsigned short *p2 = (unsigned short *)&ua[6];
-  uuid.Data3 = htons(*p2);
-  for (int i = 0; i < 8; i++)
-    uuid.Data4[i] = ua[i + 8];
-}
-
 static void UUID2array(const UUID &uuid, uuid_array_t &ua)
 {
   unsigned long *p0 = (unsigned long *)ua;
@@ -45,6 +34,10 @@ static void UUID2array(const UUID &uuid, uuid_array_t &ua)
     ua[i + 8] = uuid.Data4[i];
 }
 
+static_assert(sizeof(pws_os::CUUID) == sizeof(uuid_array_t) &&
+              std::is_trivially_copyable<pws_os::CUUID>::value,
+              "CUUID should be a plain 16-byte value");
+
 static const uuid_array_t zua = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 static pws_os::CUUID nullUUID(zua);
 
@@ -54,117 +47,67 @@ const pws_os::CUUID &pws_os::CUUID::NullUUID()
 }
 
 pws_os::CUUID::CUUID()
-  : m_ua(NULL), m_canonic(false)
 {
-  UuidCreate(&m_uuid);
+  UUID uuid;
+  UuidCreate(&uuid);
+  UUID2array(uuid, m_ua);
 }
 
-pws_os::CUUID::CUUID(const CUUID &uuid)
-  : m_ua(NULL), m_canonic(uuid.m_canonic)
+pws_os::CUUID::CUUID(const uuid_array_t &ua)
 {
-  std::memcpy(&m_uuid, &uuid.m_uuid, sizeof(m_uuid));
-}
-
-pws_os::CUUID::CUUID(const uuid_array_t &ua, bool canonic)
-  : m_ua(NULL), m_canonic(canonic)
-{
-  array2UUUID(ua, m_uuid);
+  std::memcpy(m_ua, ua, sizeof(m_ua));
 }
 
 pws_os::CUUID::CUUID(const StringX &s)
-  : m_ua(NULL), m_canonic(false)
 {
   // s is a hex string as returned by cast to StringX
   ASSERT(s.length() == 32);
-  uuid_array_t ua;
+  unsigned char *uu = m_ua;
 
-  unsigned int x(0);
-  for (size_t i = 0; i < 16; i++) {
-    iStringXStream is(s.substr(i * 2, 2));
+  int x;
+  for (unsigned int i = 0; i < 16; i++) {
+    iStringXStream is(s.substr(i*2, 2));
     is >> hex >> x;
-    ua[i] = static_cast<unsigned char>(x);
+    uu[i] = static_cast<unsigned char>(x);
   }
-  array2UUUID(ua, m_uuid);
 }
 
-pws_os::CUUID::~CUUID()
+template<class OS>
+static OS &Output(OS &os, const pws_os::CUUID &uuid, bool canonic)
 {
-  trashMemory(reinterpret_cast<unsigned char *>(&m_uuid), sizeof(m_uuid));
-  if (m_ua) {
-    trashMemory(m_ua, sizeof(uuid_array_t));
-    delete[] m_ua;
-  }
-}
-
-pws_os::CUUID &pws_os::CUUID::operator=(const CUUID &that)
-{
-  if (this != &that) {
-    std::memcpy(&m_uuid, &that.m_uuid, sizeof(m_uuid));
-    if (m_ua) {
-      trashMemory(m_ua, sizeof(uuid_array_t));
-      delete[] m_ua;
-      m_ua = NULL;
-    }
-    m_canonic = that.m_canonic;
-  }
-  return *this;
-}
-
-void pws_os::CUUID::GetARep(uuid_array_t &ua) const
-{
-  UUID2array(m_uuid, ua);
-}
-
-const uuid_array_t *pws_os::CUUID::GetARep() const
-{
-  if (m_ua == NULL) {
-    m_ua = (uuid_array_t *)(new uuid_array_t);
-    GetARep(*m_ua);
+  const uuid_array_t &uuid_a = *uuid.GetARep();
+  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
+    os << setw(2) << setfill(typename OS::char_type('0')) << hex << int(uuid_a[i]);
+    if (canonic && (i == 3 || i == 5 || i == 7 || i == 9))
+      os << typename OS::char_type('-');
   }
-  return m_ua;
+  return os;
 }
 
-bool pws_os::CUUID::operator==(const pws_os::CUUID &that) const
+std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID &uuid)
 {
-  return std::memcmp(&this->m_uuid, &that.m_uuid, sizeof(m_uuid)) == 0;
+  return Output(os, uuid, false);
 }
 
-bool pws_os::CUUID::operator<(const pws_os::CUUID &that) const
+std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID &uuid)
 {
-  return std::memcmp(&this->m_uuid, &that.m_uuid, sizeof(m_uuid)) < 0;
+  return Output(os, uuid, false);
 }
 
-std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID &uuid)
+std::ostream &pws_os::operator<<(std::ostream &os, const pws_os::CUUID::CanonicRep &cr)
 {
-  uuid_array_t ua;
-  uuid.GetARep(ua);
-  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
-    os << setw(2) << setfill('0') << hex << int(ua[i]);
-    if (uuid.m_canonic && (i == 3 || i == 5 || i == 7 || i == 9))
-      os << "-";
-  }
-  return os;
+  return Output(os, cr.uuid, true);
 }
 
-std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID &uuid)
+std::wostream &pws_os::operator<<(std::wostream &os, const pws_os::CUUID::CanonicRep &cr)
 {
-  uuid_array_t ua;
-  uuid.GetARep(ua);
-  for (size_t i = 0; i < sizeof(uuid_array_t); i++) {
-    os << setw(2) << setfill(wchar_t('0')) << hex << int(ua[i]);
-    if (uuid.m_canonic && (i == 3 || i == 5 || i == 7 || i == 9))
-      os << L"-";
-  }
-  return os;
+  return Output(os, cr.uuid, true);
 }
 
 pws_os::CUUID::operator StringX() const
 {
   oStringXStream os;
-  bool sc = m_canonic;
-  m_canonic = false;
   os << *this;
-  m_canonic = sc;
   return os.str();
 }
 
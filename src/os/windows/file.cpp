@@ -125,6 +125,14 @@ extern bool pws_os::CopyAFile(const stringT &from, const stringT &to)
   return FileOP(from, to, FO_COPY);
 }
 
+bool pws_os::ReplaceAFile(const stringT &from, const stringT &to)
+{
+  // Unlike RenameFile(), doesn't delete to first, so that it's still
+  // there if the move fails
+  return MoveFileEx(from.c_str(), to.c_str(),
+                    MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+}
+
 bool pws_os::DeleteAFile(const stringT &filename)
 {
   return DeleteFile(filename.c_str()) == TRUE;
@@ -396,14 +404,35 @@ std::FILE *pws_os::FOpen(const stringT &filename, const TCHAR *mode)
   return fd;
 }
 
+std::FILE *pws_os::CreateTempFile(stringT &filename)
+{
+  TCHAR dir[MAX_PATH + 1], name[MAX_PATH];
+  const DWORD len = GetTempPath(_countof(dir), dir);
+  // GetTempFileName() creates it, in the user's own temporary directory
+  if (len == 0 || len > _countof(dir) ||
+      GetTempFileName(dir, _T("pws"), 0, name) == 0)
+    return NULL;
+
+  std::FILE *fd = NULL;
+  if (_tfopen_s(&fd, name, _T("wb")) != 0) {
+    DeleteFile(name);
+    return NULL;
+  }
+  filename = name;
+  return fd;
+}
+
 int pws_os::FClose(std::FILE *fd, const bool &bIsWrite)
 {
   if (fd != NULL) {
+    int retval = 0;
     if (bIsWrite) {
       // Flush the data buffers
       // fflush returns 0 if the buffer was successfully flushed.
       // A return value of EOF indicates an error.
       int rc = fflush(fd);
+      if (rc != 0)
+        retval = EOF;
 
       // Don't bother trying FlushFileBuffers if fflush failed
       if (rc == 0) {
@@ -418,6 +447,8 @@ int pws_os::FClose(std::FILE *fd, const bool &bIsWrite)
 
             if (brc == FALSE) {
               pws_os::IssueError(_T("FlushFileBuffers on close of file on removable device"), false);
+              // Records are only written out on close, so the save's failed
+              retval = EOF;
             }
           } // iosfhandle
         } // ifileno
@@ -426,7 +457,9 @@ int pws_os::FClose(std::FILE *fd, const bool &bIsWrite)
 
     // Now close file
     // fclose returns 0 if the stream is successfully closed or EOF to indicate an error.
-    return fclose(fd);
+    if (fclose(fd) != 0)
+      retval = EOF;
+    return retval;
   } else {
     return 0;
   }
@@ -443,6 +476,27 @@ ulong64 pws_os::fileLength(std::FILE *fp) {
     return 0;
 }
 
+const unsigned char *pws_os::MapFile(std::FILE *fp, ulong64 length)
+{
+  if (fp == NULL || length == 0 || length != SIZE_T(length))
+    return NULL;
+  HANDLE hFile = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(fp)));
+  if (hFile == INVALID_HANDLE_VALUE)
+    return NULL;
+  HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (hMap == NULL)
+    return NULL;
+  void *p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, SIZE_T(length));
+  CloseHandle(hMap); // view keeps the mapping alive
+  return static_cast<const unsigned char *>(p);
+}
+
+void pws_os::UnmapFile(const unsigned char *p, ulong64 )
+{
+  if (p != NULL)
+    UnmapViewOfFile(p);
+}
+
 bool pws_os::GetFileTimes(const stringT &filename,
       time_t &atime, time_t &ctime, time_t &mtime)
 {
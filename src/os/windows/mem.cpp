@@ -27,6 +27,22 @@ bool pws_os::munlock(void *p, size_t size)
   return VirtualUnlock(p, size) != 0;
 }
 
+void *pws_os::allocLockedPages(size_t size)
+{
+  void *p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  if (p != NULL)
+    VirtualLock(p, size); // best effort, limited by the working set size
+  return p;
+}
+
+void pws_os::freeLockedPages(void *p, size_t size)
+{
+  if (p != NULL) {
+    VirtualUnlock(p, size);
+    VirtualFree(p, 0, MEM_RELEASE);
+  }
+}
+
 typedef BOOL (WINAPI *LP_CryptProtectMemory)(LPVOID pDataIn, DWORD cbDataIn, DWORD dwFlags);
 
 bool pws_os::mcryptProtect(void *p, size_t size)
@@ -76,3 +76,57 @@ TEST(AESTest, aes_test)
   }
   SUCCEED();
 }
+
+TEST(AESTest, Impls)
+{
+  // Every implementation this machine supports must agree with the
+  // portable one, for all key lengths and the bulk entry points,
+  // including CBC chaining across calls via the iv
+  const AES::Impl saved = AES::GetImpl();
+  const size_t N = 37, BS = AES::BLOCKSIZE;
+  unsigned char key[32], pt[N * BS], iv0[BS];
+  for (size_t i = 0; i < sizeof(key); i++) key[i] = static_cast<unsigned char>(i * 13 + 1);
+  for (size_t i = 0; i < sizeof(pt); i++) pt[i] = static_cast<unsigned char>(i * 7);
+  for (size_t i = 0; i < BS; i++) iv0[i] = static_cast<unsigned char>(0xA5 ^ i);
+
+  for (int keylen = 16; keylen <= 32; keylen += 8) {
+    ASSERT_TRUE(AES::SetImpl(AES::PORTABLE));
+    AES ref(key, keylen);
+    unsigned char ecb[N * BS], cbc[N * BS], iv[BS];
+    for (size_t b = 0; b < N; b++)
+      ref.Encrypt(pt + b * BS, ecb + b * BS);
+    memcpy(iv, iv0, BS);
+    for (size_t b = 0; b < N; b++) {
+      unsigned char tmp[BS];
+      for (size_t j = 0; j < BS; j++) tmp[j] = pt[b * BS + j] ^ iv[j];
+      ref.Encrypt(tmp, cbc + b * BS);
+      memcpy(iv, cbc + b * BS, BS);
+    }
+
+    for (AES::Impl impl : {AES::PORTABLE, AES::X86_AESNI}) {
+      if (!AES::SetImpl(impl))
+        continue; // not on this machine
+      AES aes(key, keylen);
+      unsigned char buf[N * BS];
+
+      aes.EncryptBlocks(pt, buf, N);
+      EXPECT_EQ(0, memcmp(buf, ecb, sizeof(ecb))) << "impl " << impl << " keylen " << keylen;
+      aes.DecryptBlocks(buf, buf, N);
+      EXPECT_EQ(0, memcmp(buf, pt, sizeof(pt))) << "impl " << impl << " keylen " << keylen;
+
+      memcpy(buf, pt, sizeof(pt));
+      memcpy(iv, iv0, BS);
+      aes.CBCEncrypt(buf, 5, iv);
+      aes.CBCEncrypt(buf + 5 * BS, N - 5, iv);
+      EXPECT_EQ(0, memcmp(buf, cbc, sizeof(cbc))) << "impl " << impl << " keylen " << keylen;
+      EXPECT_EQ(0, memcmp(iv, cbc + (N - 1) * BS, BS));
+
+      memcpy(iv, iv0, BS);
+      aes.CBCDecrypt(buf, 3, iv);
+      aes.CBCDecrypt(buf + 3 * BS, N - 3, iv);
+      EXPECT_EQ(0, memcmp(buf, pt, sizeof(pt))) << "impl " << impl << " keylen " << keylen;
+      EXPECT_EQ(0, memcmp(iv, cbc + (N - 1) * BS, BS));
+    }
+  }
+  AES::SetImpl(saved);
+}
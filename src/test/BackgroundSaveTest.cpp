@@ -0,0 +1,238 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// BackgroundSaveTest.cpp: Unit test for PWScore::ScheduleSave()
+
+#if defined(WIN32) && !defined(__WX__)
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/PWScore.h"
+#include "os/file.h"
+
+#include <atomic>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// Counts what the core tells the UI about background saves
+class SaveObserver : public Observer
+{
+public:
+  SaveObserver() : numReady(0), numSaved(0), lastStatus(-1) {}
+  virtual void SaveReady() {numReady++;}
+  virtual void DatabaseSaved(int status, const StringX &filename)
+  {numSaved++; lastStatus = status; lastFile = filename;}
+
+  std::atomic<int> numReady; // called on the save's thread
+  int numSaved;
+  int lastStatus;
+  StringX lastFile;
+};
+
+// A fixture for factoring common code across tests
+class BackgroundSaveTest : public ::testing::Test
+{
+protected:
+  BackgroundSaveTest(); // to init members
+  void SetUp();
+  void TearDown();
+
+  // Adds item to core as a user would
+  void Add(CItemData &item);
+  // Number of entries in fname, as saved
+  ItemList::size_type NumSaved();
+
+  const StringX passphrase;
+  const StringX fname;
+  PWScore core;
+  SaveObserver observer;
+  CItemData items[3];
+};
+
+BackgroundSaveTest::BackgroundSaveTest()
+  : passphrase(_T("enchilada-sonol")), fname(_T("BackgroundSaveTest.psafe3"))
+{}
+
+void BackgroundSaveTest::SetUp()
+{
+  for (int i = 0; i < 3; i++) {
+    items[i].CreateUUID();
+    items[i].SetTitle(StringX(_T("title ")) + StringX(1, _T('0' + i)));
+    items[i].SetPassword(_T("password"));
+  }
+  core.NewFile(passphrase);
+  core.SetCurFile(fname);
+  core.RegisterObserver(&observer);
+}
+
+void BackgroundSaveTest::TearDown()
+{
+  core.CompleteSave();
+  core.UnregisterObserver(&observer);
+  core.ClearCommands();
+  ASSERT_TRUE(pws_os::DeleteAFile(fname.c_str()));
+}
+
+void BackgroundSaveTest::Add(CItemData &item)
+{
+  core.Execute(AddEntryCommand::Create(&core, item));
+}
+
+ItemList::size_type BackgroundSaveTest::NumSaved()
+{
+  PWScore core2;
+  core2.SetCurFile(fname);
+  EXPECT_EQ(PWScore::SUCCESS, core2.ReadCurFile(passphrase));
+  return core2.GetNumEntries();
+}
+
+// And now the tests...
+
+TEST_F(BackgroundSaveTest, SaveAndComplete)
+{
+  Add(items[0]);
+  EXPECT_TRUE(core.HasDBChanged());
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+  EXPECT_TRUE(core.IsSaveInProgress());
+  EXPECT_TRUE(core.HasDBChanged()); // until it's completed
+
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_FALSE(core.IsSaveInProgress());
+  EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_EQ(1, observer.numReady);
+  EXPECT_EQ(1, observer.numSaved);
+  EXPECT_EQ(PWScore::SUCCESS, observer.lastStatus);
+  EXPECT_EQ(fname, observer.lastFile);
+  EXPECT_EQ(1U, NumSaved());
+
+  // Nothing to complete
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave(false));
+  EXPECT_EQ(1, observer.numSaved);
+}
+
+TEST_F(BackgroundSaveTest, EditDuringSave)
+{
+  Add(items[0]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+  Add(items[1]); // after the snapshot
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_EQ(1U, NumSaved());
+
+  // What was saved is clean, what wasn't isn't
+  EXPECT_TRUE(core.HasDBChanged());
+  core.Undo();
+  EXPECT_FALSE(core.HasDBChanged());
+  core.Undo();
+  EXPECT_TRUE(core.HasDBChanged());
+  core.Redo();
+  EXPECT_FALSE(core.HasDBChanged());
+}
+
+TEST_F(BackgroundSaveTest, UndoneDuringSave)
+{
+  Add(items[0]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+  core.Undo();
+  Add(items[1]); // state that was saved can't be got back to
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_EQ(1U, NumSaved());
+
+  EXPECT_TRUE(core.HasDBChanged());
+  core.Undo();
+  EXPECT_TRUE(core.HasDBChanged());
+}
+
+TEST_F(BackgroundSaveTest, CoalesceSaves)
+{
+  Add(items[0]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+  Add(items[1]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+  Add(items[2]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+
+  // First save's done, the other two are done as one
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_TRUE(core.IsSaveInProgress());
+  EXPECT_TRUE(core.HasDBChanged());
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_FALSE(core.IsSaveInProgress());
+  EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_EQ(2, observer.numSaved);
+  EXPECT_EQ(3U, NumSaved());
+}
+
+TEST_F(BackgroundSaveTest, CoalesceBackups)
+{
+  // As BackupBeforeEverySave, with _nnn suffixes
+  PWScore::BackupOptions backup;
+  backup.maxNumIncBackups = 3;
+  backup.backupSuffix = 2;
+  backup.userBackupPrefix = L"BackgroundSaveBackup";
+  ASSERT_EQ(PWScore::SUCCESS, core.WriteCurFile());
+
+  // Scheduling doesn't wait for a save in progress to take a backup
+  Add(items[0]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSave(fname, core.GetReadFileVersion(), &backup));
+  Add(items[1]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSave(fname, core.GetReadFileVersion(), &backup));
+  EXPECT_TRUE(core.IsSaveInProgress());
+  EXPECT_EQ(0, observer.numSaved);
+  Add(items[2]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSave(fname, core.GetReadFileVersion(), &backup));
+
+  // Two saves, each with its backup
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_TRUE(core.IsSaveInProgress());
+  EXPECT_EQ(PWScore::SUCCESS, core.CompleteSave());
+  EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_EQ(2, observer.numSaved);
+  EXPECT_EQ(3U, NumSaved());
+
+  std::vector<stringT> backups;
+  pws_os::FindFiles(L"BackgroundSaveBackup_???.ibak", backups);
+  EXPECT_EQ(2U, backups.size());
+  for (const auto &bu_fname : backups) {
+    PWScore core2;
+    core2.SetCurFile(bu_fname.c_str());
+    EXPECT_EQ(PWScore::SUCCESS, core2.ReadCurFile(passphrase));
+    EXPECT_GT(2U, core2.GetNumEntries()); // as before each save
+    EXPECT_TRUE(pws_os::DeleteAFile(bu_fname));
+  }
+}
+
+TEST_F(BackgroundSaveTest, BackupFails)
+{
+  PWScore::BackupOptions backup;
+  backup.userBackupPrefix = L"BackgroundSaveBackup";
+  ASSERT_EQ(PWScore::SUCCESS, core.WriteCurFile());
+
+  // Changed since it was written, so it's not backed up, nor overwritten
+  Add(items[0]);
+  ASSERT_EQ(PWScore::SUCCESS, core.WriteFile(fname, core.GetReadFileVersion(), false));
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSave(fname, core.GetReadFileVersion(), &backup));
+  EXPECT_EQ(PWScore::CANT_BACKUP, core.CompleteSave());
+  EXPECT_EQ(PWScore::CANT_BACKUP, observer.lastStatus);
+  EXPECT_FALSE(pws_os::FileExists(L"BackgroundSaveBackup.ibak"));
+  EXPECT_EQ(1U, NumSaved());
+}
+
+TEST_F(BackgroundSaveTest, SyncSaveWaits)
+{
+  Add(items[0]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+  Add(items[1]);
+  EXPECT_EQ(PWScore::SUCCESS, core.ScheduleSaveCurFile());
+
+  // Completes the first, drops the second as it's superseded
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurFile());
+  EXPECT_FALSE(core.IsSaveInProgress());
+  EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_EQ(1, observer.numSaved);
+  EXPECT_EQ(2U, NumSaved());
+}
@@ -196,3 +196,34 @@ c=05044B62FA52D080 k[24]=F0E1D2C3B4A5968778695A4B3C2D1E0F0011223344556677
       EXPECT_TRUE(memcmp(tmp, plaintext_vk[i], 8) == 0) << "Test vector " << i;
     }
   }
+
+  TEST(BlowFishTest, BulkCBC) {
+    // 8-byte blocks exercise a different path through Fish's CBC helpers
+    const size_t N = 21, BS = BlowFish::BLOCKSIZE;
+    BlowFish bf(variable_key[1], 8);
+
+    unsigned char pt[N * BS], ct[N * BS], buf[N * BS];
+    unsigned char iv[BS] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (size_t i = 0; i < sizeof(pt); i++) pt[i] = static_cast<unsigned char>(i * 13);
+
+    for (size_t b = 0; b < N; b++) {
+      unsigned char tmp[BS];
+      for (size_t j = 0; j < BS; j++) tmp[j] = pt[b * BS + j] ^ iv[j];
+      bf.Encrypt(tmp, ct + b * BS);
+      memcpy(iv, ct + b * BS, BS);
+    }
+
+    unsigned char iv1[BS] = {1, 2, 3, 4, 5, 6, 7, 8};
+    memcpy(buf, pt, sizeof(pt));
+    bf.CBCEncrypt(buf, N, iv1);
+    EXPECT_TRUE(memcmp(buf, ct, sizeof(ct)) == 0);
+
+    unsigned char iv2[BS] = {1, 2, 3, 4, 5, 6, 7, 8};
+    bf.CBCDecrypt(buf, N, iv2);
+    EXPECT_TRUE(memcmp(buf, pt, sizeof(pt)) == 0);
+    EXPECT_TRUE(memcmp(iv1, iv2, BS) == 0);
+
+    bf.EncryptBlocks(pt, buf, N);
+    bf.DecryptBlocks(buf, buf, N);
+    EXPECT_TRUE(memcmp(buf, pt, sizeof(pt)) == 0);
+  }
@@ -376,3 +376,52 @@ TEST_F(CommandsTest, UpdateEntry)
   // Get core to delete any existing commands
   core.ClearCommands();
 }
+
+TEST_F(CommandsTest, FindByGTU)
+{
+  PWScore core;
+  CItemData it;
+  it.CreateUUID();
+  it.SetGroup(L"Group0.Alpha");
+  it.SetTitle(L"GarlicKn0t");
+  it.SetUser(L"user");
+  it.SetPassword(L"password");
+  const pws_os::CUUID uuid = it.GetUUID();
+
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"GarlicKn0t", L"user"));
+  core.Execute(AddEntryCommand::Create(&core, it));
+
+  ItemListIter iter = core.Find(L"Group0.Alpha", L"GarlicKn0t", L"user");
+  ASSERT_NE(core.GetEntryEndIter(), iter);
+  EXPECT_EQ(uuid, iter->first);
+  // Fields are matched exactly, not as a concatenation
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"GarlicKn0tu", L"ser"));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"garlickn0t", L"user"));
+
+  core.Execute(UpdateEntryCommand::Create(&core, it, CItem::TITLE, L"Sp1ce"));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"GarlicKn0t", L"user"));
+  ASSERT_NE(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"Sp1ce", L"user"));
+
+  core.Execute(RenameGroupCommand::Create(&core, L"Group0.Alpha", L"Group0.Beta"));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"Sp1ce", L"user"));
+  ASSERT_NE(core.GetEntryEndIter(), core.Find(L"Group0.Beta", L"Sp1ce", L"user"));
+
+  CItemData it2(core.GetEntry(core.Find(uuid)));
+  it2.SetUser(L"other");
+  core.Execute(EditEntryCommand::Create(&core, core.GetEntry(core.Find(uuid)), it2));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Beta", L"Sp1ce", L"user"));
+  ASSERT_NE(core.GetEntryEndIter(), core.Find(L"Group0.Beta", L"Sp1ce", L"other"));
+
+  core.Undo(); core.Undo(); core.Undo();
+  iter = core.Find(L"Group0.Alpha", L"GarlicKn0t", L"user");
+  ASSERT_NE(core.GetEntryEndIter(), iter);
+  EXPECT_EQ(uuid, iter->first);
+
+  core.Execute(DeleteEntryCommand::Create(&core, core.GetEntry(iter)));
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"GarlicKn0t", L"user"));
+  core.Undo();
+  EXPECT_NE(core.GetEntryEndIter(), core.Find(L"Group0.Alpha", L"GarlicKn0t", L"user"));
+
+  // Get core to delete any existing commands
+  core.ClearCommands();
+}
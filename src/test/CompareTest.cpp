@@ -0,0 +1,89 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// CompareTest.cpp: Unit test for PWScore::Compare()
+
+#if defined(WIN32) && !defined(__WX__)
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/PWScore.h"
+
+#include "gtest/gtest.h"
+
+// A fixture for factoring common code across tests
+class CompareTest : public ::testing::Test
+{
+protected:
+  CompareTest() {}
+
+  // Adds an entry with title "title <i>" to core
+  void Add(PWScore &core, int i, const StringX &password);
+  // Compares current with comp, over the default fields
+  void Compare();
+
+  PWScore current, comp;
+  CompareData onlyInCurrent, onlyInComp, conflicts, identical;
+};
+
+void CompareTest::Add(PWScore &core, int i, const StringX &password)
+{
+  CItemData item;
+  item.CreateUUID();
+  item.SetGroup(_T("group"));
+  item.SetTitle(StringX(_T("title ")) + StringX(std::to_wstring(i).c_str()));
+  item.SetUser(_T("user"));
+  item.SetPassword(password);
+  core.Execute(AddEntryCommand::Create(&core, item));
+}
+
+void CompareTest::Compare()
+{
+  CItemData::FieldBits bsFields;
+  bsFields.set(CItemData::PASSWORD);
+  bsFields.set(CItemData::NOTES);
+  current.Compare(&comp, bsFields, false, false, _T(""), 0, 0,
+                  onlyInCurrent, onlyInComp, conflicts, identical);
+}
+
+// And now the tests...
+
+TEST_F(CompareTest, Classify)
+{
+  // Enough entries in both for the fields to be compared on more than
+  // one thread, if there's more than one core
+  const int N = 2000;
+  for (int i = 0; i < N + 10; i++)
+    Add(current, i, _T("password"));
+  for (int i = 10; i < N + 20; i++)
+    Add(comp, i, (i % 3 == 0) ? _T("other") : _T("password"));
+
+  Compare();
+  EXPECT_EQ(10U, onlyInCurrent.size());
+  EXPECT_EQ(10U, onlyInComp.size());
+
+  int numConflicts = 0;
+  for (int i = 10; i < N + 10; i++)
+    if (i % 3 == 0)
+      numConflicts++;
+  ASSERT_EQ(size_t(numConflicts), conflicts.size());
+  EXPECT_EQ(size_t(N - numConflicts), identical.size());
+
+  for (const auto &st_data : conflicts) {
+    EXPECT_TRUE(st_data.bsDiffs.test(CItemData::PASSWORD));
+    EXPECT_FALSE(st_data.bsDiffs.test(CItemData::NOTES));
+    EXPECT_EQ(BOTH, st_data.indatabase);
+    EXPECT_EQ(_T("other"), comp.GetEntry(comp.Find(st_data.uuid1)).GetPassword());
+    EXPECT_EQ(st_data.title, current.GetEntry(current.Find(st_data.uuid0)).GetTitle());
+  }
+  // Numbered in the order of the current database
+  for (size_t i = 0; i < identical.size(); i++)
+    EXPECT_EQ(int(i + 1), identical[i].id);
+
+  current.ClearCommands();
+  comp.ClearCommands();
+}
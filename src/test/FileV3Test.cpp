@@ -14,6 +14,9 @@
 #include "core/PWSfileV3.h"
 #include "os/file.h"
 
+#include <string>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 // A fixture for factoring common code across tests
@@ -155,6 +158,31 @@ TEST_F(FileV3Test, ItemTest)
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
 
+TEST_F(FileV3Test, ManyItemsTest)
+{
+  // Enough records for reading to be split across threads,
+  // see PWSfile::PreloadCBC()
+  const int N = 3000;
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  std::vector<CItemData> items(N, fullItem);
+  for (int i = 0; i < N; i++) {
+    items[i].CreateUUID();
+    items[i].SetTitle(title + StringX(std::to_wstring(i).c_str()));
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(items[i]));
+  }
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfileV3 fr(fname.c_str(), PWSfile::Read, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  for (int i = 0; i < N; i++) {
+    ASSERT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item)) << "record " << i;
+    EXPECT_EQ(items[i], item) << "record " << i;
+  }
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close()); // HMAC's OK
+}
+
 TEST_F(FileV3Test, UnknownPersistencyTest)
 {
   CItemData d1;
@@ -177,3 +205,60 @@ TEST_F(FileV3Test, UnknownPersistencyTest)
   EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
+
+TEST_F(FileV3Test, VerifiedKeyTest)
+{
+  PWSfileV3 fw(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfile::VERSION version;
+  PWSfile::VerifiedKey vk;
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD,
+            PWSfile::CheckPasskey(fname.c_str(), _T("x"), version, &vk));
+  EXPECT_FALSE(vk.IsValid());
+  ASSERT_EQ(PWSfile::SUCCESS,
+            PWSfile::CheckPasskey(fname.c_str(), passphrase, version, &vk));
+  EXPECT_EQ(PWSfile::V30, version);
+  ASSERT_TRUE(vk.Matches(fname.c_str(), passphrase));
+  EXPECT_FALSE(vk.Matches(fname.c_str(), _T("x")));
+
+  PWSfileV3 fr(fname.c_str(), PWSfile::Read, PWSfile::V30);
+  fr.SetVerifiedKey(vk);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+  EXPECT_EQ(smallItem, item);
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  // Rewriting the file changes its salt, so vk is now stale,
+  // which should cost time, not correctness
+  PWSfileV3 fw2(fname.c_str(), PWSfile::Write, PWSfile::V30);
+  ASSERT_EQ(PWSfile::SUCCESS, fw2.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw2.WriteRecord(fullItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw2.Close());
+
+  PWSfileV3 fr2(fname.c_str(), PWSfile::Read, PWSfile::V30);
+  fr2.SetVerifiedKey(vk);
+  ASSERT_EQ(PWSfile::SUCCESS, fr2.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr2.ReadRecord(item));
+  EXPECT_EQ(fullItem, item);
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr2.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr2.Close());
+}
+
+TEST(HashItersTest, Calibrate)
+{
+  // No file involved, hence not a FileV3Test fixture.
+  // Timing-based, so only check what's robust against a noisy machine
+  const uint32 shortIters = PWSfile::CalibrateHashIters(PWSfile::V30, 20);
+  const uint32 longIters = PWSfile::CalibrateHashIters(PWSfile::V30, 200);
+  EXPECT_GE(shortIters, uint32(MIN_HASH_ITERATIONS));
+  EXPECT_GT(longIters, shortIters);
+
+  EXPECT_GE(PWSfile::CalibrateHashIters(PWSfile::V40, 20),
+            uint32(MIN_HASH_ITERATIONS));
+  EXPECT_EQ(uint32(MIN_HASH_ITERATIONS),
+            PWSfile::CalibrateHashIters(PWSfile::V20, 200));
+}
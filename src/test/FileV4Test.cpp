@@ -15,6 +15,15 @@
 #include "core/PWScore.h"
 
 #include "os/file.h"
+#include "os/utf8conv.h"
+
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "gtest/gtest.h"
 
@@ -204,6 +213,50 @@ TEST_F(FileV4Test, MulitKeysTest)
   EXPECT_FALSE(kbs.RemoveKeyBlock(passphrase));
 }
 
+// Keyblocks are tried concurrently, but the first one that a passkey
+// unlocks must win, regardless of which finishes first
+TEST_F(FileV4Test, ManyKeysTest)
+{
+  const StringX pw2(_T("Mellow Yellowerer")), pw3(_T("spr1ngtime~nAplam"));
+  const StringX pw4(_T("not a keyblock"));
+
+  PWSfileV4::CKeyBlocks kbs;
+  ASSERT_TRUE(kbs.AddKeyBlock(passphrase, passphrase));
+  ASSERT_TRUE(kbs.AddKeyBlock(passphrase, pw2, MIN_HASH_ITERATIONS * 8));
+  for (int i = 0; i < 4; i++)
+    ASSERT_TRUE(kbs.AddKeyBlock(passphrase, pw2, MIN_HASH_ITERATIONS));
+  ASSERT_TRUE(kbs.AddKeyBlock(pw2, pw3, MIN_HASH_ITERATIONS + 1));
+  ASSERT_TRUE(kbs.AddKeyBlock(pw3, pw3, MIN_HASH_ITERATIONS + 2));
+  EXPECT_FALSE(kbs.AddKeyBlock(pw4, pw4));
+
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  fw.SetKeyBlocks(kbs);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(pw3));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  const struct {
+    const StringX &pw;
+    uint32 nHashIters;
+  } tests[] = {
+    {passphrase, MIN_HASH_ITERATIONS},
+    {pw2, MIN_HASH_ITERATIONS * 8},
+    {pw3, MIN_HASH_ITERATIONS + 1},
+  };
+
+  for (const auto &test : tests) {
+    PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+    ASSERT_EQ(PWSfile::SUCCESS, fr.Open(test.pw));
+    EXPECT_EQ(test.nHashIters, fr.GetNHashIters());
+    EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+    EXPECT_EQ(fullItem, item);
+    EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+  }
+
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  EXPECT_EQ(PWSfile::WRONG_PASSWORD, fr.Open(pw4));
+}
+
 TEST_F(FileV4Test, AttTest)
 {
   PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
@@ -252,6 +305,95 @@ TEST_F(FileV4Test, HdrItemAttTest)
   EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
 }
 
+TEST_F(FileV4Test, BufferedWriteTest)
+{
+  // Fields are buffered on write, see PWSfile::FlushCBC(). Have a field
+  // larger than the buffer, and an attachment's content (written
+  // directly, with its own key) between buffered records.
+  const int N = 1000;
+  std::vector<CItemData> items(N, fullItem);
+  StringX bigNotes;
+  for (int i = 0; i < 20000; i++)
+    bigNotes += _T("0123456789abcdef");
+  items[0].SetNotes(bigNotes);
+  for (int i = 1; i < N; i++) {
+    items[i].CreateUUID();
+    items[i].SetTitle(title + StringX(std::to_wstring(i).c_str()));
+  }
+
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  for (int i = 0; i < N / 2; i++)
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(items[i]));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(attItem));
+  for (int i = N / 2; i < N; i++)
+    EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(items[i]));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  CItemAtt readAtt;
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  for (int i = 0; i < N / 2; i++) {
+    ASSERT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item)) << "record " << i;
+    EXPECT_EQ(items[i], item) << "record " << i;
+  }
+  EXPECT_EQ(PWSfile::WRONG_RECORD, fr.ReadRecord(item)); // att here!
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(readAtt));
+  attItem.SetOffset(readAtt.GetOffset());
+  EXPECT_EQ(attItem, readAtt);
+  for (int i = N / 2; i < N; i++) {
+    ASSERT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item)) << "record " << i;
+    EXPECT_EQ(items[i], item) << "record " << i;
+  }
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close()); // HMAC's OK
+}
+
+TEST_F(FileV4Test, AESTest)
+{
+  // The cipher isn't recorded in the file, the reader has to find it
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  fw.SetCipher(PWSfile::PWAES);
+  fw.SetHeader(hdr);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(attItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  CItemAtt readAtt;
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  EXPECT_EQ(PWSfile::PWTwoFish, fr.GetCipher());
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::PWAES, fr.GetCipher());
+  EXPECT_EQ(hdr.m_DB_Description, fr.GetHeader().m_DB_Description);
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+  EXPECT_EQ(fullItem, item);
+  EXPECT_EQ(PWSfile::WRONG_RECORD, fr.ReadRecord(item)); // att here!
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(readAtt));
+  attItem.SetOffset(readAtt.GetOffset());
+  EXPECT_EQ(attItem, readAtt);
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  // The core keeps the cipher across a read/write cycle,
+  // and the VerifiedKey fast path gets it right too
+  PWScore core;
+  ASSERT_EQ(PWScore::SUCCESS, core.CheckPasskey(fname.c_str(), passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passphrase));
+  EXPECT_EQ(PWSfile::PWAES, core.GetCipher());
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearDBData();
+  core.SetCipher(PWSfile::PWTwoFish);
+  EXPECT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passphrase));
+  EXPECT_EQ(PWSfile::PWAES, core.GetCipher());
+  EXPECT_EQ(1U, core.GetNumEntries());
+  EXPECT_EQ(1U, core.GetNumAtts());
+
+  // A new database doesn't inherit it from the last one
+  core.NewFile(passphrase);
+  EXPECT_EQ(PWSfile::PWTwoFish, core.GetCipher());
+  core.ClearCommands();
+}
+
 TEST_F(FileV4Test, CoreRWTest)
 {
   PWScore core;
@@ -287,3 +429,465 @@ TEST_F(FileV4Test, CoreRWTest)
   // Get core to delete any existing commands
   core.ClearCommands();
 }
+
+TEST_F(FileV4Test, LazyAttTest)
+{
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(attItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  CItemAtt readAtt;
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(readAtt));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  // Content's only read when asked for
+  ASSERT_TRUE(readAtt.IsContentDeferred());
+  EXPECT_TRUE(readAtt.HasContent());
+  EXPECT_EQ(attItem.GetContentLength(), readAtt.GetContentLength());
+  ASSERT_EQ(attItem.GetContentSize(), readAtt.GetContentSize());
+  std::vector<unsigned char> expected(attItem.GetContentSize());
+  std::vector<unsigned char> actual(readAtt.GetContentSize());
+  ASSERT_TRUE(attItem.GetContent(expected.data(), expected.size()));
+  ASSERT_TRUE(readAtt.GetContent(actual.data(), actual.size()));
+  expected.resize(attItem.GetContentLength());
+  actual.resize(readAtt.GetContentLength());
+  EXPECT_EQ(expected, actual);
+
+  // Changes to it are caught when it's read
+  FILE *fd = pws_os::FOpen(fname, _T("r+b"));
+  ASSERT_TRUE(fd != nullptr);
+  fseek(fd, readAtt.GetContentOffset() + 20, SEEK_SET);
+  const int c = fgetc(fd);
+  fseek(fd, readAtt.GetContentOffset() + 20, SEEK_SET);
+  fputc(c ^ 0xff, fd); // whatever it was
+  fclose(fd);
+  actual.resize(readAtt.GetContentSize());
+  EXPECT_FALSE(readAtt.GetContent(actual.data(), actual.size()));
+  EXPECT_EQ(PWScore::BAD_DIGEST, readAtt.SpillContent());
+  EXPECT_TRUE(readAtt.IsContentDeferred());
+}
+
+TEST_F(FileV4Test, LazyAttSaveTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  // Content that's a whole number of blocks, as well as the image's
+  CItemAtt blockAtt;
+  blockAtt.CreateUUID();
+  const unsigned char blocks[32] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  blockAtt.SetContent(blocks, sizeof(blocks));
+  CItemData blockItem(smallItem);
+  blockItem.SetAttUUID(blockAtt.GetUUID());
+  fullItem.SetAttUUID(attItem.GetUUID());
+
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  core.Execute(AddEntryCommand::Create(&core, blockItem, pws_os::CUUID::NullUUID(), &blockAtt));
+  ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearDBData();
+  core.ClearCommands();
+
+  // Saving over the file the content's in, repeatedly
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+    ASSERT_EQ(2U, core.GetNumAtts());
+    EXPECT_TRUE(core.GetAtt(attItem.GetUUID()).IsContentDeferred());
+    ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+    EXPECT_FALSE(pws_os::FileExists(fname + _T(".tmp")));
+
+    // Content's now read from the new file
+    const CItemAtt &att = core.GetAtt(attItem.GetUUID());
+    ASSERT_TRUE(att.IsContentDeferred());
+    std::vector<unsigned char> expected(attItem.GetContentSize());
+    std::vector<unsigned char> actual(att.GetContentSize());
+    ASSERT_TRUE(attItem.GetContent(expected.data(), expected.size()));
+    ASSERT_TRUE(att.GetContent(actual.data(), actual.size()));
+    EXPECT_EQ(expected, actual);
+    unsigned char content[sizeof(blocks)];
+    ASSERT_TRUE(core.GetAtt(blockAtt.GetUUID()).GetContent(content, sizeof(content)));
+    EXPECT_EQ(0, memcmp(blocks, content, sizeof(blocks)));
+    core.ClearDBData();
+  }
+  core.ClearCommands();
+}
+
+TEST_F(FileV4Test, LazyAttChangedTest)
+{
+  // Content's checked as it's copied from the file it was read from,
+  // in case that's changed since
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  fullItem.SetAttUUID(attItem.GetUUID());
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearDBData();
+  core.ClearCommands();
+
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passkey, true));
+  const long offset = core.GetAtt(attItem.GetUUID()).GetContentOffset();
+  ASSERT_GE(offset, 0);
+  FILE *f = pws_os::FOpen(fname, L"r+b");
+  ASSERT_TRUE(f != nullptr);
+  unsigned char c = 0;
+  ASSERT_EQ(0, fseek(f, offset, SEEK_SET));
+  ASSERT_EQ(1U, fread(&c, 1, 1, f));
+  c ^= 0xff;
+  ASSERT_EQ(0, fseek(f, offset, SEEK_SET));
+  ASSERT_EQ(1U, fwrite(&c, 1, 1, f));
+  fclose(f);
+
+  // The file's left as it was, rather than replaced by a bad copy
+  EXPECT_NE(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  EXPECT_TRUE(pws_os::FileExists(fname));
+  EXPECT_FALSE(pws_os::FileExists(fname + _T(".tmp")));
+  core.ClearDBData();
+  core.ClearCommands();
+}
+
+#ifndef _WIN32
+TEST_F(FileV4Test, LazyAttLinkTest)
+{
+  // Saving via a symbolic link replaces the file it links to, not the link
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  const stringT link(L"V4link.psafe4");
+  fullItem.SetAttUUID(attItem.GetUUID());
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearDBData();
+  core.ClearCommands();
+  ASSERT_EQ(0, symlink(pws_os::tomb(fname).c_str(), pws_os::tomb(link).c_str()));
+
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(link.c_str(), passkey, true));
+  EXPECT_TRUE(core.GetAtt(attItem.GetUUID()).IsContentDeferred());
+  ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(link.c_str(), PWSfile::V40));
+  struct stat sb;
+  ASSERT_EQ(0, lstat(pws_os::tomb(link).c_str(), &sb));
+  EXPECT_TRUE(S_ISLNK(sb.st_mode));
+  core.ClearDBData();
+
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(link.c_str(), passkey, true));
+  const CItemAtt &att = core.GetAtt(attItem.GetUUID());
+  std::vector<unsigned char> expected(attItem.GetContentSize());
+  std::vector<unsigned char> actual(att.GetContentSize());
+  ASSERT_TRUE(attItem.GetContent(expected.data(), expected.size()));
+  ASSERT_TRUE(att.GetContent(actual.data(), actual.size()));
+  EXPECT_EQ(expected, actual);
+  core.ClearDBData();
+  core.ClearCommands();
+  pws_os::DeleteAFile(link);
+}
+#endif
+
+TEST_F(FileV4Test, ForeignAttTest)
+{
+  // An attachment added from another database's file is copied out of it,
+  // as that may change, or go, before this one's saved
+  PWScore other;
+  const StringX passkey(L"3rdMambo");
+  fullItem.SetAttUUID(attItem.GetUUID());
+  other.SetPassKey(passkey);
+  other.Execute(AddEntryCommand::Create(&other, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  ASSERT_EQ(PWSfile::SUCCESS, other.WriteFile(fname.c_str(), PWSfile::V40));
+  other.ClearDBData();
+  other.ClearCommands();
+  ASSERT_EQ(PWSfile::SUCCESS, other.ReadFile(fname.c_str(), passkey, true));
+  const CItemAtt &otherAtt = other.GetAtt(attItem.GetUUID());
+  ASSERT_TRUE(otherAtt.IsContentDeferred());
+
+  PWScore core;
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &otherAtt));
+  ASSERT_EQ(1U, core.GetNumAtts());
+  const CItemAtt &att = core.GetAtt(attItem.GetUUID());
+  ASSERT_TRUE(att.IsContentDeferred());
+  EXPECT_NE(StringX(fname.c_str()), att.GetContentFile());
+  std::vector<unsigned char> expected(attItem.GetContentSize());
+  std::vector<unsigned char> actual(att.GetContentSize());
+  ASSERT_TRUE(attItem.GetContent(expected.data(), expected.size()));
+  ASSERT_TRUE(att.GetContent(actual.data(), actual.size()));
+  EXPECT_EQ(expected, actual);
+  core.ClearCommands();
+  other.ClearCommands();
+}
+
+TEST_F(FileV4Test, SpilledAttSaveTest)
+{
+  // Content that's in a temporary file moves into the database when it's
+  // saved, and the temporary file goes with the last copy that used it
+  PWScore core;
+  CItemAtt att;
+  att.CreateUUID();
+  const unsigned char content[40] = {9, 8, 7, 6, 5, 4, 3, 2, 1};
+  ASSERT_EQ(PWScore::SUCCESS, att.SetContent(content, sizeof(content)));
+  ASSERT_TRUE(att.IsContentDeferred());
+  const StringX spill = att.GetContentFile();
+  EXPECT_TRUE(pws_os::FileExists(spill.c_str()));
+  fullItem.SetAttUUID(att.GetUUID());
+
+  core.NewFile(passphrase);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &att));
+  ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  const CItemAtt &saved = core.GetAtt(att.GetUUID());
+  ASSERT_TRUE(saved.IsContentDeferred());
+  EXPECT_EQ(StringX(fname.c_str()), saved.GetContentFile());
+  unsigned char actual[sizeof(content)];
+  ASSERT_TRUE(saved.GetContent(actual, sizeof(actual)));
+  EXPECT_EQ(0, memcmp(content, actual, sizeof(content)));
+
+  // Still used by the local copy, and the one Undo would put back
+  EXPECT_TRUE(pws_os::FileExists(spill.c_str()));
+  core.ClearCommands();
+  att.Clear();
+  EXPECT_FALSE(pws_os::FileExists(spill.c_str()));
+}
+
+TEST_F(FileV4Test, StreamedAttTest)
+{
+  // Content of several chunks, imported, saved, read back and exported
+  const stringT impFile(L"import.tmp"), expFile(L"export.tmp");
+  std::vector<unsigned char> data(3 * PWSfileV4::CONTENT_CHUNK + 5);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<unsigned char>(i % 251);
+  FILE *f = pws_os::FOpen(impFile, L"wb");
+  ASSERT_TRUE(f != nullptr);
+  ASSERT_EQ(1U, fwrite(data.data(), data.size(), 1, f));
+  fclose(f);
+
+  CItemAtt att;
+  att.CreateUUID();
+  ASSERT_EQ(PWScore::SUCCESS, att.Import(impFile));
+
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  fw.SetCipher(PWSfile::PWAES);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(att));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+  pws_os::DeleteAFile(impFile);
+
+  CItemAtt readAtt;
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(readAtt));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  ASSERT_EQ(PWScore::SUCCESS, readAtt.Export(expFile));
+  f = pws_os::FOpen(expFile, L"rb");
+  ASSERT_TRUE(f != nullptr);
+  std::vector<unsigned char> exported(data.size());
+  EXPECT_EQ(data.size(), size_t(pws_os::fileLength(f)));
+  ASSERT_EQ(1U, fread(exported.data(), exported.size(), 1, f));
+  fclose(f);
+  EXPECT_EQ(data, exported);
+  pws_os::DeleteAFile(expFile);
+}
+
+TEST_F(FileV4Test, SharedAttTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  // Same content and metadata, different attachment
+  CItemAtt sameAtt;
+  sameAtt.CreateUUID();
+  sameAtt.SetTitle(attItem.GetTitle());
+  ASSERT_EQ(PWScore::SUCCESS, sameAtt.Import(L"data/image1.jpg"));
+  fullItem.SetAttUUID(attItem.GetUUID());
+  smallItem.SetAttUUID(sameAtt.GetUUID());
+
+  // Only the content's the same
+  CItemAtt otherAtt(sameAtt);
+  otherAtt.CreateUUID();
+  otherAtt.SetTitle(L"Another attachment");
+
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  core.Execute(AddEntryCommand::Create(&core, smallItem, pws_os::CUUID::NullUUID(), &sameAtt));
+  ASSERT_EQ(1U, core.GetNumAtts());
+  EXPECT_EQ(2U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+  EXPECT_EQ(attItem.GetUUID(),
+            core.GetEntry(core.Find(smallItem.GetUUID())).GetAttUUID());
+  EXPECT_EQ(attItem.GetUUID(), core.FindDuplicateAtt(sameAtt));
+  EXPECT_EQ(pws_os::CUUID::NullUUID(), core.FindDuplicateAtt(otherAtt));
+
+  core.Undo();
+  ASSERT_EQ(1U, core.GetNumAtts());
+  EXPECT_EQ(1U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+  core.Redo();
+  EXPECT_EQ(2U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.ClearCommands();
+}
+
+TEST_F(FileV4Test, MergeAttsTest)
+{
+  // Written as two attachments, and one with only the same content
+  CItemAtt sameAtt;
+  sameAtt.CreateUUID();
+  sameAtt.SetTitle(attItem.GetTitle());
+  ASSERT_EQ(PWScore::SUCCESS, sameAtt.Import(L"data/image1.jpg"));
+  CItemAtt otherAtt(sameAtt);
+  otherAtt.CreateUUID();
+  otherAtt.SetTitle(L"Another attachment");
+  CItemData otherItem(smallItem);
+  otherItem.CreateUUID();
+  otherItem.SetTitle(L"other");
+  fullItem.SetAttUUID(attItem.GetUUID());
+  smallItem.SetAttUUID(sameAtt.GetUUID());
+  otherItem.SetAttUUID(otherAtt.GetUUID());
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(fullItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(otherItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(attItem));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(sameAtt));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(otherAtt));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWScore core;
+  ASSERT_EQ(PWSfile::SUCCESS, core.ReadFile(fname.c_str(), passphrase, true));
+  ASSERT_EQ(3U, core.GetNumAtts());
+  EXPECT_EQ(1, core.Execute(MergeDuplicateAttsCommand::Create(&core)));
+  EXPECT_TRUE(core.HasDBChanged());
+  ASSERT_EQ(2U, core.GetNumAtts());
+  EXPECT_EQ(otherAtt.GetUUID(),
+            core.GetEntry(core.Find(otherItem.GetUUID())).GetAttUUID());
+  const pws_os::CUUID kept = core.GetEntry(core.Find(fullItem.GetUUID())).GetAttUUID();
+  EXPECT_EQ(kept, core.GetEntry(core.Find(smallItem.GetUUID())).GetAttUUID());
+  EXPECT_EQ(2U, core.GetAtt(kept).GetRefcount());
+
+  // Undone, each entry has its own again
+  core.Undo();
+  EXPECT_FALSE(core.HasDBChanged());
+  ASSERT_EQ(3U, core.GetNumAtts());
+  EXPECT_EQ(attItem.GetUUID(),
+            core.GetEntry(core.Find(fullItem.GetUUID())).GetAttUUID());
+  EXPECT_EQ(sameAtt.GetUUID(),
+            core.GetEntry(core.Find(smallItem.GetUUID())).GetAttUUID());
+  EXPECT_EQ(1U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+  EXPECT_EQ(1U, core.GetAtt(sameAtt.GetUUID()).GetRefcount());
+  std::vector<unsigned char> content(sameAtt.GetContentSize());
+  EXPECT_TRUE(core.GetAtt(sameAtt.GetUUID()).GetContent(content.data(), content.size()));
+
+  core.Redo();
+  EXPECT_TRUE(core.HasDBChanged());
+  ASSERT_EQ(2U, core.GetNumAtts());
+  EXPECT_EQ(kept, core.GetEntry(core.Find(smallItem.GetUUID())).GetAttUUID());
+  EXPECT_EQ(2U, core.GetAtt(kept).GetRefcount());
+  EXPECT_EQ(0, core.Execute(MergeDuplicateAttsCommand::Create(&core)));
+
+  // And that's what's saved
+  ASSERT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  PWScore core2;
+  ASSERT_EQ(PWSfile::SUCCESS, core2.ReadFile(fname.c_str(), passphrase, true));
+  EXPECT_EQ(2U, core2.GetNumAtts());
+  EXPECT_EQ(2U, core2.GetAtt(kept).GetRefcount());
+  core.ClearCommands();
+}
+
+TEST_F(FileV4Test, EditSharedAttTest)
+{
+  PWScore core;
+  const StringX passkey(L"3rdMambo");
+  fullItem.SetAttUUID(attItem.GetUUID());
+  smallItem.SetAttUUID(attItem.GetUUID());
+
+  core.SetPassKey(passkey);
+  core.Execute(AddEntryCommand::Create(&core, fullItem, pws_os::CUUID::NullUUID(), &attItem));
+  core.Execute(AddEntryCommand::Create(&core, smallItem, pws_os::CUUID::NullUUID(), &attItem));
+  ASSERT_EQ(1U, core.GetNumAtts());
+  ASSERT_EQ(2U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+
+  // Changing a shared attachment for one entry leaves the other's as it was
+  CItemData edited(core.GetEntry(core.Find(smallItem.GetUUID())));
+  CItemAtt att(core.GetAtt(attItem.GetUUID()));
+  att.SetTitle(L"Renamed");
+  core.SetEntryAtt(edited, att);
+  ASSERT_EQ(2U, core.GetNumAtts());
+  EXPECT_NE(attItem.GetUUID(), edited.GetAttUUID());
+  EXPECT_EQ(L"Renamed", core.GetAtt(edited.GetAttUUID()).GetTitle());
+  EXPECT_EQ(1U, core.GetAtt(edited.GetAttUUID()).GetRefcount());
+  EXPECT_EQ(attItem.GetTitle(), core.GetAtt(attItem.GetUUID()).GetTitle());
+  EXPECT_EQ(1U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+
+  // An attachment that's the entry's alone is changed in place
+  const pws_os::CUUID renamed = edited.GetAttUUID();
+  att = core.GetAtt(renamed);
+  att.SetTitle(L"Renamed again");
+  core.SetEntryAtt(edited, att);
+  ASSERT_EQ(2U, core.GetNumAtts());
+  EXPECT_EQ(renamed, edited.GetAttUUID());
+  EXPECT_EQ(L"Renamed again", core.GetAtt(renamed).GetTitle());
+  EXPECT_EQ(1U, core.GetAtt(renamed).GetRefcount());
+
+  // Changed back, it's shared again
+  att = core.GetAtt(renamed);
+  att.SetTitle(attItem.GetTitle());
+  core.SetEntryAtt(edited, att);
+  ASSERT_EQ(1U, core.GetNumAtts());
+  EXPECT_EQ(attItem.GetUUID(), edited.GetAttUUID());
+  EXPECT_EQ(2U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+
+  // Removing it from one entry leaves it to the other
+  core.ClearEntryAtt(edited);
+  EXPECT_FALSE(edited.HasAttRef());
+  ASSERT_EQ(1U, core.GetNumAtts());
+  EXPECT_EQ(1U, core.GetAtt(attItem.GetUUID()).GetRefcount());
+  EXPECT_EQ(PWSfile::SUCCESS, core.WriteFile(fname.c_str(), PWSfile::V40));
+  core.RemoveAtt(attItem.GetUUID());
+  EXPECT_EQ(0U, core.GetNumAtts());
+  core.ClearCommands();
+}
+
+TEST_F(FileV4Test, VerifiedKeyTest)
+{
+  PWSfileV4 fw(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw.WriteRecord(smallItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw.Close());
+
+  PWSfile::VERSION version;
+  PWSfile::VerifiedKey vk;
+  EXPECT_NE(PWSfile::SUCCESS,
+            PWSfile::CheckPasskey(fname.c_str(), _T("x"), version, &vk));
+  EXPECT_FALSE(vk.IsValid());
+  ASSERT_EQ(PWSfile::SUCCESS,
+            PWSfile::CheckPasskey(fname.c_str(), passphrase, version, &vk));
+  EXPECT_EQ(PWSfile::V40, version);
+  ASSERT_TRUE(vk.Matches(fname.c_str(), passphrase));
+
+  PWSfileV4 fr(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  fr.SetVerifiedKey(vk);
+  ASSERT_EQ(PWSfile::SUCCESS, fr.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.ReadRecord(item));
+  EXPECT_EQ(smallItem, item);
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr.Close());
+
+  // A rewritten file has new K & L, so vk is stale and
+  // Open() has to fall back to trying the keyblocks
+  PWSfileV4 fw2(fname.c_str(), PWSfile::Write, PWSfile::V40);
+  ASSERT_EQ(PWSfile::SUCCESS, fw2.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fw2.WriteRecord(fullItem));
+  ASSERT_EQ(PWSfile::SUCCESS, fw2.Close());
+
+  PWSfileV4 fr2(fname.c_str(), PWSfile::Read, PWSfile::V40);
+  fr2.SetVerifiedKey(vk);
+  ASSERT_EQ(PWSfile::SUCCESS, fr2.Open(passphrase));
+  EXPECT_EQ(PWSfile::SUCCESS, fr2.ReadRecord(item));
+  EXPECT_EQ(fullItem, item);
+  EXPECT_EQ(PWSfile::END_OF_FILE, fr2.ReadRecord(item));
+  EXPECT_EQ(PWSfile::SUCCESS, fr2.Close());
+
+  // And via the core, as the UI does it
+  PWScore core;
+  ASSERT_EQ(PWScore::SUCCESS, core.CheckPasskey(fname.c_str(), passphrase));
+  EXPECT_EQ(PWSfile::V40, core.GetReadFileVersion());
+  EXPECT_EQ(PWScore::SUCCESS, core.ReadFile(fname.c_str(), passphrase));
+  EXPECT_EQ(1U, core.GetNumEntries());
+}
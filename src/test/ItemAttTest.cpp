@@ -121,6 +121,72 @@ TEST_F(ItemAttTest, ImpExp)
   pws_os::DeleteAFile(testExpFile);
 }
 
+TEST_F(ItemAttTest, ChangedAfterImport)
+{
+  const stringT testImpFile(L"import.tmp");
+  const stringT testExpFile(L"output.tmp");
+  // Bigger than a chunk, so that it's streamed a chunk at a time
+  std::vector<unsigned char> data(200000);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = static_cast<unsigned char>(i * 7);
+  FILE *f = pws_os::FOpen(testImpFile, L"wb");
+  ASSERT_TRUE(f != nullptr);
+  ASSERT_EQ(1U, fwrite(data.data(), data.size(), 1, f));
+  fclose(f);
+
+  CItemAtt ai;
+  ASSERT_EQ(PWScore::SUCCESS, ai.Import(testImpFile));
+  EXPECT_EQ(data.size(), ai.GetContentLength());
+
+  // It's encrypted into a temporary file of its own as it's read
+  ASSERT_TRUE(ai.IsContentDeferred());
+  const StringX spill = ai.GetContentFile();
+  EXPECT_NE(StringX(testImpFile.c_str()), spill);
+  f = pws_os::FOpen(spill.c_str(), L"rb");
+  ASSERT_TRUE(f != nullptr);
+  std::vector<unsigned char> spilled(ai.GetContentSize());
+  EXPECT_EQ(spilled.size(), size_t(pws_os::fileLength(f)));
+  ASSERT_EQ(1U, fread(spilled.data(), spilled.size(), 1, f));
+  fclose(f);
+  EXPECT_NE(0, memcmp(data.data(), spilled.data(), 1000));
+
+  ASSERT_EQ(PWScore::SUCCESS, ai.Export(testExpFile));
+  f = pws_os::FOpen(testExpFile, L"rb");
+  ASSERT_TRUE(f != nullptr);
+  std::vector<unsigned char> exported(data.size());
+  EXPECT_EQ(data.size(), size_t(pws_os::fileLength(f)));
+  ASSERT_EQ(1U, fread(exported.data(), exported.size(), 1, f));
+  fclose(f);
+  EXPECT_EQ(data, exported);
+
+  // Exporting over the imported file leaves it as it was
+  EXPECT_EQ(PWScore::SUCCESS, ai.Export(testImpFile));
+  std::vector<unsigned char> content(ai.GetContentSize());
+  ASSERT_TRUE(ai.GetContent(content.data(), content.size()));
+
+  // Changing it, or deleting it, after it's imported makes no difference
+  f = pws_os::FOpen(testImpFile, L"r+b");
+  ASSERT_TRUE(f != nullptr);
+  fseek(f, 100000, SEEK_SET);
+  fputc(data[100000] + 1, f);
+  fclose(f);
+  pws_os::DeleteAFile(testImpFile);
+  ASSERT_TRUE(ai.GetContent(content.data(), content.size()));
+  EXPECT_EQ(0, memcmp(data.data(), content.data(), data.size()));
+  EXPECT_EQ(PWScore::SUCCESS, ai.Export(testExpFile));
+  EXPECT_TRUE(pws_os::FileExists(testExpFile));
+  pws_os::DeleteAFile(testExpFile);
+
+  // The temporary file goes with the last copy of the attachment
+  {
+    CItemAtt copy(ai);
+    ai.Clear();
+    EXPECT_FALSE(ai.HasContent());
+    EXPECT_TRUE(pws_os::FileExists(spill.c_str()));
+  }
+  EXPECT_FALSE(pws_os::FileExists(spill.c_str()));
+}
+
 TEST_F(ItemAttTest, CopyCtor)
 {
   const stringT testImpFile(fullfileName);
@@ -108,6 +108,66 @@ TEST_F(ItemDataTest, Assignment)
   EXPECT_TRUE(d1 == d2);  
 }
 
+TEST_F(ItemDataTest, SameFieldValue)
+{
+  CItemData d1, d2;
+  unsigned char fp1[SHA256::HASHLEN], fp2[SHA256::HASHLEN];
+  d1.SetTitle(_T("title"));
+  d2.SetTitle(_T("title"));
+  EXPECT_TRUE(d1.IsSameFieldValue(CItemData::TITLE, d2));
+  EXPECT_TRUE(d1.IsSameFieldValue(CItemData::NOTES, d2)); // neither set
+  d1.SetNotes(_T("notes"));
+  EXPECT_FALSE(d1.IsSameFieldValue(CItemData::NOTES, d2));
+  d2.SetNotes(_T("Notes"));
+  EXPECT_FALSE(d1.IsSameFieldValue(CItemData::NOTES, d2));
+
+  // Setting a field to the value it has isn't a change
+  d1.GetFingerprint(fp1);
+  d1.SetNotes(_T("notes"));
+  d1.GetFingerprint(fp2);
+  EXPECT_EQ(0, memcmp(fp1, fp2, sizeof(fp1)));
+  d1.SetNotes(_T("other notes"));
+  d1.GetFingerprint(fp2);
+  EXPECT_NE(0, memcmp(fp1, fp2, sizeof(fp1)));
+
+  // Expiry's value includes whether it recurs
+  time_t t;
+  time(&t);
+  d1.SetXTime(t);
+  d2.SetXTime(t);
+  EXPECT_TRUE(d1.IsSameFieldValue(CItemData::XTIME, d2));
+  d1.SetXTimeInt(30);
+  EXPECT_FALSE(d1.IsSameFieldValue(CItemData::XTIME, d2));
+}
+
+TEST_F(ItemDataTest, SetAndClearInAnyOrder)
+{
+  CItemData d1, d2;
+  d1.SetURL(_T("https://pwsafe.org"));
+  d1.SetTitle(_T("title"));
+  d1.SetEmail(_T("a@b.c"));
+  d1.SetGroup(_T("group"));
+  d2.SetGroup(_T("group"));
+  d2.SetEmail(_T("a@b.c"));
+  d2.SetTitle(_T("title"));
+  d2.SetURL(_T("https://pwsafe.org"));
+  EXPECT_TRUE(d1 == d2);
+
+  d1.SetEmail(_T(""));
+  EXPECT_FALSE(d1 == d2);
+  EXPECT_EQ(_T("https://pwsafe.org"), d1.GetURL());
+  EXPECT_EQ(_T("title"), d1.GetTitle());
+  EXPECT_EQ(_T("group"), d1.GetGroup());
+  d2.SetEmail(_T(""));
+  EXPECT_TRUE(d1 == d2);
+
+  CItemData d3(d1);
+  d1.SetTitle(_T(""));
+  EXPECT_EQ(_T("title"), d3.GetTitle());
+  EXPECT_EQ(_T("https://pwsafe.org"), d3.GetURL());
+  EXPECT_EQ(_T(""), d1.GetTitle());
+}
+
 TEST_F(ItemDataTest, Getters_n_Setters)
 {
   // Setters called in SetUp()
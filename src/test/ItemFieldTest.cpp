@@ -77,3 +77,89 @@ TEST_F(ItemFieldTest, testMe)
   EXPECT_EQ(sizeof(v1), lenV2);
   EXPECT_TRUE(memcmp(v1, v2, sizeof(v1)) == 0);
 }
+
+TEST_F(ItemFieldTest, SameValue)
+{
+  unsigned char v1[5] = {0x01, 0x02, 0x03, 0x04, 0x05};
+  unsigned char v2[5] = {0x01, 0x02, 0x03, 0x04, 0x06};
+  unsigned char key[32] = {0x42};
+  Fish *bf2 = BlowFish::MakeBlowFish(key, sizeof(key));
+
+  // Same value, different ciphers
+  CItemField i1(1), i2(1);
+  i1.Set(v1, sizeof(v1), m_bf);
+  i2.Set(v1, sizeof(v1), bf2);
+  EXPECT_TRUE(i1.HasSameValue(i2));
+  EXPECT_TRUE(CItemField(i2).HasSameValue(i1));
+
+  i2.Set(v2, sizeof(v2), bf2);
+  EXPECT_FALSE(i1.HasSameValue(i2));
+  i2.Set(v1, sizeof(v1) - 1, bf2);
+  EXPECT_FALSE(i1.HasSameValue(i2));
+
+  CItemField i3(2);
+  i3.Set(v1, sizeof(v1), m_bf);
+  EXPECT_FALSE(i1.HasSameValue(i3));
+
+  delete bf2;
+}
+
+TEST_F(ItemFieldTest, SharedCipher)
+{
+  unsigned char v1[37];
+  for (size_t i = 0; i < sizeof(v1); i++)
+    v1[i] = static_cast<unsigned char>(i * 7);
+
+  // All lengths, to check the padding's handled
+  for (size_t len = 1; len <= sizeof(v1); len++) {
+    unsigned char v2[48] = {0};
+    size_t lenV2 = sizeof(v2);
+    CItemField i1(1);
+    i1.Set(v1, len);
+    EXPECT_EQ(len, i1.GetLength());
+    CItemField(i1).Get(v2, lenV2);
+    EXPECT_EQ(len, lenV2);
+    EXPECT_TRUE(memcmp(v1, v2, len) == 0);
+  }
+
+  // Same value, different ciphertext
+  const StringX sx(_T("the same, the same"));
+  CItemField i2(2), i3(2);
+  i2.Set(sx);
+  i3.Set(sx);
+  EXPECT_TRUE(i2.HasSameValue(i3));
+  EXPECT_FALSE(memcmp(i2.GetData(), i3.GetData(), i2.GetSize()) == 0);
+  StringX sx2, sx3;
+  i2.Get(sx2);
+  i3 = i2;
+  i3.Get(sx3);
+  EXPECT_EQ(sx, sx2);
+  EXPECT_EQ(sx, sx3);
+}
+
+TEST_F(ItemFieldTest, Move)
+{
+  // Short values are kept inline, long ones aren't: check both
+  const StringX values[] = {_T("ab"), _T("a value that's too long to be inline")};
+  for (const auto &sx : values) {
+    CItemField i1(3);
+    i1.Set(sx);
+    const CItemField i2(i1);
+
+    CItemField i3(std::move(i1));
+    EXPECT_TRUE(i1.IsEmpty());
+    EXPECT_TRUE(i3.HasSameValue(i2));
+    StringX sx3;
+    i3.Get(sx3);
+    EXPECT_EQ(sx, sx3);
+
+    CItemField i4(4);
+    i4.Set(_T("overwritten"));
+    i4 = std::move(i3);
+    EXPECT_TRUE(i3.IsEmpty());
+    EXPECT_EQ(3, i4.GetType());
+    StringX sx4;
+    i4.Get(sx4);
+    EXPECT_EQ(sx, sx4);
+  }
+}
@@ -0,0 +1,256 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// JournalTest.cpp: Unit test for saving changes to a journal
+
+#if defined(WIN32) && !defined(__WX__)
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/PWScore.h"
+#include "core/PWSjournal.h"
+#include "core/PWSprefs.h"
+#include "os/file.h"
+
+#include <cstdio>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+// A fixture for factoring common code across tests
+class JournalTest : public ::testing::Test
+{
+protected:
+  JournalTest(); // to init members
+  void SetUp();
+  void TearDown();
+
+  // Creates fname with three entries, and a core that has it open
+  void MakeFile(PWScore &core, PWSfile::VERSION version);
+  // Changes, deletes and adds one entry each
+  void MakeChanges(PWScore &core);
+  // Reads fname into core, checks result of MakeChanges()
+  void CheckChanges(PWScore &core);
+
+  static std::vector<unsigned char> GetBytes(const stringT &fn);
+  static void PutBytes(const stringT &fn, const std::vector<unsigned char> &v);
+
+  const StringX passphrase;
+  StringX fname;
+  stringT jname;
+  CItemData items[4];
+};
+
+JournalTest::JournalTest()
+  : passphrase(_T("enchilada-sonol")), fname(_T("JournalTest.psafe3"))
+{}
+
+void JournalTest::SetUp()
+{
+  jname = PWSjournal::JournalName(fname);
+  for (int i = 0; i < 4; i++) {
+    items[i].CreateUUID();
+    items[i].SetTitle(StringX(_T("title ")) + StringX(1, _T('0' + i)));
+    items[i].SetPassword(_T("password"));
+    items[i].SetNotes(_T("original notes"));
+  }
+  PWSprefs::GetInstance()->SetPref(PWSprefs::UseChangeJournal, true);
+}
+
+void JournalTest::TearDown()
+{
+  PWSprefs::GetInstance()->SetPref(PWSprefs::UseChangeJournal, false);
+  ASSERT_TRUE(pws_os::DeleteAFile(fname.c_str()));
+  pws_os::DeleteAFile(jname);
+}
+
+void JournalTest::MakeFile(PWScore &core, PWSfile::VERSION version)
+{
+  core.NewFile(passphrase);
+  core.SetCurFile(fname);
+  for (int i = 0; i < 3; i++)
+    core.Execute(AddEntryCommand::Create(&core, items[i]));
+  ASSERT_EQ(PWScore::SUCCESS, core.WriteFile(fname, version));
+  EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_FALSE(core.HasJournal());
+}
+
+void JournalTest::MakeChanges(PWScore &core)
+{
+  core.Execute(UpdateEntryCommand::Create(&core, items[0], CItemData::NOTES,
+                                          _T("new notes")));
+  core.Execute(DeleteEntryCommand::Create(&core, items[1]));
+  core.Execute(AddEntryCommand::Create(&core, items[3]));
+  EXPECT_TRUE(core.HasDBChanged());
+}
+
+void JournalTest::CheckChanges(PWScore &core)
+{
+  core.SetCurFile(fname);
+  ASSERT_EQ(PWScore::SUCCESS, core.ReadCurFile(passphrase));
+  EXPECT_EQ(3U, core.GetNumEntries());
+  ItemListConstIter iter = core.Find(items[0].GetUUID());
+  ASSERT_NE(core.GetEntryEndIter(), iter);
+  EXPECT_EQ(_T("new notes"), iter->second.GetNotes());
+  EXPECT_EQ(core.GetEntryEndIter(), core.Find(items[1].GetUUID()));
+  iter = core.Find(items[2].GetUUID());
+  ASSERT_NE(core.GetEntryEndIter(), iter);
+  EXPECT_EQ(items[2], iter->second);
+  iter = core.Find(items[3].GetUUID());
+  ASSERT_NE(core.GetEntryEndIter(), iter);
+  EXPECT_EQ(items[3], iter->second);
+}
+
+std::vector<unsigned char> JournalTest::GetBytes(const stringT &fn)
+{
+  std::vector<unsigned char> retval;
+  FILE *fd = pws_os::FOpen(fn, _T("rb"));
+  if (fd != nullptr) {
+    retval.resize(size_t(pws_os::fileLength(fd)));
+    if (!retval.empty() && fread(retval.data(), retval.size(), 1, fd) != 1)
+      retval.clear();
+    fclose(fd);
+  }
+  return retval;
+}
+
+void JournalTest::PutBytes(const stringT &fn, const std::vector<unsigned char> &v)
+{
+  FILE *fd = pws_os::FOpen(fn, _T("wb"));
+  ASSERT_TRUE(fd != nullptr);
+  if (!v.empty()) {
+    EXPECT_EQ(1U, fwrite(v.data(), v.size(), 1, fd));
+  }
+  fclose(fd);
+}
+
+// And now the tests...
+
+TEST_F(JournalTest, AppendAndReplayV3)
+{
+  PWScore core;
+  MakeFile(core, PWSfile::V30);
+  const std::vector<unsigned char> saved = GetBytes(fname.c_str());
+
+  MakeChanges(core);
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurJournal());
+  EXPECT_FALSE(core.HasDBChanged());
+  EXPECT_TRUE(core.HasJournal());
+  EXPECT_TRUE(pws_os::FileExists(jname));
+  EXPECT_EQ(saved, GetBytes(fname.c_str())); // only the journal's written
+
+  // Nothing changed, nothing to write
+  const std::vector<unsigned char> journal = GetBytes(jname);
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurJournal());
+  EXPECT_EQ(journal, GetBytes(jname));
+
+  PWScore core2;
+  CheckChanges(core2);
+  EXPECT_TRUE(core2.HasJournal());
+
+  // Journal can be appended to after being replayed
+  core2.Execute(UpdateEntryCommand::Create(&core2, items[2], CItemData::TITLE,
+                                           _T("renamed")));
+  EXPECT_EQ(PWScore::SUCCESS, core2.WriteCurJournal());
+  EXPECT_GT(GetBytes(jname).size(), journal.size());
+
+  PWScore core3;
+  core3.SetCurFile(fname);
+  ASSERT_EQ(PWScore::SUCCESS, core3.ReadCurFile(passphrase));
+  ItemListConstIter iter = core3.Find(items[2].GetUUID());
+  ASSERT_NE(core3.GetEntryEndIter(), iter);
+  EXPECT_EQ(_T("renamed"), iter->second.GetTitle());
+
+  // A full save folds the journal in
+  ASSERT_EQ(PWScore::SUCCESS, core3.WriteCurFile());
+  EXPECT_FALSE(core3.HasJournal());
+  EXPECT_FALSE(pws_os::FileExists(jname));
+  PWScore core4;
+  core4.SetCurFile(fname);
+  ASSERT_EQ(PWScore::SUCCESS, core4.ReadCurFile(passphrase));
+  EXPECT_EQ(3U, core4.GetNumEntries());
+  iter = core4.Find(items[0].GetUUID());
+  ASSERT_NE(core4.GetEntryEndIter(), iter);
+  EXPECT_EQ(_T("new notes"), iter->second.GetNotes());
+}
+
+TEST_F(JournalTest, AppendAndReplayV4)
+{
+  fname = _T("JournalTest.psafe4");
+  jname = PWSjournal::JournalName(fname);
+  PWScore core;
+  MakeFile(core, PWSfile::V40);
+  MakeChanges(core);
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurJournal());
+
+  PWScore core2;
+  CheckChanges(core2);
+  EXPECT_EQ(PWSfile::V40, core2.GetReadFileVersion());
+}
+
+TEST_F(JournalTest, StaleJournal)
+{
+  PWScore core;
+  MakeFile(core, PWSfile::V30);
+  MakeChanges(core);
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurJournal());
+  const std::vector<unsigned char> journal = GetBytes(jname);
+
+  // As if the full save didn't get to remove the journal
+  ASSERT_EQ(PWScore::SUCCESS, core.WriteCurFile());
+  core.Execute(DeleteEntryCommand::Create(&core, items[3]));
+  ASSERT_EQ(PWScore::SUCCESS, core.WriteCurFile());
+  PutBytes(jname, journal);
+
+  PWScore core2;
+  core2.SetCurFile(fname);
+  ASSERT_EQ(PWScore::SUCCESS, core2.ReadCurFile(passphrase));
+  EXPECT_EQ(2U, core2.GetNumEntries());
+  EXPECT_EQ(core2.GetEntryEndIter(), core2.Find(items[3].GetUUID()));
+  EXPECT_FALSE(core2.HasJournal());
+  EXPECT_FALSE(pws_os::FileExists(jname));
+}
+
+TEST_F(JournalTest, DamagedJournal)
+{
+  PWScore core;
+  MakeFile(core, PWSfile::V30);
+  MakeChanges(core);
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurJournal());
+
+  core.Execute(UpdateEntryCommand::Create(&core, items[2], CItemData::TITLE,
+                                          _T("lost")));
+  EXPECT_EQ(PWScore::SUCCESS, core.WriteCurJournal());
+
+  // As if we crashed while appending the second batch
+  std::vector<unsigned char> journal = GetBytes(jname);
+  journal.resize(journal.size() - 5);
+  PutBytes(jname, journal);
+
+  PWScore core2;
+  CheckChanges(core2); // first batch is still good
+  ItemListConstIter iter = core2.Find(items[2].GetUUID());
+  ASSERT_NE(core2.GetEntryEndIter(), iter);
+  EXPECT_EQ(items[2].GetTitle(), iter->second.GetTitle());
+
+  // Can't append after damage, only a full save will do
+  EXPECT_TRUE(core2.HasJournal());
+  EXPECT_EQ(PWScore::NOT_SUCCESS, core2.WriteCurJournal());
+  ASSERT_EQ(PWScore::SUCCESS, core2.WriteCurFile());
+  EXPECT_FALSE(pws_os::FileExists(jname));
+}
+
+TEST_F(JournalTest, HeaderChangeNeedsFullSave)
+{
+  PWScore core;
+  MakeFile(core, PWSfile::V30);
+  core.Execute(ChangeDBHeaderCommand::Create(&core, _T("new name"),
+                                             PWSfile::HDR_DBNAME));
+  EXPECT_EQ(PWScore::NOT_SUCCESS, core.WriteCurJournal());
+  EXPECT_TRUE(core.HasDBChanged());
+  EXPECT_FALSE(pws_os::FileExists(jname));
+}
@@ -0,0 +1,127 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// PBKDF2Test.cpp: Unit test for PBKDF2 with HMAC-SHA256
+// Test vectors from RFC7914 Section 11
+
+#ifdef WIN32
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/crypto/hmac.h"
+#include "core/crypto/pbkdf2.h"
+#include "core/crypto/sha256.h"
+#include "gtest/gtest.h"
+
+#include <cstring>
+
+TEST(PBKDF2Test, pbkdf2_sha256_test)
+{
+  static const struct {
+    const char *password;
+    const char *salt;
+    int iterations;
+    unsigned char dk[64];
+  } tests[] = {
+    { "passwd", "salt", 1,
+      { 0x55, 0xac, 0x04, 0x6e, 0x56, 0xe3, 0x08, 0x9f,
+        0xec, 0x16, 0x91, 0xc2, 0x25, 0x44, 0xb6, 0x05,
+        0xf9, 0x41, 0x85, 0x21, 0x6d, 0xde, 0x04, 0x65,
+        0xe6, 0x8b, 0x9d, 0x57, 0xc2, 0x0d, 0xac, 0xbc,
+        0x49, 0xca, 0x9c, 0xcc, 0xf1, 0x79, 0xb6, 0x45,
+        0x99, 0x16, 0x64, 0xb3, 0x9d, 0x77, 0xef, 0x31,
+        0x7c, 0x71, 0xb8, 0x45, 0xb1, 0xe3, 0x0b, 0xd5,
+        0x09, 0x11, 0x20, 0x41, 0xd3, 0xa1, 0x97, 0x83 }
+    },
+    { "Password", "NaCl", 80000,
+      { 0x4d, 0xdc, 0xd8, 0xf6, 0x0b, 0x98, 0xbe, 0x21,
+        0x83, 0x0c, 0xee, 0x5e, 0xf2, 0x27, 0x01, 0xf9,
+        0x64, 0x1a, 0x44, 0x18, 0xd0, 0x4c, 0x04, 0x14,
+        0xae, 0xff, 0x08, 0x87, 0x6b, 0x34, 0xab, 0x56,
+        0xa1, 0xd4, 0x25, 0xa1, 0x22, 0x58, 0x33, 0x54,
+        0x9a, 0xdb, 0x84, 0x1b, 0x51, 0xc9, 0xb3, 0x17,
+        0x6a, 0x27, 0x2b, 0xde, 0xbb, 0xa1, 0xd0, 0x78,
+        0x47, 0x8f, 0x62, 0xb3, 0x97, 0xf3, 0x3c, 0x8d }
+    },
+  };
+
+  const SHA256::Impl impls[] = {SHA256::PORTABLE, SHA256::X86_SHA,
+                                SHA256::ARMV8_SHA};
+  const SHA256::Impl saved = SHA256::GetImpl();
+
+  for (auto impl : impls) {
+    if (!SHA256::SetImpl(impl))
+      continue;
+    for (size_t i = 0; i < (sizeof(tests) / sizeof(tests[0])); i++) {
+      unsigned char dk[64];
+      unsigned long dklen = sizeof(dk);
+      pbkdf2_sha256(reinterpret_cast<const unsigned char *>(tests[i].password),
+                    static_cast<unsigned long>(strlen(tests[i].password)),
+                    reinterpret_cast<const unsigned char *>(tests[i].salt),
+                    static_cast<unsigned long>(strlen(tests[i].salt)),
+                    tests[i].iterations, dk, &dklen);
+      EXPECT_EQ(sizeof(dk), dklen);
+      EXPECT_EQ(0, memcmp(dk, tests[i].dk, sizeof(dk)))
+        << "impl " << impl << " test vector " << i;
+    }
+  }
+  SHA256::SetImpl(saved);
+}
+
+// The fast path must agree with the generic one, including for
+// passwords longer than a block and output lengths that aren't a
+// multiple of the hash length
+TEST(PBKDF2Test, pbkdf2_generic_test)
+{
+  unsigned char password[100], salt[32];
+  for (size_t i = 0; i < sizeof(password); i++)
+    password[i] = static_cast<unsigned char>(i * 7 + 1);
+  for (size_t i = 0; i < sizeof(salt); i++)
+    salt[i] = static_cast<unsigned char>(i * 13 + 5);
+
+  const unsigned long pwlens[] = {0, 1, 32, 64, 65, 100};
+  const unsigned long outlens[] = {20, 32, 40};
+  const int iterations[] = {1, 2, 2048};
+
+  for (auto pwlen : pwlens)
+    for (auto outlen : outlens)
+      for (auto iter : iterations) {
+        unsigned char expected[40], dk[40];
+        unsigned long expected_len = outlen, dklen = outlen;
+        HMAC<SHA256, SHA256::HASHLEN, SHA256::BLOCKSIZE> hmac;
+        pbkdf2(password, pwlen, salt, sizeof(salt), iter, &hmac,
+               expected, &expected_len);
+        pbkdf2_sha256(password, pwlen, salt, sizeof(salt), iter,
+                      dk, &dklen);
+        EXPECT_EQ(expected_len, dklen);
+        EXPECT_EQ(0, memcmp(dk, expected, dklen))
+          << "pwlen " << pwlen << " outlen " << outlen << " iter " << iter;
+      }
+}
+
+TEST(PBKDF2Test, pbkdf2_abort_test)
+{
+  const unsigned char password[] = "password", salt[] = "salt";
+  unsigned char dk[32], expected[32];
+  unsigned long dklen = sizeof(dk), expected_len = sizeof(expected);
+  int ncalls = 0;
+
+  // aborted() is polled, and returning true stops the computation...
+  EXPECT_FALSE(pbkdf2_sha256(password, 8, salt, 4, 100000, dk, &dklen,
+                             [&ncalls]() {return ++ncalls > 2;}));
+  EXPECT_EQ(3, ncalls);
+  EXPECT_EQ(0U, dklen);
+
+  // ...while returning false has no effect on the result
+  dklen = sizeof(dk);
+  EXPECT_TRUE(pbkdf2_sha256(password, 8, salt, 4, 100000, dk, &dklen,
+                            []() {return false;}));
+  EXPECT_TRUE(pbkdf2_sha256(password, 8, salt, 4, 100000,
+                            expected, &expected_len));
+  EXPECT_EQ(expected_len, dklen);
+  EXPECT_EQ(0, memcmp(dk, expected, sizeof(dk)));
+}
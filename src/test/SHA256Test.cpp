@@ -13,6 +13,10 @@
 #include "core/crypto/sha256.h"
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
 TEST(SHA256Test, sha256_test)
 {
   static const struct {
@@ -43,3 +47,133 @@ TEST(SHA256Test, sha256_test)
     EXPECT_TRUE(memcmp(tmp, tests[i].hash, 32) == 0) << "test vector " << i;
   }
 }
+
+// Check each compression function this processor supports against known
+// answers and the portable code, over a range of lengths and chunkings
+TEST(SHA256Test, sha256_impl_test)
+{
+  // SHA-256 of one million 'a's, from FIPS 180-2
+  static const unsigned char million_a[32] = {
+    0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92,
+    0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+    0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e,
+    0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0
+  };
+  const SHA256::Impl impls[] = {SHA256::PORTABLE, SHA256::X86_SHA,
+                                SHA256::ARMV8_SHA};
+  const SHA256::Impl saved = SHA256::GetImpl();
+
+  unsigned char data[300];
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = static_cast<unsigned char>(i * 131 + 7);
+
+  unsigned char expected[sizeof(data) + 1][32];
+  ASSERT_TRUE(SHA256::SetImpl(SHA256::PORTABLE));
+  for (size_t len = 0; len <= sizeof(data); len++) {
+    SHA256 md;
+    md.Update(data, len);
+    md.Final(expected[len]);
+  }
+
+  unsigned char tmp[32];
+  for (auto impl : impls) {
+    if (!SHA256::SetImpl(impl))
+      continue;
+    EXPECT_EQ(impl, SHA256::GetImpl());
+
+    SHA256 ma;
+    unsigned char as[1000];
+    memset(as, 'a', sizeof(as));
+    for (int i = 0; i < 1000; i++)
+      ma.Update(as, sizeof(as));
+    ma.Final(tmp);
+    EXPECT_EQ(0, memcmp(tmp, million_a, 32)) << "impl " << impl;
+
+    for (size_t len = 0; len <= sizeof(data); len++) {
+      // whole buffer at once, then in uneven pieces
+      SHA256 md1;
+      md1.Update(data, len);
+      md1.Final(tmp);
+      EXPECT_EQ(0, memcmp(tmp, expected[len], 32)) << "impl " << impl
+                                                   << " len " << len;
+      SHA256 md2;
+      for (size_t off = 0; off < len; off += 37)
+        md2.Update(data + off, std::min<size_t>(37, len - off));
+      md2.Final(tmp);
+      EXPECT_EQ(0, memcmp(tmp, expected[len], 32)) << "impl " << impl
+                                                   << " len " << len;
+    }
+  }
+  SHA256::SetImpl(saved);
+}
+
+// IterateDigest must match hashing the digest repeatedly via Update/Final
+TEST(SHA256Test, sha256_iterate_test)
+{
+  const SHA256::Impl impls[] = {SHA256::PORTABLE, SHA256::X86_SHA,
+                                SHA256::ARMV8_SHA};
+  const SHA256::Impl saved = SHA256::GetImpl();
+  const unsigned int counts[] = {0, 1, 2, 3, 1000};
+
+  for (auto N : counts) {
+    unsigned char expected[32], X[32];
+    for (int i = 0; i < 32; i++)
+      expected[i] = static_cast<unsigned char>(i + N);
+    memcpy(X, expected, sizeof(X));
+
+    for (unsigned int i = 0; i < N; i++) {
+      SHA256 H;
+      H.Update(expected, sizeof(expected));
+      H.Final(expected);
+    }
+
+    for (auto impl : impls) {
+      if (!SHA256::SetImpl(impl))
+        continue;
+      unsigned char tmp[32];
+      memcpy(tmp, X, sizeof(tmp));
+      SHA256::IterateDigest(tmp, N);
+      EXPECT_EQ(0, memcmp(tmp, expected, 32)) << "impl " << impl
+                                              << " N " << N;
+    }
+  }
+  SHA256::SetImpl(saved);
+}
+
+// Not a test as such, but a measure of key stretching speed with the
+// generic per-iteration Update/Final loop, and with IterateDigest, for
+// each implementation. Run with --gtest_also_run_disabled_tests
+TEST(SHA256Test, DISABLED_sha256_iterate_benchmark)
+{
+  const SHA256::Impl impls[] = {SHA256::PORTABLE, SHA256::X86_SHA,
+                                SHA256::ARMV8_SHA};
+  const SHA256::Impl saved = SHA256::GetImpl();
+  const unsigned int N = 1 << 20;
+  unsigned char X[32] = {0};
+
+  for (auto impl : impls) {
+    if (!SHA256::SetImpl(impl))
+      continue;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < N; i++) {
+      SHA256 H;
+      H.Update(X, sizeof(X));
+      H.Final(X);
+    }
+    const std::chrono::duration<double> loop =
+      std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    SHA256::IterateDigest(X, N);
+    const std::chrono::duration<double> iter =
+      std::chrono::steady_clock::now() - start;
+
+    std::cout << "impl " << impl << ": Update/Final "
+              << static_cast<unsigned long>(N / loop.count())
+              << " iterations/s, IterateDigest "
+              << static_cast<unsigned long>(N / iter.count())
+              << " iterations/s" << std::endl;
+  }
+  SHA256::SetImpl(saved);
+}
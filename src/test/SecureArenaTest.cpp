@@ -0,0 +1,74 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// SecureArenaTest.cpp: Unit test for SecureArena
+
+#ifdef WIN32
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/SecureArena.h"
+#include "core/StringX.h"
+
+#include "gtest/gtest.h"
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+TEST(SecureArenaTest, Blocks)
+{
+  // Every size class, and the pages of their own past them
+  const size_t sizes[] = {0, 1, 16, 17, 100, 1000, 2048, 2049, 4096, 10000, 65536};
+  for (size_t size : sizes) {
+    std::vector<unsigned char *> blocks;
+    for (int i = 0; i < 100; i++) {
+      auto *p = static_cast<unsigned char *>(SecureArena::Allocate(size));
+      ASSERT_TRUE(p != nullptr);
+      memset(p, i + 1, size);
+      blocks.push_back(p);
+    }
+    // No two overlap
+    for (int i = 0; i < 100; i++)
+      for (size_t j = 0; j < size; j++)
+        ASSERT_EQ(i + 1, blocks[i][j]);
+    for (auto *p : blocks)
+      SecureArena::Release(p, size);
+  }
+
+  // A released block's reused, wiped
+  auto *p = static_cast<unsigned char *>(SecureArena::Allocate(40));
+  memset(p, 0xff, 40);
+  SecureArena::Release(p, 40);
+  auto *q = static_cast<unsigned char *>(SecureArena::Allocate(40));
+  EXPECT_EQ(p, q);
+  for (size_t j = 0; j < 40; j++)
+    EXPECT_EQ(0, q[j]);
+  SecureArena::Release(q, 40);
+}
+
+TEST(SecureArenaTest, Threads)
+{
+  // Strings allocated on one thread may be released on another, and
+  // threads give their blocks back as they exit
+  std::vector<StringX> strings(4000);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; t++)
+    threads.push_back(std::thread([&strings, t]() {
+      for (size_t i = t; i < strings.size(); i += 4) {
+        strings[i] = StringX(i % 200 + 1, _T('a') + t);
+        StringX temp(strings[i]);
+        temp += temp;
+      }
+    }));
+  for (auto &thread : threads)
+    thread.join();
+
+  for (size_t i = 0; i < strings.size(); i++)
+    EXPECT_EQ(StringX(i % 200 + 1, _T('a') + i % 4), strings[i]);
+  strings.clear();
+}
@@ -0,0 +1,102 @@
+/*
+* Copyright (c) 2003-2020 Rony Shapiro <ronys@pwsafe.org>.
+* All rights reserved. Use of the code is allowed under the
+* Artistic License 2.0 terms, as specified in the LICENSE file
+* distributed with this code, or available from
+* http://www.opensource.org/licenses/artistic-license-2.0.php
+*/
+// UUIDMapTest.cpp: Unit test for UUIDMap, and the CUUIDs it's keyed on
+
+#ifdef WIN32
+#include "../ui/Windows/stdafx.h"
+#endif
+
+#include "core/UUIDMap.h"
+
+#include "gtest/gtest.h"
+
+#include <map>
+#include <sstream>
+
+TEST(UUIDMapTest, UUID)
+{
+  const uuid_array_t ua = {0x20, 0x40, 0x12, 0xe6, 0x60, 0x0f, 0x4e, 0x01,
+                           0xa5, 0xeb, 0x51, 0x52, 0x67, 0xcb, 0x0d, 0x50};
+  const pws_os::CUUID uuid(ua);
+  EXPECT_EQ(0, memcmp(ua, *uuid.GetARep(), sizeof(ua)));
+  EXPECT_EQ(StringX(_T("204012e6600f4e01a5eb515267cb0d50")), StringX(uuid));
+  EXPECT_EQ(uuid, pws_os::CUUID(StringX(uuid)));
+  EXPECT_EQ(uuid.Hash(), pws_os::CUUID(uuid).Hash());
+
+  std::ostringstream os;
+  os << uuid.Canonic();
+  EXPECT_EQ("204012e6-600f-4e01-a5eb-515267cb0d50", os.str());
+
+  EXPECT_TRUE(pws_os::CUUID::NullUUID() < uuid);
+  EXPECT_NE(uuid, pws_os::CUUID());
+}
+
+TEST(UUIDMapTest, AsMap)
+{
+  // Check it against std::map, adding and erasing enough to make
+  // it rehash, and keys collide
+  UUIDMap<int> um;
+  std::map<pws_os::CUUID, int> m;
+  std::vector<pws_os::CUUID> uuids;
+  for (int i = 0; i < 1000; i++) {
+    uuid_array_t ua = {0};
+    ua[15] = static_cast<unsigned char>(i);
+    ua[14] = static_cast<unsigned char>(i >> 8);
+    uuids.push_back(pws_os::CUUID(ua));
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_TRUE(um.emplace(uuids[i], i).second);
+    m[uuids[i]] = i;
+  }
+  EXPECT_FALSE(um.insert(std::make_pair(uuids[0], -1)).second);
+  EXPECT_EQ(0, um[uuids[0]]);
+
+  // Pointers stay valid as others are added and erased
+  const int *p997 = &um.find(uuids[997])->second;
+  for (int i = 0; i < 1000; i += 3) {
+    EXPECT_EQ(1U, um.erase(uuids[i]));
+    m.erase(uuids[i]);
+  }
+  EXPECT_EQ(0U, um.erase(uuids[0]));
+  for (int i = 0; i < 1000; i += 6)
+    um[uuids[i]] = m[uuids[i]] = 2 * i;
+  EXPECT_EQ(&um.find(uuids[997])->second, p997);
+
+  ASSERT_EQ(m.size(), um.size());
+  for (const auto &p : m) {
+    auto iter = um.find(p.first);
+    ASSERT_TRUE(iter != um.end());
+    EXPECT_EQ(p.second, iter->second);
+  }
+  for (int i = 0; i < 1000; i++)
+    EXPECT_EQ(m.count(uuids[i]), um.count(uuids[i]));
+
+  // Erasing while iterating
+  for (auto iter = um.begin(); iter != um.end();)
+    iter = (iter->second % 2 == 0) ? um.erase(iter) : std::next(iter);
+  for (const auto &p : um)
+    EXPECT_EQ(1, p.second % 2);
+
+  // Sorted view's in the same order as std::map's
+  m.clear();
+  for (const auto &p : um)
+    m[p.first] = p.second;
+  const UUIDMap<int> copy(um);
+  const auto sorted = copy.SortedByKey();
+  ASSERT_EQ(m.size(), sorted.size());
+  auto miter = m.begin();
+  for (const auto &iter : sorted)
+    EXPECT_EQ((miter++)->first, iter->first);
+
+  UUIDMap<int> moved(std::move(um));
+  EXPECT_TRUE(um.empty());
+  EXPECT_EQ(copy.size(), moved.size());
+  EXPECT_EQ(&moved.find(uuids[997])->second, p997);
+  EXPECT_EQ(--moved.end(), moved.find(uuids[997]));
+}
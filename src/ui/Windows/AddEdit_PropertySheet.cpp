@@ -388,14 +388,15 @@ BOOL CAddEdit_PropertySheet::OnApply(const int &iCID)
         m_AEMD.oldKBShortcut = m_AEMD.KBShortcut;
         m_AEMD.pci->SetKBShortcut(m_AEMD.KBShortcut);
 
-        // TODO - What if user has removed the old attachment or changed it? (Rony)
-        if (m_AEMD.attachment.HasUUID()) {
-          m_AEMD.pci->SetAttUUID(m_AEMD.attachment.GetUUID());
-          m_AEMD.pcore->PutAtt(m_AEMD.attachment);
-        } else {
-          m_AEMD.pci->ClearAttUUID();
-          if (m_AEMD.oldattachment.HasUUID())
-            m_AEMD.pcore->RemoveAtt(m_AEMD.oldattachment.GetUUID());
+        // Other entries sharing the old attachment keep it as it was
+        if (m_AEMD.attachment != m_AEMD.oldattachment) {
+          if (m_AEMD.attachment.HasUUID()) {
+            m_AEMD.pcore->SetEntryAtt(*m_AEMD.pci, m_AEMD.attachment);
+            m_AEMD.attachment = m_AEMD.pcore->GetAtt(m_AEMD.pci->GetAttUUID());
+          } else {
+            m_AEMD.pcore->ClearEntryAtt(*m_AEMD.pci);
+          }
+          m_AEMD.oldattachment = m_AEMD.attachment;
         }
       } // m_bIsModified
 
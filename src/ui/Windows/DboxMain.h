@@ -590,6 +590,7 @@ public:
   LRESULT OnExecuteFilters(WPARAM wParam, LPARAM lParam);
   LRESULT OnApplyEditChanges(WPARAM wParam, LPARAM lParam);
   LRESULT OnDroppedFile(WPARAM wParam, LPARAM lParam);
+  LRESULT OnSaveReady(WPARAM wParam, LPARAM lParam);
 
   void UpdateAlwaysOnTop();
   void ClearAppData(const bool bClearMRE = true);
@@ -819,6 +820,11 @@ private:
   
   virtual void GUIRefreshEntry(const CItemData &ci, bool bAllowFail = false);
   virtual void UpdateWizard(const std::wstring &s);
+  virtual void SaveReady();
+  virtual void DatabaseSaved(int status, const StringX &filename);
+
+  int SaveDone(int rc, const StringX &sxCurrFile, const std::wstring &bu_fname,
+               const SaveType savetype);
 
   static int CALLBACK CompareFunc(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort);
 
@@ -153,8 +153,7 @@ BOOL CEditShortcutDlg::OnInitDialog()
     pws_os::CUUID entry_uuid = m_pci->GetUUID();
     if (entry_uuid != pws_os::CUUID::NullUUID()) {
       ostringstreamT os;
-      pws_os::CUUID huuid(*entry_uuid.GetARep(), true);
-      os << std::uppercase << huuid;
+      os << std::uppercase << entry_uuid.Canonic();
       cs_uuid = os.str().c_str();
     }
     GetDlgItem(IDC_UUID)->SetWindowText(cs_uuid);
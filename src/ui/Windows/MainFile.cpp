@@ -78,6 +78,9 @@ static void DisplayFileWriteError(INT_PTR rc, const StringX &cs_newfile)
   case PWScore::WRONG_PASSWORD:
     cs_temp.Format(IDS_MISSINGPASSKEY);
     break;
+  case PWScore::CANT_BACKUP:
+    cs_temp.LoadString(IDS_NOIBACKUP);
+    break;
   default:
     cs_temp.Format(IDS_UNKNOWNERROR, static_cast<LPCWSTR>(cs_newfile.c_str()));
     break;
@@ -1113,6 +1116,8 @@ int DboxMain::Save(const SaveType savetype)
   CGeneralMsgBox gmb;
   std::wstring NewName;
   std::wstring bu_fname; // used to undo backup if save failed
+  PWScore::BackupOptions backup;
+  bool bBackgroundBackup = false; // taken by the background save instead
 
   const StringX sxCurrFile = m_core.GetCurFile();
   const PWSfile::VERSION current_version = m_core.GetReadFileVersion();
@@ -1154,6 +1159,15 @@ int DboxMain::Save(const SaveType savetype)
           userBackupDir = wsExpandedPath;
         }
 
+        if (savetype == ST_SAVEIMMEDIATELY) {
+          backup.maxNumIncBackups = maxNumIncBackups;
+          backup.backupSuffix = backupSuffix;
+          backup.userBackupPrefix = userBackupPrefix;
+          backup.userBackupDir = userBackupDir;
+          bBackgroundBackup = true;
+          break;
+        }
+
         if (!m_core.BackupCurFile(maxNumIncBackups, backupSuffix,
                                   userBackupPrefix, userBackupDir, bu_fname)) {
           switch (savetype) {
@@ -1223,8 +1237,21 @@ int DboxMain::Save(const SaveType savetype)
   m_core.SetRUEList(RUEList);
 
   // We are saving the current DB. Retain current version
+  if (savetype == ST_SAVEIMMEDIATELY) {
+    // Saving after every change mustn't hold up the next one, so write
+    // it in the background, backup and all, see DatabaseSaved() for how
+    // it went
+    return m_core.ScheduleSave(sxCurrFile, current_version,
+                               bBackgroundBackup ? &backup : nullptr);
+  }
+
   rc = m_core.WriteFile(sxCurrFile, current_version);
+  return SaveDone(rc, sxCurrFile, bu_fname, savetype);
+}
 
+int DboxMain::SaveDone(int rc, const StringX &sxCurrFile,
+                       const std::wstring &bu_fname, const SaveType savetype)
+{
   if (rc != PWScore::SUCCESS) { // Save failed!
     // Restore backup, if we have one
     if (!bu_fname.empty() && !sxCurrFile.empty())
@@ -1305,10 +1332,12 @@ int DboxMain::SaveIfChanged()
   // Here we save the DB if the DB has at least one entry or empty group AND:
   //  Entry Access Times have been changed OR
   //  The Group Display has changed and the User specified to use it at open time OR
-  //  RUE list has changed and the user wants them saved
+  //  RUE list has changed and the user wants them saved OR
+  //  SaveImmediately() wrote a journal, and there's nothing else to save
   PWSprefs *prefs = PWSprefs::GetInstance();
   if (!m_bUserDeclinedSave &&
       (m_bEntryTimestampsChanged || 
+       (m_core.HasJournal() && !m_core.HasDBChanged()) ||
        (prefs->GetPref(PWSprefs::TreeDisplayStatusAtOpen) == PWSprefs::AsPerLastSave && 
             m_core.HasGroupDisplayChanged()) ||
        (prefs->GetPref(PWSprefs::MaxREItems) > 0 &&
@@ -1353,6 +1382,11 @@ int DboxMain::SaveIfChanged()
 
 int DboxMain::SaveImmediately()
 {
+  // Just append the changed entries to the journal, if we can
+  if (PWSprefs::GetInstance()->GetPref(PWSprefs::UseChangeJournal) &&
+      m_core.WriteCurJournal() == PWScore::SUCCESS)
+    return PWScore::SUCCESS;
+
   // Get normal save to do this (code already there for intermediate backups)
   return Save(ST_SAVEIMMEDIATELY);
 }
@@ -3617,6 +3651,27 @@ LRESULT DboxMain::OnDroppedFile(WPARAM /* wParam */, LPARAM /* lParam */)
   return 0;
 }
 
+void DboxMain::SaveReady()
+{
+  // Called on the thread that wrote the file - let ours finish the save
+  PostMessage(PWS_MSG_SAVE_READY);
+}
+
+LRESULT DboxMain::OnSaveReady(WPARAM /* wParam */, LPARAM /* lParam */)
+{
+  // Nothing to do if it's already been completed, e.g., by a later save
+  m_core.CompleteSave(false);
+  return 0;
+}
+
+void DboxMain::DatabaseSaved(int status, const StringX &filename)
+{
+  // Whether OnSaveReady() or anything waiting for the save completed it.
+  // The save's put back any backup it took if it failed.
+  if (filename == m_core.GetCurFile())
+    SaveDone(status, filename, std::wstring(), ST_SAVEIMMEDIATELY);
+}
+
 LRESULT DboxMain::ViewCompareResult(PWScore *pcore, const CUUID &entryUUID)
 {
   ItemListIter pos = pcore->Find(entryUUID);
@@ -51,6 +51,9 @@
 // Notification from tree control that a file was dropped on it
 #define PWS_MSG_DROPPED_FILE            (WM_APP + 65)
 
+// Posted by the thread writing a background save when it's done
+#define PWS_MSG_SAVE_READY              (WM_APP + 66)
+
 // Message to get Virtual Keyboard buffer.
 #define PWS_MSG_INSERTBUFFER            (WM_APP + 70)
 #define PWS_MSG_RESETTIMER              (WM_APP + 71)
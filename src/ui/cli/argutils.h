@@ -37,7 +37,7 @@ struct UserArgs {
   StringX safe;
   StringX passphrase[2];
   enum OpType {Unset, Import, Export, CreateNew, Search, Add,
-               Diff, Sync, Merge} Operation{Unset};
+               Diff, Sync, Merge, MergeAtts} Operation{Unset};
   enum {Print, Delete, Update, ClearFields, ChangePassword} SearchAction{Print};
   enum {Unknown, XML, Text} Format{Unknown};
 
@@ -57,6 +57,9 @@ struct UserArgs {
   DiffFmt dfmt{DiffFmt::Unified};
   unsigned int colwidth{60}; // for side-by-side diff
 
+  // used by create: target unlock time in msecs, 0 => default iterations
+  unsigned int unlockTime{0};
+
   // used by add & update
   using FieldValue = std::tuple<CItemData::FieldType, StringX>;
   using FieldUpdates = std::vector< FieldValue >;
@@ -14,6 +14,7 @@
 #include <iostream>
 #include <sstream>
 #include <cassert>
+#include <cstdlib>
 #ifndef _WIN32
 #include <getopt.h>
 #include <libgen.h> // for basename()
@@ -65,8 +66,10 @@ int SaveCore(PWScore &core, const UserArgs &);
 
 // These are the new operations. Each returns the code to exit with
 static int CreateNewSafe(PWScore &core, const StringX &filename, const StringX &passphrase);
+static int CalibrateNewSafe(PWScore &core, const UserArgs &ua);
 static int Sync(PWScore &core, const UserArgs &ua);
 static int Merge(PWScore &core, const UserArgs &ua);
+static int MergeAtts(PWScore &core, const UserArgs &ua);
 
 //-----------------------------------------------------------------
 
@@ -86,12 +89,13 @@ struct pws_op {
 const map<UserArgs::OpType, pws_op> pws_ops = {
   { UserArgs::Import,     {OpenCore,        Import,     SaveCore}},
   { UserArgs::Export,     {OpenCore,        Export,     null_op}},
-  { UserArgs::CreateNew,  {CreateNewSafe,   null_op,    SaveCore}},
+  { UserArgs::CreateNew,  {CreateNewSafe,   CalibrateNewSafe, SaveCore}},
   { UserArgs::Add,        {OpenCore,        AddEntry,   SaveCore}},
   { UserArgs::Search,     {OpenCore,        Search,     SaveAfterSearch}},
   { UserArgs::Diff,       {OpenCore,        Diff,       null_op}},
   { UserArgs::Sync,       {OpenCore,        Sync,       SaveCore}},
   { UserArgs::Merge,      {OpenCore,        Merge,      SaveCore}},
+  { UserArgs::MergeAtts,  {OpenCore,        MergeAtts,  SaveCore}},
 };
 
 
@@ -102,7 +106,7 @@ Usage: %PROGNAME% safe --imp[=file] --text|--xml
 
        %PROGNAME% safe --exp[=file] --text|--xml
 
-       %PROGNAME% safe --create
+       %PROGNAME% safe --create [--unlock-time=<msecs>]
 
        %PROGNAME% safe --add=field1=value1,field2=value2,...
 
@@ -118,6 +122,8 @@ Usage: %PROGNAME% safe --imp[=file] --text|--xml
 
        %PROGNAME% safe --merge=<other-safe> [ --subset=<Field><OP><Value>[/iI] ] [--yes]
 
+       %PROGNAME% safe --merge-attachments [--dry-run]
+
                         where OP is one of ==, !==, ^= !^=, $=, !$=, ~=, !~=
                          = => exactly similar
                          ^ => begins with
@@ -201,9 +207,11 @@ bool parseArgs(int argc, char *argv[], UserArgs &ua)
       {"synchronize", no_argument,        0, 'z'},
     //  {"synch",       no_argument,        0, 'z'},
       {"merge",       no_argument,        0, 'm'},
+      {"merge-attachments", no_argument,  0, 'A'},
       {"colwidth",    required_argument,  0, 'w'},
       {"passphrase",  required_argument,  0, 'P'},
       {"passphrase2", required_argument,  0, 'Q'},
+      {"unlock-time", required_argument,  0, 'T'},
       {0, 0, 0, 0}
     };
 
@@ -211,7 +219,7 @@ bool parseArgs(int argc, char *argv[], UserArgs &ua)
     static_assert(no_dup_short_option(long_options), "Short option used twice");
 #endif
 
-    int c = getopt_long(argc-1, argv+1, "i::e::txcs:b:f:oa:u:pryd:gjknz:m:P:Q:",
+    int c = getopt_long(argc-1, argv+1, "i::e::txcs:b:f:oa:u:pryd:gjknz:m:AP:Q:T:",
                         long_options, &option_index);
     if (c == -1)
       break;
@@ -259,6 +267,10 @@ bool parseArgs(int argc, char *argv[], UserArgs &ua)
       ua.SetMainOp(UserArgs::Merge, optarg);
       break;
 
+    case 'A':
+      ua.SetMainOp(UserArgs::MergeAtts);
+      break;
+
     case 'b':
         assert(optarg);
         ua.SetSubset(Utf82wstring(optarg));
@@ -339,11 +351,29 @@ bool parseArgs(int argc, char *argv[], UserArgs &ua)
         Utf82StringX(optarg, ua.passphrase[1]);
         break;
 
+    case 'T': {
+        assert(optarg);
+        // Up to a minute: any longer, and it's surely a typo
+        char *end;
+        const long msecs = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || msecs < 1 || msecs > 60000) {
+          wcerr << L"--unlock-time must be from 1 to 60000 msecs" << endl;
+          return false;
+        }
+        ua.unlockTime = static_cast<unsigned int>(msecs);
+        break;
+      }
+
     default:
       wcerr << L"Unknown option: " << static_cast<wchar_t>(c) << endl;
       return false;
     } // switch
   } // while 
+
+  if (ua.unlockTime > 0 && ua.Operation != UserArgs::CreateNew) {
+    wcerr << L"--unlock-time only applies to --create" << endl;
+    return false;
+  }
   return true;
 }
 
@@ -393,6 +423,9 @@ int main(int argc, char *argv[])
         status = itr->second.main_op(core, ua);
         if (status == PWScore::SUCCESS)
           status = itr->second.post_op(core, ua);
+        // post_op may have left a save writing in the background
+        if (status == PWScore::SUCCESS)
+          status = core.CompleteSave();
       }
     }
     catch(const exception &e) {
@@ -421,10 +454,22 @@ static int CreateNewSafe(PWScore &core, const StringX &filename, const StringX &
     return PWScore::SUCCESS;
 }
 
+static int CalibrateNewSafe(PWScore &core, const UserArgs &ua)
+{
+  // Pick the hash iterations that make unlocking take ua.unlockTime msecs
+  // on this machine, rather than the fixed default
+  if (ua.unlockTime > 0) {
+    const uint32 nIters = core.CalibrateHashIters(ua.unlockTime);
+    core.SetHashIters(nIters);
+    wcout << L"Using " << nIters << L" hash iterations" << endl;
+  }
+  return PWScore::SUCCESS;
+}
+
 int SaveCore(PWScore &core, const UserArgs &ua)
 {
   if (!ua.dry_run)
-    return core.WriteCurFile();
+    return core.ScheduleSaveCurFile(); // main() waits for it
 
   return PWScore::SUCCESS;
 }
@@ -471,3 +516,11 @@ int Merge(PWScore &core, const UserArgs &ua)
   }
   return status;
 }
+
+int MergeAtts(PWScore &core, const UserArgs &)
+{
+  // Entries with the same attachment come to share one copy of it
+  const int numRemoved = core.Execute(MergeDuplicateAttsCommand::Create(&core));
+  wcout << numRemoved << L" duplicate attachment(s) removed" << endl;
+  return PWScore::SUCCESS;
+}
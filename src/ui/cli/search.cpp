@@ -54,7 +54,7 @@ int SaveAfterSearch(PWScore &core, const UserArgs &ua)
     case UserArgs::Delete:
     case UserArgs::ClearFields:
     case UserArgs::ChangePassword:
-      if ( core.HasDBChanged() ) return core.WriteCurFile();
+      if ( core.HasDBChanged() ) return core.ScheduleSaveCurFile(); // main() waits for it
       break;
     case UserArgs::Print:
       break;
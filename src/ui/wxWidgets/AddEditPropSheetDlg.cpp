@@ -2048,9 +2048,9 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
             Case: Item doesn't have an attachment and shall get one.
             Steps:
               1) Update attachment meta data.
-              2) Associate the attachment with the item (CItemData).
-              3) Add attachment (CItemAtt) to the core.
-              4) Update item's status.
+              2) Associate the attachment with the item (CItemData),
+                 adding it to the core, or sharing one that's the same.
+              3) Update item's status.
           */
           else if (!m_Item.HasAttRef() && m_ItemAttachment.HasUUID() && m_ItemAttachment.HasContent()) {
 
@@ -2064,13 +2064,9 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
             m_ItemAttachment.SetCTime(timestamp);
 
             // Step 2)
-            m_Item.SetAttUUID(m_ItemAttachment.GetUUID());
-            m_ItemAttachment.IncRefcount();
+            m_Core.SetEntryAtt(m_Item, m_ItemAttachment);
 
             // Step 3)
-            m_Core.PutAtt(m_ItemAttachment);
-
-            // Step 4)
             m_ItemAttachment.SetStatus(CItem::EntryStatus::ES_ADDED);
             m_Item.SetStatus(CItem::EntryStatus::ES_MODIFIED);
           }
@@ -2078,22 +2074,16 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
           /*
             Case: Item has an attachment which shall be removed.
             Steps:
-              1) Detach the attachment (CItemAtt) from the item.
-              2) Remove the attachment from the core.
-              3) Update item's status.
+              1) Detach the attachment (CItemAtt) from the item, removing
+                 it from the core unless other items share it.
+              2) Update item's status.
           */
           else if (m_Item.HasAttRef() && !m_ItemAttachment.HasUUID() && !m_ItemAttachment.HasContent()) {
 
             // Step 1)
-            auto uuid = m_Item.GetAttUUID();
-            auto itemAttachment = m_Core.GetAtt(uuid);
-            m_Item.ClearAttUUID();
-            itemAttachment.DecRefcount();
+            m_Core.ClearEntryAtt(m_Item);
 
             // Step 2)
-            m_Core.RemoveAtt(itemAttachment.GetUUID());
-
-            // Step 3)
             m_Item.SetStatus(CItem::EntryStatus::ES_MODIFIED);
           }
 
@@ -2101,11 +2091,10 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
             Case: Item has an attachment which shall be replaced by a new one.
             Steps:
               1) Update attachment meta data.
-              2) Detach the attachment (CItemAtt) from the item.
-              3) Remove the attachment from the Core.
-              4) Associate the new attachment with the item (CItemData).
-              5) Add new attachment (CItemAtt) to the core.
-              6) Update item's status.
+              2) Associate the new attachment with the item (CItemData) in
+                 place of the old one. Items sharing the old one keep it
+                 unchanged, this item gets a copy.
+              3) Update item's status.
           */
           else if (isAttachmentModified) {
 
@@ -2119,22 +2108,9 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
             m_ItemAttachment.SetCTime(timestamp);
 
             // Step 2)
-            auto uuid = m_Item.GetAttUUID();
-            auto itemAttachment = m_Core.GetAtt(uuid);
-            m_Item.ClearAttUUID();
-            itemAttachment.DecRefcount();
+            m_Core.SetEntryAtt(m_Item, m_ItemAttachment);
 
             // Step 3)
-            m_Core.RemoveAtt(itemAttachment.GetUUID());
-
-            // Step 4)
-            m_Item.SetAttUUID(m_ItemAttachment.GetUUID());
-            m_ItemAttachment.IncRefcount();
-
-            // Step 5)
-            m_Core.PutAtt(m_ItemAttachment);
-
-            // Step 6)
             m_Item.SetStatus(CItem::EntryStatus::ES_MODIFIED);
           }
           else {
@@ -2235,9 +2211,9 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
             Case: New item shall get an attachment.
             Steps:
               1) Update attachment meta data.
-              2) Associate the attachment with the item (CItemData).
-              3) Add attachment (CItemAtt) to the core.
-              4) Update item's status.
+              2) Associate the attachment with the item (CItemData),
+                 adding it to the core, or sharing one that's the same.
+              3) Update item's status.
           */
           if (!m_Item.HasAttRef() && m_ItemAttachment.HasUUID() && m_ItemAttachment.HasContent()) {
 
@@ -2251,13 +2227,9 @@ void AddEditPropSheetDlg::OnOk(wxCommandEvent& WXUNUSED(evt))
             m_ItemAttachment.SetCTime(timestamp);
 
             // Step 2)
-            m_Item.SetAttUUID(m_ItemAttachment.GetUUID());
-            m_ItemAttachment.IncRefcount();
+            m_Core.SetEntryAtt(m_Item, m_ItemAttachment);
 
             // Step 3)
-            m_Core.PutAtt(m_ItemAttachment);
-
-            // Step 4)
             m_ItemAttachment.SetStatus(CItem::EntryStatus::ES_ADDED);
             m_Item.SetStatus(CItem::EntryStatus::ES_MODIFIED);
           }
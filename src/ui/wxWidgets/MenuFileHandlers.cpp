@@ -62,6 +62,9 @@ static void DisplayFileWriteError(int rc, const StringX &fname)
   case PWScore::FAILURE:
     cs_temp =_("Write operation failed!\nFile may have been corrupted.\nTry saving in a different location");
     break;
+  case PWScore::CANT_BACKUP:
+    cs_temp = _("Unable to create intermediate backup.");
+    break;
   default:
     cs_temp = fname.c_str();
     cs_temp += wxT("\n\n");
@@ -289,6 +292,11 @@ void PasswordSafeFrame::OnSaveAsClick(wxCommandEvent& evt)
 
 int PasswordSafeFrame::SaveImmediately()
 {
+  // Just append the changed entries to the journal, if we can
+  if (PWSprefs::GetInstance()->GetPref(PWSprefs::UseChangeJournal) &&
+      m_core.WriteCurJournal() == PWScore::SUCCESS)
+    return PWScore::SUCCESS;
+
   // Get normal save to do this (code already there for intermediate backups)
   return Save(SaveType::IMMEDIATELY);
 }
@@ -296,6 +304,8 @@ int PasswordSafeFrame::SaveImmediately()
 int PasswordSafeFrame::Save(SaveType savetype /* = SaveType::INVALID*/)
 {
   stringT bu_fname; // used to undo backup if save failed
+  PWScore::BackupOptions backup;
+  bool bBackgroundBackup = false; // taken by the background save instead
   PWSprefs *prefs = PWSprefs::GetInstance();
 
   // Save Application related preferences
@@ -318,6 +328,16 @@ int PasswordSafeFrame::Save(SaveType savetype /* = SaveType::INVALID*/)
         int backupSuffix = prefs->GetPref(PWSprefs::BackupSuffix);
         std::wstring userBackupPrefix = prefs->GetPref(PWSprefs::BackupPrefixValue).c_str();
         std::wstring userBackupDir = prefs->GetPref(PWSprefs::BackupDir).c_str();
+#if wxCHECK_VERSION(2,9,5)
+        if (savetype == SaveType::IMMEDIATELY) {
+          backup.maxNumIncBackups = maxNumIncBackups;
+          backup.backupSuffix = backupSuffix;
+          backup.userBackupPrefix = userBackupPrefix;
+          backup.userBackupDir = userBackupDir;
+          bBackgroundBackup = true;
+          break;
+        }
+#endif
         if (!m_core.BackupCurFile(maxNumIncBackups, backupSuffix,
                                   userBackupPrefix, userBackupDir, bu_fname)) {
           switch (savetype) {
@@ -378,8 +398,21 @@ int PasswordSafeFrame::Save(SaveType savetype /* = SaveType::INVALID*/)
   m_RUEList.GetRUEList(RUElist);
   m_core.SetRUEList(RUElist);
 
-  const int rc = m_core.WriteCurFile();
+#if wxCHECK_VERSION(2,9,5)
+  if (savetype == SaveType::IMMEDIATELY) {
+    // Saving after every change mustn't hold up the next one, so write
+    // it in the background, backup and all, see DatabaseSaved() for how
+    // it went
+    return m_core.ScheduleSave(m_core.GetCurFile(), m_core.GetReadFileVersion(),
+                               bBackgroundBackup ? &backup : nullptr);
+  }
+#endif
 
+  return SaveDone(m_core.WriteCurFile(), bu_fname, savetype);
+}
+
+int PasswordSafeFrame::SaveDone(int rc, const stringT &bu_fname, SaveType savetype)
+{
   if (rc != PWScore::SUCCESS) { // Save failed!
     // Restore backup, if we have one
     if (!bu_fname.empty() && m_core.IsDbOpen())
@@ -408,6 +441,28 @@ int PasswordSafeFrame::Save(SaveType savetype /* = SaveType::INVALID*/)
   return PWScore::SUCCESS;
 }
 
+void PasswordSafeFrame::SaveReady()
+{
+  // Called on the thread that wrote the file - let ours finish the save
+#if wxCHECK_VERSION(2,9,5)
+  CallAfter(&PasswordSafeFrame::CompleteBackgroundSave);
+#endif
+}
+
+void PasswordSafeFrame::CompleteBackgroundSave()
+{
+  // Nothing to do if it's already been completed, e.g., by a later save
+  m_core.CompleteSave(false);
+}
+
+void PasswordSafeFrame::DatabaseSaved(int status, const StringX &filename)
+{
+  // Whether CompleteBackgroundSave() or anything waiting for the save
+  // completed it. The save's put back any backup it took if it failed.
+  if (filename == m_core.GetCurFile())
+    SaveDone(status, stringT(), SaveType::IMMEDIATELY);
+}
+
 int PasswordSafeFrame::SaveAs()
 {
   const PWSfile::VERSION curver = m_core.GetReadFileVersion();
@@ -543,6 +598,11 @@ int PasswordSafeFrame::SaveIfChanged()
   if (m_core.IsReadOnly())
     return PWScore::SUCCESS;
 
+  // Fold the journal written by SaveImmediately() into the database,
+  // no need to ask if that's all there is to save
+  if (m_core.HasJournal() && !m_bTSUpdated && !m_core.HasDBChanged())
+    return (Save() == PWScore::SUCCESS) ? PWScore::SUCCESS : PWScore::CANT_OPEN_FILE;
+
   // Offer to save existing database if it was modified.
   //
   // Note: RUE list saved here via time stamp being updated.
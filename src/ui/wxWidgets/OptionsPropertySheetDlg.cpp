@@ -30,6 +30,8 @@
 #include <wx/debug.h>
 #include <wx/taskbar.h>
 
+#include <algorithm>
+
 #include "core/PWSprefs.h"
 #include "core/Util.h" // for datetime string
 #include "core/PWSAuxParse.h" // for DEFAULT_AUTOTYPE
@@ -78,6 +80,7 @@ BEGIN_EVENT_TABLE( OptionsPropertySheetDlg, wxPropertySheetDialog )
   EVT_CHECKBOX(    ID_CHECKBOX24,      OptionsPropertySheetDlg::OnUseDefaultUserClick )
   EVT_BUTTON(      ID_BUTTON8,         OptionsPropertySheetDlg::OnBrowseLocationClick )
   EVT_BUTTON(      ID_PWHISTAPPLY,     OptionsPropertySheetDlg::OnPWHistApply )
+  EVT_BUTTON(      ID_HASHITERCALIBRATE, OptionsPropertySheetDlg::OnHashIterCalibrate )
 ////@end OptionsPropertySheetDlg event table entries
 
   EVT_BOOKCTRL_PAGE_CHANGING(wxID_ANY, OptionsPropertySheetDlg::OnPageChanging)
@@ -112,6 +115,7 @@ BEGIN_EVENT_TABLE( OptionsPropertySheetDlg, wxPropertySheetDialog )
   EVT_UPDATE_UI(   ID_STATICTEXT_2,    OptionsPropertySheetDlg::OnUpdateUI )
   EVT_UPDATE_UI(   ID_STATICTEXT_3,    OptionsPropertySheetDlg::OnUpdateUI )
   EVT_UPDATE_UI(   ID_SLIDER,          OptionsPropertySheetDlg::OnUpdateUI )
+  EVT_UPDATE_UI(   ID_HASHITERCALIBRATE, OptionsPropertySheetDlg::OnUpdateUI )
   EVT_UPDATE_UI(   ID_STATICTEXT_4,    OptionsPropertySheetDlg::OnUpdateUI )
   EVT_UPDATE_UI(   ID_STATICTEXT_5,    OptionsPropertySheetDlg::OnUpdateUI )
   EVT_UPDATE_UI(   ID_SPINCTRL13,      OptionsPropertySheetDlg::OnUpdateUI )
@@ -829,6 +833,10 @@ wxPanel* OptionsPropertySheetDlg::CreateSecurityPanel(const wxString& title)
   wxStaticText* itemStaticText103 = new wxStaticText( itemPanel86, ID_STATICTEXT_5, _("Maximum"), wxDefaultPosition, wxDefaultSize, 0 );
   itemBoxSizer100->Add(itemStaticText103, 0, wxALIGN_CENTER_VERTICAL|wxALL, 5);
 
+  wxButton* itemButton104 = new wxButton( itemPanel86, ID_HASHITERCALIBRATE, _("Calibrate"), wxDefaultPosition, wxDefaultSize, 0 );
+  itemButton104->SetToolTip(_("Set the unlock difficulty to what this computer can check in about half a second"));
+  itemBoxSizer97->Add(itemButton104, 0, wxALIGN_LEFT|wxALL, 5);
+
   // Security Preferences
   security_ClearClipboardOnMinimizeCB->SetValidator( wxGenericValidator(& m_Security_ClearClipboardOnMinimize) );
   security_ClearClipboardOnExitCB->SetValidator( wxGenericValidator(& m_Security_ClearClipboardOnExit) );
@@ -1377,6 +1385,29 @@ void OptionsPropertySheetDlg::OnBrowseLocationClick(wxCommandEvent& WXUNUSED(evt
   }
 }
 
+/*!
+ * wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_HASHITERCALIBRATE
+ */
+
+void OptionsPropertySheetDlg::OnHashIterCalibrate(wxCommandEvent& WXUNUSED(evt))
+{
+  uint32 hashIters;
+  {
+    wxBusyCursor busy;
+    hashIters = m_core.CalibrateHashIters(DEFAULT_UNLOCK_MSECS);
+  }
+
+  // Same mapping as in InitDialog/OnOk; anything beyond the slider's
+  // range is pinned to "Maximum"
+  const uint32 step = MAX_USABLE_HASH_ITERS/100;
+  const int value = (hashIters <= MIN_HASH_ITERATIONS) ? 0 :
+    int(std::min(hashIters/step, uint32(100)));
+
+  auto *slider = wxDynamicCast(FindWindow(ID_SLIDER), wxSlider);
+  if (slider != nullptr)
+    slider->SetValue(value);
+}
+
 /*!
  * wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_PWHISTAPPLY
  */
@@ -1530,6 +1561,7 @@ void OptionsPropertySheetDlg::OnUpdateUI(wxUpdateUIEvent& evt)
       evt.Enable(!dbIsReadOnly);
       break;
     case ID_SLIDER:
+    case ID_HASHITERCALIBRATE:
       evt.Enable(!dbIsReadOnly);
       break;
     case ID_STATICTEXT_4:
@@ -103,6 +103,7 @@ class wxBookCtrlEvent;
 #define ID_CHECKBOX29 10180
 #define ID_SPINCTRL12 10181
 #define ID_SLIDER 10059
+#define ID_HASHITERCALIBRATE 10200
 #define ID_PANEL6 10137
 #define ID_CHECKBOX30 10182
 #define ID_SPINCTRL13 10183
@@ -193,6 +194,9 @@ public:
   /// wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_PWHISTAPPLY
   void OnPWHistApply( wxCommandEvent& event );
 
+  /// wxEVT_COMMAND_BUTTON_CLICKED event handler for ID_HASHITERCALIBRATE
+  void OnHashIterCalibrate( wxCommandEvent& event );
+
   /// wxEVT_UPDATE_UI event handler for all command ids
   void OnUpdateUI(wxUpdateUIEvent& evt);
 
@@ -211,6 +211,12 @@ public:
   /// Implements Observer::UpdateGUI(UpdateGUICommand::GUI_Action, const pws_os::CUUID&, CItemData::FieldType)
   void UpdateGUI(UpdateGUICommand::GUI_Action ga, const pws_os::CUUID &entry_uuid, CItemData::FieldType ft = CItemData::START) override;
 
+  /// Implements Observer::SaveReady()
+  void SaveReady() override;
+
+  /// Implements Observer::DatabaseSaved(int, const StringX&)
+  void DatabaseSaved(int status, const StringX &filename) override;
+
 ////@begin PasswordSafeFrame event handler declarations
 
   /// wxEVT_CHAR_HOOK event handler for WXK_ESCAPE
@@ -531,6 +537,8 @@ private:
   int SaveAs(void);
   int Save(SaveType savetype = SaveType::INVALID);
   int SaveImmediately();
+  int SaveDone(int rc, const stringT &bu_fname, SaveType savetype);
+  void CompleteBackgroundSave();
   void ShowGrid(bool show = true);
   void ShowTree(bool show = true);
   void ClearAppData();